@@ -97,6 +97,17 @@ ebpf_curcpu(void)
 	return 0;
 }
 
+/*
+ * The thread may run on the other CPU than the one ebpf_curcpu
+ * returned, so the slot is updated atomically.
+ */
+void
+ebpf_percpu_add64(void *base, size_t stride, uint64_t delta)
+{
+	ck_pr_add_64((uint64_t *)((uint8_t *)base + stride * ebpf_curcpu()),
+		     delta);
+}
+
 long
 ebpf_getpagesize(void)
 {
@@ -191,10 +202,16 @@ ebpf_jenkins_hash(const void *buf, size_t len, uint32_t hash)
 
 int
 ebpf_init(void)
+{
+	return ebpf_init_reclaim(EBPF_RECLAIM_EPOCH);
+}
+
+int
+ebpf_init_reclaim(uint32_t reclaim)
 {
 	int error;
 
-	error = ebpf_epoch_init();
+	error = ebpf_epoch_init(reclaim);
 	if (error != 0) {
 		return error;
 	}
@@ -38,7 +38,7 @@
 
 #include "endian.h"
 
-typedef void *ebpf_epoch_context;
+typedef ck_epoch_entry_t ebpf_epoch_context;
 typedef pthread_mutex_t ebpf_mtx;
 typedef ck_spinlock_t ebpf_spinmtx;
 
@@ -55,3 +55,47 @@ typedef ck_spinlock_t ebpf_spinmtx;
 	CK_LIST_INSERT_HEAD(_head, _elem, _name)
 #define EBPF_EPOCH_LIST_REMOVE(_elem, _name) CK_LIST_REMOVE(_elem, _name)
 #define EBPF_EPOCH_LIST_NEXT(_elem, _name) CK_LIST_NEXT(_elem, _name)
+
+/* Pointers which are published to and read by epoch readers */
+#define EBPF_EPOCH_DEREF(_p) ck_pr_load_ptr(&(_p))
+#define EBPF_EPOCH_ASSIGN(_p, _v)                                              \
+	do {                                                                   \
+		ck_pr_fence_store();                                           \
+		ck_pr_store_ptr(&(_p), (_v));                                  \
+	} while (0)
+
+/* Primitives for optimistic readers validated by sequence counters */
+#define ebpf_atomic_load32(_p) ck_pr_load_32(_p)
+#define ebpf_atomic_store32(_p, _v) ck_pr_store_32((_p), (_v))
+#define ebpf_fence_load() ck_pr_fence_load()
+#define ebpf_fence_store() ck_pr_fence_store()
+#define ebpf_cpu_relax() ck_pr_stall()
+
+/* Pointer operations for the lock-free map writers */
+#define ebpf_atomic_load_ptr(_p) ck_pr_load_ptr(_p)
+#define ebpf_atomic_cas_ptr(_p, _old, _new) ck_pr_cas_ptr((_p), (_old), (_new))
+
+/* Atomic operations used by the eBPF atomic instructions */
+#define ebpf_atomic_add32(_p, _v) ck_pr_add_32((_p), (_v))
+#define ebpf_atomic_add64(_p, _v) ck_pr_add_64((_p), (_v))
+#define ebpf_atomic_fetch_add32(_p, _v) ck_pr_faa_32((_p), (_v))
+#define ebpf_atomic_fetch_add64(_p, _v) ck_pr_faa_64((_p), (_v))
+#define ebpf_atomic_swap32(_p, _v) ck_pr_fas_32((_p), (_v))
+#define ebpf_atomic_swap64(_p, _v) ck_pr_fas_64((_p), (_v))
+
+/* Returns the value of *p before the operation */
+static inline uint32_t
+ebpf_atomic_cmpxchg32(uint32_t *p, uint32_t cmp, uint32_t set)
+{
+	uint32_t prev;
+	ck_pr_cas_32_value(p, cmp, set, &prev);
+	return prev;
+}
+
+static inline uint64_t
+ebpf_atomic_cmpxchg64(uint64_t *p, uint64_t cmp, uint64_t set)
+{
+	uint64_t prev;
+	ck_pr_cas_64_value(p, cmp, set, &prev);
+	return prev;
+}
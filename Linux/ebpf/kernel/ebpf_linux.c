@@ -114,6 +114,14 @@ ebpf_curcpu(void)
   return smp_processor_id();
 }
 
+void
+ebpf_percpu_add64(void *base, size_t stride, uint64_t delta)
+{
+	int cpu = get_cpu();
+	*(uint64_t *)((uint8_t *)base + stride * cpu) += delta;
+	put_cpu();
+}
+
 long
 ebpf_getpagesize(void)
 {
@@ -145,6 +153,19 @@ ebpf_epoch_wait(void)
   synchronize_rcu();
 }
 
+/* synchronize_rcu doesn't wait for the callbacks deferred by call_rcu */
+void
+ebpf_epoch_barrier(void)
+{
+  rcu_barrier();
+}
+
+/* RCU readers don't announce the quiescent state by themselves */
+void
+ebpf_quiescent(void)
+{
+}
+
 void
 ebpf_mtx_init(ebpf_mtx *mutex, const char *name)
 {
@@ -232,6 +253,16 @@ ebpf_init(void)
 	return 0;
 }
 
+/* Only the native RCU is supported */
+int
+ebpf_init_reclaim(uint32_t reclaim)
+{
+	if (reclaim != EBPF_RECLAIM_EPOCH)
+		return ENOTSUP;
+
+	return ebpf_init();
+}
+
 static int
 ebpf_mod_init(void)
 {
@@ -266,6 +297,7 @@ EXPORT_SYMBOL(ebpf_map_lookup_elem_from_user);
 EXPORT_SYMBOL(ebpf_map_update_elem_from_user);
 EXPORT_SYMBOL(ebpf_map_delete_elem_from_user);
 EXPORT_SYMBOL(ebpf_map_get_next_key_from_user);
+EXPORT_SYMBOL(ebpf_map_percpu_add_elem);
 EXPORT_SYMBOL(ebpf_map_destroy);
 
 /* dev/ebpf/ebpf_allocator.h */
@@ -292,11 +324,14 @@ EXPORT_SYMBOL(ebpf_exfree);
 EXPORT_SYMBOL(ebpf_error);
 EXPORT_SYMBOL(ebpf_ncpus);
 EXPORT_SYMBOL(ebpf_curcpu);
+EXPORT_SYMBOL(ebpf_percpu_add64);
 EXPORT_SYMBOL(ebpf_getpagesize);
 EXPORT_SYMBOL(ebpf_epoch_enter);
 EXPORT_SYMBOL(ebpf_epoch_exit);
 EXPORT_SYMBOL(ebpf_epoch_call);
 EXPORT_SYMBOL(ebpf_epoch_wait);
+EXPORT_SYMBOL(ebpf_epoch_barrier);
+EXPORT_SYMBOL(ebpf_quiescent);
 EXPORT_SYMBOL(ebpf_mtx_init);
 EXPORT_SYMBOL(ebpf_mtx_lock);
 EXPORT_SYMBOL(ebpf_mtx_unlock);
@@ -60,6 +60,7 @@
 #include <linux/jhash.h>
 #include <linux/rcupdate.h>
 #include <linux/rculist.h>
+#include <linux/atomic.h>
 #include <asm/byteorder.h>
 
 #define UINT64_MAX U64_MAX
@@ -94,3 +95,34 @@ typedef raw_spinlock_t ebpf_spinmtx;
 #define EBPF_EPOCH_LIST_REMOVE(_elem, _name) hlist_del_rcu(&_elem->_name)
 #define EBPF_EPOCH_LIST_NEXT(_elem, _name) \
   hlist_entry(hlist_next_rcu(&_elem->_name), typeof(*_elem), _name)
+
+/* Pointers which are published to and read by epoch readers */
+#define EBPF_EPOCH_DEREF(_p) rcu_dereference(_p)
+#define EBPF_EPOCH_ASSIGN(_p, _v) rcu_assign_pointer(_p, _v)
+
+/* Primitives for optimistic readers validated by sequence counters */
+#define ebpf_atomic_load32(_p) READ_ONCE(*(_p))
+#define ebpf_atomic_store32(_p, _v) WRITE_ONCE(*(_p), (_v))
+#define ebpf_fence_load() smp_rmb()
+#define ebpf_fence_store() smp_wmb()
+#define ebpf_cpu_relax() cpu_relax()
+
+/* Pointer operations for the lock-free map writers */
+#define ebpf_atomic_load_ptr(_p) READ_ONCE(*(_p))
+#define ebpf_atomic_cas_ptr(_p, _old, _new) \
+  (cmpxchg((_p), (_old), (_new)) == (_old))
+
+/*
+ * Atomic operations used by the eBPF atomic instructions. Same as
+ * the Linux eBPF interpreter, treat raw memory as atomic_t.
+ */
+#define ebpf_atomic_add32(_p, _v) atomic_add((_v), (atomic_t *)(_p))
+#define ebpf_atomic_add64(_p, _v) atomic64_add((_v), (atomic64_t *)(_p))
+#define ebpf_atomic_fetch_add32(_p, _v) \
+  ((uint32_t)atomic_fetch_add((_v), (atomic_t *)(_p)))
+#define ebpf_atomic_fetch_add64(_p, _v) \
+  ((uint64_t)atomic64_fetch_add((_v), (atomic64_t *)(_p)))
+#define ebpf_atomic_swap32(_p, _v) xchg((_p), (_v))
+#define ebpf_atomic_swap64(_p, _v) xchg((_p), (_v))
+#define ebpf_atomic_cmpxchg32(_p, _old, _new) cmpxchg((_p), (_old), (_new))
+#define ebpf_atomic_cmpxchg64(_p, _old, _new) cmpxchg((_p), (_old), (_new))
@@ -22,6 +22,21 @@
 #include <dev/ebpf/ebpf_epoch.h>
 #include <sys/ebpf.h>
 
+#if defined(__has_include) && defined(__has_builtin)
+#if __has_include(<sys/rseq.h>) && __has_builtin(__builtin_thread_pointer)
+#include <sys/rseq.h>
+#ifdef RSEQ_SIG
+#define EBPF_HAVE_RSEQ
+#if defined(__x86_64__)
+#define EBPF_HAVE_RSEQ_PERCPU_ADD
+#endif
+#endif
+#endif
+#endif
+
+#define EBPF_STR(_x) EBPF_STR_(_x)
+#define EBPF_STR_(_x) #_x
+
 void *
 ebpf_malloc(size_t size)
 {
@@ -74,14 +89,51 @@ ebpf_error(const char *fmt, ...)
 	return ret;
 }
 
-uint16_t
-ebpf_ncpus(void)
+/*
+ * ebpf_curcpu is called by every per-CPU map operation, so it must not
+ * make system calls. The source of the CPU number is chosen once by
+ * ebpf_init from the cheapest one available.
+ *
+ * - The cpu_id field of the rseq area, which glibc registers for every
+ *   thread and the kernel keeps up to date on each migration.
+ * - sched_getcpu, which is served by the vDSO on most architectures.
+ * - The first CPU of the thread's affinity set. It is looked up once
+ *   and cached per thread, so changing the affinity of the thread
+ *   afterwards is not reflected.
+ *
+ * For the thread pinned to single CPU, all of them return the pinned
+ * CPU. Other threads may migrate in the middle of the operation, so
+ * the per-CPU maps never work correctly unless each thread which uses
+ * them is pinned to its own CPU. ebpf_percpu_add64 is the exception.
+ */
+enum ebpf_cpuid_sources {
+	EBPF_CPUID_AFFINITY,
+	EBPF_CPUID_GETCPU,
+	EBPF_CPUID_RSEQ
+};
+
+static int ebpf_cpuid_source = EBPF_CPUID_AFFINITY;
+static uint16_t ebpf_ncpus_cached;
+static __thread int32_t ebpf_affinity_cpu_cached = -1;
+
+#ifdef EBPF_HAVE_RSEQ
+static inline struct rseq *
+ebpf_rseq_area(void)
 {
-	return sysconf(_SC_NPROCESSORS_ONLN);
+	return (struct rseq *)((uint8_t *)__builtin_thread_pointer() +
+			       __rseq_offset);
 }
 
-uint16_t
-ebpf_curcpu(void)
+static inline int32_t
+ebpf_rseq_cpu(void)
+{
+	/* Negative until the rseq area is registered for this thread */
+	return (int32_t)ck_pr_load_32(&ebpf_rseq_area()->cpu_id);
+}
+#endif
+
+static int32_t
+ebpf_affinity_cpu(void)
 {
 	int error;
 	cpu_set_t cpus;
@@ -93,10 +145,6 @@ ebpf_curcpu(void)
 	 * Return first CPU founded from affinity set.
 	 * If the program pinned the thread to single
 	 * CPU, this function returns pinned CPU.
-	 *
-	 * Note that the epoch never works correctly
-	 * unless the running thread is pinned to
-	 * single CPU.
 	 */
 	for (uint16_t i = 0; i < CPU_MAXSIZE; i++) {
 		if (CPU_ISSET(i, &cpus)) {
@@ -111,6 +159,196 @@ ebpf_curcpu(void)
 	return 0;
 }
 
+/*
+ * The per-CPU slots are sized by the highest possible CPU id rather
+ * than the number of online CPUs. CPU ids can be sparse while some
+ * CPUs are offline, and every CPU the thread may run on must own its
+ * slot, or the unlocked add of ebpf_percpu_add64 races with the other
+ * CPU sharing the slot.
+ */
+static uint16_t
+ebpf_possible_cpus(void)
+{
+	FILE *f;
+	char buf[256];
+	long n = -1, conf, onln;
+
+	/* The list looks like "0-7" or "0,2-5", the last id is the highest */
+	f = fopen("/sys/devices/system/cpu/possible", "r");
+	if (f != NULL) {
+		if (fgets(buf, sizeof(buf), f) != NULL) {
+			for (char *p = buf; *p != '\0'; p++) {
+				if (*p >= '0' && *p <= '9' &&
+				    (p == buf || p[-1] < '0' || p[-1] > '9'))
+					n = strtol(p, NULL, 10);
+			}
+		}
+		fclose(f);
+	}
+
+	conf = sysconf(_SC_NPROCESSORS_CONF);
+	onln = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n++;
+	if (n < conf)
+		n = conf;
+	if (n < onln)
+		n = onln;
+	if (n > UINT16_MAX)
+		n = UINT16_MAX;
+
+	return n;
+}
+
+static void
+ebpf_cpuid_init(void)
+{
+	ebpf_ncpus_cached = ebpf_possible_cpus();
+
+#ifdef EBPF_HAVE_RSEQ
+	if (__rseq_size > 0 && ebpf_rseq_cpu() >= 0) {
+		ebpf_cpuid_source = EBPF_CPUID_RSEQ;
+		return;
+	}
+#endif
+
+	if (sched_getcpu() >= 0) {
+		ebpf_cpuid_source = EBPF_CPUID_GETCPU;
+		return;
+	}
+
+	ebpf_cpuid_source = EBPF_CPUID_AFFINITY;
+}
+
+uint16_t
+ebpf_ncpus(void)
+{
+	if (ebpf_ncpus_cached == 0) {
+		ebpf_ncpus_cached = ebpf_possible_cpus();
+	}
+
+	return ebpf_ncpus_cached;
+}
+
+uint16_t
+ebpf_curcpu(void)
+{
+	int32_t cpu = -1;
+
+	switch (ebpf_cpuid_source) {
+#ifdef EBPF_HAVE_RSEQ
+	case EBPF_CPUID_RSEQ:
+		cpu = ebpf_rseq_cpu();
+		if (cpu >= 0) {
+			break;
+		}
+		/* FALLTHROUGH */
+#endif
+	case EBPF_CPUID_GETCPU:
+		cpu = sched_getcpu();
+		if (cpu >= 0) {
+			break;
+		}
+		/* FALLTHROUGH */
+	default:
+		if (ebpf_affinity_cpu_cached < 0) {
+			ebpf_affinity_cpu_cached = ebpf_affinity_cpu();
+		}
+		cpu = ebpf_affinity_cpu_cached;
+		break;
+	}
+
+	/*
+	 * The per-CPU maps are sized for all possible CPUs, so this
+	 * never happens unless the kernel reports a bogus CPU number.
+	 */
+	if (cpu >= ebpf_ncpus()) {
+		cpu %= ebpf_ncpus();
+	}
+
+	return cpu;
+}
+
+#ifdef EBPF_HAVE_RSEQ_PERCPU_ADD
+/*
+ * Adds delta to the slot of the CPU the thread is running on in a
+ * restartable sequence. The kernel restarts the sequence from the
+ * abort handler when the thread is preempted or migrated before the
+ * add, which is also the commit, so the slot is only ever written by
+ * the owner CPU and needs no lock prefix. Returns EAGAIN on abort and
+ * ENOTSUP when rseq is not registered for this thread. The CPU number
+ * is checked against the slots as well, but every possible CPU has
+ * its slot.
+ */
+static inline int
+ebpf_rseq_percpu_add64(void *base, size_t stride, uint64_t delta)
+{
+	struct rseq *rs = ebpf_rseq_area();
+	uint64_t ncpus = ebpf_ncpus();
+
+	__asm__ __volatile__ goto(
+	    ".pushsection __rseq_cs, \"aw\"\n\t"
+	    ".balign 32\n\t"
+	    "3:\n\t"
+	    ".long 0x0, 0x0\n\t"
+	    ".quad 1f, (2f - 1f), 4f\n\t"
+	    ".popsection\n\t"
+	    "leaq 3b(%%rip), %%rax\n\t"
+	    "movq %%rax, %[rseq_cs]\n\t"
+	    "1:\n\t"
+	    "movl %[cpu_id], %%eax\n\t"
+	    "cmpq %[ncpus], %%rax\n\t"
+	    "jae %l[unavailable]\n\t"
+	    "imulq %[stride], %%rax\n\t"
+	    "addq %[delta], (%[base], %%rax)\n\t"
+	    "2:\n\t"
+	    ".pushsection __rseq_failure, \"ax\"\n\t"
+	    /* ud1 with the signature, which must precede the handler */
+	    ".byte 0x0f, 0xb9, 0x3d\n\t"
+	    ".long " EBPF_STR(RSEQ_SIG) "\n\t"
+	    "4:\n\t"
+	    "jmp %l[aborted]\n\t"
+	    ".popsection\n\t"
+	    :
+	    : [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id),
+	      [ncpus] "r" (ncpus), [stride] "r" (stride), [base] "r" (base),
+	      [delta] "r" (delta)
+	    : "memory", "cc", "rax"
+	    : aborted, unavailable);
+
+	return 0;
+aborted:
+	return EAGAIN;
+unavailable:
+	return ENOTSUP;
+}
+#endif
+
+/*
+ * Without rseq, the thread may run on the other CPU than the one
+ * ebpf_curcpu returned, so the slot is updated atomically. The rseq
+ * path is never mixed with this one on the same slot, since all CPU
+ * numbers the kernel reports are below ebpf_ncpus.
+ */
+void
+ebpf_percpu_add64(void *base, size_t stride, uint64_t delta)
+{
+#ifdef EBPF_HAVE_RSEQ_PERCPU_ADD
+	int error;
+
+	if (ebpf_cpuid_source == EBPF_CPUID_RSEQ) {
+		while ((error = ebpf_rseq_percpu_add64(base, stride,
+						       delta)) == EAGAIN)
+			;
+		if (error == 0)
+			return;
+	}
+#endif
+
+	ck_pr_add_64((uint64_t *)((uint8_t *)base + stride * ebpf_curcpu()),
+		     delta);
+}
+
 long
 ebpf_getpagesize(void)
 {
@@ -209,10 +447,18 @@ ebpf_jenkins_hash(const void *buf, size_t len, uint32_t hash)
 
 int
 ebpf_init(void)
+{
+	return ebpf_init_reclaim(EBPF_RECLAIM_EPOCH);
+}
+
+int
+ebpf_init_reclaim(uint32_t reclaim)
 {
 	int error;
 
-	error = ebpf_epoch_init();
+	ebpf_cpuid_init();
+
+	error = ebpf_epoch_init(reclaim);
 	if (error != 0) {
 		return error;
 	}
@@ -0,0 +1,788 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2015 Big Switch Networks, Inc
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * x86-64 JIT compiler for eBPF. Based on ubpf's ubpf_jit_x86_64.c.
+ *
+ * The compiled image follows the System V AMD64 calling convention,
+ * so it can be called as a plain C function which takes the context
+ * as the first argument.
+ */
+
+#include <dev/ebpf/ebpf_platform.h>
+#include <dev/ebpf/ebpf_prog.h>
+#include <dev/ebpf/ebpf_map.h>
+#include <sys/ebpf_vm_isa.h>
+
+#include "ebpf_jit_x86_64.h"
+
+/*
+ * Maximum size of native code for single eBPF instruction. The
+ * largest one is 32/64bit division and modulo.
+ */
+#define EBPF_JIT_MAX_INST_SIZE 128
+#define EBPF_JIT_PROLOGUE_SIZE 64
+
+/*
+ * eBPF register to x86-64 register mapping. R1 - R5 are mapped
+ * to argument registers, R6 - R9 are mapped to callee saved
+ * registers and R10 (frame pointer) is mapped to RBP.
+ *
+ * R4 is mapped to R9 instead of RCX, because RCX is required
+ * for variable shift. It is moved to RCX just before calling
+ * helper functions. R10 and R11 are used as scratch registers.
+ */
+static const int register_map[EBPF_REG_MAX] = {
+	RAX, RDI, RSI, RDX, R9, R8, RBX, R13, R14, R15, RBP,
+};
+
+static const int callee_saved_registers[] = {
+	RBP, RBX, R13, R14, R15,
+};
+
+#define NCALLEE_SAVED \
+	(sizeof(callee_saved_registers) / sizeof(callee_saved_registers[0]))
+
+static int
+map_register(int r)
+{
+	ebpf_assert(r < EBPF_REG_MAX);
+	return register_map[r];
+}
+
+static void
+emit_prologue(struct jit_state *state)
+{
+	for (uint32_t i = 0; i < NCALLEE_SAVED; i++)
+		emit_push(state, callee_saved_registers[i]);
+
+	/*
+	 * Setup eBPF stack. Five pushes and the return address
+	 * keep the stack 16 bytes aligned, so as long as the
+	 * EBPF_STACK_SIZE is multiple of 16, we don't need any
+	 * additional alignment for calling helpers.
+	 */
+	emit_mov(state, RSP, map_register(EBPF_R10));
+	emit_alu64_imm32(state, 0x81, 5, RSP, EBPF_STACK_SIZE);
+}
+
+static void
+emit_epilogue(struct jit_state *state)
+{
+	state->exit_loc = state->offset;
+
+	emit_alu64_imm32(state, 0x81, 0, RSP, EBPF_STACK_SIZE);
+
+	for (uint32_t i = NCALLEE_SAVED; i > 0; i--)
+		emit_pop(state, callee_saved_registers[i - 1]);
+
+	emit_ret(state);
+}
+
+/*
+ * Division and modulo. x86-64 div instruction takes dividend
+ * from RDX:RAX and writes quotient to RAX and remainder to RDX,
+ * so we have to save R0 and R3 around it. Division by zero
+ * yields zero and modulo by zero leaves dst untouched as Linux
+ * does.
+ */
+static void
+emit_muldivmod(struct jit_state *state, uint8_t opcode, int src, int dst,
+	       int32_t imm)
+{
+	bool is64 = EBPF_CLS(opcode) == EBPF_CLS_ALU64;
+	bool mod = EBPF_ALU_OP(opcode) == EBPF_MOD;
+	uint32_t zero_loc, done_loc;
+
+	if (EBPF_SRC(opcode) == EBPF_SRC_IMM)
+		emit_load_imm(state, RCX, imm);
+	else
+		emit_mov(state, src, RCX);
+
+	if (is64)
+		emit_alu64(state, 0x85, RCX, RCX);
+	else
+		emit_alu32(state, 0x85, RCX, RCX);
+
+	/* je zero */
+	zero_loc = emit_local_jcc(state, 0x84);
+
+	emit_push(state, RAX);
+	emit_push(state, RDX);
+
+	if (dst != RAX)
+		emit_mov(state, dst, RAX);
+
+	/* xor %edx,%edx */
+	emit_alu32(state, 0x31, RDX, RDX);
+
+	/* div %rcx */
+	if (is64)
+		emit_alu64(state, 0xf7, 6, RCX);
+	else
+		emit_alu32(state, 0xf7, 6, RCX);
+
+	emit_mov(state, mod ? RDX : RAX, R11);
+	emit_pop(state, RDX);
+	emit_pop(state, RAX);
+	emit_mov(state, R11, dst);
+
+	done_loc = emit_local_jmp(state);
+
+	emit_local_jump_fixup(state, zero_loc);
+	if (!mod) {
+		/* xor dst,dst */
+		emit_alu32(state, 0x31, dst, dst);
+	} else if (!is64) {
+		/* Zero extend dst */
+		emit_alu32(state, 0x89, dst, dst);
+	}
+
+	emit_local_jump_fixup(state, done_loc);
+}
+
+static void
+emit_bswap(struct jit_state *state, int dst, int32_t imm)
+{
+	if (imm == 16) {
+		/* rol $8,%dst16 */
+		emit1(state, 0x66);
+		emit_alu32_imm8(state, 0xc1, 0, dst, 8);
+		/* movzwl %dst16,%dst32 */
+		emit_basic_rex(state, 0, dst, dst);
+		emit1(state, 0x0f);
+		emit1(state, 0xb7);
+		emit_modrm_reg2reg(state, dst, dst);
+	} else if (imm == 32 || imm == 64) {
+		/* bswap */
+		emit_basic_rex(state, imm == 64, 0, dst);
+		emit1(state, 0x0f);
+		emit1(state, 0xc8 | (dst & 7));
+	}
+}
+
+static void
+emit_truncate(struct jit_state *state, int dst, int32_t imm)
+{
+	if (imm == 16) {
+		/* movzwl %dst16,%dst32 */
+		emit_basic_rex(state, 0, dst, dst);
+		emit1(state, 0x0f);
+		emit1(state, 0xb7);
+		emit_modrm_reg2reg(state, dst, dst);
+	} else if (imm == 32) {
+		/* mov %dst32,%dst32 */
+		emit_alu32(state, 0x89, dst, dst);
+	}
+}
+
+/*
+ * Atomic operations on [dst + offset]. Fetched values are written
+ * back to src by xadd and xchg, and cmpxchg compares with RAX which
+ * is R0. 32bit forms implicitly zero extend the destination register
+ * except for successful cmpxchg, so R0 is zero extended explicitly.
+ */
+static int
+emit_atomic(struct jit_state *state, enum operand_size size, int32_t op,
+	    int src, int dst, int32_t offset)
+{
+	if (op != EBPF_ADD && op != (EBPF_ADD | EBPF_FETCH) &&
+	    op != EBPF_XCHG && op != EBPF_CMPXCHG)
+		return EINVAL;
+
+	/* xchg with memory operand is always locked */
+	if (op != EBPF_XCHG)
+		emit1(state, 0xf0);
+
+	emit_basic_rex(state, size == S64, src, dst);
+
+	switch (op) {
+	case EBPF_ADD:
+		/* lock add */
+		emit1(state, 0x01);
+		break;
+	case EBPF_ADD | EBPF_FETCH:
+		/* lock xadd */
+		emit1(state, 0x0f);
+		emit1(state, 0xc1);
+		break;
+	case EBPF_XCHG:
+		emit1(state, 0x87);
+		break;
+	case EBPF_CMPXCHG:
+		/* lock cmpxchg */
+		emit1(state, 0x0f);
+		emit1(state, 0xb1);
+		break;
+	}
+
+	emit_modrm_and_displacement(state, src, dst, offset);
+
+	if (op == EBPF_CMPXCHG && size == S32)
+		emit_alu32(state, 0x89, RAX, RAX);
+
+	return 0;
+}
+
+/*
+ * BPF-to-BPF call. The callee saved registers are saved on the
+ * machine stack, which also keeps it 16 bytes aligned for the helper
+ * calls in the callee. The frame size of the caller is computed by
+ * the interpreter at decode time.
+ */
+static void
+emit_local_call(struct jit_state *state, int32_t frame_size,
+		uint32_t target_pc)
+{
+	for (uint32_t i = 0; i < NCALLEE_SAVED; i++)
+		emit_push(state, callee_saved_registers[i]);
+
+	emit_alu64_imm32(state, 0x81, 5, map_register(EBPF_R10), frame_size);
+
+	/* callq target */
+	emit1(state, 0xe8);
+	emit_jump_offset(state, target_pc);
+
+	for (uint32_t i = NCALLEE_SAVED; i > 0; i--)
+		emit_pop(state, callee_saved_registers[i - 1]);
+}
+
+/*
+ * Inlined map_lookup_elem of array and percpu_array map. R0 is the
+ * address of the element or NULL as array_map_lookup_elem returns.
+ * The base address of the element array of per-CPU map is looked up
+ * by the current CPU. ebpf_curcpu clobbers R1 - R5 as helpers do.
+ */
+static void
+emit_array_lookup(struct jit_state *state, struct ebpf_map *em)
+{
+	int key = map_register(EBPF_R2);
+	uint32_t null_loc, null_loc2, done_loc;
+
+	/* Doesn't fit in the sign-extended immediates */
+	if (em->max_entries > INT32_MAX || em->value_size > INT32_MAX) {
+		emit_mov(state, map_register(EBPF_R4), RCX);
+		emit_call(state, (void *)ebpf_map_lookup_elem);
+		return;
+	}
+
+	/* R0 = key == NULL || *key >= max_entries ? NULL : ... */
+	emit_alu64(state, 0x85, key, key);
+	null_loc = emit_local_jcc(state, 0x84);
+	emit_load(state, S32, key, RAX, 0);
+	emit_cmp_imm32(state, RAX, em->max_entries);
+	null_loc2 = emit_local_jcc(state, 0x83);
+
+	/* imul $value_size,%rax,%rax */
+	emit_alu64_imm32(state, 0x69, RAX, RAX, em->value_size);
+
+	if (em->percpu) {
+		/* Twice to keep the stack aligned */
+		emit_push(state, RAX);
+		emit_push(state, RAX);
+		emit_call(state, (void *)ebpf_curcpu);
+		/* movzwl %ax,%eax */
+		emit1(state, 0x0f);
+		emit1(state, 0xb7);
+		emit_modrm_reg2reg(state, RAX, RAX);
+		/* shl $3,%rax, struct ebpf_map_array is a pointer */
+		_Static_assert(sizeof(struct ebpf_map_array) == 8,
+			       "shift of the per-CPU array index");
+		emit_alu64_imm8(state, 0xc1, 4, RAX, 3);
+		emit_load_imm(state, R11, (int64_t)(uintptr_t)em->data);
+		emit_alu64(state, 0x01, RAX, R11);
+		emit_load(state, S64, R11, R11, 0);
+		emit_pop(state, RAX);
+		emit_pop(state, RCX);
+	} else {
+		emit_load_imm(state, R11, (int64_t)(uintptr_t)
+			      ((struct ebpf_map_array *)em->data)->array);
+	}
+
+	emit_alu64(state, 0x01, R11, RAX);
+	done_loc = emit_local_jmp(state);
+
+	emit_local_jump_fixup(state, null_loc);
+	emit_local_jump_fixup(state, null_loc2);
+	emit_alu32(state, 0x31, RAX, RAX);
+
+	emit_local_jump_fixup(state, done_loc);
+}
+
+static int
+translate(struct ebpf_prog *ep, struct jit_state *state)
+{
+	const struct ebpf_helper_type *const *helpers =
+		ep->eo.eo_ee->ec->helper_types;
+	uint32_t main_len = ep->prog_len;
+
+	/* Functions called by BPF-to-BPF call follow the main program */
+	for (uint32_t i = 0; i < ep->prog_len; i++) {
+		if (ep->prog[i].opcode == EBPF_OP_CALL &&
+				ep->prog[i].src == EBPF_PSEUDO_CALL &&
+				ep->dprog[i].target < main_len)
+			main_len = ep->dprog[i].target;
+	}
+
+	emit_prologue(state);
+
+	for (uint32_t i = 0; i < ep->prog_len; i++) {
+		struct ebpf_inst inst = ep->prog[i];
+		int dst = map_register(inst.dst);
+		/* src of call is not a register */
+		int src = inst.opcode == EBPF_OP_CALL ? 0 :
+			map_register(inst.src);
+		uint32_t target_pc = i + inst.offset + 1;
+
+		state->pc_locs[i] = state->offset;
+
+		switch (inst.opcode) {
+		case EBPF_OP_ADD_IMM:
+			emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
+			break;
+		case EBPF_OP_ADD_REG:
+			emit_alu32(state, 0x01, src, dst);
+			break;
+		case EBPF_OP_SUB_IMM:
+			emit_alu32_imm32(state, 0x81, 5, dst, inst.imm);
+			break;
+		case EBPF_OP_SUB_REG:
+			emit_alu32(state, 0x29, src, dst);
+			break;
+		case EBPF_OP_MUL_IMM:
+			/* imul $imm,%dst32,%dst32 */
+			emit_alu32_imm32(state, 0x69, dst, dst, inst.imm);
+			break;
+		case EBPF_OP_MUL_REG:
+			/* imul %src32,%dst32 */
+			emit_basic_rex(state, 0, dst, src);
+			emit1(state, 0x0f);
+			emit1(state, 0xaf);
+			emit_modrm_reg2reg(state, dst, src);
+			break;
+		case EBPF_OP_DIV_IMM:
+		case EBPF_OP_DIV_REG:
+		case EBPF_OP_MOD_IMM:
+		case EBPF_OP_MOD_REG:
+			emit_muldivmod(state, inst.opcode, src, dst, inst.imm);
+			break;
+		case EBPF_OP_OR_IMM:
+			emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
+			break;
+		case EBPF_OP_OR_REG:
+			emit_alu32(state, 0x09, src, dst);
+			break;
+		case EBPF_OP_AND_IMM:
+			emit_alu32_imm32(state, 0x81, 4, dst, inst.imm);
+			break;
+		case EBPF_OP_AND_REG:
+			emit_alu32(state, 0x21, src, dst);
+			break;
+		case EBPF_OP_LSH_IMM:
+			emit_alu32_imm8(state, 0xc1, 4, dst, inst.imm);
+			break;
+		case EBPF_OP_LSH_REG:
+			emit_mov(state, src, RCX);
+			emit_alu32(state, 0xd3, 4, dst);
+			break;
+		case EBPF_OP_RSH_IMM:
+			emit_alu32_imm8(state, 0xc1, 5, dst, inst.imm);
+			break;
+		case EBPF_OP_RSH_REG:
+			emit_mov(state, src, RCX);
+			emit_alu32(state, 0xd3, 5, dst);
+			break;
+		case EBPF_OP_NEG:
+			emit_alu32(state, 0xf7, 3, dst);
+			break;
+		case EBPF_OP_XOR_IMM:
+			emit_alu32_imm32(state, 0x81, 6, dst, inst.imm);
+			break;
+		case EBPF_OP_XOR_REG:
+			emit_alu32(state, 0x31, src, dst);
+			break;
+		case EBPF_OP_MOV_IMM:
+			emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
+			break;
+		case EBPF_OP_MOV_REG:
+			emit_alu32(state, 0x89, src, dst);
+			break;
+		case EBPF_OP_ARSH_IMM:
+			emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
+			break;
+		case EBPF_OP_ARSH_REG:
+			emit_mov(state, src, RCX);
+			emit_alu32(state, 0xd3, 7, dst);
+			break;
+		case EBPF_OP_LE:
+			/* We only support little endian host */
+			emit_truncate(state, dst, inst.imm);
+			break;
+		case EBPF_OP_BE:
+			emit_bswap(state, dst, inst.imm);
+			break;
+
+		case EBPF_OP_ADD64_IMM:
+			emit_alu64_imm32(state, 0x81, 0, dst, inst.imm);
+			break;
+		case EBPF_OP_ADD64_REG:
+			emit_alu64(state, 0x01, src, dst);
+			break;
+		case EBPF_OP_SUB64_IMM:
+			emit_alu64_imm32(state, 0x81, 5, dst, inst.imm);
+			break;
+		case EBPF_OP_SUB64_REG:
+			emit_alu64(state, 0x29, src, dst);
+			break;
+		case EBPF_OP_MUL64_IMM:
+			/* imul $imm,%dst,%dst */
+			emit_alu64_imm32(state, 0x69, dst, dst, inst.imm);
+			break;
+		case EBPF_OP_MUL64_REG:
+			/* imul %src,%dst */
+			emit_basic_rex(state, 1, dst, src);
+			emit1(state, 0x0f);
+			emit1(state, 0xaf);
+			emit_modrm_reg2reg(state, dst, src);
+			break;
+		case EBPF_OP_DIV64_IMM:
+		case EBPF_OP_DIV64_REG:
+		case EBPF_OP_MOD64_IMM:
+		case EBPF_OP_MOD64_REG:
+			emit_muldivmod(state, inst.opcode, src, dst, inst.imm);
+			break;
+		case EBPF_OP_OR64_IMM:
+			emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
+			break;
+		case EBPF_OP_OR64_REG:
+			emit_alu64(state, 0x09, src, dst);
+			break;
+		case EBPF_OP_AND64_IMM:
+			emit_alu64_imm32(state, 0x81, 4, dst, inst.imm);
+			break;
+		case EBPF_OP_AND64_REG:
+			emit_alu64(state, 0x21, src, dst);
+			break;
+		case EBPF_OP_LSH64_IMM:
+			emit_alu64_imm8(state, 0xc1, 4, dst, inst.imm);
+			break;
+		case EBPF_OP_LSH64_REG:
+			emit_mov(state, src, RCX);
+			emit_alu64(state, 0xd3, 4, dst);
+			break;
+		case EBPF_OP_RSH64_IMM:
+			emit_alu64_imm8(state, 0xc1, 5, dst, inst.imm);
+			break;
+		case EBPF_OP_RSH64_REG:
+			emit_mov(state, src, RCX);
+			emit_alu64(state, 0xd3, 5, dst);
+			break;
+		case EBPF_OP_NEG64:
+			emit_alu64(state, 0xf7, 3, dst);
+			break;
+		case EBPF_OP_XOR64_IMM:
+			emit_alu64_imm32(state, 0x81, 6, dst, inst.imm);
+			break;
+		case EBPF_OP_XOR64_REG:
+			emit_alu64(state, 0x31, src, dst);
+			break;
+		case EBPF_OP_MOV64_IMM:
+			emit_load_imm(state, dst, inst.imm);
+			break;
+		case EBPF_OP_MOV64_REG:
+			emit_mov(state, src, dst);
+			break;
+		case EBPF_OP_ARSH64_IMM:
+			emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
+			break;
+		case EBPF_OP_ARSH64_REG:
+			emit_mov(state, src, RCX);
+			emit_alu64(state, 0xd3, 7, dst);
+			break;
+
+		case EBPF_OP_JA:
+			emit_jmp(state, target_pc);
+			break;
+		case EBPF_OP_JEQ_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x84, target_pc);
+			break;
+		case EBPF_OP_JEQ_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x84, target_pc);
+			break;
+		case EBPF_OP_JGT_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x87, target_pc);
+			break;
+		case EBPF_OP_JGT_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x87, target_pc);
+			break;
+		case EBPF_OP_JGE_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x83, target_pc);
+			break;
+		case EBPF_OP_JGE_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x83, target_pc);
+			break;
+		case EBPF_OP_JLT_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x82, target_pc);
+			break;
+		case EBPF_OP_JLT_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x82, target_pc);
+			break;
+		case EBPF_OP_JLE_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x86, target_pc);
+			break;
+		case EBPF_OP_JLE_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x86, target_pc);
+			break;
+		case EBPF_OP_JSET_IMM:
+			/* test $imm,%dst */
+			emit_alu64_imm32(state, 0xf7, 0, dst, inst.imm);
+			emit_jcc(state, 0x85, target_pc);
+			break;
+		case EBPF_OP_JSET_REG:
+			/* test %src,%dst */
+			emit_alu64(state, 0x85, src, dst);
+			emit_jcc(state, 0x85, target_pc);
+			break;
+		case EBPF_OP_JNE_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x85, target_pc);
+			break;
+		case EBPF_OP_JNE_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x85, target_pc);
+			break;
+		case EBPF_OP_JSGT_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x8f, target_pc);
+			break;
+		case EBPF_OP_JSGT_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x8f, target_pc);
+			break;
+		case EBPF_OP_JSGE_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x8d, target_pc);
+			break;
+		case EBPF_OP_JSGE_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x8d, target_pc);
+			break;
+		case EBPF_OP_JSLT_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x8c, target_pc);
+			break;
+		case EBPF_OP_JSLT_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x8c, target_pc);
+			break;
+		case EBPF_OP_JSLE_IMM:
+			emit_cmp_imm32(state, dst, inst.imm);
+			emit_jcc(state, 0x8e, target_pc);
+			break;
+		case EBPF_OP_JSLE_REG:
+			emit_cmp(state, src, dst);
+			emit_jcc(state, 0x8e, target_pc);
+			break;
+		case EBPF_OP_CALL:
+			if (inst.src == EBPF_PSEUDO_CALL) {
+				emit_local_call(state, ep->dprog[i].imm,
+						ep->dprog[i].target);
+				break;
+			}
+			if (inst.src == EBPF_PSEUDO_CALL_ARRAY_LOOKUP) {
+				emit_array_lookup(state,
+						ep->dep_maps[inst.imm]);
+				break;
+			}
+			if (inst.imm < 0 || inst.imm >= EBPF_TYPE_MAX ||
+					helpers[inst.imm] == NULL) {
+				ebpf_error("Invalid helper %d at PC %u\n",
+						inst.imm, i);
+				return EINVAL;
+			}
+			/*
+			 * Tail calls are handled by the interpreter.
+			 * Fall back to it silently.
+			 */
+			if (helpers[inst.imm] == &eht_tail_call)
+				return ENOTSUP;
+			/* Fourth argument is passed by RCX */
+			emit_mov(state, map_register(EBPF_R4), RCX);
+			emit_call(state, helpers[inst.imm]->fn);
+			break;
+		case EBPF_OP_EXIT:
+			if (i >= main_len)
+				emit_ret(state);
+			else if (i != ep->prog_len - 1)
+				emit_jmp(state, TARGET_PC_EXIT);
+			break;
+
+		case EBPF_OP_LDXW:
+			emit_load(state, S32, src, dst, inst.offset);
+			break;
+		case EBPF_OP_LDXH:
+			emit_load(state, S16, src, dst, inst.offset);
+			break;
+		case EBPF_OP_LDXB:
+			emit_load(state, S8, src, dst, inst.offset);
+			break;
+		case EBPF_OP_LDXDW:
+			emit_load(state, S64, src, dst, inst.offset);
+			break;
+
+		case EBPF_OP_STW:
+			emit_store_imm32(state, S32, dst, inst.offset, inst.imm);
+			break;
+		case EBPF_OP_STH:
+			emit_store_imm32(state, S16, dst, inst.offset, inst.imm);
+			break;
+		case EBPF_OP_STB:
+			emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
+			break;
+		case EBPF_OP_STDW:
+			emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
+			break;
+
+		case EBPF_OP_STXW:
+			emit_store(state, S32, src, dst, inst.offset);
+			break;
+		case EBPF_OP_STXH:
+			emit_store(state, S16, src, dst, inst.offset);
+			break;
+		case EBPF_OP_STXB:
+			emit_store(state, S8, src, dst, inst.offset);
+			break;
+		case EBPF_OP_STXDW:
+			emit_store(state, S64, src, dst, inst.offset);
+			break;
+
+		case EBPF_OP_XADDW:
+		case EBPF_OP_XADDDW:
+			if (emit_atomic(state,
+					inst.opcode == EBPF_OP_XADDDW ? S64 : S32,
+					inst.imm, src, dst, inst.offset) != 0) {
+				ebpf_error("Invalid atomic operation at PC %u\n",
+						i);
+				return EINVAL;
+			}
+			break;
+
+		case EBPF_OP_LDDW:
+			if (i + 1 >= ep->prog_len) {
+				ebpf_error("Incomplete lddw at PC %u\n", i);
+				return EINVAL;
+			}
+			emit_load_imm(state, dst, (uint32_t)inst.imm |
+				((uint64_t)ep->prog[i + 1].imm << 32));
+			/* Second half of lddw has no native code */
+			state->pc_locs[++i] = state->offset;
+			break;
+
+		default:
+			ebpf_error("Unknown instruction at PC %u: opcode %02x\n",
+					i, inst.opcode);
+			return EINVAL;
+		}
+	}
+
+	emit_epilogue(state);
+
+	return 0;
+}
+
+static int
+resolve_jumps(struct ebpf_prog *ep, struct jit_state *state)
+{
+	for (uint32_t i = 0; i < state->num_jumps; i++) {
+		struct jump jump = state->jumps[i];
+		uint32_t target_loc;
+		int32_t rel;
+
+		if (jump.target_pc == TARGET_PC_EXIT) {
+			target_loc = state->exit_loc;
+		} else if (jump.target_pc < ep->prog_len) {
+			target_loc = state->pc_locs[jump.target_pc];
+		} else {
+			ebpf_error("Jump to out of program\n");
+			return EINVAL;
+		}
+
+		/* Assumes jump offset is at end of instruction */
+		rel = target_loc - (jump.offset_loc + sizeof(uint32_t));
+		memcpy(state->buf + jump.offset_loc, &rel, sizeof(rel));
+	}
+
+	return 0;
+}
+
+int
+ebpf_jit_compile(struct ebpf_prog *ep)
+{
+	int error;
+	struct jit_state state;
+	void *image;
+
+	state.offset = 0;
+	state.size = ep->prog_len * EBPF_JIT_MAX_INST_SIZE +
+		EBPF_JIT_PROLOGUE_SIZE * 2;
+	state.num_jumps = 0;
+	state.exit_loc = 0;
+
+	state.buf = ebpf_malloc(state.size);
+	state.pc_locs = ebpf_calloc(ep->prog_len, sizeof(state.pc_locs[0]));
+	state.jumps = ebpf_calloc(ep->prog_len, sizeof(state.jumps[0]));
+	if (state.buf == NULL || state.pc_locs == NULL || state.jumps == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	error = translate(ep, &state);
+	if (error != 0)
+		goto out;
+
+	error = resolve_jumps(ep, &state);
+	if (error != 0)
+		goto out;
+
+	image = ebpf_exalloc(state.offset);
+	if (image == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	memcpy(image, state.buf, state.offset);
+	ep->jit_code = (ebpf_jit_fn)image;
+	ep->jit_size = state.offset;
+
+out:
+	ebpf_free(state.jumps);
+	ebpf_free(state.pc_locs);
+	ebpf_free(state.buf);
+	return error;
+}
@@ -17,30 +17,83 @@
  */
 
 #include "ebpf_allocator.h"
+#include "ebpf_util.h"
 
 #define EBPF_ALLOCATOR_ALIGN sizeof(void *)
+#define EBPF_ALLOCATOR_CACHELINE 64
+#define EBPF_ALLOCATOR_MAG_SIZE 32
+#define EBPF_ALLOCATOR_MAG_BATCH (EBPF_ALLOCATOR_MAG_SIZE / 2)
+#define EBPF_ALLOCATOR_CACHE_STRIDE                                            \
+	ebpf_roundup(sizeof(struct ebpf_allocator_cache),                      \
+		     EBPF_ALLOCATOR_CACHELINE)
 
 /*
  * Simple fixed size memory block allocator with free list
  * for eBPF maps. It preallocates all blocks at initialization
  * time and never calls malloc() or free() until deinitialization
  * time.
+ *
+ * Each CPU has a magazine of free blocks in front of the global
+ * free list, so alloc and free usually take only the lock of the
+ * current CPU's magazine. The magazine lock is still needed, since
+ * the thread may migrate or share the CPU with the other threads.
  */
 
+static inline struct ebpf_allocator_cache *
+ebpf_allocator_cache(struct ebpf_allocator *alloc, uint16_t cpu)
+{
+	return (struct ebpf_allocator_cache *)(alloc->caches +
+					       EBPF_ALLOCATOR_CACHE_STRIDE *
+						   cpu);
+}
+
 static int ebpf_allocator_prealloc(struct ebpf_allocator *alloc, uint32_t nblocks,
 				   int (*ctor)(void *, void *), void *arg);
+static void ebpf_allocator_release(struct ebpf_allocator *alloc,
+				   void (*dtor)(void *, void *), void *arg);
 
+/*
+ * The dtor is only called for the blocks which were already constructed
+ * when the preallocation fails.
+ */
 int
 ebpf_allocator_init(struct ebpf_allocator *alloc, uint32_t block_size,
-		    uint32_t nblocks, int (*ctor)(void *, void *), void *arg)
+		    uint32_t nblocks, int (*ctor)(void *, void *),
+		    void (*dtor)(void *, void *), void *arg)
 {
+	int error;
+
 	SLIST_INIT(&alloc->free_block);
 	SLIST_INIT(&alloc->used_segment);
 	alloc->nblocks = nblocks;
 	alloc->block_size = block_size;
 	alloc->count = nblocks;
+
+	alloc->caches_mem = ebpf_calloc(1, EBPF_ALLOCATOR_CACHE_STRIDE *
+						   ebpf_ncpus() +
+					       EBPF_ALLOCATOR_CACHELINE);
+	if (alloc->caches_mem == NULL)
+		return ENOMEM;
+
+	alloc->caches = (uint8_t *)ebpf_roundup(
+	    (uintptr_t)alloc->caches_mem, EBPF_ALLOCATOR_CACHELINE);
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		struct ebpf_allocator_cache *cache =
+		    ebpf_allocator_cache(alloc, i);
+		SLIST_INIT(&cache->free_block);
+		ebpf_spinmtx_init(&cache->lock, "ebpf_allocator cache lock");
+	}
+
 	ebpf_spinmtx_init(&alloc->lock, "ebpf_allocator lock");
-	return ebpf_allocator_prealloc(alloc, nblocks, ctor, arg);
+
+	error = ebpf_allocator_prealloc(alloc, nblocks, ctor, arg);
+	if (error != 0) {
+		ebpf_allocator_release(alloc, dtor, arg);
+		return error;
+	}
+
+	return 0;
 }
 
 /*
@@ -53,10 +106,42 @@ void
 ebpf_allocator_deinit(struct ebpf_allocator *alloc, void (*dtor)(void *, void *),
 		      void *arg)
 {
+	struct ebpf_allocator_cache *cache;
 	struct ebpf_allocator_entry *tmp;
 
+	/*
+	 * Return the blocks in the magazines to the global free list
+	 */
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		cache = ebpf_allocator_cache(alloc, i);
+		while (!SLIST_EMPTY(&cache->free_block)) {
+			tmp = SLIST_FIRST(&cache->free_block);
+			SLIST_REMOVE_HEAD(&cache->free_block, entry);
+			SLIST_INSERT_HEAD(&alloc->free_block, tmp, entry);
+			alloc->count++;
+		}
+	}
+
 	ebpf_assert(alloc->count == alloc->nblocks);
 
+	ebpf_allocator_release(alloc, dtor, arg);
+}
+
+/*
+ * Destructs the blocks in the global free list and frees everything
+ * allocated by ebpf_allocator_init.
+ */
+static void
+ebpf_allocator_release(struct ebpf_allocator *alloc,
+		       void (*dtor)(void *, void *), void *arg)
+{
+	struct ebpf_allocator_entry *tmp;
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++)
+		ebpf_spinmtx_destroy(&ebpf_allocator_cache(alloc, i)->lock);
+
+	ebpf_free(alloc->caches_mem);
+
 	if (dtor != NULL) {
 		SLIST_FOREACH(tmp, &alloc->free_block, entry)
 		{
@@ -135,18 +220,95 @@ finish:
 	return 0;
 }
 
-void *
-ebpf_allocator_alloc(struct ebpf_allocator *alloc)
+/*
+ * Moves up to EBPF_ALLOCATOR_MAG_BATCH blocks from the global free
+ * list to the magazine. Must be called with the magazine locked.
+ */
+static void
+ebpf_allocator_refill(struct ebpf_allocator *alloc,
+		      struct ebpf_allocator_cache *cache)
 {
-	void *ret = NULL;
+	struct ebpf_allocator_entry *tmp;
 
 	ebpf_spinmtx_lock(&alloc->lock);
-	if (alloc->count > 0) {
-		ret = SLIST_FIRST(&alloc->free_block);
+	while (alloc->count > 0 && cache->count < EBPF_ALLOCATOR_MAG_BATCH) {
+		tmp = SLIST_FIRST(&alloc->free_block);
 		SLIST_REMOVE_HEAD(&alloc->free_block, entry);
+		SLIST_INSERT_HEAD(&cache->free_block, tmp, entry);
 		alloc->count--;
+		cache->count++;
 	}
 	ebpf_spinmtx_unlock(&alloc->lock);
+}
+
+/*
+ * Moves EBPF_ALLOCATOR_MAG_BATCH blocks from the magazine to the
+ * global free list. Must be called with the magazine locked.
+ */
+static void
+ebpf_allocator_spill(struct ebpf_allocator *alloc,
+		     struct ebpf_allocator_cache *cache)
+{
+	struct ebpf_allocator_entry *tmp;
+
+	ebpf_spinmtx_lock(&alloc->lock);
+	for (uint32_t i = 0; i < EBPF_ALLOCATOR_MAG_BATCH; i++) {
+		tmp = SLIST_FIRST(&cache->free_block);
+		SLIST_REMOVE_HEAD(&cache->free_block, entry);
+		SLIST_INSERT_HEAD(&alloc->free_block, tmp, entry);
+		cache->count--;
+		alloc->count++;
+	}
+	ebpf_spinmtx_unlock(&alloc->lock);
+}
+
+static void *
+ebpf_allocator_cache_pop(struct ebpf_allocator_cache *cache)
+{
+	struct ebpf_allocator_entry *ret = NULL;
+
+	if (cache->count > 0) {
+		ret = SLIST_FIRST(&cache->free_block);
+		SLIST_REMOVE_HEAD(&cache->free_block, entry);
+		cache->count--;
+	}
+
+	return ret;
+}
+
+void *
+ebpf_allocator_alloc(struct ebpf_allocator *alloc)
+{
+	struct ebpf_allocator_cache *cache;
+	uint16_t cpu = ebpf_curcpu();
+	void *ret;
+
+	cache = ebpf_allocator_cache(alloc, cpu);
+
+	ebpf_spinmtx_lock(&cache->lock);
+	if (cache->count == 0)
+		ebpf_allocator_refill(alloc, cache);
+	ret = ebpf_allocator_cache_pop(cache);
+	ebpf_spinmtx_unlock(&cache->lock);
+
+	if (ret != NULL)
+		return ret;
+
+	/*
+	 * The global free list is empty too. Take a block from the
+	 * other CPUs' magazines, so that all preallocated blocks are
+	 * available regardless of where they were freed.
+	 */
+	for (uint16_t i = 0; i < ebpf_ncpus() && ret == NULL; i++) {
+		if (i == cpu)
+			continue;
+
+		cache = ebpf_allocator_cache(alloc, i);
+
+		ebpf_spinmtx_lock(&cache->lock);
+		ret = ebpf_allocator_cache_pop(cache);
+		ebpf_spinmtx_unlock(&cache->lock);
+	}
 
 	return ret;
 }
@@ -154,9 +316,15 @@ ebpf_allocator_alloc(struct ebpf_allocator *alloc)
 void
 ebpf_allocator_free(struct ebpf_allocator *alloc, void *ptr)
 {
-	ebpf_spinmtx_lock(&alloc->lock);
-	SLIST_INSERT_HEAD(&alloc->free_block,
-			(struct ebpf_allocator_entry *)ptr, entry);
-	alloc->count++;
-	ebpf_spinmtx_unlock(&alloc->lock);
+	struct ebpf_allocator_cache *cache;
+
+	cache = ebpf_allocator_cache(alloc, ebpf_curcpu());
+
+	ebpf_spinmtx_lock(&cache->lock);
+	if (cache->count == EBPF_ALLOCATOR_MAG_SIZE)
+		ebpf_allocator_spill(alloc, cache);
+	SLIST_INSERT_HEAD(&cache->free_block,
+			  (struct ebpf_allocator_entry *)ptr, entry);
+	cache->count++;
+	ebpf_spinmtx_unlock(&cache->lock);
 }
@@ -25,18 +25,30 @@ struct ebpf_allocator_entry {
 	SLIST_ENTRY(ebpf_allocator_entry) entry;
 };
 
+/*
+ * Per-CPU magazine. A bounded stack of free blocks which is refilled
+ * from and spilled to the global free list in batches.
+ */
+struct ebpf_allocator_cache {
+	SLIST_HEAD(, ebpf_allocator_entry) free_block;
+	ebpf_spinmtx lock;
+	uint32_t count;
+};
+
 struct ebpf_allocator {
 	SLIST_HEAD(, ebpf_allocator_entry) free_block;
 	SLIST_HEAD(, ebpf_allocator_entry) used_segment;
 	ebpf_spinmtx lock;
 	uint32_t nblocks;
 	uint32_t block_size;
-	uint32_t count;
+	uint32_t count; /* blocks in the global free list */
+	uint8_t *caches; /* cacheline aligned ebpf_allocator_cache per CPU */
+	void *caches_mem;
 };
 
 int ebpf_allocator_init(struct ebpf_allocator *alloc, uint32_t block_size,
 			uint32_t nblocks, int (*ctor)(void *, void *),
-			void *arg);
+			void (*dtor)(void *, void *), void *arg);
 void ebpf_allocator_deinit(struct ebpf_allocator *alloc,
 			   void (*dtor)(void *, void *), void *arg);
 void *ebpf_allocator_alloc(struct ebpf_allocator *alloc);
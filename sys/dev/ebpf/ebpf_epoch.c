@@ -24,8 +24,49 @@
 
 #include "ebpf_epoch.h"
 
+/*
+ * The reclaimer thread polls the epoch at this interval, or earlier
+ * when this many callbacks were deferred since the last wakeup.
+ */
+#define EBPF_EPOCH_RECLAIM_INTERVAL_MS 10
+#define EBPF_EPOCH_RECLAIM_BATCH 1024
+
+static uint32_t ebpf_epoch_reclaim_type;
 static ck_epoch_t ebpf_epoch;
+static bool ebpf_epoch_initialized;
 static pthread_key_t ebpf_epoch_key;
+static uint32_t ebpf_epoch_key_gen;
+
+/*
+ * The record of the thread is cached in TLS, so that the readers
+ * don't look it up with pthread_getspecific. The pthread key only
+ * unregisters the record on thread exit. The key is created again
+ * every time the library is initialized, so the record remembers
+ * the generation of the key it is set to and is set to the new key
+ * on mismatch. Otherwise the record would leak on thread exit.
+ */
+static __thread ck_epoch_record_t *ebpf_epoch_record;
+static __thread uint32_t ebpf_epoch_record_gen;
+
+/*
+ * Callbacks deferred by ebpf_epoch_call are pushed to the shared
+ * stack and moved into the record of the reclaimer thread, which
+ * dispatches them in batches with ck_epoch_poll. The record is only
+ * touched with ebpf_epoch_reclaim_mtx held, since ebpf_epoch_wait
+ * dispatches them as well.
+ */
+static ck_stack_t ebpf_epoch_deferred;
+static ck_epoch_record_t ebpf_epoch_reclaim_record;
+static pthread_mutex_t ebpf_epoch_reclaim_mtx;
+static pthread_cond_t ebpf_epoch_reclaim_cv;
+static pthread_t ebpf_epoch_reclaimer;
+static bool ebpf_epoch_reclaimer_stop;
+static uint64_t ebpf_epoch_ncalls;
+static uint64_t ebpf_epoch_ndispatched;
+static __thread bool ebpf_epoch_dispatching;
+
+CK_STACK_CONTAINER(struct ck_epoch_entry, stack_entry,
+		   ebpf_epoch_entry_container)
 
 static void
 ebpf_epoch_record_dtor(void *specific)
@@ -34,51 +75,243 @@ ebpf_epoch_record_dtor(void *specific)
 	ck_epoch_unregister(record);
 }
 
+/*
+ * QSBR has no record to hold the callbacks until they are safe to
+ * dispatch, so the batch waits for the grace period of its own.
+ */
+static void
+ebpf_epoch_reclaim_qsbr(bool barrier)
+{
+	ck_stack_entry_t *cursor, *next;
+	ck_epoch_entry_t *entry;
+	uint64_t ndispatch = 0;
+	bool dispatching;
+
+	cursor = ck_stack_batch_pop_upmc(&ebpf_epoch_deferred);
+	if (cursor == NULL && !barrier)
+		return;
+
+	ebpf_qsbr_synchronize();
+
+	dispatching = ebpf_epoch_dispatching;
+	ebpf_epoch_dispatching = true;
+
+	for (; cursor != NULL; cursor = next) {
+		next = CK_STACK_NEXT(cursor);
+		entry = ebpf_epoch_entry_container(cursor);
+		entry->function(entry);
+		ndispatch++;
+	}
+
+	ebpf_epoch_dispatching = dispatching;
+
+	ck_pr_add_64(&ebpf_epoch_ndispatched, ndispatch);
+}
+
+/*
+ * Called with ebpf_epoch_reclaim_mtx held. With barrier, waits for
+ * the grace period and dispatches all deferred callbacks. Otherwise
+ * only dispatches the ones which are already safe to. The callbacks
+ * may call ebpf_epoch_wait, which reenters here with the lock held.
+ */
+static void
+ebpf_epoch_reclaim(bool barrier)
+{
+	ck_epoch_record_t *record = &ebpf_epoch_reclaim_record;
+	unsigned long ndispatch = record->n_dispatch;
+	ck_stack_entry_t *cursor, *next;
+	ck_epoch_entry_t *entry;
+	bool dispatching;
+
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR) {
+		ebpf_epoch_reclaim_qsbr(barrier);
+		return;
+	}
+
+	dispatching = ebpf_epoch_dispatching;
+	ebpf_epoch_dispatching = true;
+
+	cursor = ck_stack_batch_pop_upmc(&ebpf_epoch_deferred);
+	for (; cursor != NULL; cursor = next) {
+		next = CK_STACK_NEXT(cursor);
+		entry = ebpf_epoch_entry_container(cursor);
+		ck_epoch_call(record, entry, entry->function);
+	}
+
+	if (barrier)
+		ck_epoch_barrier(record);
+	else if (record->n_pending > 0)
+		ck_epoch_poll(record);
+
+	ebpf_epoch_dispatching = dispatching;
+
+	/* The outermost call also counts the nested dispatches */
+	if (!dispatching)
+		ck_pr_add_64(&ebpf_epoch_ndispatched,
+			     record->n_dispatch - ndispatch);
+}
+
+static void *
+ebpf_epoch_reclaimer_main(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&ebpf_epoch_reclaim_mtx);
+
+	while (!ebpf_epoch_reclaimer_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += EBPF_EPOCH_RECLAIM_INTERVAL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&ebpf_epoch_reclaim_cv,
+				       &ebpf_epoch_reclaim_mtx, &ts);
+		ebpf_epoch_reclaim(false);
+	}
+
+	pthread_mutex_unlock(&ebpf_epoch_reclaim_mtx);
+
+	return NULL;
+}
+
 int
-ebpf_epoch_init(void)
+ebpf_epoch_init(uint32_t reclaim)
 {
-	ck_epoch_init(&ebpf_epoch);
-	return pthread_key_create(&ebpf_epoch_key,
-			ebpf_epoch_record_dtor);
+	int error;
+
+	switch (reclaim) {
+	case EBPF_RECLAIM_EPOCH:
+		break;
+	case EBPF_RECLAIM_QSBR:
+		error = ebpf_qsbr_init();
+		if (error != 0)
+			return error;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	ebpf_epoch_reclaim_type = reclaim;
+
+	/*
+	 * The records cached in TLS stay registered to the epoch,
+	 * so it is never reset even if the library is initialized
+	 * again.
+	 */
+	if (!ebpf_epoch_initialized) {
+		ck_epoch_init(&ebpf_epoch);
+		ck_stack_init(&ebpf_epoch_deferred);
+		ck_epoch_register(&ebpf_epoch, &ebpf_epoch_reclaim_record);
+		ebpf_epoch_initialized = true;
+	}
+
+	error = pthread_key_create(&ebpf_epoch_key, ebpf_epoch_record_dtor);
+	if (error != 0)
+		goto err0;
+
+	pthread_mutex_init(&ebpf_epoch_reclaim_mtx, NULL);
+	pthread_cond_init(&ebpf_epoch_reclaim_cv, NULL);
+	ebpf_epoch_reclaimer_stop = false;
+
+	error = pthread_create(&ebpf_epoch_reclaimer, NULL,
+			       ebpf_epoch_reclaimer_main, NULL);
+	if (error != 0)
+		goto err1;
+
+	/* Never zero, which is the generation of the fresh thread */
+	if (++ebpf_epoch_key_gen == 0)
+		ebpf_epoch_key_gen++;
+
+	return 0;
+
+err1:
+	pthread_cond_destroy(&ebpf_epoch_reclaim_cv);
+	pthread_mutex_destroy(&ebpf_epoch_reclaim_mtx);
+	pthread_key_delete(ebpf_epoch_key);
+err0:
+	if (reclaim == EBPF_RECLAIM_QSBR)
+		ebpf_qsbr_deinit();
+	return error;
 }
 
 int
 ebpf_epoch_deinit(void)
 {
+	pthread_mutex_lock(&ebpf_epoch_reclaim_mtx);
+	ebpf_epoch_reclaimer_stop = true;
+	pthread_cond_signal(&ebpf_epoch_reclaim_cv);
+	pthread_mutex_unlock(&ebpf_epoch_reclaim_mtx);
+
+	pthread_join(ebpf_epoch_reclaimer, NULL);
+
+	/* Nobody else dispatches the callbacks anymore */
+	ebpf_epoch_reclaim(true);
+
+	pthread_cond_destroy(&ebpf_epoch_reclaim_cv);
+	pthread_mutex_destroy(&ebpf_epoch_reclaim_mtx);
+
 	return pthread_key_delete(ebpf_epoch_key);
 }
 
-static int
-ebpf_epoch_get_record(ck_epoch_record_t **record)
+/*
+ * Allocates the record of the thread, or sets the record which is
+ * already cached in TLS to the key of the current generation.
+ */
+static ck_epoch_record_t *
+ebpf_epoch_record_alloc(void)
 {
+	ck_epoch_record_t *record = ebpf_epoch_record;
 	int error;
-	*record = pthread_getspecific(ebpf_epoch_key);
 
-	if (*record == NULL) {
-		*record = ebpf_malloc(sizeof(ck_epoch_record_t));
-		if (*record == NULL)
-			return -1;
+	if (record == NULL) {
+		record = ck_epoch_recycle(&ebpf_epoch);
+		if (record == NULL) {
+			record = ebpf_malloc(sizeof(ck_epoch_record_t));
+			if (record == NULL)
+				return NULL;
 
-		ck_epoch_register(&ebpf_epoch, *record);
-
-		error = pthread_setspecific(ebpf_epoch_key, *record);
-		if (error != 0) {
-			ebpf_free(*record);
-			return -1;
+			ck_epoch_register(&ebpf_epoch, record);
 		}
 	}
 
-	return 0;
+	error = pthread_setspecific(ebpf_epoch_key, record);
+	if (error != 0) {
+		if (ebpf_epoch_record == NULL)
+			ck_epoch_unregister(record);
+		return NULL;
+	}
+
+	ebpf_epoch_record = record;
+	ebpf_epoch_record_gen = ebpf_epoch_key_gen;
+
+	return record;
+}
+
+static inline ck_epoch_record_t *
+ebpf_epoch_get_record(void)
+{
+	ck_epoch_record_t *record = ebpf_epoch_record;
+
+	if (__builtin_expect(ebpf_epoch_record_gen != ebpf_epoch_key_gen, 0))
+		record = ebpf_epoch_record_alloc();
+
+	return record;
 }
 
 void
 ebpf_epoch_enter(void)
 {
-	int error;
 	ck_epoch_record_t *record;
 
-	error = ebpf_epoch_get_record(&record);
-	ebpf_assert(error == 0);
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR) {
+		ebpf_qsbr_enter();
+		return;
+	}
+
+	record = ebpf_epoch_get_record();
+	ebpf_assert(record != NULL);
 
 	ck_epoch_begin(record, NULL);
 }
@@ -86,9 +319,13 @@ ebpf_epoch_enter(void)
 void
 ebpf_epoch_exit(void)
 {
-	ck_epoch_record_t *record;
+	ck_epoch_record_t *record = ebpf_epoch_record;
+
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR) {
+		ebpf_qsbr_exit();
+		return;
+	}
 
-	record = pthread_getspecific(ebpf_epoch_key);
 	ebpf_assert(record != NULL);
 
 	ck_epoch_end(record, NULL);
@@ -98,23 +335,62 @@ void
 ebpf_epoch_call(ebpf_epoch_context *ctx,
 		void (*callback)(ebpf_epoch_context *))
 {
-	int error;
-	ck_epoch_record_t *record;
+	uint64_t ncalls;
 
-	error = ebpf_epoch_get_record(&record);
-	ebpf_assert(error == 0);
+	ctx->function = callback;
+	ck_stack_push_upmc(&ebpf_epoch_deferred, &ctx->stack_entry);
 
-	ck_epoch_call(record, ctx, callback);
+	ncalls = ck_pr_faa_64(&ebpf_epoch_ncalls, 1) + 1;
+	if (ncalls % EBPF_EPOCH_RECLAIM_BATCH == 0)
+		pthread_cond_signal(&ebpf_epoch_reclaim_cv);
 }
 
 void
 ebpf_epoch_wait(void)
 {
-	int error;
-	ck_epoch_record_t *record;
+	/*
+	 * The callbacks may release the last reference of the object
+	 * which waits for the epoch on destruction. The reclaim lock
+	 * is already held then. The object may still have callbacks
+	 * of its own in flight, so they are dispatched here as well.
+	 */
+	if (ebpf_epoch_dispatching) {
+		ebpf_epoch_reclaim(true);
+		return;
+	}
 
-	error = ebpf_epoch_get_record(&record);
-	ebpf_assert(error == 0);
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR)
+		ebpf_qsbr_offline();
 
-	ck_epoch_synchronize(record);
+	/*
+	 * Unlike ck_epoch_synchronize, this also dispatches the
+	 * callbacks deferred by ebpf_epoch_call before the call.
+	 */
+	pthread_mutex_lock(&ebpf_epoch_reclaim_mtx);
+	ebpf_epoch_reclaim(true);
+	pthread_mutex_unlock(&ebpf_epoch_reclaim_mtx);
+
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR)
+		ebpf_qsbr_online();
+}
+
+/* ebpf_epoch_wait already dispatches all deferred callbacks */
+void
+ebpf_epoch_barrier(void)
+{
+	ebpf_epoch_wait();
+}
+
+void
+ebpf_quiescent(void)
+{
+	if (ebpf_epoch_reclaim_type == EBPF_RECLAIM_QSBR)
+		ebpf_qsbr_quiescent();
+}
+
+uint64_t
+ebpf_epoch_backlog(void)
+{
+	return ck_pr_load_64(&ebpf_epoch_ncalls) -
+	       ck_pr_load_64(&ebpf_epoch_ndispatched);
 }
@@ -17,6 +17,23 @@
  */
 
 #include "ebpf_platform.h"
+#include <sys/ebpf.h>
 
-int ebpf_epoch_init(void);
+int ebpf_epoch_init(uint32_t reclaim);
 int ebpf_epoch_deinit(void);
+
+/*
+ * Number of the callbacks deferred by ebpf_epoch_call which are not
+ * dispatched yet.
+ */
+uint64_t ebpf_epoch_backlog(void);
+
+/* Backend of EBPF_RECLAIM_QSBR in ebpf_qsbr.c */
+int ebpf_qsbr_init(void);
+void ebpf_qsbr_deinit(void);
+void ebpf_qsbr_quiescent(void);
+void ebpf_qsbr_enter(void);
+void ebpf_qsbr_exit(void);
+void ebpf_qsbr_offline(void);
+void ebpf_qsbr_online(void);
+void ebpf_qsbr_synchronize(void);
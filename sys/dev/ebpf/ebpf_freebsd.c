@@ -80,6 +80,14 @@ ebpf_curcpu(void)
 	return curcpu;
 }
 
+__inline void
+ebpf_percpu_add64(void *base, size_t stride, uint64_t delta)
+{
+	critical_enter();
+	*(uint64_t *)((uint8_t *)base + stride * curcpu) += delta;
+	critical_exit();
+}
+
 __inline long
 ebpf_getpagesize(void)
 {
@@ -113,6 +121,19 @@ ebpf_epoch_wait(void)
 	epoch_wait(ebpf_epoch);
 }
 
+/* epoch_wait doesn't wait for the callbacks deferred by epoch_call */
+__inline void
+ebpf_epoch_barrier(void)
+{
+	epoch_drain_callbacks(ebpf_epoch);
+}
+
+/* epoch(9) readers don't announce the quiescent state by themselves */
+__inline void
+ebpf_quiescent(void)
+{
+}
+
 __inline void
 ebpf_mtx_init(ebpf_mtx *mutex, const char *name)
 {
@@ -192,6 +213,16 @@ ebpf_init(void)
 	return 0;
 }
 
+/* Only the native epoch(9) is supported */
+int
+ebpf_init_reclaim(uint32_t reclaim)
+{
+	if (reclaim != EBPF_RECLAIM_EPOCH)
+		return ENOTSUP;
+
+	return ebpf_init();
+}
+
 int
 ebpf_deinit(void)
 {
@@ -0,0 +1,73 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ebpf_hash.h"
+#include <sys/ebpf.h>
+
+/*
+ * Only userspace has a portable way to query CPU features. Kernel
+ * builds never use CRC32C, EBPF_MAP_HASH_AUTO picks wyhash there.
+ */
+static bool
+cpu_has_crc32c(void)
+{
+#if defined(EBPF_HASH_HAVE_CRC32C) && !defined(_KERNEL)
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+/*
+ * Returns the hash type EBPF_MAP_HASH_AUTO resolves to. CRC32C is
+ * a few instructions per 8 bytes, which is the fastest for short
+ * keys. Otherwise wyhash.
+ */
+uint32_t
+ebpf_hash_auto(void)
+{
+	return cpu_has_crc32c() ? EBPF_MAP_HASH_CRC32C : EBPF_MAP_HASH_WYHASH;
+}
+
+int
+ebpf_hash_select(uint32_t type, ebpf_hash_fn *fnp)
+{
+	switch (type) {
+	case EBPF_MAP_HASH_JHASH:
+		*fnp = ebpf_hash_jhash;
+		return 0;
+	case EBPF_MAP_HASH_CRC32C:
+#ifdef EBPF_HASH_HAVE_CRC32C
+		if (cpu_has_crc32c()) {
+			*fnp = ebpf_hash_crc32c;
+			return 0;
+		}
+#endif
+		return ENOTSUP;
+	case EBPF_MAP_HASH_XXH64:
+		*fnp = ebpf_hash_xxh64;
+		return 0;
+	case EBPF_MAP_HASH_WYHASH:
+		*fnp = ebpf_hash_wyhash;
+		return 0;
+	case EBPF_MAP_HASH_AUTO:
+		return ebpf_hash_select(ebpf_hash_auto(), fnp);
+	default:
+		return EINVAL;
+	}
+}
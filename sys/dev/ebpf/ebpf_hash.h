@@ -0,0 +1,282 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "ebpf_platform.h"
+
+/*
+ * Hash functions for the hash based maps. Maps pick one of them at
+ * creation time with ebpf_hash_select. They are inline here so that
+ * the specialized map paths can use them without indirect call.
+ */
+
+typedef uint32_t (*ebpf_hash_fn)(const void *key, uint32_t len);
+
+int ebpf_hash_select(uint32_t type, ebpf_hash_fn *fnp);
+uint32_t ebpf_hash_auto(void);
+
+static inline uint64_t
+ebpf_hash_read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+ebpf_hash_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+ebpf_hash_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * CRC32C with SSE4.2 crc32 instruction. Inline assembly is used
+ * instead of the intrinsics, because the instruction only touches
+ * general purpose registers and is usable in the kernel. Callers
+ * must check the CPU supports it.
+ */
+#if defined(__x86_64__)
+#define EBPF_HASH_HAVE_CRC32C 1
+
+static inline uint32_t
+ebpf_hash_crc32c(const void *key, uint32_t len)
+{
+	const uint8_t *p = key;
+	uint64_t crc = UINT32_MAX;
+	uint32_t crc32;
+
+	for (; len >= 8; len -= 8, p += 8)
+		__asm__("crc32q %1, %0"
+			: "+r"(crc)
+			: "rm"(ebpf_hash_read64(p)));
+
+	crc32 = crc;
+	if (len >= 4) {
+		__asm__("crc32l %1, %0"
+			: "+r"(crc32)
+			: "rm"((uint32_t)ebpf_hash_read32(p)));
+		len -= 4;
+		p += 4;
+	}
+
+	for (; len > 0; len--, p++)
+		__asm__("crc32b %1, %0" : "+r"(crc32) : "rm"(*p));
+
+	return ~crc32;
+}
+#endif
+
+/*
+ * XXH64 by Yann Collet, truncated to 32bits.
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+ebpf_xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = ebpf_hash_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+ebpf_xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= ebpf_xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t
+ebpf_xxh64(const void *key, uint32_t len, uint64_t seed)
+{
+	const uint8_t *p = key, *end = p + len;
+	uint64_t h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = seed + XXH_PRIME64_2;
+		v3 = seed;
+		v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = ebpf_xxh64_round(v1, ebpf_hash_read64(p));
+			v2 = ebpf_xxh64_round(v2, ebpf_hash_read64(p + 8));
+			v3 = ebpf_xxh64_round(v3, ebpf_hash_read64(p + 16));
+			v4 = ebpf_xxh64_round(v4, ebpf_hash_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = ebpf_hash_rotl64(v1, 1) + ebpf_hash_rotl64(v2, 7) +
+		    ebpf_hash_rotl64(v3, 12) + ebpf_hash_rotl64(v4, 18);
+		h = ebpf_xxh64_merge_round(h, v1);
+		h = ebpf_xxh64_merge_round(h, v2);
+		h = ebpf_xxh64_merge_round(h, v3);
+		h = ebpf_xxh64_merge_round(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= ebpf_xxh64_round(0, ebpf_hash_read64(p));
+		h = ebpf_hash_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= ebpf_hash_read32(p) * XXH_PRIME64_1;
+		h = ebpf_hash_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = ebpf_hash_rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static inline uint32_t
+ebpf_hash_xxh64(const void *key, uint32_t len)
+{
+	return ebpf_xxh64(key, len, 0);
+}
+
+/*
+ * wyhash (final version 4) by Wang Yi, with the default secret and
+ * truncated to 32bits.
+ */
+static inline void
+ebpf_wymum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = (uint32_t)*a, lb = (uint32_t)*b, hi, lo;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static inline uint64_t
+ebpf_wymix(uint64_t a, uint64_t b)
+{
+	ebpf_wymum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+ebpf_wyhash(const void *key, uint32_t len, uint64_t seed)
+{
+	static const uint64_t secret[4] = {
+	    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+	const uint8_t *p = key;
+	uint64_t a, b, see1, see2;
+	uint32_t i = len;
+
+	seed ^= ebpf_wymix(seed ^ secret[0], secret[1]);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (ebpf_hash_read32(p) << 32) |
+			    ebpf_hash_read32(p + ((len >> 3) << 2));
+			b = (ebpf_hash_read32(p + len - 4) << 32) |
+			    ebpf_hash_read32(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) |
+			    ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (i > 48) {
+			see1 = seed;
+			see2 = seed;
+			do {
+				seed = ebpf_wymix(ebpf_hash_read64(p) ^ secret[1],
+						  ebpf_hash_read64(p + 8) ^ seed);
+				see1 = ebpf_wymix(ebpf_hash_read64(p + 16) ^ secret[2],
+						  ebpf_hash_read64(p + 24) ^ see1);
+				see2 = ebpf_wymix(ebpf_hash_read64(p + 32) ^ secret[3],
+						  ebpf_hash_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+
+		while (i > 16) {
+			seed = ebpf_wymix(ebpf_hash_read64(p) ^ secret[1],
+					  ebpf_hash_read64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+
+		a = ebpf_hash_read64(p + i - 16);
+		b = ebpf_hash_read64(p + i - 8);
+	}
+
+	a ^= secret[1];
+	b ^= seed;
+	ebpf_wymum(&a, &b);
+
+	return ebpf_wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+static inline uint32_t
+ebpf_hash_wyhash(const void *key, uint32_t len)
+{
+	return ebpf_wyhash(key, len, 0);
+}
+
+static inline uint32_t
+ebpf_hash_jhash(const void *key, uint32_t len)
+{
+	return ebpf_jenkins_hash(key, len, 0);
+}
@@ -16,357 +16,1465 @@
  * limitations under the License.
  */
 
+/*
+ * Direct-threaded eBPF interpreter.
+ *
+ * At load time, each eBPF instruction is translated into struct
+ * ebpf_dinst which holds the address of its handler, pre-extracted
+ * register numbers, a sign-extended immediate and an absolute jump
+ * target. At run time, each handler jumps to the next handler directly
+ * with computed goto, so there is no central dispatch loop and no
+ * bitfield decoding.
+ *
+ * After decoding, common instruction sequences emitted by compilers
+ * are fused into superinstructions. A fused handler is installed on
+ * the first instruction of the sequence and reads the operands of the
+ * following instructions from their own ebpf_dinst, so the index of
+ * every instruction is still preserved. A sequence is fused only when
+ * no jump lands in the middle of it.
+ *
+ * The interpreter can run the program over the batch of contexts in
+ * a single invocation. The handler table, the register file and the
+ * stack are set up once, and the context which is going to be
+ * processed a few iterations later is prefetched.
+ *
+ * In the interleaved mode, several instances of the program run on
+ * different contexts in a round robin manner. When an instance calls
+ * map_lookup_elem, the interpreter asks the map to prefetch the memory
+ * the lookup is going to touch and switches to the next instance
+ * instead of stalling on the cache miss. The call is performed when
+ * the instance is resumed.
+ *
+ * The calls of map_lookup_elem on the array maps known at load time
+ * are rewritten by the loader, and the interpreter computes the
+ * address of the element in place without calling the helper.
+ *
+ * Tail calls switch the decoded program the instance is running on
+ * and start from its first instruction. The stack and the registers
+ * are taken over as is, so a tail call costs no more than a jump.
+ *
+ * BPF-to-BPF calls push the return address and the callee saved
+ * registers R6 - R10 to the shadow return stack of the instance. The
+ * stack frame of the callee is placed right below the frame of the
+ * caller. Since there is no verifier, the stack usage of each function
+ * is estimated at load time from the way it addresses R10, and the
+ * program is rejected when the frames of the deepest call chain don't
+ * fit in EBPF_STACK_SIZE.
+ */
+
 #include "ebpf_platform.h"
 #include <sys/ebpf_vm_isa.h>
 #include "ebpf_prog.h"
+#include "ebpf_map.h"
+#include "ebpf_util.h"
 
-uint64_t
-ebpf_prog_run(void *ctx, struct ebpf_prog *ep)
-{
-	uint32_t pc = 0;
+/* Number of contexts to prefetch ahead in the batched execution */
+#define EBPF_BATCH_PREFETCH_DIST 4
+
+/*
+ * Number of program instances in flight in the interleaved mode.
+ * Every instance has its own stack, so keep this small enough to
+ * run on the kernel stack.
+ */
+#define EBPF_INTERLEAVE_WIDTH 4
+
+/* Caller's state saved by BPF-to-BPF call */
+struct ebpf_interp_frame {
+	const struct ebpf_dinst *ret;
+	uint64_t reg[EBPF_REG_MAX - EBPF_R6]; /* R6 - R10 */
+};
+
+/* Execution state of an instance of the program */
+struct ebpf_interp_state {
 	uint64_t reg[EBPF_REG_MAX];
+	const struct ebpf_dinst *dprog; /* program currently running */
+	const struct ebpf_dinst *d;	/* where to resume, NULL if finished */
+	uint32_t idx;			/* index of the context */
+	uint32_t tail_calls;		/* number of tail calls so far */
+	uint32_t nframes;		/* number of callers in frames */
+	bool waiting;			/* suspended at map_lookup_elem */
+	struct ebpf_interp_frame frames[EBPF_MAX_CALL_DEPTH - 1];
 	uint8_t stack[EBPF_STACK_SIZE];
+};
+
+/* Flags of the instructions which can be reached by other than NEXT */
+#define EBPF_TARGET_JUMP 0x01 /* jump target */
+#define EBPF_TARGET_FUNC 0x02 /* entry of the function */
+
+/* Function in the program. Function 0 is the main program */
+struct ebpf_interp_func {
+	uint32_t start;
+	uint32_t end;
+	uint32_t depth;	 /* stack usage of this function */
+	uint32_t stack;	 /* stack usage including the callees */
+	uint32_t frames; /* depth of the deepest call chain from here */
+	bool visiting;
+	bool done;
+};
+
+/*
+ * Internal opcodes which don't exist in the eBPF ISA. They are
+ * placed after all 8bit eBPF opcodes.
+ */
+enum ebpf_interp_ops {
+	EBPF_IOP_INVALID = 256,
+	EBPF_IOP_CALL_MAP_LOOKUP,
+	EBPF_IOP_TAIL_CALL,
+	EBPF_IOP_CALL_LOCAL,
+	EBPF_IOP_RETURN,
+	EBPF_IOP_ARRAY_LOOKUP,
+	EBPF_IOP_PERCPU_ARRAY_LOOKUP,
+	EBPF_IOP_XADDW_FETCH,
+	EBPF_IOP_XADDDW_FETCH,
+	EBPF_IOP_XCHGW,
+	EBPF_IOP_XCHGDW,
+	EBPF_IOP_CMPXCHGW,
+	EBPF_IOP_CMPXCHGDW,
+	EBPF_IOP_LDXW_JEQ_IMM,
+	EBPF_IOP_LDXW_JNE_IMM,
+	EBPF_IOP_LDXH_JEQ_IMM,
+	EBPF_IOP_LDXH_JNE_IMM,
+	EBPF_IOP_LDXB_JEQ_IMM,
+	EBPF_IOP_LDXB_JNE_IMM,
+	EBPF_IOP_LDXDW_JEQ_IMM,
+	EBPF_IOP_LDXDW_JNE_IMM,
+	EBPF_IOP_MOV64_IMM_ADD64_REG,
+	EBPF_IOP_MOV64_REG_ADD64_IMM,
+	EBPF_IOP_MOV64_REG_ADD64_IMM_CALL,
+	EBPF_IOP_LDDW_CALL,
+	EBPF_IOP_MAX
+};
+
+static void ebpf_interp_exec(const struct ebpf_dinst *prog,
+			     const struct ebpf_prog_type *ept, void **ctxs,
+			     uint64_t *rets, uint32_t n,
+			     struct ebpf_interp_state *states,
+			     uint32_t nstates, const void *const **handlersp);
+
+static const void *const *
+ebpf_interp_handlers(void)
+{
+	const void *const *handlers;
+	ebpf_interp_exec(NULL, NULL, NULL, NULL, 0, NULL, 0, &handlers);
+	return handlers;
+}
+
+static bool
+is_jmp_with_offset(uint8_t opcode)
+{
+	return EBPF_CLS(opcode) == EBPF_CLS_JMP &&
+		opcode != EBPF_OP_CALL && opcode != EBPF_OP_EXIT;
+}
+
+static bool
+is_local_call(const struct ebpf_inst *inst)
+{
+	return inst->opcode == EBPF_OP_CALL && inst->src == EBPF_PSEUDO_CALL;
+}
+
+/*
+ * Checks the instructions [pc, pc + len) exist and no jump lands
+ * on the instructions other than the first one.
+ */
+static bool
+is_fusable(struct ebpf_prog *ep, const uint8_t *targets, uint32_t pc,
+	   uint32_t len)
+{
+	if (pc + len > ep->prog_len)
+		return false;
+
+	for (uint32_t i = pc + 1; i < pc + len; i++) {
+		if (targets[i])
+			return false;
+	}
+
+	return true;
+}
+
+/* Indexed by EBPF_SIZE(opcode) >> 3 */
+static const uint16_t ldx_jeq_iops[] = {
+	EBPF_IOP_LDXW_JEQ_IMM,
+	EBPF_IOP_LDXH_JEQ_IMM,
+	EBPF_IOP_LDXB_JEQ_IMM,
+	EBPF_IOP_LDXDW_JEQ_IMM
+};
+
+static const uint16_t ldx_jne_iops[] = {
+	EBPF_IOP_LDXW_JNE_IMM,
+	EBPF_IOP_LDXH_JNE_IMM,
+	EBPF_IOP_LDXB_JNE_IMM,
+	EBPF_IOP_LDXDW_JNE_IMM
+};
+
+/*
+ * Fused handlers call the helper directly, which doesn't work for
+ * tail calls and BPF-to-BPF calls.
+ */
+static bool
+is_fusable_call(struct ebpf_dinst *dprog, uint32_t pc,
+		const void *const *handlers)
+{
+	return dprog[pc].handler == handlers[EBPF_OP_CALL] ||
+		dprog[pc].handler == handlers[EBPF_IOP_CALL_MAP_LOOKUP];
+}
+
+static void
+ebpf_interp_fuse(struct ebpf_prog *ep, struct ebpf_dinst *dprog,
+		 const uint8_t *targets)
+{
 	struct ebpf_inst *inst;
-	const struct ebpf_helper_type *const *helpers =
-		ep->eo.eo_ee->ec->helper_types;
+	uint32_t iop, type, len;
+	const void *const *handlers = ebpf_interp_handlers();
 
-	pc = 0;
-	inst = ep->prog;
-	reg[1] = (uint64_t)ctx;
-	reg[10] = (uint64_t)(stack + EBPF_STACK_SIZE);
+	for (uint32_t pc = 0; pc < ep->prog_len; pc += len) {
+		inst = ep->prog + pc;
+		iop = EBPF_IOP_INVALID;
+		type = EBPF_FUSION_MAX;
+		len = inst->opcode == EBPF_OP_LDDW ? 2 : 1;
 
-	while (true) {
-		inst = inst + pc++;
 		switch (inst->opcode) {
-		case EBPF_OP_ADD_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] + (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_ADD_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] + (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_SUB_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] - (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_SUB_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] - (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_MUL_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] * (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_MUL_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] * (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_DIV_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] / (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_DIV_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] / (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_OR_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] | (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_OR_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] | (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_AND_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] & (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_AND_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] & (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_LSH_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] << (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_LSH_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] << (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_RSH_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] >> (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_RSH_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] >> (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_NEG:
-			reg[inst->dst] = -(uint32_t)inst->imm;
-			break;
-		case EBPF_OP_MOD_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] % (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_MOD_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] % (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_XOR_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] ^ (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_XOR_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] ^ (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_MOV_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_MOV_IMM:
-			reg[inst->dst] = (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_ARSH_REG:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] >> (uint32_t)reg[inst->src];
-			break;
-		case EBPF_OP_ARSH_IMM:
-			reg[inst->dst] = (uint32_t)reg[inst->dst] >> (uint32_t)inst->imm;
-			break;
-		case EBPF_OP_LE:
-			if (inst->imm == 16) {
-				reg[inst->dst] = htole16((uint16_t)reg[inst->dst]);
-			} else if (inst->imm == 32) {
-				reg[inst->dst] = htole32((uint32_t)reg[inst->dst]);
-			} else if (inst->imm == 64) {
-				reg[inst->dst] = htole64((uint64_t)reg[inst->dst]);
-			}
-			break;
-		case EBPF_OP_BE:
-			if (inst->imm == 16) {
-				reg[inst->dst] = htobe16((uint16_t)reg[inst->dst]);
-			} else if (inst->imm == 32) {
-				reg[inst->dst] = htobe32((uint32_t)reg[inst->dst]);
-			} else if (inst->imm == 64) {
-				reg[inst->dst] = htobe64((uint64_t)reg[inst->dst]);
-			}
-			break;
-		case EBPF_OP_ADD64_REG:
-			reg[inst->dst] = reg[inst->dst] + reg[inst->src];
-			break;
-		case EBPF_OP_ADD64_IMM:
-			reg[inst->dst] = reg[inst->dst] + inst->imm;
-			break;
-		case EBPF_OP_SUB64_REG:
-			reg[inst->dst] = reg[inst->dst] - reg[inst->src];
-			break;
-		case EBPF_OP_SUB64_IMM:
-			reg[inst->dst] = reg[inst->dst] - inst->imm;
-			break;
-		case EBPF_OP_MUL64_REG:
-			reg[inst->dst] = reg[inst->dst] * reg[inst->src];
-			break;
-		case EBPF_OP_MUL64_IMM:
-			reg[inst->dst] = reg[inst->dst] * inst->imm;
-			break;
-		case EBPF_OP_DIV64_REG:
-			reg[inst->dst] = reg[inst->dst] / reg[inst->src];
-			break;
-		case EBPF_OP_DIV64_IMM:
-			reg[inst->dst] = reg[inst->dst] / inst->imm;
-			break;
-		case EBPF_OP_OR64_REG:
-			reg[inst->dst] = reg[inst->dst] | reg[inst->src];
-			break;
-		case EBPF_OP_OR64_IMM:
-			reg[inst->dst] = reg[inst->dst] | inst->imm;
-			break;
-		case EBPF_OP_AND64_REG:
-			reg[inst->dst] = reg[inst->dst] & reg[inst->src];
-			break;
-		case EBPF_OP_AND64_IMM:
-			reg[inst->dst] = reg[inst->dst] & inst->imm;
-			break;
-		case EBPF_OP_LSH64_REG:
-			reg[inst->dst] = reg[inst->dst] << reg[inst->src];
-			break;
-		case EBPF_OP_LSH64_IMM:
-			reg[inst->dst] = reg[inst->dst] << inst->imm;
-			break;
-		case EBPF_OP_RSH64_REG:
-			reg[inst->dst] = reg[inst->dst] >> reg[inst->src];
-			break;
-		case EBPF_OP_RSH64_IMM:
-			reg[inst->dst] = reg[inst->dst] >> inst->imm;
-			break;
-		case EBPF_OP_NEG64:
-			reg[inst->dst] = reg[inst->dst] - inst->imm;
-			break;
-		case EBPF_OP_MOD64_REG:
-			reg[inst->dst] = reg[inst->dst] % reg[inst->src];
-			break;
-		case EBPF_OP_MOD64_IMM:
-			reg[inst->dst] = reg[inst->dst] % inst->imm;
-			break;
-		case EBPF_OP_XOR64_REG:
-			reg[inst->dst] = reg[inst->dst] ^ reg[inst->src];
-			break;
-		case EBPF_OP_XOR64_IMM:
-			reg[inst->dst] = reg[inst->dst] ^ inst->imm;
-			break;
-		case EBPF_OP_MOV64_REG:
-			reg[inst->dst] = reg[inst->dst] + reg[inst->src];
+		case EBPF_OP_LDXW:
+		case EBPF_OP_LDXH:
+		case EBPF_OP_LDXB:
+		case EBPF_OP_LDXDW:
+			if (!is_fusable(ep, targets, pc, 2) ||
+					inst[1].dst != inst->dst)
+				break;
+			if (inst[1].opcode == EBPF_OP_JEQ_IMM)
+				iop = ldx_jeq_iops[EBPF_SIZE(inst->opcode) >> 3];
+			else if (inst[1].opcode == EBPF_OP_JNE_IMM)
+				iop = ldx_jne_iops[EBPF_SIZE(inst->opcode) >> 3];
+			else
+				break;
+			type = EBPF_FUSION_LDX_JCC;
+			len = 2;
 			break;
 		case EBPF_OP_MOV64_IMM:
-			reg[inst->dst] = reg[inst->dst] + inst->imm;
-			break;
-		case EBPF_OP_ARSH64_REG:
-			reg[inst->dst] = reg[inst->dst] >> reg[inst->src];
-			break;
-		case EBPF_OP_ARSH64_IMM:
-			reg[inst->dst] = reg[inst->dst] >> inst->imm;
-			break;
-		case EBPF_OP_JA:
-			pc += inst->offset;
-			break;
-		case EBPF_OP_JEQ_REG:
-			if ((uint64_t)reg[inst->dst] == (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JEQ_IMM:
-			if ((uint64_t)reg[inst->dst] == (uint64_t)inst->imm) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JGT_REG:
-			if ((uint64_t)reg[inst->dst] > (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
+			if (!is_fusable(ep, targets, pc, 2) ||
+					inst[1].opcode != EBPF_OP_ADD64_REG ||
+					inst[1].src != inst->dst)
+				break;
+			iop = EBPF_IOP_MOV64_IMM_ADD64_REG;
+			type = EBPF_FUSION_MOV_IMM_ADD;
+			len = 2;
 			break;
-		case EBPF_OP_JGT_IMM:
-			if ((uint64_t)reg[inst->dst] > (uint64_t)inst->imm) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JGE_REG:
-			if ((uint64_t)reg[inst->dst] >= (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JGE_IMM:
-			if ((uint64_t)reg[inst->dst] >= (uint64_t)inst->imm) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JSET_REG:
-			if ((uint64_t)reg[inst->dst] & (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
+		case EBPF_OP_MOV64_REG:
+			if (!is_fusable(ep, targets, pc, 2) ||
+					inst[1].opcode != EBPF_OP_ADD64_IMM ||
+					inst[1].dst != inst->dst)
+				break;
+			if (is_fusable(ep, targets, pc, 3) &&
+					is_fusable_call(dprog, pc + 2, handlers)) {
+				iop = EBPF_IOP_MOV64_REG_ADD64_IMM_CALL;
+				type = EBPF_FUSION_STACK_ADDR_CALL;
+				len = 3;
+			} else {
+				iop = EBPF_IOP_MOV64_REG_ADD64_IMM;
+				type = EBPF_FUSION_STACK_ADDR;
+				len = 2;
 			}
 			break;
-		case EBPF_OP_JSET_IMM:
-			if ((uint64_t)reg[inst->dst] & (uint64_t)inst->imm) {
-				pc += inst->offset;
-			}
+		case EBPF_OP_LDDW:
+			if (!is_fusable(ep, targets, pc, 3) ||
+					!is_fusable_call(dprog, pc + 2, handlers))
+				break;
+			iop = EBPF_IOP_LDDW_CALL;
+			type = EBPF_FUSION_LDDW_CALL;
+			len = 3;
 			break;
-		case EBPF_OP_JNE_REG:
-			if ((uint64_t)reg[inst->dst] != (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
+		default:
 			break;
-		case EBPF_OP_JNE_IMM:
-			if ((uint64_t)reg[inst->dst] != (uint64_t)inst->imm) {
-				pc += inst->offset;
+		}
+
+		if (iop != EBPF_IOP_INVALID) {
+			dprog[pc].handler = handlers[iop];
+			ep->fusion_count[type]++;
+		}
+	}
+}
+
+/* The register doesn't hold an address derived from R10 */
+#define STACK_OFF_NONE INT32_MAX
+
+static inline int32_t
+stack_off(const int32_t *regs, uint8_t reg)
+{
+	return reg == EBPF_R10 ? 0 : regs[reg];
+}
+
+/*
+ * Merges the registers into the state at the start of the instruction.
+ * A register which may hold several addresses on the stack keeps the
+ * lowest one. Returns true when the state changed.
+ */
+static bool
+stack_merge(int32_t *dst, const int32_t *src, uint8_t *reached)
+{
+	bool changed = !*reached;
+
+	*reached = 1;
+	for (uint32_t i = 0; i < EBPF_R10; i++) {
+		if (src[i] < dst[i]) {
+			dst[i] = src[i];
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Stack usage of the function. The offset from R10 of each register
+ * derived from it is tracked over all paths, so the accesses through
+ * "rX = R10; rX += imm" which compilers emit, and through chains of
+ * such additions, are understood. Any other use of the derived
+ * registers (copies, other arithmetic, storing them to memory) is
+ * assumed to use the whole stack.
+ */
+static uint32_t
+func_stack_depth(struct ebpf_prog *ep, const struct ebpf_interp_func *f)
+{
+	uint32_t n = f->end - f->start, succ[2], nsucc;
+	int32_t *in, regs[EBPF_R10], srcoff;
+	int64_t off, depth = 0;
+	struct ebpf_inst *inst;
+	uint8_t *reached;
+	bool changed = true;
+
+	in = ebpf_malloc(sizeof(int32_t) * EBPF_R10 * n);
+	reached = ebpf_calloc(n, sizeof(uint8_t));
+	if (in == NULL || reached == NULL)
+		goto full;
+
+	for (uint32_t i = 0; i < EBPF_R10 * n; i++)
+		in[i] = STACK_OFF_NONE;
+	reached[0] = 1;
+
+	while (changed) {
+		changed = false;
+
+		for (uint32_t i = 0; i < n; i++) {
+			if (!reached[i])
+				continue;
+
+			inst = ep->prog + f->start + i;
+			memcpy(regs, in + EBPF_R10 * i, sizeof(regs));
+			succ[0] = i + 1;
+			nsucc = 1;
+
+			switch (EBPF_CLS(inst->opcode)) {
+			case EBPF_CLS_LD:
+				if (inst->opcode != EBPF_OP_LDDW ||
+						inst->dst == EBPF_R10)
+					goto full;
+				regs[inst->dst] = STACK_OFF_NONE;
+				succ[0] = i + 2;
+				break;
+			case EBPF_CLS_LDX:
+				if (inst->dst == EBPF_R10)
+					goto full;
+				off = stack_off(regs, inst->src);
+				if (off != STACK_OFF_NONE &&
+						-(off + inst->offset) > depth)
+					depth = -(off + inst->offset);
+				regs[inst->dst] = STACK_OFF_NONE;
+				break;
+			case EBPF_CLS_ST:
+			case EBPF_CLS_STX:
+				if (EBPF_CLS(inst->opcode) == EBPF_CLS_STX &&
+						stack_off(regs, inst->src) !=
+						STACK_OFF_NONE)
+					goto full;
+				off = stack_off(regs, inst->dst);
+				if (off != STACK_OFF_NONE &&
+						-(off + inst->offset) > depth)
+					depth = -(off + inst->offset);
+				/* Fetching atomics load into src or R0 */
+				if (EBPF_MODE(inst->opcode) == EBPF_MODE_XADD) {
+					regs[inst->src] = STACK_OFF_NONE;
+					regs[EBPF_R0] = STACK_OFF_NONE;
+				}
+				break;
+			case EBPF_CLS_ALU:
+			case EBPF_CLS_ALU64:
+				if (inst->dst == EBPF_R10)
+					goto full;
+				srcoff = EBPF_SRC(inst->opcode) == EBPF_SRC_REG ?
+					stack_off(regs, inst->src) :
+					STACK_OFF_NONE;
+				if (EBPF_ALU_OP(inst->opcode) == EBPF_MOV) {
+					if (srcoff == STACK_OFF_NONE)
+						regs[inst->dst] = STACK_OFF_NONE;
+					else if (inst->opcode ==
+							EBPF_OP_MOV64_REG &&
+							inst->src == EBPF_R10)
+						regs[inst->dst] = 0;
+					else
+						goto full;
+				} else if (inst->opcode == EBPF_OP_ADD64_IMM &&
+						regs[inst->dst] != STACK_OFF_NONE) {
+					off = (int64_t)regs[inst->dst] + inst->imm;
+					if (off < -EBPF_STACK_SIZE ||
+							off > EBPF_STACK_SIZE)
+						goto full;
+					regs[inst->dst] = off;
+					/* The address may be passed to calls */
+					if (-off > depth)
+						depth = -off;
+				} else if (regs[inst->dst] != STACK_OFF_NONE ||
+						srcoff != STACK_OFF_NONE) {
+					goto full;
+				}
+				break;
+			case EBPF_CLS_JMP:
+				switch (EBPF_JMP_OP(inst->opcode)) {
+				case EBPF_CALL:
+					for (uint32_t r = EBPF_R0; r <= EBPF_R5; r++)
+						regs[r] = STACK_OFF_NONE;
+					break;
+				case EBPF_EXIT:
+					nsucc = 0;
+					break;
+				case EBPF_JA:
+					succ[0] = i + 1 + inst->offset;
+					break;
+				default:
+					succ[1] = i + 1 + inst->offset;
+					nsucc = 2;
+					break;
+				}
+				break;
+			default:
+				goto full;
 			}
-			break;
-		case EBPF_OP_JSGT_REG:
-			if ((int64_t)reg[inst->dst] > (int64_t)reg[inst->src]) {
-				pc += inst->offset;
+
+			for (uint32_t s = 0; s < nsucc; s++) {
+				if (succ[s] >= n)
+					goto full;
+				changed |= stack_merge(in + EBPF_R10 * succ[s],
+						       regs, reached + succ[s]);
 			}
-			break;
-		case EBPF_OP_JSGT_IMM:
-			if ((int64_t)reg[inst->dst] > (int64_t)inst->imm) {
-				pc += inst->offset;
+		}
+	}
+
+	/* Keep the frames 8 bytes aligned */
+	depth = (depth + 7) & ~7;
+	goto out;
+
+full:
+	depth = EBPF_STACK_SIZE;
+out:
+	ebpf_free(reached);
+	ebpf_free(in);
+	return depth;
+}
+
+static uint32_t
+func_index(const struct ebpf_interp_func *funcs, uint32_t nfuncs,
+	   uint32_t pc)
+{
+	uint32_t lo = 0, hi = nfuncs, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (funcs[mid].start <= pc)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Computes the stack usage and the call depth of the deepest call
+ * chain from the function. Recursion is rejected.
+ */
+static int
+check_call_chain(struct ebpf_prog *ep, struct ebpf_interp_func *funcs,
+		 uint32_t nfuncs, uint32_t idx, uint32_t level)
+{
+	int error;
+	struct ebpf_interp_func *f = funcs + idx, *callee;
+
+	if (f->done)
+		return 0;
+
+	if (f->visiting || level >= EBPF_MAX_CALL_DEPTH) {
+		ebpf_error("Recursive or too deep call to PC %u\n", f->start);
+		return EINVAL;
+	}
+
+	f->visiting = true;
+	f->stack = f->depth;
+	f->frames = 1;
+
+	for (uint32_t pc = f->start; pc < f->end; pc++) {
+		if (!is_local_call(ep->prog + pc))
+			continue;
+
+		callee = funcs + func_index(funcs, nfuncs,
+					    pc + ep->prog[pc].imm + 1);
+		error = check_call_chain(ep, funcs, nfuncs, callee - funcs,
+					 level + 1);
+		if (error != 0)
+			return error;
+
+		if (f->depth + callee->stack > f->stack)
+			f->stack = f->depth + callee->stack;
+		if (callee->frames + 1 > f->frames)
+			f->frames = callee->frames + 1;
+	}
+
+	f->visiting = false;
+	f->done = true;
+
+	return 0;
+}
+
+/*
+ * Splits the program into functions at the targets of BPF-to-BPF
+ * calls and validates them. Jumps must stay in the function and
+ * every function other than the main program must end with exit or
+ * jump. Exits of such functions return to the caller.
+ */
+static int
+ebpf_interp_check_funcs(struct ebpf_prog *ep, struct ebpf_dinst *dprog,
+			const uint8_t *targets, uint32_t nfuncs)
+{
+	int error;
+	struct ebpf_inst *inst;
+	struct ebpf_interp_func *funcs, *f;
+	const void *const *handlers = ebpf_interp_handlers();
+
+	funcs = ebpf_calloc(nfuncs, sizeof(*funcs));
+	if (funcs == NULL)
+		return ENOMEM;
+
+	for (uint32_t pc = 1, i = 1; pc < ep->prog_len; pc++) {
+		if (targets[pc] & EBPF_TARGET_FUNC) {
+			funcs[i - 1].end = pc;
+			funcs[i++].start = pc;
+		}
+	}
+	funcs[nfuncs - 1].end = ep->prog_len;
+
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		f = funcs + i;
+
+		inst = ep->prog + f->end - 1;
+		if (i != 0 && inst->opcode != EBPF_OP_EXIT &&
+				inst->opcode != EBPF_OP_JA) {
+			ebpf_error("Function at PC %u falls through\n",
+					f->start);
+			error = EINVAL;
+			goto out;
+		}
+
+		for (uint32_t pc = f->start; pc < f->end; pc++) {
+			inst = ep->prog + pc;
+
+			if (is_jmp_with_offset(inst->opcode) &&
+					(dprog[pc].target < f->start ||
+					 dprog[pc].target >= f->end)) {
+				ebpf_error("Jump out of function at PC %u\n",
+						pc);
+				error = EINVAL;
+				goto out;
 			}
-			break;
-		case EBPF_OP_JSGE_REG:
-			if ((int64_t)reg[inst->dst] >= (int64_t)reg[inst->src]) {
-				pc += inst->offset;
+
+			if (i == 0)
+				continue;
+
+			if (dprog[pc].handler == handlers[EBPF_IOP_TAIL_CALL]) {
+				ebpf_error("Tail call in function at PC %u\n",
+						pc);
+				error = EINVAL;
+				goto out;
 			}
-			break;
-		case EBPF_OP_JSGE_IMM:
-			if ((int64_t)reg[inst->dst] >= (int64_t)inst->imm) {
-				pc += inst->offset;
+
+			if (inst->opcode == EBPF_OP_EXIT)
+				dprog[pc].handler = handlers[EBPF_IOP_RETURN];
+		}
+
+		f->depth = func_stack_depth(ep, f);
+	}
+
+	error = check_call_chain(ep, funcs, nfuncs, 0, 0);
+	if (error != 0)
+		goto out;
+
+	/* Functions shared by several callers are checked only once */
+	if (funcs[0].frames > EBPF_MAX_CALL_DEPTH) {
+		ebpf_error("Call chain is too deep: %u\n", funcs[0].frames);
+		error = EINVAL;
+		goto out;
+	}
+
+	if (funcs[0].stack > EBPF_STACK_SIZE) {
+		ebpf_error("Stack of the call chain is too large: %u\n",
+				funcs[0].stack);
+		error = EINVAL;
+		goto out;
+	}
+
+	/* The frame of the callee starts below the frame of the caller */
+	for (uint32_t pc = 0; pc < ep->prog_len; pc++) {
+		if (is_local_call(ep->prog + pc))
+			dprog[pc].imm =
+				funcs[func_index(funcs, nfuncs, pc)].depth;
+	}
+
+out:
+	ebpf_free(funcs);
+	return error;
+}
+
+int
+ebpf_interp_decode(struct ebpf_prog *ep)
+{
+	int error = EINVAL;
+	bool dw;
+	uint8_t *targets;
+	uint32_t nfuncs = 1;
+	struct ebpf_inst *inst;
+	struct ebpf_map *em;
+	struct ebpf_dinst *dprog, *d;
+	const void *const *handlers = ebpf_interp_handlers();
+	const struct ebpf_helper_type *const *helpers =
+		ep->eo.eo_ee->ec->helper_types;
+
+	dprog = ebpf_calloc(ep->prog_len, sizeof(*dprog));
+	if (dprog == NULL)
+		return ENOMEM;
+
+	targets = ebpf_calloc(ep->prog_len, sizeof(*targets));
+	if (targets == NULL) {
+		ebpf_free(dprog);
+		return ENOMEM;
+	}
+
+	for (uint32_t pc = 0; pc < ep->prog_len; pc++) {
+		inst = ep->prog + pc;
+		d = dprog + pc;
+
+		d->handler = handlers[inst->opcode];
+		d->dst = inst->dst;
+		d->src = inst->src;
+		d->offset = inst->offset;
+		d->imm = inst->imm;
+
+		/* src of call is not a register, checked below */
+		if (d->handler == NULL || inst->dst >= EBPF_REG_MAX ||
+				(inst->src >= EBPF_REG_MAX &&
+				 inst->opcode != EBPF_OP_CALL)) {
+			ebpf_error("Invalid instruction at PC %u\n", pc);
+			goto err;
+		}
+
+		if (is_jmp_with_offset(inst->opcode)) {
+			if ((int64_t)pc + inst->offset + 1 < 0 ||
+			    (int64_t)pc + inst->offset + 1 >= ep->prog_len) {
+				ebpf_error("Jump out of program at PC %u\n", pc);
+				goto err;
 			}
-			break;
+			d->target = pc + inst->offset + 1;
+			targets[d->target] |= EBPF_TARGET_JUMP;
+		}
+
+		switch (inst->opcode) {
 		case EBPF_OP_CALL:
-			reg[0] = helpers[inst->imm]->fn(reg[1], reg[2], reg[3], reg[4], reg[5]);
-			break;
-		case EBPF_OP_EXIT:
-			return reg[0];
-		case EBPF_OP_JLT_REG:
-			if ((uint64_t)reg[inst->dst] < (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JLT_IMM:
-			if ((uint64_t)reg[inst->dst] < (uint64_t)inst->imm) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JLE_REG:
-			if ((uint64_t)reg[inst->dst] <= (uint64_t)reg[inst->src]) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JLE_IMM:
-			if ((uint64_t)reg[inst->dst] <= (uint64_t)inst->imm) {
-				pc += inst->offset;
+			if (inst->src == EBPF_PSEUDO_CALL) {
+				if ((int64_t)pc + inst->imm + 1 <= 0 ||
+				    (int64_t)pc + inst->imm + 1 >= ep->prog_len) {
+					ebpf_error("Invalid call target at PC %u\n",
+							pc);
+					goto err;
+				}
+				d->target = pc + inst->imm + 1;
+				d->handler = handlers[EBPF_IOP_CALL_LOCAL];
+				if (!(targets[d->target] & EBPF_TARGET_FUNC))
+					nfuncs++;
+				targets[d->target] |= EBPF_TARGET_FUNC;
+				break;
 			}
-			break;
-		case EBPF_OP_JSLT_REG:
-			if ((int64_t)reg[inst->dst] < (int64_t)reg[inst->src]) {
-				pc += inst->offset;
+			if (inst->src == EBPF_PSEUDO_CALL_ARRAY_LOOKUP) {
+				/* Rewritten by ebpf_prog_inline_lookups */
+				em = ep->dep_maps[inst->imm];
+				d->imm = (uintptr_t)em;
+				d->handler = handlers[em->percpu ?
+					EBPF_IOP_PERCPU_ARRAY_LOOKUP :
+					EBPF_IOP_ARRAY_LOOKUP];
+				break;
 			}
-			break;
-		case EBPF_OP_JSLT_IMM:
-			if ((int64_t)reg[inst->dst] < (int64_t)inst->imm) {
-				pc += inst->offset;
-			}
-			break;
-		case EBPF_OP_JSLE_REG:
-			if ((int64_t)reg[inst->dst] <= (int64_t)reg[inst->src]) {
-				pc += inst->offset;
+			if (inst->src != 0 || inst->imm < 0 || inst->imm >= EBPF_TYPE_MAX ||
+					helpers[inst->imm] == NULL) {
+				ebpf_error("Invalid helper at PC %u\n", pc);
+				goto err;
 			}
-			break;
-		case EBPF_OP_JSLE_IMM:
-			if ((int64_t)reg[inst->dst] <= (int64_t)inst->imm) {
-				pc += inst->offset;
+			d->fn = helpers[inst->imm]->fn;
+			if (d->fn == eht_map_lookup_elem.fn)
+				d->handler = handlers[EBPF_IOP_CALL_MAP_LOOKUP];
+			else if (d->fn == eht_tail_call.fn)
+				d->handler = handlers[EBPF_IOP_TAIL_CALL];
+			break;
+		case EBPF_OP_XADDW:
+		case EBPF_OP_XADDDW:
+			dw = inst->opcode == EBPF_OP_XADDDW;
+			switch (inst->imm) {
+			case EBPF_ADD:
+				break;
+			case EBPF_ADD | EBPF_FETCH:
+				d->handler = handlers[dw ? EBPF_IOP_XADDDW_FETCH :
+						  EBPF_IOP_XADDW_FETCH];
+				break;
+			case EBPF_XCHG:
+				d->handler = handlers[dw ? EBPF_IOP_XCHGDW :
+						  EBPF_IOP_XCHGW];
+				break;
+			case EBPF_CMPXCHG:
+				d->handler = handlers[dw ? EBPF_IOP_CMPXCHGDW :
+						  EBPF_IOP_CMPXCHGW];
+				break;
+			default:
+				ebpf_error("Invalid atomic operation at PC %u\n",
+						pc);
+				goto err;
 			}
 			break;
-		case EBPF_OP_LDXB:
-			reg[inst->dst] = *(uint8_t *)(uintptr_t)(reg[inst->src] + inst->offset);
-			break;
-		case EBPF_OP_LDXDW:
-			reg[inst->dst] = *(uint64_t *)(uintptr_t)(reg[inst->src] + inst->offset);
-			break;
-		case EBPF_OP_LDXH:
-			reg[inst->dst] = *(uint16_t *)(uintptr_t)(reg[inst->src] + inst->offset);
-			break;
-		case EBPF_OP_LDXW:
-			reg[inst->dst] = *(uint32_t *)(uintptr_t)(reg[inst->src] + inst->offset);
-			break;
 		case EBPF_OP_LDDW:
-			reg[inst->dst] = (uint32_t)inst->imm | ((uint64_t)((inst + 1)->imm) << 32);
+			if (pc + 1 >= ep->prog_len) {
+				ebpf_error("Incomplete lddw at PC %u\n", pc);
+				goto err;
+			}
+			d->imm = (uint32_t)inst->imm |
+				((uint64_t)(inst + 1)->imm << 32);
+			/* Second half of lddw is never executed */
 			pc++;
-			break;
-		case EBPF_OP_STXB:
-			*(uint8_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = reg[inst->src];
-			break;
-		case EBPF_OP_STXDW:
-			*(uint64_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = reg[inst->src];
-			break;
-		case EBPF_OP_STXH:
-			*(uint16_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = reg[inst->src];
-			break;
-		case EBPF_OP_STXW:
-			*(uint32_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = reg[inst->src];
-			break;
-		case EBPF_OP_STB:
-			*(uint8_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = (uint8_t)inst->imm;
-			break;
-		case EBPF_OP_STDW:
-			*(uint64_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = (uint64_t)inst->imm;
-			break;
-		case EBPF_OP_STH:
-			*(uint16_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = (uint16_t)inst->imm;
-			break;
-		case EBPF_OP_STW:
-			*(uint32_t *)(uintptr_t)(reg[inst->dst] + inst->offset) = (uint32_t)inst->imm;
+			dprog[pc].handler = handlers[EBPF_IOP_INVALID];
 			break;
 		default:
-			ebpf_error("Invalid instruction at PC %u\n", pc);
-			ebpf_assert(false);
+			break;
+		}
+	}
+
+	if (nfuncs > 1) {
+		error = ebpf_interp_check_funcs(ep, dprog, targets, nfuncs);
+		if (error != 0)
+			goto err;
+	}
+
+	ebpf_interp_fuse(ep, dprog, targets);
+	ebpf_free(targets);
+
+	ep->dprog = dprog;
+
+	return 0;
+
+err:
+	ebpf_free(targets);
+	ebpf_free(dprog);
+	return error;
+}
+
+uint64_t
+ebpf_prog_run(void *ctx, struct ebpf_prog *ep)
+{
+	uint64_t ret;
+	struct ebpf_interp_state state;
+
+	if (ep->jit_code != NULL)
+		return ep->jit_code(ctx);
+
+	ebpf_interp_exec(ep->dprog, ep->ept, &ctx, &ret, 1, &state, 1, NULL);
+
+	return ret;
+}
+
+void
+ebpf_prog_run_batch(struct ebpf_prog *ep, void **ctxs, uint64_t *rets,
+		    uint32_t n)
+{
+	ebpf_jit_fn jit_code = ep->jit_code;
+
+	if (n == 0)
+		return;
+
+	if (jit_code == NULL) {
+		struct ebpf_interp_state state;
+		ebpf_interp_exec(ep->dprog, ep->ept, ctxs, rets, n, &state, 1,
+				 NULL);
+		return;
+	}
+
+	for (uint32_t i = 0; i < n && i < EBPF_BATCH_PREFETCH_DIST; i++)
+		ebpf_prefetch(ctxs[i]);
+
+	for (uint32_t i = 0; i < n; i++) {
+		if (i + EBPF_BATCH_PREFETCH_DIST < n)
+			ebpf_prefetch(ctxs[i + EBPF_BATCH_PREFETCH_DIST]);
+		rets[i] = jit_code(ctxs[i]);
+	}
+}
+
+/*
+ * JIT-ed code cannot be suspended in the middle, so the interleaved
+ * mode always runs on the interpreter.
+ */
+void
+ebpf_prog_run_interleaved(struct ebpf_prog *ep, void **ctxs, uint64_t *rets,
+			  uint32_t n)
+{
+	struct ebpf_interp_state states[EBPF_INTERLEAVE_WIDTH];
+
+	if (n == 0)
+		return;
+
+	ebpf_interp_exec(ep->dprog, ep->ept, ctxs, rets, n, states,
+			 EBPF_INTERLEAVE_WIDTH, NULL);
+}
+
+#define DST	reg[d->dst]
+#define SRC	reg[d->src]
+#define IMM	d->imm
+#define OFF	d->offset
+
+#define NEXT()                                                                 \
+	do {                                                                   \
+		d++;                                                           \
+		goto *d->handler;                                              \
+	} while (0)
+
+#define JUMP()                                                                 \
+	do {                                                                   \
+		d = dprog + d->target;                                         \
+		goto *d->handler;                                              \
+	} while (0)
+
+#define COND_JUMP(_cond)                                                       \
+	do {                                                                   \
+		if (_cond)                                                     \
+			JUMP();                                                \
+		NEXT();                                                        \
+	} while (0)
+
+#define MEM(_type, _base) (*(_type *)(uintptr_t)((_base) + OFF))
+#define ATOMIC_PTR(_type) ((_type *)(uintptr_t)(DST + OFF))
+
+/* Continue after the fused sequence of _n instructions */
+#define NEXT_N(_n)                                                             \
+	do {                                                                   \
+		d += (_n);                                                     \
+		goto *d->handler;                                              \
+	} while (0)
+
+/* Conditional jump of the second instruction of fused pair */
+#define FUSED_COND_JUMP(_cond)                                                 \
+	do {                                                                   \
+		if (_cond) {                                                   \
+			d = dprog + d[1].target;                               \
+			goto *d->handler;                                      \
+		}                                                              \
+		NEXT_N(2);                                                     \
+	} while (0)
+
+/*
+ * Helper call at the end of fused sequence. In the interleaved mode,
+ * dispatch to the handler of the call since it may need to suspend.
+ */
+#define FUSED_CALL(_n)                                                         \
+	do {                                                                   \
+		d += (_n);                                                     \
+		if (interleave)                                                \
+			goto *d->handler;                                      \
+		reg[0] = d->fn(reg[1], reg[2], reg[3], reg[4], reg[5]);        \
+		NEXT();                                                        \
+	} while (0)
+
+#define START_STATE(_st, _idx)                                                 \
+	do {                                                                   \
+		(_st)->idx = (_idx);                                           \
+		(_st)->reg[1] = (uint64_t)ctxs[(_idx)];                        \
+		(_st)->reg[10] =                                               \
+		    (uint64_t)((_st)->stack + EBPF_STACK_SIZE);                \
+		(_st)->dprog = prog;                                           \
+		(_st)->d = prog;                                               \
+		(_st)->tail_calls = 0;                                         \
+		(_st)->nframes = 0;                                            \
+		(_st)->waiting = false;                                        \
+	} while (0)
+
+/*
+ * ept is the type of prog. Tail calls only jump into the programs of
+ * the same type, so it is also the type of every program in the chain.
+ */
+static void
+ebpf_interp_exec(const struct ebpf_dinst *prog,
+		 const struct ebpf_prog_type *ept, void **ctxs, uint64_t *rets,
+		 uint32_t n, struct ebpf_interp_state *states, uint32_t nstates,
+		 const void *const **handlersp)
+{
+	static const void *const handlers[EBPF_IOP_MAX] = {
+		[EBPF_OP_ADD_IMM] = &&op_ADD_IMM,
+		[EBPF_OP_ADD_REG] = &&op_ADD_REG,
+		[EBPF_OP_SUB_IMM] = &&op_SUB_IMM,
+		[EBPF_OP_SUB_REG] = &&op_SUB_REG,
+		[EBPF_OP_MUL_IMM] = &&op_MUL_IMM,
+		[EBPF_OP_MUL_REG] = &&op_MUL_REG,
+		[EBPF_OP_DIV_IMM] = &&op_DIV_IMM,
+		[EBPF_OP_DIV_REG] = &&op_DIV_REG,
+		[EBPF_OP_OR_IMM] = &&op_OR_IMM,
+		[EBPF_OP_OR_REG] = &&op_OR_REG,
+		[EBPF_OP_AND_IMM] = &&op_AND_IMM,
+		[EBPF_OP_AND_REG] = &&op_AND_REG,
+		[EBPF_OP_LSH_IMM] = &&op_LSH_IMM,
+		[EBPF_OP_LSH_REG] = &&op_LSH_REG,
+		[EBPF_OP_RSH_IMM] = &&op_RSH_IMM,
+		[EBPF_OP_RSH_REG] = &&op_RSH_REG,
+		[EBPF_OP_NEG] = &&op_NEG,
+		[EBPF_OP_MOD_IMM] = &&op_MOD_IMM,
+		[EBPF_OP_MOD_REG] = &&op_MOD_REG,
+		[EBPF_OP_XOR_IMM] = &&op_XOR_IMM,
+		[EBPF_OP_XOR_REG] = &&op_XOR_REG,
+		[EBPF_OP_MOV_IMM] = &&op_MOV_IMM,
+		[EBPF_OP_MOV_REG] = &&op_MOV_REG,
+		[EBPF_OP_ARSH_IMM] = &&op_ARSH_IMM,
+		[EBPF_OP_ARSH_REG] = &&op_ARSH_REG,
+		[EBPF_OP_LE] = &&op_LE,
+		[EBPF_OP_BE] = &&op_BE,
+		[EBPF_OP_ADD64_IMM] = &&op_ADD64_IMM,
+		[EBPF_OP_ADD64_REG] = &&op_ADD64_REG,
+		[EBPF_OP_SUB64_IMM] = &&op_SUB64_IMM,
+		[EBPF_OP_SUB64_REG] = &&op_SUB64_REG,
+		[EBPF_OP_MUL64_IMM] = &&op_MUL64_IMM,
+		[EBPF_OP_MUL64_REG] = &&op_MUL64_REG,
+		[EBPF_OP_DIV64_IMM] = &&op_DIV64_IMM,
+		[EBPF_OP_DIV64_REG] = &&op_DIV64_REG,
+		[EBPF_OP_OR64_IMM] = &&op_OR64_IMM,
+		[EBPF_OP_OR64_REG] = &&op_OR64_REG,
+		[EBPF_OP_AND64_IMM] = &&op_AND64_IMM,
+		[EBPF_OP_AND64_REG] = &&op_AND64_REG,
+		[EBPF_OP_LSH64_IMM] = &&op_LSH64_IMM,
+		[EBPF_OP_LSH64_REG] = &&op_LSH64_REG,
+		[EBPF_OP_RSH64_IMM] = &&op_RSH64_IMM,
+		[EBPF_OP_RSH64_REG] = &&op_RSH64_REG,
+		[EBPF_OP_NEG64] = &&op_NEG64,
+		[EBPF_OP_MOD64_IMM] = &&op_MOD64_IMM,
+		[EBPF_OP_MOD64_REG] = &&op_MOD64_REG,
+		[EBPF_OP_XOR64_IMM] = &&op_XOR64_IMM,
+		[EBPF_OP_XOR64_REG] = &&op_XOR64_REG,
+		[EBPF_OP_MOV64_IMM] = &&op_MOV64_IMM,
+		[EBPF_OP_MOV64_REG] = &&op_MOV64_REG,
+		[EBPF_OP_ARSH64_IMM] = &&op_ARSH64_IMM,
+		[EBPF_OP_ARSH64_REG] = &&op_ARSH64_REG,
+		[EBPF_OP_JA] = &&op_JA,
+		[EBPF_OP_JEQ_IMM] = &&op_JEQ_IMM,
+		[EBPF_OP_JEQ_REG] = &&op_JEQ_REG,
+		[EBPF_OP_JGT_IMM] = &&op_JGT_IMM,
+		[EBPF_OP_JGT_REG] = &&op_JGT_REG,
+		[EBPF_OP_JGE_IMM] = &&op_JGE_IMM,
+		[EBPF_OP_JGE_REG] = &&op_JGE_REG,
+		[EBPF_OP_JSET_IMM] = &&op_JSET_IMM,
+		[EBPF_OP_JSET_REG] = &&op_JSET_REG,
+		[EBPF_OP_JNE_IMM] = &&op_JNE_IMM,
+		[EBPF_OP_JNE_REG] = &&op_JNE_REG,
+		[EBPF_OP_JSGT_IMM] = &&op_JSGT_IMM,
+		[EBPF_OP_JSGT_REG] = &&op_JSGT_REG,
+		[EBPF_OP_JSGE_IMM] = &&op_JSGE_IMM,
+		[EBPF_OP_JSGE_REG] = &&op_JSGE_REG,
+		[EBPF_OP_JLT_IMM] = &&op_JLT_IMM,
+		[EBPF_OP_JLT_REG] = &&op_JLT_REG,
+		[EBPF_OP_JLE_IMM] = &&op_JLE_IMM,
+		[EBPF_OP_JLE_REG] = &&op_JLE_REG,
+		[EBPF_OP_JSLT_IMM] = &&op_JSLT_IMM,
+		[EBPF_OP_JSLT_REG] = &&op_JSLT_REG,
+		[EBPF_OP_JSLE_IMM] = &&op_JSLE_IMM,
+		[EBPF_OP_JSLE_REG] = &&op_JSLE_REG,
+		[EBPF_OP_CALL] = &&op_CALL,
+		[EBPF_OP_EXIT] = &&op_EXIT,
+		[EBPF_OP_LDXB] = &&op_LDXB,
+		[EBPF_OP_LDXH] = &&op_LDXH,
+		[EBPF_OP_LDXW] = &&op_LDXW,
+		[EBPF_OP_LDXDW] = &&op_LDXDW,
+		[EBPF_OP_LDDW] = &&op_LDDW,
+		[EBPF_OP_STB] = &&op_STB,
+		[EBPF_OP_STH] = &&op_STH,
+		[EBPF_OP_STW] = &&op_STW,
+		[EBPF_OP_STDW] = &&op_STDW,
+		[EBPF_OP_STXB] = &&op_STXB,
+		[EBPF_OP_STXH] = &&op_STXH,
+		[EBPF_OP_STXW] = &&op_STXW,
+		[EBPF_OP_STXDW] = &&op_STXDW,
+		[EBPF_OP_XADDW] = &&op_XADDW,
+		[EBPF_OP_XADDDW] = &&op_XADDDW,
+		[EBPF_IOP_INVALID] = &&op_INVALID,
+		[EBPF_IOP_CALL_MAP_LOOKUP] = &&op_CALL_MAP_LOOKUP,
+		[EBPF_IOP_TAIL_CALL] = &&op_TAIL_CALL,
+		[EBPF_IOP_CALL_LOCAL] = &&op_CALL_LOCAL,
+		[EBPF_IOP_RETURN] = &&op_RETURN,
+		[EBPF_IOP_ARRAY_LOOKUP] = &&op_ARRAY_LOOKUP,
+		[EBPF_IOP_PERCPU_ARRAY_LOOKUP] = &&op_PERCPU_ARRAY_LOOKUP,
+		[EBPF_IOP_XADDW_FETCH] = &&op_XADDW_FETCH,
+		[EBPF_IOP_XADDDW_FETCH] = &&op_XADDDW_FETCH,
+		[EBPF_IOP_XCHGW] = &&op_XCHGW,
+		[EBPF_IOP_XCHGDW] = &&op_XCHGDW,
+		[EBPF_IOP_CMPXCHGW] = &&op_CMPXCHGW,
+		[EBPF_IOP_CMPXCHGDW] = &&op_CMPXCHGDW,
+		[EBPF_IOP_LDXW_JEQ_IMM] = &&op_LDXW_JEQ_IMM,
+		[EBPF_IOP_LDXW_JNE_IMM] = &&op_LDXW_JNE_IMM,
+		[EBPF_IOP_LDXH_JEQ_IMM] = &&op_LDXH_JEQ_IMM,
+		[EBPF_IOP_LDXH_JNE_IMM] = &&op_LDXH_JNE_IMM,
+		[EBPF_IOP_LDXB_JEQ_IMM] = &&op_LDXB_JEQ_IMM,
+		[EBPF_IOP_LDXB_JNE_IMM] = &&op_LDXB_JNE_IMM,
+		[EBPF_IOP_LDXDW_JEQ_IMM] = &&op_LDXDW_JEQ_IMM,
+		[EBPF_IOP_LDXDW_JNE_IMM] = &&op_LDXDW_JNE_IMM,
+		[EBPF_IOP_MOV64_IMM_ADD64_REG] = &&op_MOV64_IMM_ADD64_REG,
+		[EBPF_IOP_MOV64_REG_ADD64_IMM] = &&op_MOV64_REG_ADD64_IMM,
+		[EBPF_IOP_MOV64_REG_ADD64_IMM_CALL] =
+			&&op_MOV64_REG_ADD64_IMM_CALL,
+		[EBPF_IOP_LDDW_CALL] = &&op_LDDW_CALL
+	};
+	uint64_t *reg;
+	const struct ebpf_dinst *dprog, *d;
+	struct ebpf_interp_state *st;
+	struct ebpf_interp_frame *fr;
+	struct ebpf_prog *ep;
+	struct ebpf_map *em;
+	struct ebpf_map_array *ma;
+	uint32_t k, cur = 0, next = 0, nactive = 0;
+	bool interleave = nstates > 1;
+
+	if (handlersp != NULL) {
+		*handlersp = handlers;
+		return;
+	}
+
+	for (uint32_t i = 0; i < n && i < EBPF_BATCH_PREFETCH_DIST; i++)
+		ebpf_prefetch(ctxs[i]);
+
+	for (uint32_t i = 0; i < nstates; i++) {
+		if (next < n) {
+			START_STATE(&states[i], next);
+			next++;
+			nactive++;
+		} else {
+			states[i].d = NULL;
+		}
+	}
+
+	st = states;
+	reg = st->reg;
+	dprog = st->dprog;
+	d = st->d;
+	goto *d->handler;
+
+switch_state:
+	do {
+		cur = cur + 1 == nstates ? 0 : cur + 1;
+		st = states + cur;
+	} while (st->d == NULL);
+
+	reg = st->reg;
+	dprog = st->dprog;
+	d = st->d;
+	if (st->waiting) {
+		st->waiting = false;
+		goto op_CALL;
+	}
+	goto *d->handler;
+
+op_ADD_IMM:
+	DST = (uint32_t)(DST + IMM);
+	NEXT();
+op_ADD_REG:
+	DST = (uint32_t)(DST + SRC);
+	NEXT();
+op_SUB_IMM:
+	DST = (uint32_t)(DST - IMM);
+	NEXT();
+op_SUB_REG:
+	DST = (uint32_t)(DST - SRC);
+	NEXT();
+op_MUL_IMM:
+	DST = (uint32_t)DST * (uint32_t)IMM;
+	NEXT();
+op_MUL_REG:
+	DST = (uint32_t)DST * (uint32_t)SRC;
+	NEXT();
+op_DIV_IMM:
+	DST = (uint32_t)IMM ? (uint32_t)DST / (uint32_t)IMM : 0;
+	NEXT();
+op_DIV_REG:
+	DST = (uint32_t)SRC ? (uint32_t)DST / (uint32_t)SRC : 0;
+	NEXT();
+op_OR_IMM:
+	DST = (uint32_t)(DST | IMM);
+	NEXT();
+op_OR_REG:
+	DST = (uint32_t)(DST | SRC);
+	NEXT();
+op_AND_IMM:
+	DST = (uint32_t)(DST & IMM);
+	NEXT();
+op_AND_REG:
+	DST = (uint32_t)(DST & SRC);
+	NEXT();
+op_LSH_IMM:
+	DST = (uint32_t)DST << (IMM & 31);
+	NEXT();
+op_LSH_REG:
+	DST = (uint32_t)DST << (SRC & 31);
+	NEXT();
+op_RSH_IMM:
+	DST = (uint32_t)DST >> (IMM & 31);
+	NEXT();
+op_RSH_REG:
+	DST = (uint32_t)DST >> (SRC & 31);
+	NEXT();
+op_NEG:
+	DST = (uint32_t)-(uint32_t)DST;
+	NEXT();
+op_MOD_IMM:
+	DST = (uint32_t)IMM ? (uint32_t)DST % (uint32_t)IMM : (uint32_t)DST;
+	NEXT();
+op_MOD_REG:
+	DST = (uint32_t)SRC ? (uint32_t)DST % (uint32_t)SRC : (uint32_t)DST;
+	NEXT();
+op_XOR_IMM:
+	DST = (uint32_t)(DST ^ IMM);
+	NEXT();
+op_XOR_REG:
+	DST = (uint32_t)(DST ^ SRC);
+	NEXT();
+op_MOV_IMM:
+	DST = (uint32_t)IMM;
+	NEXT();
+op_MOV_REG:
+	DST = (uint32_t)SRC;
+	NEXT();
+op_ARSH_IMM:
+	DST = (uint32_t)((int32_t)DST >> (IMM & 31));
+	NEXT();
+op_ARSH_REG:
+	DST = (uint32_t)((int32_t)DST >> (SRC & 31));
+	NEXT();
+op_LE:
+	if (IMM == 16)
+		DST = htole16((uint16_t)DST);
+	else if (IMM == 32)
+		DST = htole32((uint32_t)DST);
+	else if (IMM == 64)
+		DST = htole64((uint64_t)DST);
+	NEXT();
+op_BE:
+	if (IMM == 16)
+		DST = htobe16((uint16_t)DST);
+	else if (IMM == 32)
+		DST = htobe32((uint32_t)DST);
+	else if (IMM == 64)
+		DST = htobe64((uint64_t)DST);
+	NEXT();
+
+op_ADD64_IMM:
+	DST += IMM;
+	NEXT();
+op_ADD64_REG:
+	DST += SRC;
+	NEXT();
+op_SUB64_IMM:
+	DST -= IMM;
+	NEXT();
+op_SUB64_REG:
+	DST -= SRC;
+	NEXT();
+op_MUL64_IMM:
+	DST *= IMM;
+	NEXT();
+op_MUL64_REG:
+	DST *= SRC;
+	NEXT();
+op_DIV64_IMM:
+	DST = IMM ? DST / (uint64_t)IMM : 0;
+	NEXT();
+op_DIV64_REG:
+	DST = SRC ? DST / SRC : 0;
+	NEXT();
+op_OR64_IMM:
+	DST |= IMM;
+	NEXT();
+op_OR64_REG:
+	DST |= SRC;
+	NEXT();
+op_AND64_IMM:
+	DST &= IMM;
+	NEXT();
+op_AND64_REG:
+	DST &= SRC;
+	NEXT();
+op_LSH64_IMM:
+	DST <<= (IMM & 63);
+	NEXT();
+op_LSH64_REG:
+	DST <<= (SRC & 63);
+	NEXT();
+op_RSH64_IMM:
+	DST >>= (IMM & 63);
+	NEXT();
+op_RSH64_REG:
+	DST >>= (SRC & 63);
+	NEXT();
+op_NEG64:
+	DST = -DST;
+	NEXT();
+op_MOD64_IMM:
+	DST = IMM ? DST % (uint64_t)IMM : DST;
+	NEXT();
+op_MOD64_REG:
+	DST = SRC ? DST % SRC : DST;
+	NEXT();
+op_XOR64_IMM:
+	DST ^= IMM;
+	NEXT();
+op_XOR64_REG:
+	DST ^= SRC;
+	NEXT();
+op_MOV64_IMM:
+	DST = IMM;
+	NEXT();
+op_MOV64_REG:
+	DST = SRC;
+	NEXT();
+op_ARSH64_IMM:
+	DST = (int64_t)DST >> (IMM & 63);
+	NEXT();
+op_ARSH64_REG:
+	DST = (int64_t)DST >> (SRC & 63);
+	NEXT();
+
+op_JA:
+	JUMP();
+op_JEQ_IMM:
+	COND_JUMP(DST == (uint64_t)IMM);
+op_JEQ_REG:
+	COND_JUMP(DST == SRC);
+op_JGT_IMM:
+	COND_JUMP(DST > (uint64_t)IMM);
+op_JGT_REG:
+	COND_JUMP(DST > SRC);
+op_JGE_IMM:
+	COND_JUMP(DST >= (uint64_t)IMM);
+op_JGE_REG:
+	COND_JUMP(DST >= SRC);
+op_JSET_IMM:
+	COND_JUMP(DST & (uint64_t)IMM);
+op_JSET_REG:
+	COND_JUMP(DST & SRC);
+op_JNE_IMM:
+	COND_JUMP(DST != (uint64_t)IMM);
+op_JNE_REG:
+	COND_JUMP(DST != SRC);
+op_JSGT_IMM:
+	COND_JUMP((int64_t)DST > IMM);
+op_JSGT_REG:
+	COND_JUMP((int64_t)DST > (int64_t)SRC);
+op_JSGE_IMM:
+	COND_JUMP((int64_t)DST >= IMM);
+op_JSGE_REG:
+	COND_JUMP((int64_t)DST >= (int64_t)SRC);
+op_JLT_IMM:
+	COND_JUMP(DST < (uint64_t)IMM);
+op_JLT_REG:
+	COND_JUMP(DST < SRC);
+op_JLE_IMM:
+	COND_JUMP(DST <= (uint64_t)IMM);
+op_JLE_REG:
+	COND_JUMP(DST <= SRC);
+op_JSLT_IMM:
+	COND_JUMP((int64_t)DST < IMM);
+op_JSLT_REG:
+	COND_JUMP((int64_t)DST < (int64_t)SRC);
+op_JSLE_IMM:
+	COND_JUMP((int64_t)DST <= IMM);
+op_JSLE_REG:
+	COND_JUMP((int64_t)DST <= (int64_t)SRC);
+op_CALL_MAP_LOOKUP:
+	if (interleave && nactive > 1) {
+		em = (struct ebpf_map *)reg[1];
+		if (em != NULL && reg[2] != 0 &&
+				em->ops->prefetch_elem != NULL) {
+			em->ops->prefetch_elem(em, (void *)reg[2]);
+			st->d = d;
+			st->waiting = true;
+			goto switch_state;
+		}
+	}
+	/* FALLTHROUGH */
+op_CALL:
+	reg[0] = d->fn(reg[1], reg[2], reg[3], reg[4], reg[5]);
+	NEXT();
+op_ARRAY_LOOKUP:
+	em = (struct ebpf_map *)IMM;
+	ma = em->data;
+	goto array_lookup;
+op_PERCPU_ARRAY_LOOKUP:
+	em = (struct ebpf_map *)IMM;
+	ma = (struct ebpf_map_array *)em->data + ebpf_curcpu();
+array_lookup:
+	/* Same as ebpf_map_lookup_elem and array_map_lookup_elem */
+	if (reg[2] == 0 || (k = *(uint32_t *)reg[2]) >= em->max_entries)
+		reg[0] = 0;
+	else
+		reg[0] = (uint64_t)((uint8_t *)ma->array +
+				    (uint64_t)em->value_size * k);
+	NEXT();
+op_CALL_LOCAL:
+	fr = st->frames + st->nframes++;
+	fr->ret = d + 1;
+	memcpy(fr->reg, reg + EBPF_R6, sizeof(fr->reg));
+	reg[10] -= IMM;
+	JUMP();
+op_RETURN:
+	fr = st->frames + --st->nframes;
+	memcpy(reg + EBPF_R6, fr->reg, sizeof(fr->reg));
+	d = fr->ret;
+	goto *d->handler;
+op_TAIL_CALL:
+	/* On failure, continue with the next instruction */
+	if (st->tail_calls < EBPF_MAX_TAIL_CALL_CNT) {
+		ep = ebpf_prog_array_get((struct ebpf_map *)reg[2],
+					 (uint32_t)reg[3], ept);
+		if (ep != NULL) {
+			st->tail_calls++;
+			st->dprog = dprog = ep->dprog;
+			d = dprog;
+			goto *d->handler;
 		}
 	}
+	NEXT();
+op_EXIT:
+	rets[st->idx] = reg[0];
+	if (next < n) {
+		if (next + EBPF_BATCH_PREFETCH_DIST < n)
+			ebpf_prefetch(ctxs[next + EBPF_BATCH_PREFETCH_DIST]);
+		START_STATE(st, next);
+		next++;
+		dprog = st->dprog;
+		d = st->d;
+		goto *d->handler;
+	}
+	st->d = NULL;
+	if (--nactive == 0)
+		return;
+	goto switch_state;
+
+op_LDXB:
+	DST = MEM(uint8_t, SRC);
+	NEXT();
+op_LDXH:
+	DST = MEM(uint16_t, SRC);
+	NEXT();
+op_LDXW:
+	DST = MEM(uint32_t, SRC);
+	NEXT();
+op_LDXDW:
+	DST = MEM(uint64_t, SRC);
+	NEXT();
+op_LDDW:
+	DST = IMM;
+	/* Skip second half of lddw */
+	d++;
+	NEXT();
+op_STB:
+	MEM(uint8_t, DST) = (uint8_t)IMM;
+	NEXT();
+op_STH:
+	MEM(uint16_t, DST) = (uint16_t)IMM;
+	NEXT();
+op_STW:
+	MEM(uint32_t, DST) = (uint32_t)IMM;
+	NEXT();
+op_STDW:
+	MEM(uint64_t, DST) = (uint64_t)IMM;
+	NEXT();
+op_STXB:
+	MEM(uint8_t, DST) = (uint8_t)SRC;
+	NEXT();
+op_STXH:
+	MEM(uint16_t, DST) = (uint16_t)SRC;
+	NEXT();
+op_STXW:
+	MEM(uint32_t, DST) = (uint32_t)SRC;
+	NEXT();
+op_STXDW:
+	MEM(uint64_t, DST) = SRC;
+	NEXT();
+
+op_XADDW:
+	ebpf_atomic_add32(ATOMIC_PTR(uint32_t), (uint32_t)SRC);
+	NEXT();
+op_XADDDW:
+	ebpf_atomic_add64(ATOMIC_PTR(uint64_t), SRC);
+	NEXT();
+op_XADDW_FETCH:
+	SRC = ebpf_atomic_fetch_add32(ATOMIC_PTR(uint32_t), (uint32_t)SRC);
+	NEXT();
+op_XADDDW_FETCH:
+	SRC = ebpf_atomic_fetch_add64(ATOMIC_PTR(uint64_t), SRC);
+	NEXT();
+op_XCHGW:
+	SRC = ebpf_atomic_swap32(ATOMIC_PTR(uint32_t), (uint32_t)SRC);
+	NEXT();
+op_XCHGDW:
+	SRC = ebpf_atomic_swap64(ATOMIC_PTR(uint64_t), SRC);
+	NEXT();
+op_CMPXCHGW:
+	reg[0] = ebpf_atomic_cmpxchg32(ATOMIC_PTR(uint32_t), (uint32_t)reg[0],
+				       (uint32_t)SRC);
+	NEXT();
+op_CMPXCHGDW:
+	reg[0] = ebpf_atomic_cmpxchg64(ATOMIC_PTR(uint64_t), reg[0], SRC);
+	NEXT();
+
+	/* Superinstructions */
+op_LDXW_JEQ_IMM:
+	DST = MEM(uint32_t, SRC);
+	FUSED_COND_JUMP(DST == (uint64_t)d[1].imm);
+op_LDXW_JNE_IMM:
+	DST = MEM(uint32_t, SRC);
+	FUSED_COND_JUMP(DST != (uint64_t)d[1].imm);
+op_LDXH_JEQ_IMM:
+	DST = MEM(uint16_t, SRC);
+	FUSED_COND_JUMP(DST == (uint64_t)d[1].imm);
+op_LDXH_JNE_IMM:
+	DST = MEM(uint16_t, SRC);
+	FUSED_COND_JUMP(DST != (uint64_t)d[1].imm);
+op_LDXB_JEQ_IMM:
+	DST = MEM(uint8_t, SRC);
+	FUSED_COND_JUMP(DST == (uint64_t)d[1].imm);
+op_LDXB_JNE_IMM:
+	DST = MEM(uint8_t, SRC);
+	FUSED_COND_JUMP(DST != (uint64_t)d[1].imm);
+op_LDXDW_JEQ_IMM:
+	DST = MEM(uint64_t, SRC);
+	FUSED_COND_JUMP(DST == (uint64_t)d[1].imm);
+op_LDXDW_JNE_IMM:
+	DST = MEM(uint64_t, SRC);
+	FUSED_COND_JUMP(DST != (uint64_t)d[1].imm);
+op_MOV64_IMM_ADD64_REG:
+	DST = IMM;
+	reg[d[1].dst] += DST;
+	NEXT_N(2);
+op_MOV64_REG_ADD64_IMM:
+	DST = SRC + d[1].imm;
+	NEXT_N(2);
+op_MOV64_REG_ADD64_IMM_CALL:
+	DST = SRC + d[1].imm;
+	FUSED_CALL(2);
+op_LDDW_CALL:
+	DST = IMM;
+	FUSED_CALL(2);
+
+op_INVALID:
+	ebpf_error("Invalid instruction at PC %u\n", (uint32_t)(d - dprog));
+	ebpf_assert(false);
 }
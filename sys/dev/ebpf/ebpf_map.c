@@ -22,7 +22,7 @@ static void
 ebpf_map_dtor(struct ebpf_obj *eo)
 {
 	struct ebpf_map *em = (struct ebpf_map *)eo;
-	em->emt->ops.deinit(em);
+	em->ops->deinit(em);
 }
 
 int
@@ -51,12 +51,13 @@ ebpf_map_create(struct ebpf_env *ee, struct ebpf_map **emp,
 	em->eo.eo_type	= EBPF_OBJ_TYPE_MAP;
 	em->eo.eo_dtor	= ebpf_map_dtor;
 	em->emt 	= emt;
+	em->ops		= &emt->ops;
 	em->key_size	= attr->key_size;
 	em->value_size	= attr->value_size;
 	em->max_entries	= attr->max_entries;
 	em->map_flags	= attr->flags;
 
-	error = emt->ops.init(em, attr);
+	error = em->ops->init(em, attr);
 	if (error != 0) {
 		/* 
 		 * In here, eo has a reference to ee. We need to
@@ -80,7 +81,7 @@ ebpf_map_lookup_elem(struct ebpf_map *em, void *key)
 	if (em == NULL || key == NULL)
 		return NULL;
 
-	return em->emt->ops.lookup_elem(em, key);
+	return em->ops->lookup_elem(em, key);
 }
 
 int
@@ -92,21 +93,32 @@ ebpf_map_lookup_elem_from_user(struct ebpf_map *em, void *key, void *value)
 		return EINVAL;
 
 	ebpf_epoch_enter();
-	error = em->emt->ops.lookup_elem_from_user(em, key, value);
+	error = em->ops->lookup_elem_from_user(em, key, value);
 	ebpf_epoch_exit();
 
 	return error;
 }
 
+/*
+ * The update returns EAGAIN when the map has room for the key, but all
+ * of its spare elements are waiting for the epoch. The datapath can't
+ * wait for the epoch, so it sees EBUSY as for the full map.
+ */
 int
 ebpf_map_update_elem(struct ebpf_map *em, void *key, void *value,
 		     uint64_t flags)
 {
+	int error;
+
 	if (em == NULL || key == NULL ||
 			value == NULL || flags > EBPF_EXIST)
 		return EINVAL;
 
-	return em->emt->ops.update_elem(em, key, value, flags);
+	error = em->ops->update_elem(em, key, value, flags);
+	if (error == EAGAIN)
+		error = EBUSY;
+
+	return error;
 }
 
 int
@@ -115,9 +127,17 @@ ebpf_map_update_elem_from_user(struct ebpf_map *em, void *key, void *value,
 {
 	int error;
 
-	ebpf_epoch_enter();
-	error = em->emt->ops.update_elem_from_user(em, key, value, flags);
-	ebpf_epoch_exit();
+	for (;;) {
+		ebpf_epoch_enter();
+		error = em->ops->update_elem_from_user(em, key, value, flags);
+		ebpf_epoch_exit();
+
+		if (error != EAGAIN)
+			break;
+
+		/* Let the spare elements come back */
+		ebpf_epoch_barrier();
+	}
 
 	return error;
 }
@@ -128,7 +148,7 @@ ebpf_map_delete_elem(struct ebpf_map *em, void *key)
 	if (em == NULL || key == NULL)
 		return EINVAL;
 
-	return em->emt->ops.delete_elem(em, key);
+	return em->ops->delete_elem(em, key);
 }
 
 int
@@ -139,7 +159,7 @@ ebpf_map_delete_elem_from_user(struct ebpf_map *em, void *key)
 		return EINVAL;
 
 	ebpf_epoch_enter();
-	error = em->emt->ops.delete_elem_from_user(em, key);
+	error = em->ops->delete_elem_from_user(em, key);
 	ebpf_epoch_exit();
 
 	return error;
@@ -158,7 +178,31 @@ ebpf_map_get_next_key_from_user(struct ebpf_map *em, void *key, void *next_key)
 		return EINVAL;
 
 	ebpf_epoch_enter();
-	error = em->emt->ops.get_next_key_from_user(em, key, next_key);
+	error = em->ops->get_next_key_from_user(em, key, next_key);
+	ebpf_epoch_exit();
+
+	return error;
+}
+
+int
+ebpf_map_percpu_add_elem(struct ebpf_map *em, void *key, uint32_t offset,
+			 uint64_t delta)
+{
+	int error;
+
+	if (em == NULL || key == NULL)
+		return EINVAL;
+
+	if (em->ops->percpu_add_elem == NULL)
+		return ENOTSUP;
+
+	if (offset % sizeof(uint64_t) != 0 ||
+			em->value_size % sizeof(uint64_t) != 0 ||
+			offset + sizeof(uint64_t) > em->value_size)
+		return EINVAL;
+
+	ebpf_epoch_enter();
+	error = em->ops->percpu_add_elem(em, key, offset, delta);
 	ebpf_epoch_exit();
 
 	return error;
@@ -23,6 +23,7 @@
 struct ebpf_map {
 	struct ebpf_obj eo;
 	const struct ebpf_map_type *emt;
+	const struct ebpf_map_ops *ops; /* &emt->ops or specialized by init */
 	uint32_t key_size;
 	uint32_t value_size;
 	uint32_t map_flags;
@@ -31,6 +32,17 @@ struct ebpf_map {
 	void *data;
 };
 
+/*
+ * Data of array map. Per-CPU array map has one per CPU. This is
+ * public so that the lookups can be inlined into programs.
+ */
+struct ebpf_map_array {
+	void *array;
+};
+
 #define EO2EM(eo) \
 	(eo != NULL && eo->eo_type == EBPF_OBJ_TYPE_MAP ? \
    (struct ebpf_map *)eo : NULL)
+
+struct ebpf_prog *ebpf_prog_array_get(struct ebpf_map *em, uint32_t index,
+				      const struct ebpf_prog_type *ept);
@@ -17,12 +17,23 @@
  */
 
 #include "ebpf_map.h"
-
-struct ebpf_map_array {
-	void *array;
-};
+#include "ebpf_prog.h"
+#include "ebpf_util.h"
 
 #define ARRAY_MAP(_map) ((struct ebpf_map_array *)(_map->data))
+#define ARRAY_CACHELINE 64
+
+/*
+ * The arrays of the per-CPU array map are allocated at once and
+ * separated by this stride, so that a value of any CPU can be
+ * addressed from the value of CPU 0.
+ */
+static inline size_t
+array_map_percpu_stride(uint32_t max_entries, uint32_t value_size)
+{
+	return ebpf_roundup((size_t)max_entries * value_size,
+			    ARRAY_CACHELINE);
+}
 
 static void
 array_map_deinit(struct ebpf_map *em)
@@ -42,9 +53,7 @@ array_map_deinit_percpu(struct ebpf_map *em)
 
 	ebpf_epoch_wait();
 
-	for (uint16_t i = 0; i < ebpf_ncpus(); i++)
-		ebpf_free(ma[i].array);
-
+	ebpf_free(ma[0].array);
 	ebpf_free(ma);
 }
 
@@ -83,33 +92,29 @@ array_map_init(struct ebpf_map *em, struct ebpf_map_attr *attr)
 static int
 array_map_init_percpu(struct ebpf_map *em, struct ebpf_map_attr *attr)
 {
-	int error;
 	uint16_t ncpus = ebpf_ncpus();
+	size_t stride;
+	uint8_t *mem;
 
 	struct ebpf_map_array *ma =
 	    ebpf_calloc(ncpus, sizeof(*ma));
 	if (ma == NULL)
 		return ENOMEM;
 
-	uint16_t i;
-	for (i = 0; i < ncpus; i++) {
-		error = array_map_init_common(ma + i, attr);
-		if (error != 0)
-			goto err0;
+	stride = array_map_percpu_stride(attr->max_entries, attr->value_size);
+	mem = ebpf_calloc(ncpus, stride);
+	if (mem == NULL) {
+		ebpf_free(ma);
+		return ENOMEM;
 	}
 
+	for (uint16_t i = 0; i < ncpus; i++)
+		ma[i].array = mem + stride * i;
+
 	em->data = ma;
 	em->percpu = true;
 
 	return 0;
-
-err0:
-	for (uint16_t j = i; j > 0; j--)
-		ebpf_free(ma[i].array);
-
-	ebpf_free(ma);
-
-	return error;
 }
 
 static void *
@@ -123,6 +128,14 @@ array_map_lookup_elem(struct ebpf_map *em, void *key)
 	return (uint8_t *)(ARRAY_MAP(em)->array) + (em->value_size * k);
 }
 
+static void
+array_map_prefetch_elem(struct ebpf_map *em, void *key)
+{
+	void *elem = array_map_lookup_elem(em, key);
+	if (elem != NULL)
+		ebpf_prefetch(elem);
+}
+
 static int
 array_map_lookup_elem_from_user(struct ebpf_map *em, void *key, void *value)
 {
@@ -150,6 +163,14 @@ array_map_lookup_elem_percpu(struct ebpf_map *em, void *key)
 	       (em->value_size * k);
 }
 
+static void
+array_map_prefetch_elem_percpu(struct ebpf_map *em, void *key)
+{
+	void *elem = array_map_lookup_elem_percpu(em, key);
+	if (elem != NULL)
+		ebpf_prefetch(elem);
+}
+
 static int
 array_map_lookup_elem_percpu_from_user(struct ebpf_map *em, void *key,
 				       void *value)
@@ -170,6 +191,24 @@ array_map_lookup_elem_percpu_from_user(struct ebpf_map *em, void *key,
 	return 0;
 }
 
+static int
+array_map_percpu_add_elem(struct ebpf_map *em, void *key, uint32_t offset,
+			  uint64_t delta)
+{
+	uint32_t k = *(uint32_t *)key;
+
+	if (k >= em->max_entries)
+		return EINVAL;
+
+	ebpf_percpu_add64((uint8_t *)(ARRAY_MAP(em)->array) +
+			      (em->value_size * k) + offset,
+			  array_map_percpu_stride(em->max_entries,
+						  em->value_size),
+			  delta);
+
+	return 0;
+}
+
 static int
 array_map_update_elem_common(struct ebpf_map *em,
 			     struct ebpf_map_array *ma, uint32_t key,
@@ -278,7 +317,8 @@ const struct ebpf_map_type emt_array = {
 		.lookup_elem_from_user = array_map_lookup_elem_from_user,
 		.delete_elem_from_user = array_map_delete_elem,
 		.get_next_key_from_user = array_map_get_next_key,
-		.deinit = array_map_deinit
+		.deinit = array_map_deinit,
+		.prefetch_elem = array_map_prefetch_elem
 	}
 };
 
@@ -293,6 +333,229 @@ const struct ebpf_map_type emt_percpu_array = {
 		.lookup_elem_from_user = array_map_lookup_elem_percpu_from_user,
 		.delete_elem_from_user = array_map_delete_elem, // delete is anyway invalid
 		.get_next_key_from_user = array_map_get_next_key,
-		.deinit = array_map_deinit_percpu
+		.deinit = array_map_deinit_percpu,
+		.prefetch_elem = array_map_prefetch_elem_percpu,
+		.percpu_add_elem = array_map_percpu_add_elem
 	}
 };
+
+/*
+ * Program array. Each element holds a reference to a program which
+ * can be the target of tail calls. Elements are only updated from
+ * user space. Readers see the programs without taking any lock and
+ * replaced programs are released after the epoch.
+ *
+ * Since the map holds references to the programs, a program which
+ * is stored in the map it depends on is never freed until the user
+ * deletes the element.
+ */
+struct ebpf_map_prog_array {
+	ebpf_mtx lock;
+	struct ebpf_prog **progs;
+};
+
+struct prog_array_release {
+	ebpf_epoch_context ec;
+	struct ebpf_prog *ep;
+};
+
+#define PROG_ARRAY_MAP(_map) ((struct ebpf_map_prog_array *)(_map->data))
+
+static int
+prog_array_map_init(struct ebpf_map *em, struct ebpf_map_attr *attr)
+{
+	struct ebpf_map_prog_array *ma;
+
+	if (attr->key_size != sizeof(uint32_t) ||
+			attr->value_size != sizeof(struct ebpf_prog *))
+		return EINVAL;
+
+	ma = ebpf_calloc(1, sizeof(*ma));
+	if (ma == NULL)
+		return ENOMEM;
+
+	ma->progs = ebpf_calloc(attr->max_entries, sizeof(*ma->progs));
+	if (ma->progs == NULL) {
+		ebpf_free(ma);
+		return ENOMEM;
+	}
+
+	ebpf_mtx_init(&ma->lock, "ebpf_prog_array_lock");
+
+	em->data = ma;
+	em->percpu = false;
+
+	return 0;
+}
+
+static void
+prog_array_map_deinit(struct ebpf_map *em)
+{
+	struct ebpf_map_prog_array *ma = em->data;
+
+	ebpf_epoch_wait();
+
+	for (uint32_t i = 0; i < em->max_entries; i++)
+		if (ma->progs[i] != NULL)
+			ebpf_obj_release(&ma->progs[i]->eo);
+
+	ebpf_mtx_destroy(&ma->lock);
+	ebpf_free(ma->progs);
+	ebpf_free(ma);
+}
+
+static void *
+prog_array_map_lookup_elem(struct ebpf_map *em, void *key)
+{
+	/* Programs can only reach the elements via tail call */
+	return NULL;
+}
+
+static int
+prog_array_map_update_elem(struct ebpf_map *em, void *key, void *value,
+			   uint64_t flags)
+{
+	return EINVAL;
+}
+
+static int
+prog_array_map_lookup_elem_from_user(struct ebpf_map *em, void *key,
+				     void *value)
+{
+	return ENOTSUP;
+}
+
+static void
+prog_array_release_cb(ebpf_epoch_context *ec)
+{
+	struct prog_array_release *rel =
+		ebpf_container_of(ec, struct prog_array_release, ec);
+
+	ebpf_obj_release(&rel->ep->eo);
+	ebpf_free(rel);
+}
+
+/*
+ * Replaces the element with ep and releases the old program after
+ * the epoch. ep is NULL on delete.
+ */
+static int
+prog_array_map_replace(struct ebpf_map *em, uint32_t k, struct ebpf_prog *ep,
+		       uint64_t flags)
+{
+	int error = 0;
+	struct ebpf_map_prog_array *ma = em->data;
+	struct prog_array_release *rel;
+	struct ebpf_prog *old;
+
+	if (k >= em->max_entries)
+		return EINVAL;
+
+	rel = ebpf_malloc(sizeof(*rel));
+	if (rel == NULL)
+		return ENOMEM;
+
+	ebpf_mtx_lock(&ma->lock);
+
+	old = ma->progs[k];
+	if (ep != NULL && old != NULL && flags == EBPF_NOEXIST)
+		error = EEXIST;
+	else if (old == NULL && (ep == NULL || flags == EBPF_EXIST))
+		error = ENOENT;
+
+	if (error != 0) {
+		ebpf_mtx_unlock(&ma->lock);
+		ebpf_free(rel);
+		return error;
+	}
+
+	if (ep != NULL)
+		ebpf_obj_acquire(&ep->eo);
+	EBPF_EPOCH_ASSIGN(ma->progs[k], ep);
+
+	ebpf_mtx_unlock(&ma->lock);
+
+	if (old != NULL) {
+		rel->ep = old;
+		ebpf_epoch_call(&rel->ec, prog_array_release_cb);
+	} else {
+		ebpf_free(rel);
+	}
+
+	return 0;
+}
+
+static int
+prog_array_map_update_elem_from_user(struct ebpf_map *em, void *key,
+				     void *value, uint64_t flags)
+{
+	struct ebpf_prog *ep = *(struct ebpf_prog **)value;
+
+	if (flags >= __EBPF_MAP_UPDATE_FLAGS_MAX)
+		return EINVAL;
+
+	/* Can't jump into the program which lives in another env */
+	if (ep == NULL || ep->eo.eo_ee != em->eo.eo_ee)
+		return EINVAL;
+
+	return prog_array_map_replace(em, *(uint32_t *)key, ep, flags);
+}
+
+static int
+prog_array_map_delete_elem_from_user(struct ebpf_map *em, void *key)
+{
+	return prog_array_map_replace(em, *(uint32_t *)key, NULL, EBPF_ANY);
+}
+
+/*
+ * Returns the target of the tail call from the program of type ept.
+ * The program of the other type expects another context, so it is
+ * never returned.
+ */
+struct ebpf_prog *
+ebpf_prog_array_get(struct ebpf_map *em, uint32_t index,
+		    const struct ebpf_prog_type *ept)
+{
+	struct ebpf_prog *ep;
+
+	if (em == NULL || em->emt != &emt_prog_array ||
+			index >= em->max_entries)
+		return NULL;
+
+	ep = EBPF_EPOCH_DEREF(PROG_ARRAY_MAP(em)->progs[index]);
+	if (ep == NULL || ep->ept != ept)
+		return NULL;
+
+	return ep;
+}
+
+/*
+ * Tail calls are handled by the interpreter. This is never called
+ * unless the program is run by something else.
+ */
+static uint64_t
+ebpf_tail_call(uint64_t ctx, uint64_t map, uint64_t index, uint64_t arg3,
+	       uint64_t arg4)
+{
+	return 0;
+}
+
+const struct ebpf_map_type emt_prog_array = {
+	.name = "prog_array",
+	.ops = {
+		.init = prog_array_map_init,
+		.update_elem = prog_array_map_update_elem,
+		.lookup_elem = prog_array_map_lookup_elem,
+		.delete_elem = array_map_delete_elem,
+		.update_elem_from_user = prog_array_map_update_elem_from_user,
+		.lookup_elem_from_user = prog_array_map_lookup_elem_from_user,
+		.delete_elem_from_user = prog_array_map_delete_elem_from_user,
+		.get_next_key_from_user = array_map_get_next_key,
+		.deinit = prog_array_map_deinit
+	}
+};
+
+const struct ebpf_helper_type eht_tail_call = {
+	.name = "tail_call",
+	.fn = ebpf_tail_call
+};
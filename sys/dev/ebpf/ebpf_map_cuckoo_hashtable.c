@@ -0,0 +1,701 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ebpf_map.h"
+#include "ebpf_util.h"
+#include "ebpf_hash.h"
+
+#if defined(__SSE2__) && !defined(_KERNEL)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Bucketized cuckoo hashtable. Every key can live in one of the two
+ * buckets. Each bucket fits in a cacheline and holds the 8-bit tags
+ * and the entry indices of 8 slots, so lookup compares all the tags
+ * of the bucket at once and touches the key only on tag match. This
+ * makes lookup cost at most two bucket cachelines (plus the entry)
+ * regardless of occupancy.
+ *
+ * The alternative bucket is derived from the bucket and the tag
+ * (partial-key cuckoo hashing), so that the writer can displace the
+ * entry without reading its key.
+ *
+ * Readers don't take any lock, but validate what they read with the
+ * version counters of the two buckets. Writers serialize with the
+ * spin lock and bump the versions of every bucket they modify.
+ *
+ * The entry of the deleted key is not reused until the readers which
+ * may still hold its value pointer are gone. Its index is chained to
+ * the pending list with reclaim_next, and the list is passed to the
+ * epoch as a batch once it has CUCKOO_RECLAIM_BATCH entries, in the
+ * same way as emt_hashtable does with its elements. The table has
+ * spare entries for the ones waiting for the epoch, so the number of
+ * the keys is limited by count instead of the free entries. When the
+ * spare entries run out, the update returns EAGAIN to make
+ * ebpf_map_update_elem_from_user wait for the epoch.
+ */
+
+#define CUCKOO_BUCKET_SLOTS 8
+#define CUCKOO_BFS_MAX 256
+#define CUCKOO_CACHELINE 64
+#define CUCKOO_RECLAIM_BATCH 16
+#define CUCKOO_RECLAIM_NBATCHES 4
+#define CUCKOO_RECLAIM_RESERVE                                                 \
+	(CUCKOO_RECLAIM_BATCH * (CUCKOO_RECLAIM_NBATCHES + 1))
+#define CUCKOO_IDX_NONE UINT32_MAX
+
+struct cuckoo_bucket {
+	uint32_t version;
+	uint8_t tags[CUCKOO_BUCKET_SLOTS]; /* 0 means empty slot */
+	uint32_t idx[CUCKOO_BUCKET_SLOTS];
+	uint8_t pad[CUCKOO_CACHELINE - sizeof(uint32_t) * 9 -
+		    CUCKOO_BUCKET_SLOTS];
+};
+
+/* Node of the breadth first search for the free slot */
+struct cuckoo_path {
+	uint32_t bucket;
+	int32_t parent;
+	uint32_t pslot; /* slot of the parent which moves to this bucket */
+};
+
+struct ebpf_map_cuckoo_hashtable;
+
+struct cuckoo_reclaim_batch {
+	ebpf_epoch_context ec;
+	struct ebpf_map_cuckoo_hashtable *ch;
+	uint32_t head; /* first index of the chain */
+	uint32_t busy; /* passed to the epoch */
+};
+
+struct ebpf_map_cuckoo_hashtable {
+	uint32_t mask;
+	uint32_t key_size; /* round upped key size */
+	uint32_t entry_size;
+	uint32_t count; /* number of the keys */
+	uint32_t nfree;
+	uint32_t pending; /* first index of the deleted entries */
+	uint32_t npending;
+	ebpf_spinmtx lock;
+	ebpf_hash_fn hash;
+	struct cuckoo_bucket *buckets;
+	void *buckets_mem;
+	uint8_t *entries;
+	uint32_t *free_idx;
+	uint32_t *reclaim_next;
+	struct cuckoo_path *path; /* scratch space for writer */
+	struct cuckoo_reclaim_batch batches[CUCKOO_RECLAIM_NBATCHES];
+};
+
+#define CUCKOO_ENTRY(_chp, _idx)                                               \
+	((_chp)->entries + (size_t)(_chp)->entry_size * (_idx))
+#define CUCKOO_ENTRY_VALUE(_chp, _entryp) ((_entryp) + (_chp)->key_size)
+
+static inline uint32_t
+cuckoo_hash(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	return ch->hash(key, map->key_size);
+}
+
+static inline uint8_t
+cuckoo_tag(uint32_t hash)
+{
+	uint8_t tag = hash >> 24;
+	return tag != 0 ? tag : 1;
+}
+
+static inline uint32_t
+cuckoo_alt_bucket(struct ebpf_map_cuckoo_hashtable *ch, uint32_t bucket,
+		  uint8_t tag)
+{
+	return (bucket ^ (tag * 0x5bd1e995)) & ch->mask;
+}
+
+/*
+ * Returns the bitmask of the slots whose tag equals to tag.
+ */
+static inline uint32_t
+cuckoo_match_tags(struct cuckoo_bucket *b, uint8_t tag)
+{
+#if defined(__SSE2__) && !defined(_KERNEL)
+	__m128i tags = _mm_loadl_epi64((const __m128i *)b->tags);
+	__m128i cmp = _mm_cmpeq_epi8(tags, _mm_set1_epi8(tag));
+	return _mm_movemask_epi8(cmp) & ((1 << CUCKOO_BUCKET_SLOTS) - 1);
+#else
+	/*
+	 * SWAR fallback. Sets the top bit of each byte of tags which
+	 * equals to tag, then gathers them.
+	 */
+	const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t x, t;
+	uint32_t mask = 0;
+
+	memcpy(&x, b->tags, sizeof(x));
+	x ^= 0x0101010101010101ULL * tag;
+	t = ~(((x & lo7) + lo7) | x | lo7);
+	while (t != 0) {
+		mask |= 1 << (__builtin_ctzll(t) / 8);
+		t &= t - 1;
+	}
+
+	return mask;
+#endif
+}
+
+static uint8_t *
+cuckoo_find_in_bucket(struct ebpf_map *map, struct cuckoo_bucket *b,
+		      void *key, uint8_t tag, uint32_t *slotp)
+{
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	uint32_t match = cuckoo_match_tags(b, tag);
+	uint8_t *entry;
+	uint32_t i;
+
+	while (match != 0) {
+		i = __builtin_ctz(match);
+		entry = CUCKOO_ENTRY(ch, ebpf_atomic_load32(&b->idx[i]));
+		if (memcmp(entry, key, map->key_size) == 0) {
+			if (slotp != NULL)
+				*slotp = i;
+			return entry;
+		}
+		match &= match - 1;
+	}
+
+	return NULL;
+}
+
+static inline uint8_t *
+cuckoo_find(struct ebpf_map *map, void *key, uint32_t hash,
+	    struct cuckoo_bucket **bp, uint32_t *slotp)
+{
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	uint8_t tag = cuckoo_tag(hash);
+	uint32_t b1 = hash & ch->mask;
+	uint32_t b2 = cuckoo_alt_bucket(ch, b1, tag);
+	uint8_t *entry;
+
+	*bp = ch->buckets + b1;
+	entry = cuckoo_find_in_bucket(map, *bp, key, tag, slotp);
+	if (entry != NULL)
+		return entry;
+
+	*bp = ch->buckets + b2;
+	return cuckoo_find_in_bucket(map, *bp, key, tag, slotp);
+}
+
+static void
+cuckoo_reclaim_cb(ebpf_epoch_context *ec)
+{
+	struct cuckoo_reclaim_batch *batch;
+	struct ebpf_map_cuckoo_hashtable *ch;
+
+	batch = ebpf_container_of(ec, struct cuckoo_reclaim_batch, ec);
+	ch = batch->ch;
+
+	ebpf_spinmtx_lock(&ch->lock);
+
+	for (uint32_t idx = batch->head; idx != CUCKOO_IDX_NONE;
+	     idx = ch->reclaim_next[idx])
+		ch->free_idx[ch->nfree++] = idx;
+
+	batch->head = CUCKOO_IDX_NONE;
+	batch->busy = 0;
+
+	ebpf_spinmtx_unlock(&ch->lock);
+}
+
+/*
+ * Moves the pending list to the free batch when it has at least min
+ * entries. Must be called with the lock held, and the returned batch
+ * must be passed to ebpf_epoch_call after unlocking.
+ */
+static struct cuckoo_reclaim_batch *
+cuckoo_reclaim_take(struct ebpf_map_cuckoo_hashtable *ch, uint32_t min)
+{
+	struct cuckoo_reclaim_batch *batch;
+
+	if (ch->npending == 0 || ch->npending < min)
+		return NULL;
+
+	for (uint32_t i = 0; i < CUCKOO_RECLAIM_NBATCHES; i++) {
+		batch = ch->batches + i;
+		if (!batch->busy) {
+			batch->head = ch->pending;
+			batch->busy = 1;
+			ch->pending = CUCKOO_IDX_NONE;
+			ch->npending = 0;
+			return batch;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+cuckoo_hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
+{
+	int error;
+	struct ebpf_map_cuckoo_hashtable *ch;
+	uint64_t entry_size;
+	uint32_t nbuckets, nentries;
+
+	_Static_assert(sizeof(struct cuckoo_bucket) == CUCKOO_CACHELINE,
+		       "cuckoo_bucket must fit in a cacheline");
+
+	if (attr->max_entries > (1U << 30))
+		return E2BIG;
+
+	entry_size = ebpf_roundup(attr->key_size, 8) +
+		     ebpf_roundup((uint64_t)attr->value_size, 8);
+	if (entry_size > UINT32_MAX)
+		return E2BIG;
+
+	ch = ebpf_calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		return ENOMEM;
+
+	error = ebpf_hash_select(EBPF_MAP_F_HASH_TYPE(attr->flags), &ch->hash);
+	if (error != 0)
+		goto err0;
+
+	/* Leave some headroom, cuckoo insertion fails near 100% load */
+	nbuckets = ebpf_roundup_pow_of_two(
+	    (attr->max_entries + attr->max_entries / 8) / CUCKOO_BUCKET_SLOTS +
+	    1);
+	if (nbuckets < 2)
+		nbuckets = 2;
+
+	ch->mask = nbuckets - 1;
+	ch->key_size = ebpf_roundup(attr->key_size, 8);
+	ch->entry_size = entry_size;
+
+	error = ENOMEM;
+
+	ch->buckets_mem = ebpf_calloc(1, (size_t)nbuckets *
+					     sizeof(struct cuckoo_bucket) +
+					 CUCKOO_CACHELINE);
+	if (ch->buckets_mem == NULL)
+		goto err0;
+
+	ch->buckets = (struct cuckoo_bucket *)ebpf_roundup(
+	    (uintptr_t)ch->buckets_mem, CUCKOO_CACHELINE);
+
+	/*
+	 * Spare entries for the deleted ones waiting for the epoch, but
+	 * never more than max_entries (or one batch for the tiny maps).
+	 */
+	nentries = ebpf_min(CUCKOO_RECLAIM_RESERVE, attr->max_entries);
+	if (nentries < CUCKOO_RECLAIM_BATCH)
+		nentries = CUCKOO_RECLAIM_BATCH;
+	nentries += attr->max_entries;
+
+	ch->entries = ebpf_calloc(nentries, ch->entry_size);
+	if (ch->entries == NULL)
+		goto err1;
+
+	ch->free_idx = ebpf_calloc(nentries, sizeof(uint32_t));
+	if (ch->free_idx == NULL)
+		goto err2;
+
+	ch->reclaim_next = ebpf_calloc(nentries, sizeof(uint32_t));
+	if (ch->reclaim_next == NULL)
+		goto err3;
+
+	ch->path = ebpf_calloc(CUCKOO_BFS_MAX, sizeof(struct cuckoo_path));
+	if (ch->path == NULL)
+		goto err4;
+
+	for (uint32_t i = 0; i < nentries; i++)
+		ch->free_idx[i] = nentries - i - 1;
+	ch->nfree = nentries;
+	ch->pending = CUCKOO_IDX_NONE;
+
+	for (uint32_t i = 0; i < CUCKOO_RECLAIM_NBATCHES; i++) {
+		ch->batches[i].ch = ch;
+		ch->batches[i].head = CUCKOO_IDX_NONE;
+	}
+
+	ebpf_spinmtx_init(&ch->lock, "ebpf_cuckoo_hashtable_map lock");
+
+	map->percpu = false;
+	map->data = ch;
+
+	return 0;
+
+err4:
+	ebpf_free(ch->reclaim_next);
+err3:
+	ebpf_free(ch->free_idx);
+err2:
+	ebpf_free(ch->entries);
+err1:
+	ebpf_free(ch->buckets_mem);
+err0:
+	ebpf_free(ch);
+	return error;
+}
+
+static void
+cuckoo_hashtable_map_deinit(struct ebpf_map *map)
+{
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+
+	/*
+	 * Wait for current readers, then for the batches of the deleted
+	 * entries, whose callbacks take the lock of the map.
+	 */
+	ebpf_epoch_wait();
+	ebpf_epoch_barrier();
+
+	for (uint32_t i = 0; i < CUCKOO_RECLAIM_NBATCHES; i++)
+		ebpf_assert(!ch->batches[i].busy);
+
+	ebpf_spinmtx_destroy(&ch->lock);
+	ebpf_free(ch->path);
+	ebpf_free(ch->reclaim_next);
+	ebpf_free(ch->free_idx);
+	ebpf_free(ch->entries);
+	ebpf_free(ch->buckets_mem);
+	ebpf_free(ch);
+}
+
+static void *
+cuckoo_hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = cuckoo_hash(map, key);
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	struct cuckoo_bucket *b1, *b2, *b;
+	uint32_t v1, v2;
+	uint8_t *entry;
+
+	b1 = ch->buckets + (hash & ch->mask);
+	b2 = ch->buckets + cuckoo_alt_bucket(ch, hash & ch->mask,
+					     cuckoo_tag(hash));
+
+	do {
+		v1 = ebpf_seq_read_begin(&b1->version);
+		v2 = ebpf_seq_read_begin(&b2->version);
+		entry = cuckoo_find(map, key, hash, &b, NULL);
+	} while (ebpf_seq_read_retry(&b1->version, v1) ||
+		 ebpf_seq_read_retry(&b2->version, v2));
+
+	if (entry == NULL)
+		return NULL;
+
+	return CUCKOO_ENTRY_VALUE(ch, entry);
+}
+
+static void
+cuckoo_hashtable_map_prefetch_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = cuckoo_hash(map, key);
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+
+	ebpf_prefetch(ch->buckets + (hash & ch->mask));
+	ebpf_prefetch(ch->buckets + cuckoo_alt_bucket(ch, hash & ch->mask,
+						      cuckoo_tag(hash)));
+}
+
+static int
+cuckoo_hashtable_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
+					   void *value)
+{
+	uint32_t hash = cuckoo_hash(map, key);
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	struct cuckoo_bucket *b1, *b2, *b;
+	uint32_t v1, v2;
+	uint8_t *entry;
+
+	b1 = ch->buckets + (hash & ch->mask);
+	b2 = ch->buckets + cuckoo_alt_bucket(ch, hash & ch->mask,
+					     cuckoo_tag(hash));
+
+	/* Copy inside the read section to get consistent value */
+	do {
+		v1 = ebpf_seq_read_begin(&b1->version);
+		v2 = ebpf_seq_read_begin(&b2->version);
+		entry = cuckoo_find(map, key, hash, &b, NULL);
+		if (entry != NULL)
+			memcpy(value, CUCKOO_ENTRY_VALUE(ch, entry),
+			       map->value_size);
+	} while (ebpf_seq_read_retry(&b1->version, v1) ||
+		 ebpf_seq_read_retry(&b2->version, v2));
+
+	if (entry == NULL)
+		return ENOENT;
+
+	return 0;
+}
+
+static int
+cuckoo_free_slot(struct cuckoo_bucket *b)
+{
+	for (uint32_t i = 0; i < CUCKOO_BUCKET_SLOTS; i++)
+		if (b->tags[i] == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Makes a free slot in bucket b1 or b2 by moving the entries to
+ * their alternative buckets. Search the shortest path with BFS
+ * first, then move the entries from the end of the path, so that
+ * every entry is reachable at any moment. Returns the bucket and
+ * the slot which became free.
+ */
+static int
+cuckoo_make_room(struct ebpf_map_cuckoo_hashtable *ch, uint32_t b1,
+		 uint32_t b2, uint32_t *bucketp, uint32_t *slotp)
+{
+	struct cuckoo_path *path = ch->path, *node;
+	struct cuckoo_bucket *b, *pb;
+	uint32_t head = 0, tail = 0, ps;
+	int slot;
+
+	path[tail++] = (struct cuckoo_path){b1, -1, 0};
+	path[tail++] = (struct cuckoo_path){b2, -1, 0};
+
+	while (head < tail) {
+		node = path + head;
+		b = ch->buckets + node->bucket;
+
+		slot = cuckoo_free_slot(b);
+		if (slot >= 0)
+			break;
+
+		for (uint32_t i = 0;
+		     i < CUCKOO_BUCKET_SLOTS && tail < CUCKOO_BFS_MAX; i++)
+			path[tail++] = (struct cuckoo_path){
+			    cuckoo_alt_bucket(ch, node->bucket, b->tags[i]),
+			    head, i};
+
+		head++;
+	}
+
+	if (head == tail)
+		return EBUSY;
+
+	while (node->parent >= 0) {
+		b = ch->buckets + node->bucket;
+		pb = ch->buckets + path[node->parent].bucket;
+		ps = node->pslot;
+
+		/* Bucket may appear twice on the path */
+		if (b->tags[slot] != 0)
+			return EBUSY;
+
+		/*
+		 * Copy to the new slot before clearing the old one.
+		 * Readers may see the key twice, but never miss it.
+		 */
+		ebpf_seq_write_begin(&b->version);
+		if (pb != b)
+			ebpf_seq_write_begin(&pb->version);
+
+		b->idx[slot] = pb->idx[ps];
+		b->tags[slot] = pb->tags[ps];
+		pb->tags[ps] = 0;
+
+		if (pb != b)
+			ebpf_seq_write_end(&pb->version);
+		ebpf_seq_write_end(&b->version);
+
+		slot = ps;
+		node = path + node->parent;
+	}
+
+	*bucketp = node->bucket;
+	*slotp = slot;
+
+	return 0;
+}
+
+static int
+cuckoo_hashtable_map_update_elem(struct ebpf_map *map, void *key,
+				 void *value, uint64_t flags)
+{
+	int error = 0;
+	uint32_t hash = cuckoo_hash(map, key);
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	struct cuckoo_reclaim_batch *batch = NULL;
+	struct cuckoo_bucket *b;
+	uint32_t b1, b2, bucket, slot, idx;
+	uint8_t tag = cuckoo_tag(hash);
+	uint8_t *entry;
+
+	if (flags >= __EBPF_MAP_UPDATE_FLAGS_MAX)
+		return EINVAL;
+
+	ebpf_spinmtx_lock(&ch->lock);
+
+	entry = cuckoo_find(map, key, hash, &b, NULL);
+	if (entry != NULL) {
+		if (flags == EBPF_NOEXIST) {
+			error = EEXIST;
+			goto err0;
+		}
+
+		/*
+		 * Datapath readers may see torn value as in array
+		 * map, but lookup_elem_from_user never does.
+		 */
+		ebpf_seq_write_begin(&b->version);
+		memcpy(CUCKOO_ENTRY_VALUE(ch, entry), value, map->value_size);
+		ebpf_seq_write_end(&b->version);
+		goto err0;
+	}
+
+	if (flags == EBPF_EXIST) {
+		error = ENOENT;
+		goto err0;
+	}
+
+	if (ch->count >= map->max_entries) {
+		error = EBUSY;
+		goto err0;
+	}
+
+	/*
+	 * All spare entries are waiting for the epoch. Pass the short
+	 * pending list as well, so that they come back even if no more
+	 * keys are deleted, and let the caller wait for them.
+	 */
+	if (ch->nfree == 0) {
+		batch = cuckoo_reclaim_take(ch, 1);
+		error = EAGAIN;
+		goto err0;
+	}
+
+	b1 = hash & ch->mask;
+	b2 = cuckoo_alt_bucket(ch, b1, tag);
+	error = cuckoo_make_room(ch, b1, b2, &bucket, &slot);
+	if (error != 0)
+		goto err0;
+
+	idx = ch->free_idx[--ch->nfree];
+	ch->count++;
+	entry = CUCKOO_ENTRY(ch, idx);
+	memcpy(entry, key, map->key_size);
+	memcpy(CUCKOO_ENTRY_VALUE(ch, entry), value, map->value_size);
+
+	b = ch->buckets + bucket;
+	ebpf_seq_write_begin(&b->version);
+	b->idx[slot] = idx;
+	b->tags[slot] = tag;
+	ebpf_seq_write_end(&b->version);
+
+err0:
+	ebpf_spinmtx_unlock(&ch->lock);
+
+	if (batch != NULL)
+		ebpf_epoch_call(&batch->ec, cuckoo_reclaim_cb);
+
+	return error;
+}
+
+static int
+cuckoo_hashtable_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = cuckoo_hash(map, key);
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	struct cuckoo_reclaim_batch *batch;
+	struct cuckoo_bucket *b;
+	uint32_t slot, idx;
+	uint8_t *entry;
+
+	ebpf_spinmtx_lock(&ch->lock);
+
+	entry = cuckoo_find(map, key, hash, &b, &slot);
+	if (entry == NULL) {
+		ebpf_spinmtx_unlock(&ch->lock);
+		return ENOENT;
+	}
+
+	ebpf_seq_write_begin(&b->version);
+	b->tags[slot] = 0;
+	ebpf_seq_write_end(&b->version);
+
+	/* Readers may still see the entry until the epoch passes */
+	idx = b->idx[slot];
+	ch->reclaim_next[idx] = ch->pending;
+	ch->pending = idx;
+	ch->npending++;
+	ch->count--;
+
+	batch = cuckoo_reclaim_take(ch, CUCKOO_RECLAIM_BATCH);
+
+	ebpf_spinmtx_unlock(&ch->lock);
+
+	if (batch != NULL)
+		ebpf_epoch_call(&batch->ec, cuckoo_reclaim_cb);
+
+	return 0;
+}
+
+static int
+cuckoo_hashtable_map_get_next_key(struct ebpf_map *map, void *key,
+				  void *next_key)
+{
+	struct ebpf_map_cuckoo_hashtable *ch = map->data;
+	struct cuckoo_bucket *b;
+	uint32_t i = 0, slot;
+	int error = ENOENT;
+
+	/* Iteration is not the hot path. Just exclude writers. */
+	ebpf_spinmtx_lock(&ch->lock);
+
+	if (key != NULL &&
+	    cuckoo_find(map, key, cuckoo_hash(map, key),
+			&b, &slot) != NULL)
+		i = (b - ch->buckets) * CUCKOO_BUCKET_SLOTS + slot + 1;
+
+	for (; i < (ch->mask + 1) * CUCKOO_BUCKET_SLOTS; i++) {
+		b = ch->buckets + i / CUCKOO_BUCKET_SLOTS;
+		slot = i % CUCKOO_BUCKET_SLOTS;
+		if (b->tags[slot] != 0) {
+			memcpy(next_key, CUCKOO_ENTRY(ch, b->idx[slot]),
+			       map->key_size);
+			error = 0;
+			break;
+		}
+	}
+
+	ebpf_spinmtx_unlock(&ch->lock);
+
+	return error;
+}
+
+const struct ebpf_map_type emt_cuckoo_hashtable = {
+	.name = "cuckoo_hashtable",
+	.ops = {
+		.init = cuckoo_hashtable_map_init,
+		.update_elem = cuckoo_hashtable_map_update_elem,
+		.lookup_elem = cuckoo_hashtable_map_lookup_elem,
+		.delete_elem = cuckoo_hashtable_map_delete_elem,
+		.update_elem_from_user = cuckoo_hashtable_map_update_elem,
+		.lookup_elem_from_user = cuckoo_hashtable_map_lookup_elem_from_user,
+		.delete_elem_from_user = cuckoo_hashtable_map_delete_elem,
+		.get_next_key_from_user = cuckoo_hashtable_map_get_next_key,
+		.deinit = cuckoo_hashtable_map_deinit,
+		.prefetch_elem = cuckoo_hashtable_map_prefetch_elem
+	}
+};
@@ -18,16 +18,49 @@
 
 #include "ebpf_map.h"
 #include "ebpf_allocator.h"
+#include "ebpf_hash.h"
 #include "ebpf_util.h"
 
 struct ebpf_map_hashtable;
 
+#define HASH_RECLAIM_BATCH 16
+#define HASH_RECLAIM_NBATCHES 4
+
+/*
+ * Spare elements of each CPU. Covers the batches waiting for the
+ * epoch and the pending list which is being filled.
+ */
+#define HASH_RECLAIM_RESERVE (HASH_RECLAIM_BATCH * (HASH_RECLAIM_NBATCHES + 1))
+
+/*
+ * Number of the spare elements preallocated in addition to max_entries.
+ * It is HASH_RECLAIM_RESERVE per CPU, but never more than max_entries
+ * (or one batch for the tiny maps), so the spare elements cost at most
+ * as much memory as the map itself. Note that the element of the percpu
+ * map carries ncpus values. When the reserve is used up, the pending
+ * lists are flushed and the update returns EAGAIN, on which
+ * ebpf_map_update_elem_from_user waits for the epoch and retries.
+ */
+static uint32_t
+hashtable_reclaim_reserve(uint32_t max_entries)
+{
+	uint32_t reserve = ebpf_ncpus() * HASH_RECLAIM_RESERVE;
+
+	if (max_entries < HASH_RECLAIM_BATCH)
+		max_entries = HASH_RECLAIM_BATCH;
+
+	return ebpf_min(reserve, max_entries);
+}
+
 /*
  * hashtable_map's element. Actual value is following to
  * variable length key.
  */
 struct hash_elem {
 	EBPF_EPOCH_LIST_ENTRY(hash_elem) elem;
+	struct hash_elem *reclaim_next; /* chains the unlinked elements */
+	uint32_t hash; /* cached hash of the key */
+	uint32_t seq;  /* protects in-place value update */
 	uint8_t key[0];
 	/* uint8_t value[value_size]; Instance of value in normal map case */
 	/* uint8_t **valuep; Pointer to percpu value in percpu map case */
@@ -38,14 +71,91 @@ struct hash_bucket {
 	ebpf_spinmtx lock;
 };
 
+/*
+ * lru_hashtable_map's element. Wraps hash_elem with the state
+ * used for eviction. Free elements are chained with free_next
+ * instead of the list entry of hash_elem, so readers which are
+ * still walking on evicted element never follow into free list.
+ * The element goes back to the free list after the epoch, in the
+ * same way as the element of emt_hashtable.
+ */
+struct lru_elem {
+	struct lru_elem *free_next;
+	uint8_t ref;    /* referenced since the clock hand passed */
+	uint8_t in_use; /* linked to bucket, protected by bucket lock */
+	struct hash_elem he;
+};
+
+/*
+ * Per-CPU free list. Updates take elements from here first,
+ * so the global lock is only taken once per LRU_LOCAL_BATCH
+ * insertions.
+ */
+struct lru_local {
+	ebpf_spinmtx lock;
+	struct lru_elem *free;
+};
+
+struct hash_lru {
+	ebpf_spinmtx lock; /* protects free and hand */
+	struct lru_elem *free;
+	uint32_t hand;
+	uint32_t nelems;
+	uint32_t elem_size;
+	uint8_t *elems;
+	struct lru_local *locals;
+};
+
+/*
+ * Element of the hashtable in EBPF_MAP_F_LOCKFREE mode. The elements
+ * of a bucket are chained with next, whose lowest bit is set when
+ * the element is logically deleted (Harris-Michael list). The list
+ * entry of hash_elem is unused, but the unlinked elements are
+ * reclaimed with reclaim_next like in the locked mode.
+ */
+struct hash_lf_elem {
+	struct hash_lf_elem *next;
+	struct hash_elem he;
+};
+
+/*
+ * Elements unlinked from the buckets are not reused until the readers
+ * which may still see them are gone. They are chained to the list of
+ * the current CPU first, and the whole list is passed to the epoch as
+ * a batch once it has HASH_RECLAIM_BATCH elements, so ebpf_epoch_call
+ * is amortized over the batch. The elements are chained with
+ * reclaim_next, since the readers may still follow their list entry.
+ */
+struct hash_reclaim_batch {
+	ebpf_epoch_context ec;
+	struct ebpf_map_hashtable *hash_map;
+	struct hash_elem *elems;
+	uint32_t busy; /* passed to the epoch */
+};
+
+struct hash_reclaim {
+	ebpf_spinmtx lock;
+	struct hash_elem *pending;
+	uint32_t npending;
+	struct hash_reclaim_batch batches[HASH_RECLAIM_NBATCHES];
+};
+
+#define LRU_LOCAL_BATCH 16
+#define LRU_ELEM(_lrup, _idx)                                                  \
+	((struct lru_elem *)((_lrup)->elems + (size_t)(_lrup)->elem_size * (_idx)))
+
 struct ebpf_map_hashtable {
 	uint32_t elem_size;
 	uint32_t key_size;   /* round upped key size */
 	uint32_t value_size; /* round uppped value size */
 	uint32_t nbuckets;
 	struct hash_bucket *buckets;
-	struct hash_elem **pcpu_extra_elems;
+	struct hash_reclaim *reclaims; /* per CPU */
 	struct ebpf_allocator allocator;
+	struct hash_lru *lru; /* lru_hashtable_map only */
+	ebpf_hash_fn hash;
+	struct hash_lf_elem **lf_buckets; /* EBPF_MAP_F_LOCKFREE only */
+	uint32_t count; /* number of the keys */
 };
 
 #define HASH_ELEM_VALUE(_hash_mapp, _elemp) ((_elemp)->key + (_hash_mapp)->key_size)
@@ -57,31 +167,220 @@ struct ebpf_map_hashtable {
 #define HASH_BUCKET_LOCK(_bucketp) ebpf_spinmtx_lock(&_bucketp->lock);
 #define HASH_BUCKET_UNLOCK(_bucketp) ebpf_spinmtx_unlock(&_bucketp->lock);
 
+static inline uint32_t
+hashtable_hash(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	return hash_map->hash(key, map->key_size);
+}
+
 static struct hash_bucket *
 get_hash_bucket(struct ebpf_map_hashtable *hash_map, uint32_t hash)
 {
 	return &hash_map->buckets[hash & (hash_map->nbuckets - 1)];
 }
 
-static struct hash_elem *
-get_hash_elem(struct hash_bucket *bucket, void *key, uint32_t key_size)
+/*
+ * Word-wise compare for the common key sizes. The switch is folded
+ * away in the key size specialized paths.
+ */
+static ebpf_always_inline bool
+hash_key_equal(const uint8_t *elem_key, const void *key, uint32_t key_size)
+{
+	const uint8_t *k = key;
+
+	switch (key_size) {
+	case 4:
+		return ebpf_hash_read32(elem_key) == ebpf_hash_read32(k);
+	case 8:
+		return ebpf_hash_read64(elem_key) == ebpf_hash_read64(k);
+	case 16:
+		return ((ebpf_hash_read64(elem_key) ^ ebpf_hash_read64(k)) |
+			(ebpf_hash_read64(elem_key + 8) ^
+			 ebpf_hash_read64(k + 8))) == 0;
+	case 40:
+		return ((ebpf_hash_read64(elem_key) ^ ebpf_hash_read64(k)) |
+			(ebpf_hash_read64(elem_key + 8) ^
+			 ebpf_hash_read64(k + 8)) |
+			(ebpf_hash_read64(elem_key + 16) ^
+			 ebpf_hash_read64(k + 16)) |
+			(ebpf_hash_read64(elem_key + 24) ^
+			 ebpf_hash_read64(k + 24)) |
+			(ebpf_hash_read64(elem_key + 32) ^
+			 ebpf_hash_read64(k + 32))) == 0;
+	default:
+		return memcmp(elem_key, key, key_size) == 0;
+	}
+}
+
+/*
+ * Compare the cached hash first. Elements in the same bucket mostly
+ * differ in the upper bits of the hash, so the key is usually
+ * compared only for the element which has the key.
+ */
+static ebpf_always_inline struct hash_elem *
+get_hash_elem(struct hash_bucket *bucket, void *key, uint32_t key_size,
+	      uint32_t hash)
 {
 	struct hash_elem *elem;
 	EBPF_EPOCH_LIST_FOREACH(elem, &bucket->head, elem)
 	{
-		if (memcmp(elem->key, key, key_size) == 0)
+		if (elem->hash == hash &&
+		    hash_key_equal(elem->key, key, key_size))
 			return elem;
 	}
 	return NULL;
 }
 
-static struct hash_elem *
-get_extra_elem(struct ebpf_map_hashtable *hash_map, struct hash_elem *elem)
+/*
+ * Reserves the room for the new key and takes an element for it. The
+ * allocator has spare elements for the ones waiting for the epoch (see
+ * hashtable_reclaim_reserve), so the number of the keys is limited by
+ * the counter instead. Returns EBUSY when the map is full, and EAGAIN
+ * when all spare elements are waiting for the epoch.
+ */
+static int
+hashtable_elem_alloc(struct ebpf_map_hashtable *hash_map,
+		     uint32_t max_entries, struct hash_elem **elemp)
+{
+	if (ebpf_atomic_fetch_add32(&hash_map->count, 1) >= max_entries) {
+		ebpf_atomic_add32(&hash_map->count, -1);
+		return EBUSY;
+	}
+
+	*elemp = ebpf_allocator_alloc(&hash_map->allocator);
+	if (*elemp == NULL) {
+		ebpf_atomic_add32(&hash_map->count, -1);
+		return EAGAIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the element to the allocator. The block of the allocator
+ * is the whole hash_lf_elem in EBPF_MAP_F_LOCKFREE mode. The LRU
+ * hashtable has its own free list instead of the allocator.
+ */
+static void
+hashtable_elem_free(struct ebpf_map_hashtable *hash_map,
+		    struct hash_elem *elem)
+{
+	struct hash_lru *lru = hash_map->lru;
+	struct lru_elem *le;
+
+	if (lru != NULL) {
+		le = ebpf_container_of(elem, struct lru_elem, he);
+		ebpf_spinmtx_lock(&lru->lock);
+		le->free_next = lru->free;
+		lru->free = le;
+		ebpf_spinmtx_unlock(&lru->lock);
+	} else if (hash_map->lf_buckets != NULL)
+		ebpf_allocator_free(&hash_map->allocator,
+				    ebpf_container_of(elem, struct hash_lf_elem,
+						      he));
+	else
+		ebpf_allocator_free(&hash_map->allocator, elem);
+}
+
+static void
+hashtable_reclaim_cb(ebpf_epoch_context *ec)
+{
+	struct hash_reclaim_batch *batch;
+	struct hash_elem *elem, *next;
+
+	batch = ebpf_container_of(ec, struct hash_reclaim_batch, ec);
+
+	for (elem = batch->elems; elem != NULL; elem = next) {
+		next = elem->reclaim_next;
+		hashtable_elem_free(batch->hash_map, elem);
+	}
+
+	batch->elems = NULL;
+	ebpf_fence_store();
+	ebpf_atomic_store32(&batch->busy, 0);
+}
+
+/*
+ * Returns the element unlinked from the bucket to the allocator after
+ * the epoch. When all batches of the CPU are still waiting for the
+ * epoch, the pending list keeps growing and is passed as a whole to
+ * the first batch which becomes free.
+ */
+static void
+hashtable_elem_reclaim(struct ebpf_map_hashtable *hash_map,
+		       struct hash_elem *elem)
+{
+	struct hash_reclaim *reclaim = hash_map->reclaims + ebpf_curcpu();
+	struct hash_reclaim_batch *batch = NULL;
+
+	ebpf_spinmtx_lock(&reclaim->lock);
+
+	elem->reclaim_next = reclaim->pending;
+	reclaim->pending = elem;
+
+	if (++reclaim->npending >= HASH_RECLAIM_BATCH) {
+		for (uint32_t i = 0; i < HASH_RECLAIM_NBATCHES; i++) {
+			if (!ebpf_atomic_load32(&reclaim->batches[i].busy)) {
+				batch = reclaim->batches + i;
+				break;
+			}
+		}
+
+		if (batch != NULL) {
+			batch->elems = reclaim->pending;
+			batch->busy = 1;
+			reclaim->pending = NULL;
+			reclaim->npending = 0;
+		}
+	}
+
+	ebpf_spinmtx_unlock(&reclaim->lock);
+
+	if (batch != NULL)
+		ebpf_epoch_call(&batch->ec, hashtable_reclaim_cb);
+}
+
+/*
+ * Passes the pending lists of all CPUs to the epoch regardless of their
+ * length. Called when the allocator runs out of the spare elements, so
+ * that the elements sitting on the short pending lists come back after
+ * the epoch even if no more elements are unlinked.
+ */
+static void
+hashtable_reclaim_flush(struct ebpf_map_hashtable *hash_map)
 {
-	struct hash_elem *tmp;
-	tmp = hash_map->pcpu_extra_elems[ebpf_curcpu()];
-	hash_map->pcpu_extra_elems[ebpf_curcpu()] = elem;
-	return tmp;
+	struct hash_reclaim *reclaim;
+	struct hash_reclaim_batch *batch;
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		reclaim = hash_map->reclaims + i;
+		batch = NULL;
+
+		ebpf_spinmtx_lock(&reclaim->lock);
+
+		if (reclaim->pending != NULL) {
+			for (uint32_t j = 0; j < HASH_RECLAIM_NBATCHES; j++) {
+				if (!ebpf_atomic_load32(
+					&reclaim->batches[j].busy)) {
+					batch = reclaim->batches + j;
+					break;
+				}
+			}
+		}
+
+		if (batch != NULL) {
+			batch->elems = reclaim->pending;
+			batch->busy = 1;
+			reclaim->pending = NULL;
+			reclaim->npending = 0;
+		}
+
+		ebpf_spinmtx_unlock(&reclaim->lock);
+
+		if (batch != NULL)
+			ebpf_epoch_call(&batch->ec, hashtable_reclaim_cb);
+	}
 }
 
 static int
@@ -134,10 +433,102 @@ is_percpu(struct ebpf_map *map)
 	return false;
 }
 
+static int
+hashtable_buckets_init(struct ebpf_map_hashtable *hash_map,
+		       uint32_t max_entries)
+{
+	/*
+	 * Roundup number of buckets to power of two.
+	 * This improbes performance, because we don't have to
+	 * use slow moduro opearation.
+	 */
+	hash_map->nbuckets = ebpf_roundup_pow_of_two(max_entries);
+	hash_map->buckets =
+	    ebpf_calloc(hash_map->nbuckets, sizeof(struct hash_bucket));
+	if (hash_map->buckets == NULL)
+		return ENOMEM;
+
+	for (uint32_t i = 0; i < hash_map->nbuckets; i++) {
+		EBPF_EPOCH_LIST_INIT(&hash_map->buckets[i].head);
+		ebpf_spinmtx_init(&hash_map->buckets[i].lock,
+			      "ebpf_hashtable_map bucket lock");
+	}
+
+	return 0;
+}
+
+static void
+hashtable_buckets_deinit(struct ebpf_map_hashtable *hash_map)
+{
+	for (uint32_t i = 0; i < hash_map->nbuckets; i++)
+		ebpf_spinmtx_destroy(&hash_map->buckets[i].lock);
+
+	ebpf_free(hash_map->buckets);
+}
+
+static int
+hashtable_reclaim_init(struct ebpf_map_hashtable *hash_map)
+{
+	hash_map->reclaims =
+	    ebpf_calloc(ebpf_ncpus(), sizeof(struct hash_reclaim));
+	if (hash_map->reclaims == NULL)
+		return ENOMEM;
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		ebpf_spinmtx_init(&hash_map->reclaims[i].lock,
+				  "ebpf_hashtable_map reclaim lock");
+		for (uint32_t j = 0; j < HASH_RECLAIM_NBATCHES; j++)
+			hash_map->reclaims[i].batches[j].hash_map = hash_map;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the unlinked elements to the allocator on map destruction.
+ * Waiting for the readers doesn't wait for the batches which are
+ * already passed to the epoch in the kernel, so the callbacks are
+ * drained first. Otherwise they would touch the freed map.
+ */
+static void
+hashtable_reclaim_drain(struct ebpf_map_hashtable *hash_map)
+{
+	struct hash_elem *elem, *next;
+
+	ebpf_epoch_barrier();
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		for (uint32_t j = 0; j < HASH_RECLAIM_NBATCHES; j++)
+			ebpf_assert(!hash_map->reclaims[i].batches[j].busy);
+
+		for (elem = hash_map->reclaims[i].pending; elem != NULL;
+		     elem = next) {
+			next = elem->reclaim_next;
+			hashtable_elem_free(hash_map, elem);
+		}
+	}
+}
+
+static void
+hashtable_reclaim_deinit(struct ebpf_map_hashtable *hash_map)
+{
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++)
+		ebpf_spinmtx_destroy(&hash_map->reclaims[i].lock);
+
+	ebpf_free(hash_map->reclaims);
+}
+
+static const struct ebpf_map_ops *
+hashtable_fixed_key_ops(uint32_t hash_type, uint32_t key_size);
+static int hashtable_lf_map_init(struct ebpf_map *map,
+				 struct ebpf_map_attr *attr);
+
 static int
 hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
 {
 	int error;
+	uint32_t hash_type;
+	const struct ebpf_map_ops *ops;
 
 	map->percpu = is_percpu(map);
 
@@ -152,6 +543,35 @@ hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
 	if (hash_map == NULL)
 		return ENOMEM;
 
+	hash_type = EBPF_MAP_F_HASH_TYPE(attr->flags);
+	if (hash_type == EBPF_MAP_HASH_AUTO)
+		hash_type = ebpf_hash_auto();
+
+	error = ebpf_hash_select(hash_type, &hash_map->hash);
+	if (error != 0)
+		goto err0;
+
+	/* Percpu hashtable always updates the value in place */
+	if ((attr->flags & EBPF_MAP_F_INPLACE) &&
+	    (map->percpu || (attr->flags & EBPF_MAP_F_LOCKFREE))) {
+		error = EINVAL;
+		goto err0;
+	}
+
+	if (attr->flags & EBPF_MAP_F_LOCKFREE) {
+		if (map->percpu) {
+			error = EINVAL;
+			goto err0;
+		}
+
+		map->data = hash_map;
+		error = hashtable_lf_map_init(map, attr);
+		if (error != 0)
+			goto err0;
+
+		return 0;
+	}
+
 	/*
 	 * Roundup key size and value size for efficiency.
 	 * This affects sizeof element. Never allow users
@@ -172,57 +592,33 @@ hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
 				      hash_map->value_size +
 				      sizeof(struct hash_elem);
 
-	/*
-	 * Roundup number of buckets to power of two.
-	 * This improbes performance, because we don't have to
-	 * use slow moduro opearation.
-	 */
-	hash_map->nbuckets = ebpf_roundup_pow_of_two(attr->max_entries);
-	hash_map->buckets =
-	    ebpf_calloc(hash_map->nbuckets, sizeof(struct hash_bucket));
-	if (hash_map->buckets == NULL) {
-		error = ENOMEM;
+	if (attr->max_entries >
+	    UINT32_MAX - hashtable_reclaim_reserve(attr->max_entries)) {
+		error = E2BIG;
 		goto err0;
 	}
 
-	for (uint32_t i = 0; i < hash_map->nbuckets; i++) {
-		EBPF_EPOCH_LIST_INIT(&hash_map->buckets[i].head);
-		ebpf_spinmtx_init(&hash_map->buckets[i].lock,
-			      "ebpf_hashtable_map bucket lock");
-	}
-
-	if (map->percpu) {
-		error = ebpf_allocator_init(&hash_map->allocator,
-					    hash_map->elem_size, attr->max_entries,
-					    percpu_elem_ctor, hash_map);
-		if (error != 0)
-			goto err1;
-	} else {
-		error = ebpf_allocator_init(
-		    &hash_map->allocator, hash_map->elem_size,
-		    attr->max_entries + ebpf_ncpus(), NULL, NULL);
-		if (error != 0)
-			goto err1;
+	error = hashtable_buckets_init(hash_map, attr->max_entries);
+	if (error != 0)
+		goto err0;
 
-		hash_map->pcpu_extra_elems =
-		    ebpf_calloc(ebpf_ncpus(), sizeof(struct hash_elem *));
-		if (hash_map->pcpu_extra_elems == NULL) {
-			error = ENOMEM;
-			goto err2;
-		}
+	error = hashtable_reclaim_init(hash_map);
+	if (error != 0)
+		goto err1;
+
+	error = ebpf_allocator_init(
+	    &hash_map->allocator, hash_map->elem_size,
+	    attr->max_entries + hashtable_reclaim_reserve(attr->max_entries),
+	    map->percpu ? percpu_elem_ctor : NULL,
+	    map->percpu ? percpu_elem_dtor : NULL,
+	    map->percpu ? hash_map : NULL);
+	if (error != 0)
+		goto err2;
 
-		/*
-		 * Reserve percpu extra map element in here.
-		 * These elemens are useful to update existing
-		 * map element. Since updating is running at
-		 * critical section, we don't require any lock
-		 * to take this element.
-		 */
-		for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
-			hash_map->pcpu_extra_elems[i] =
-			    ebpf_allocator_alloc(&hash_map->allocator);
-			ebpf_assert(hash_map->pcpu_extra_elems[i]);
-		}
+	if (!map->percpu) {
+		ops = hashtable_fixed_key_ops(hash_type, attr->key_size);
+		if (ops != NULL)
+			map->ops = ops;
 	}
 
 	map->data = hash_map;
@@ -230,11 +626,9 @@ hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
 	return 0;
 
 err2:
-	ebpf_allocator_deinit(&hash_map->allocator,
-			      map->percpu ? percpu_elem_dtor : NULL,
-			      map->percpu ? hash_map : NULL);
+	hashtable_reclaim_deinit(hash_map);
 err1:
-	ebpf_free(hash_map->buckets);
+	hashtable_buckets_deinit(hash_map);
 err0:
 	ebpf_free(hash_map);
 	return error;
@@ -244,18 +638,14 @@ static void
 hashtable_map_deinit(struct ebpf_map *map)
 {
 	struct ebpf_map_hashtable *hash_map = map->data;
+	struct hash_elem *elem;
 
 	/*
 	 * Wait for current readers
 	 */
 	ebpf_epoch_wait();
+	hashtable_reclaim_drain(hash_map);
 
-	if (!map->percpu)
-		for (uint16_t i = 0; i < ebpf_ncpus(); i++)
-			ebpf_allocator_free(&hash_map->allocator,
-					hash_map->pcpu_extra_elems[i]);
-
-	struct hash_elem *elem;
 	for (uint32_t i = 0; i < hash_map->nbuckets; i++) {
 		while (!EBPF_EPOCH_LIST_EMPTY(&hash_map->buckets[i].head)) {
 			elem =
@@ -272,27 +662,29 @@ hashtable_map_deinit(struct ebpf_map *map)
 			      map->percpu ? percpu_elem_dtor : NULL,
 			      map->percpu ? hash_map : NULL);
 
-	for (uint32_t i = 0; i < hash_map->nbuckets; i++)
-		ebpf_spinmtx_destroy(&hash_map->buckets[i].lock);
-
-	if (!map->percpu)
-		ebpf_free(hash_map->pcpu_extra_elems);
-
-	ebpf_free(hash_map->buckets);
+	hashtable_reclaim_deinit(hash_map);
+	hashtable_buckets_deinit(hash_map);
 	ebpf_free(hash_map);
 }
 
-static void *
-hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
+/*
+ * The *_common functions below are the templates of the lookup,
+ * update and delete operations. The generic operations pass the
+ * key size and the hash function of the map, and the specialized
+ * ones (see HASHTABLE_FIXED_KEY_OPS) pass the constants.
+ */
+static ebpf_always_inline void *
+hashtable_map_lookup_elem_common(struct ebpf_map *map, void *key,
+				 uint32_t key_size, ebpf_hash_fn hash_fn)
 {
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hash_fn(key, key_size);
 	struct ebpf_map_hashtable *hash_map;
 	struct hash_bucket *bucket;
 	struct hash_elem *elem;
 
 	hash_map = map->data;
 	bucket = get_hash_bucket(hash_map, hash);
-	elem = get_hash_elem(bucket, key, map->key_size);
+	elem = get_hash_elem(bucket, key, key_size, hash);
 	if (elem == NULL)
 		return NULL;
 
@@ -300,22 +692,40 @@ hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
 			   : HASH_ELEM_VALUE(hash_map, elem);
 }
 
-static int
-hashtable_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
-				    void *value)
+static ebpf_always_inline void
+hashtable_map_prefetch_elem_common(struct ebpf_map *map, void *key,
+				   uint32_t key_size, ebpf_hash_fn hash_fn)
+{
+	uint32_t hash = hash_fn(key, key_size);
+	ebpf_prefetch(get_hash_bucket(map->data, hash));
+}
+
+static ebpf_always_inline int
+hashtable_map_lookup_elem_from_user_common(struct ebpf_map *map, void *key,
+					   void *value, uint32_t key_size,
+					   ebpf_hash_fn hash_fn)
 {
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hash_fn(key, key_size), seq;
 	struct ebpf_map_hashtable *hash_map;
 	struct hash_bucket *bucket;
 	struct hash_elem *elem;
 
 	hash_map = map->data;
 	bucket = get_hash_bucket(hash_map, hash);
-	elem = get_hash_elem(bucket, key, map->key_size);
+	elem = get_hash_elem(bucket, key, key_size, hash);
 	if (elem == NULL)
 		return ENOENT;
 
-	memcpy(value, HASH_ELEM_VALUE(hash_map, elem), map->value_size);
+	if (map->map_flags & EBPF_MAP_F_INPLACE) {
+		do {
+			seq = ebpf_seq_read_begin(&elem->seq);
+			memcpy(value, HASH_ELEM_VALUE(hash_map, elem),
+			       map->value_size);
+		} while (ebpf_seq_read_retry(&elem->seq, seq));
+	} else {
+		memcpy(value, HASH_ELEM_VALUE(hash_map, elem),
+		       map->value_size);
+	}
 
 	return 0;
 }
@@ -324,14 +734,14 @@ static int
 hashtable_map_lookup_elem_percpu_from_user(struct ebpf_map *map, void *key,
 					   void *value)
 {
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hashtable_hash(map, key);
 	struct ebpf_map_hashtable *hash_map;
 	struct hash_bucket *bucket;
 	struct hash_elem *elem;
 
 	hash_map = map->data;
 	bucket = get_hash_bucket(hash_map, hash);
-	elem = get_hash_elem(bucket, key, map->key_size);
+	elem = get_hash_elem(bucket, key, map->key_size, hash);
 	if (elem == NULL)
 		return ENOENT;
 
@@ -344,11 +754,33 @@ hashtable_map_lookup_elem_percpu_from_user(struct ebpf_map *map, void *key,
 }
 
 static int
-hashtable_map_update_elem(struct ebpf_map *map, void *key, void *value,
-			  uint64_t flags)
+hashtable_map_percpu_add_elem(struct ebpf_map *map, void *key,
+			      uint32_t offset, uint64_t delta)
+{
+	uint32_t hash = hashtable_hash(map, key);
+	struct ebpf_map_hashtable *hash_map;
+	struct hash_bucket *bucket;
+	struct hash_elem *elem;
+
+	hash_map = map->data;
+	bucket = get_hash_bucket(hash_map, hash);
+	elem = get_hash_elem(bucket, key, map->key_size, hash);
+	if (elem == NULL)
+		return ENOENT;
+
+	ebpf_percpu_add64(HASH_ELEM_PERCPU_VALUE(hash_map, elem, 0) + offset,
+			  hash_map->value_size, delta);
+
+	return 0;
+}
+
+static ebpf_always_inline int
+hashtable_map_update_elem_common(struct ebpf_map *map, void *key, void *value,
+				 uint64_t flags, uint32_t key_size,
+				 ebpf_hash_fn hash_fn)
 {
 	int error = 0;
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hash_fn(key, key_size);
 	struct hash_bucket *bucket;
 	struct hash_elem *old_elem, *new_elem;
 	struct ebpf_map_hashtable *hash_map = map->data;
@@ -357,36 +789,58 @@ hashtable_map_update_elem(struct ebpf_map *map, void *key, void *value,
 
 	HASH_BUCKET_LOCK(bucket);
 
-	old_elem = get_hash_elem(bucket, key, map->key_size);
+	old_elem = get_hash_elem(bucket, key, key_size, hash);
 	error = check_update_flags(hash_map, old_elem, flags);
 	if (error != 0)
 		goto err0;
 
+	if (old_elem != NULL && (map->map_flags & EBPF_MAP_F_INPLACE)) {
+		ebpf_seq_write_begin(&old_elem->seq);
+		memcpy(HASH_ELEM_VALUE(hash_map, old_elem), value,
+		       map->value_size);
+		ebpf_seq_write_end(&old_elem->seq);
+		goto err0;
+	}
+
+	/*
+	 * The old element is replaced by a spare element, which may all
+	 * be waiting for the epoch.
+	 */
 	if (old_elem != NULL) {
-		/*
-		 * In case of updating existing element, we can
-		 * use percpu extra elements and swap it with old
-		 * element. This avoids take lock of memory allocator.
-		 */
-		new_elem = get_extra_elem(hash_map, old_elem);
-	} else {
 		new_elem = ebpf_allocator_alloc(&hash_map->allocator);
-		if (!new_elem) {
-			error = EBUSY;
-			goto err0;
-		}
+		if (new_elem == NULL)
+			error = EAGAIN;
+	} else {
+		error = hashtable_elem_alloc(hash_map, map->max_entries,
+					     &new_elem);
 	}
 
-	memcpy(new_elem->key, key, map->key_size);
+	if (error != 0) {
+		HASH_BUCKET_UNLOCK(bucket);
+		if (error == EAGAIN)
+			hashtable_reclaim_flush(hash_map);
+		return error;
+	}
+
+	new_elem->hash = hash;
+	new_elem->seq = 0;
+	memcpy(new_elem->key, key, key_size);
 	memcpy(HASH_ELEM_VALUE(hash_map, new_elem), value, map->value_size);
 
 	EBPF_EPOCH_LIST_INSERT_HEAD(&bucket->head, new_elem, elem);
 	if (old_elem != NULL)
 		EBPF_EPOCH_LIST_REMOVE(old_elem, elem);
 
-err0:
 	HASH_BUCKET_UNLOCK(bucket);
-	return error;
+
+	if (old_elem != NULL)
+		hashtable_elem_reclaim(hash_map, old_elem);
+
+	return 0;
+
+err0:
+	HASH_BUCKET_UNLOCK(bucket);
+	return error;
 }
 
 static int
@@ -394,7 +848,7 @@ hashtable_map_update_elem_percpu(struct ebpf_map *map, void *key, void *value,
 				 uint64_t flags)
 {
 	int error = 0;
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hashtable_hash(map, key);
 	struct hash_bucket *bucket;
 	struct hash_elem *old_elem, *new_elem;
 	struct ebpf_map_hashtable *hash_map = map->data;
@@ -403,7 +857,7 @@ hashtable_map_update_elem_percpu(struct ebpf_map *map, void *key, void *value,
 
 	HASH_BUCKET_LOCK(bucket);
 
-	old_elem = get_hash_elem(bucket, key, map->key_size);
+	old_elem = get_hash_elem(bucket, key, map->key_size, hash);
 	error = check_update_flags(hash_map, old_elem, flags);
 	if (error != 0)
 		goto err0;
@@ -412,12 +866,16 @@ hashtable_map_update_elem_percpu(struct ebpf_map *map, void *key, void *value,
 		memcpy(HASH_ELEM_CURCPU_VALUE(hash_map, old_elem), value,
 		       map->value_size);
 	} else {
-		new_elem = ebpf_allocator_alloc(&hash_map->allocator);
-		if (new_elem == NULL) {
-			error = EBUSY;
-			goto err0;
+		error = hashtable_elem_alloc(hash_map, map->max_entries,
+					     &new_elem);
+		if (error != 0) {
+			HASH_BUCKET_UNLOCK(bucket);
+			if (error == EAGAIN)
+				hashtable_reclaim_flush(hash_map);
+			return error;
 		}
 
+		new_elem->hash = hash;
 		memcpy(new_elem->key, key, map->key_size);
 		memcpy(HASH_ELEM_CURCPU_VALUE(hash_map, new_elem), value,
 		       map->value_size);
@@ -434,7 +892,7 @@ hashtable_map_update_elem_percpu_from_user(struct ebpf_map *map, void *key,
 					   void *value, uint64_t flags)
 {
 	int error = 0;
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hashtable_hash(map, key);
 	struct hash_bucket *bucket;
 	struct hash_elem *old_elem, *new_elem;
 	struct ebpf_map_hashtable *hash_map = map->data;
@@ -443,7 +901,7 @@ hashtable_map_update_elem_percpu_from_user(struct ebpf_map *map, void *key,
 
 	HASH_BUCKET_LOCK(bucket);
 
-	old_elem = get_hash_elem(bucket, key, map->key_size);
+	old_elem = get_hash_elem(bucket, key, map->key_size, hash);
 	error = check_update_flags(hash_map, old_elem, flags);
 	if (error != 0)
 		goto err0;
@@ -453,16 +911,20 @@ hashtable_map_update_elem_percpu_from_user(struct ebpf_map *map, void *key,
 			memcpy(HASH_ELEM_PERCPU_VALUE(hash_map, old_elem, i),
 			       value, map->value_size);
 	} else {
-		new_elem = ebpf_allocator_alloc(&hash_map->allocator);
-		if (new_elem == NULL) {
-			error = EBUSY;
-			goto err0;
-        }
+		error = hashtable_elem_alloc(hash_map, map->max_entries,
+					     &new_elem);
+		if (error != 0) {
+			HASH_BUCKET_UNLOCK(bucket);
+			if (error == EAGAIN)
+				hashtable_reclaim_flush(hash_map);
+			return error;
+		}
 
 		for (uint16_t i = 0; i < ebpf_ncpus(); i++)
 			memcpy(HASH_ELEM_PERCPU_VALUE(hash_map, new_elem, i),
 			       value, map->value_size);
 
+		new_elem->hash = hash;
 		memcpy(new_elem->key, key, map->key_size);
 		EBPF_EPOCH_LIST_INSERT_HEAD(&bucket->head, new_elem, elem);
 	}
@@ -472,10 +934,11 @@ err0:
 	return error;
 }
 
-static int
-hashtable_map_delete_elem(struct ebpf_map *map, void *key)
+static ebpf_always_inline int
+hashtable_map_delete_elem_common(struct ebpf_map *map, void *key,
+				 uint32_t key_size, ebpf_hash_fn hash_fn)
 {
-	uint32_t hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	uint32_t hash = hash_fn(key, key_size);
 	struct ebpf_map_hashtable *hash_map = map->data;
 	struct hash_bucket *bucket;
 	struct hash_elem *elem;
@@ -484,23 +947,66 @@ hashtable_map_delete_elem(struct ebpf_map *map, void *key)
 
 	HASH_BUCKET_LOCK(bucket);
 
-	elem = get_hash_elem(bucket, key, map->key_size);
+	elem = get_hash_elem(bucket, key, key_size, hash);
 	if (elem != NULL)
 		EBPF_EPOCH_LIST_REMOVE(elem, elem);
 
 	HASH_BUCKET_UNLOCK(bucket);
 
 	/*
-	 * Just return element to memory allocator without any
-	 * synchronization. This is safe, because ebpf_allocator
-	 * never calls free().
+	 * Readers may still be looking at the element, so it must
+	 * not be reused for another key until the epoch passes.
 	 */
-	if (elem != NULL)
-		ebpf_allocator_free(&hash_map->allocator, elem);
+	if (elem != NULL) {
+		ebpf_atomic_add32(&hash_map->count, -1);
+		hashtable_elem_reclaim(hash_map, elem);
+	}
 
 	return 0;
 }
 
+static void *
+hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	return hashtable_map_lookup_elem_common(map, key, map->key_size,
+						hash_map->hash);
+}
+
+static void
+hashtable_map_prefetch_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	hashtable_map_prefetch_elem_common(map, key, map->key_size,
+					   hash_map->hash);
+}
+
+static int
+hashtable_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
+				    void *value)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	return hashtable_map_lookup_elem_from_user_common(
+	    map, key, value, map->key_size, hash_map->hash);
+}
+
+static int
+hashtable_map_update_elem(struct ebpf_map *map, void *key, void *value,
+			  uint64_t flags)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	return hashtable_map_update_elem_common(map, key, value, flags,
+						map->key_size, hash_map->hash);
+}
+
+static int
+hashtable_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	return hashtable_map_delete_elem_common(map, key, map->key_size,
+						hash_map->hash);
+}
+
 static int
 hashtable_map_get_next_key(struct ebpf_map *map, void *key, void *next_key)
 {
@@ -513,9 +1019,9 @@ hashtable_map_get_next_key(struct ebpf_map *map, void *key, void *next_key)
 	if (key == NULL)
 		goto get_first_key;
 
-	hash = ebpf_jenkins_hash(key, map->key_size, 0);
+	hash = hashtable_hash(map, key);
 	bucket = get_hash_bucket(hash_map, hash);
-	elem = get_hash_elem(bucket, key, map->key_size);
+	elem = get_hash_elem(bucket, key, map->key_size, hash);
 	if (elem == NULL)
 		goto get_first_key;
 
@@ -525,7 +1031,7 @@ hashtable_map_get_next_key(struct ebpf_map *map, void *key, void *next_key)
 		return 0;
 	}
 
-	i = (hash & (hash_map->nbuckets - 1)) + 1;
+	i = (elem->hash & (hash_map->nbuckets - 1)) + 1;
 
 get_first_key:
 	for (; i < hash_map->nbuckets; i++) {
@@ -540,6 +1046,846 @@ get_first_key:
 	return ENOENT;
 }
 
+static struct lru_elem *
+lru_local_pop(struct lru_local *local)
+{
+	struct lru_elem *le;
+
+	ebpf_spinmtx_lock(&local->lock);
+	le = local->free;
+	if (le != NULL)
+		local->free = le->free_next;
+	ebpf_spinmtx_unlock(&local->lock);
+
+	return le;
+}
+
+static void
+lru_local_push(struct lru_local *local, struct lru_elem *list)
+{
+	struct lru_elem *next;
+
+	ebpf_spinmtx_lock(&local->lock);
+	while (list != NULL) {
+		next = list->free_next;
+		list->free_next = local->free;
+		local->free = list;
+		list = next;
+	}
+	ebpf_spinmtx_unlock(&local->lock);
+}
+
+/*
+ * CLOCK sweep over all elements. Must be called with lru->lock
+ * held. Referenced elements get their bit cleared and second
+ * chance, unreferenced ones are unlinked from their bucket and
+ * chained to *listp. Two rounds are enough to find a victim as
+ * long as there is any element linked to the buckets.
+ */
+static uint32_t
+lru_evict(struct ebpf_map_hashtable *hash_map, struct lru_elem **listp,
+	  uint32_t n)
+{
+	struct hash_lru *lru = hash_map->lru;
+	struct hash_bucket *bucket;
+	struct lru_elem *le;
+	uint32_t evicted = 0;
+
+	for (uint32_t i = 0; i < lru->nelems * 2 && evicted < n; i++) {
+		le = LRU_ELEM(lru, lru->hand);
+		if (++lru->hand == lru->nelems)
+			lru->hand = 0;
+
+		if (!le->in_use)
+			continue;
+
+		if (le->ref) {
+			le->ref = 0;
+			continue;
+		}
+
+		bucket = get_hash_bucket(hash_map, le->he.hash);
+
+		HASH_BUCKET_LOCK(bucket);
+
+		/*
+		 * Element may be deleted and reused for another key
+		 * since we read its hash. Only the bucket which it
+		 * currently belongs to is allowed to unlink it.
+		 */
+		if (le->in_use && get_hash_bucket(hash_map, le->he.hash) == bucket) {
+			EBPF_EPOCH_LIST_REMOVE(&le->he, elem);
+			le->in_use = 0;
+			le->free_next = *listp;
+			*listp = le;
+			ebpf_atomic_add32(&hash_map->count, -1);
+			evicted++;
+		}
+
+		HASH_BUCKET_UNLOCK(bucket);
+	}
+
+	return evicted;
+}
+
+/*
+ * Evicts a batch of elements to make room for the new key. They are
+ * reclaimed like the deleted ones, since readers may still see them.
+ */
+static void
+lru_make_room(struct ebpf_map_hashtable *hash_map)
+{
+	struct hash_lru *lru = hash_map->lru;
+	struct lru_elem *le, *next, *list = NULL;
+
+	ebpf_spinmtx_lock(&lru->lock);
+	lru_evict(hash_map, &list, LRU_LOCAL_BATCH);
+	ebpf_spinmtx_unlock(&lru->lock);
+
+	for (le = list; le != NULL; le = next) {
+		next = le->free_next;
+		hashtable_elem_reclaim(hash_map, &le->he);
+	}
+}
+
+/*
+ * Takes a free element. The keys are evicted once the map reaches
+ * max_entries, so the spare elements are either free or waiting for
+ * the epoch. Returns EAGAIN when all of them are waiting.
+ */
+static int
+lru_alloc(struct ebpf_map_hashtable *hash_map, struct lru_elem **lep)
+{
+	struct hash_lru *lru = hash_map->lru;
+	struct lru_local *local = lru->locals + ebpf_curcpu();
+	struct lru_elem *le, *list = NULL;
+	uint32_t n = 0;
+
+	*lep = lru_local_pop(local);
+	if (*lep != NULL)
+		return 0;
+
+	/*
+	 * Local free list is empty. Refill it with a batch from
+	 * global free list.
+	 */
+	ebpf_spinmtx_lock(&lru->lock);
+	while (lru->free != NULL && n < LRU_LOCAL_BATCH) {
+		le = lru->free;
+		lru->free = le->free_next;
+		le->free_next = list;
+		list = le;
+		n++;
+	}
+	ebpf_spinmtx_unlock(&lru->lock);
+
+	if (n != 0) {
+		*lep = list;
+		lru_local_push(local, list->free_next);
+		return 0;
+	}
+
+	/*
+	 * All free elements are sitting on the local free lists of
+	 * other CPUs. Steal one of them.
+	 */
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+		*lep = lru_local_pop(lru->locals + i);
+		if (*lep != NULL)
+			return 0;
+	}
+
+	hashtable_reclaim_flush(hash_map);
+
+	return EAGAIN;
+}
+
+static void
+lru_free(struct ebpf_map_hashtable *hash_map, struct lru_elem *le)
+{
+	le->free_next = NULL;
+	lru_local_push(hash_map->lru->locals + ebpf_curcpu(), le);
+}
+
+static int
+lru_hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
+{
+	int error;
+	struct hash_lru *lru;
+	struct lru_elem *le;
+
+	/* Check overflow */
+	if (ebpf_roundup(attr->key_size, 8) + ebpf_roundup(attr->value_size, 8) +
+		sizeof(struct lru_elem) >
+	    UINT32_MAX) {
+		return E2BIG;
+	}
+
+	/* Elements are always replaced, and never unlinked lock-free */
+	if (attr->flags & (EBPF_MAP_F_INPLACE | EBPF_MAP_F_LOCKFREE))
+		return EINVAL;
+
+	if (attr->max_entries >
+	    UINT32_MAX - hashtable_reclaim_reserve(attr->max_entries))
+		return E2BIG;
+
+	struct ebpf_map_hashtable *hash_map = ebpf_calloc(1, sizeof(*hash_map));
+	if (hash_map == NULL)
+		return ENOMEM;
+
+	error = ebpf_hash_select(EBPF_MAP_F_HASH_TYPE(attr->flags),
+				 &hash_map->hash);
+	if (error != 0)
+		goto err0;
+
+	hash_map->key_size = ebpf_roundup(attr->key_size, 8);
+	hash_map->value_size = ebpf_roundup(attr->value_size, 8);
+	hash_map->elem_size = hash_map->key_size + hash_map->value_size +
+			      sizeof(struct lru_elem);
+
+	error = hashtable_buckets_init(hash_map, attr->max_entries);
+	if (error != 0)
+		goto err0;
+
+	lru = ebpf_calloc(1, sizeof(*lru));
+	if (lru == NULL) {
+		error = ENOMEM;
+		goto err1;
+	}
+
+	/* Spare elements for the ones waiting for the epoch */
+	lru->nelems = attr->max_entries +
+		      hashtable_reclaim_reserve(attr->max_entries);
+	lru->elem_size = hash_map->elem_size;
+
+	/*
+	 * All elements are allocated at once, so that clock hand
+	 * can walk through them by index.
+	 */
+	lru->elems = ebpf_calloc(lru->nelems, lru->elem_size);
+	if (lru->elems == NULL) {
+		error = ENOMEM;
+		goto err2;
+	}
+
+	lru->locals = ebpf_calloc(ebpf_ncpus(), sizeof(struct lru_local));
+	if (lru->locals == NULL) {
+		error = ENOMEM;
+		goto err3;
+	}
+
+	error = hashtable_reclaim_init(hash_map);
+	if (error != 0)
+		goto err4;
+
+	ebpf_spinmtx_init(&lru->lock, "ebpf_lru_hashtable_map lock");
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++)
+		ebpf_spinmtx_init(&lru->locals[i].lock,
+			      "ebpf_lru_hashtable_map local lock");
+
+	for (uint32_t i = lru->nelems; i > 0; i--) {
+		le = LRU_ELEM(lru, i - 1);
+		le->free_next = lru->free;
+		lru->free = le;
+	}
+
+	hash_map->lru = lru;
+	map->data = hash_map;
+
+	return 0;
+
+err4:
+	ebpf_free(lru->locals);
+err3:
+	ebpf_free(lru->elems);
+err2:
+	ebpf_free(lru);
+err1:
+	hashtable_buckets_deinit(hash_map);
+err0:
+	ebpf_free(hash_map);
+	return error;
+}
+
+static void
+lru_hashtable_map_deinit(struct ebpf_map *map)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	struct hash_lru *lru = hash_map->lru;
+
+	/*
+	 * Wait for current readers
+	 */
+	ebpf_epoch_wait();
+	hashtable_reclaim_drain(hash_map);
+	hashtable_reclaim_deinit(hash_map);
+
+	for (uint16_t i = 0; i < ebpf_ncpus(); i++)
+		ebpf_spinmtx_destroy(&lru->locals[i].lock);
+	ebpf_spinmtx_destroy(&lru->lock);
+
+	ebpf_free(lru->locals);
+	ebpf_free(lru->elems);
+	ebpf_free(lru);
+
+	hashtable_buckets_deinit(hash_map);
+	ebpf_free(hash_map);
+}
+
+static void *
+lru_hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = hashtable_hash(map, key);
+	struct ebpf_map_hashtable *hash_map;
+	struct hash_bucket *bucket;
+	struct hash_elem *elem;
+	struct lru_elem *le;
+
+	hash_map = map->data;
+	bucket = get_hash_bucket(hash_map, hash);
+	elem = get_hash_elem(bucket, key, map->key_size, hash);
+	if (elem == NULL)
+		return NULL;
+
+	/*
+	 * Only write the reference bit when it is cleared. This
+	 * keeps the cacheline shared among readers of hot elements.
+	 */
+	le = ebpf_container_of(elem, struct lru_elem, he);
+	if (!le->ref)
+		le->ref = 1;
+
+	return HASH_ELEM_VALUE(hash_map, elem);
+}
+
+static int
+lru_hashtable_map_update_elem(struct ebpf_map *map, void *key, void *value,
+			      uint64_t flags)
+{
+	int error = 0;
+	uint32_t hash = hashtable_hash(map, key);
+	struct hash_bucket *bucket;
+	struct hash_elem *old_elem;
+	struct lru_elem *old_le = NULL, *new_le;
+	struct ebpf_map_hashtable *hash_map = map->data;
+
+	error = lru_alloc(hash_map, &new_le);
+	if (error != 0)
+		return error;
+
+	new_le->he.hash = hash;
+	new_le->ref = 0;
+	memcpy(new_le->he.key, key, map->key_size);
+	memcpy(HASH_ELEM_VALUE(hash_map, &new_le->he), value, map->value_size);
+
+	bucket = get_hash_bucket(hash_map, hash);
+
+retry:
+	HASH_BUCKET_LOCK(bucket);
+
+	old_elem = get_hash_elem(bucket, key, map->key_size, hash);
+	error = check_update_flags(hash_map, old_elem, flags);
+	if (error != 0) {
+		HASH_BUCKET_UNLOCK(bucket);
+		lru_free(hash_map, new_le);
+		return error;
+	}
+
+	/*
+	 * Evict before the new key exceeds max_entries. Eviction takes
+	 * the lock of other buckets, so drop ours first.
+	 */
+	if (old_elem == NULL &&
+	    ebpf_atomic_fetch_add32(&hash_map->count, 1) >= map->max_entries) {
+		ebpf_atomic_add32(&hash_map->count, -1);
+		HASH_BUCKET_UNLOCK(bucket);
+		lru_make_room(hash_map);
+		goto retry;
+	}
+
+	new_le->in_use = 1;
+	EBPF_EPOCH_LIST_INSERT_HEAD(&bucket->head, &new_le->he, elem);
+	if (old_elem != NULL) {
+		EBPF_EPOCH_LIST_REMOVE(old_elem, elem);
+		old_le = ebpf_container_of(old_elem, struct lru_elem, he);
+		old_le->in_use = 0;
+	}
+
+	HASH_BUCKET_UNLOCK(bucket);
+
+	if (old_le != NULL)
+		hashtable_elem_reclaim(hash_map, &old_le->he);
+
+	return 0;
+}
+
+static int
+lru_hashtable_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = hashtable_hash(map, key);
+	struct ebpf_map_hashtable *hash_map = map->data;
+	struct hash_bucket *bucket;
+	struct hash_elem *elem;
+	struct lru_elem *le = NULL;
+
+	bucket = get_hash_bucket(hash_map, hash);
+
+	HASH_BUCKET_LOCK(bucket);
+
+	elem = get_hash_elem(bucket, key, map->key_size, hash);
+	if (elem != NULL) {
+		EBPF_EPOCH_LIST_REMOVE(elem, elem);
+		le = ebpf_container_of(elem, struct lru_elem, he);
+		le->in_use = 0;
+		ebpf_atomic_add32(&hash_map->count, -1);
+	}
+
+	HASH_BUCKET_UNLOCK(bucket);
+
+	if (le != NULL)
+		hashtable_elem_reclaim(hash_map, &le->he);
+
+	return 0;
+}
+
+#define HASH_LF_MARKED(_lep) (((uintptr_t)(_lep) & 1) != 0)
+#define HASH_LF_MARK(_lep) ((struct hash_lf_elem *)((uintptr_t)(_lep) | 1))
+#define HASH_LF_UNMARK(_lep)                                                   \
+	((struct hash_lf_elem *)((uintptr_t)(_lep) & ~(uintptr_t)1))
+
+static struct hash_lf_elem **
+hashtable_lf_get_bucket(struct ebpf_map_hashtable *hash_map, uint32_t hash)
+{
+	return &hash_map->lf_buckets[hash & (hash_map->nbuckets - 1)];
+}
+
+/*
+ * Returns the element which is not logically deleted and has the key.
+ * Doesn't modify the list, so it's usable from readers.
+ */
+static struct hash_lf_elem *
+hashtable_lf_find(struct hash_lf_elem **head, void *key, uint32_t key_size,
+		  uint32_t hash)
+{
+	struct hash_lf_elem *le, *next;
+
+	for (le = ebpf_atomic_load_ptr(head); le != NULL;
+	     le = HASH_LF_UNMARK(next)) {
+		next = ebpf_atomic_load_ptr(&le->next);
+		if (!HASH_LF_MARKED(next) && le->he.hash == hash &&
+		    hash_key_equal(le->he.key, key, key_size))
+			return le;
+	}
+
+	return NULL;
+}
+
+/*
+ * Logically deletes (marks) every element which has the key in the
+ * list starting from *startp, and unlinks them. Also unlinks marked
+ * elements left by other writers on the way. The element is returned
+ * to the allocator after the epoch by the writer which succeeded to
+ * unlink it. Returns the number of the elements marked by this call.
+ */
+static uint32_t
+hashtable_lf_remove(struct ebpf_map_hashtable *hash_map,
+		    struct hash_lf_elem **startp, void *key, uint32_t key_size,
+		    uint32_t hash)
+{
+	struct hash_lf_elem **prevp, *le, *next;
+	uint32_t nmarked = 0;
+
+retry:
+	prevp = startp;
+	le = ebpf_atomic_load_ptr(prevp);
+
+	/*
+	 * The element which owns startp was deleted. Whoever deleted
+	 * it takes care of the rest of the list.
+	 */
+	if (HASH_LF_MARKED(le))
+		return nmarked;
+
+	while (le != NULL) {
+		next = ebpf_atomic_load_ptr(&le->next);
+
+		if (!HASH_LF_MARKED(next)) {
+			if (le->he.hash != hash ||
+			    !hash_key_equal(le->he.key, key, key_size)) {
+				prevp = &le->next;
+				le = next;
+				continue;
+			}
+
+			if (!ebpf_atomic_cas_ptr(&le->next, next,
+						 HASH_LF_MARK(next)))
+				continue;
+
+			nmarked++;
+		}
+
+		next = HASH_LF_UNMARK(next);
+		if (!ebpf_atomic_cas_ptr(prevp, le, next))
+			goto retry;
+
+		hashtable_elem_reclaim(hash_map, &le->he);
+		le = next;
+	}
+
+	return nmarked;
+}
+
+static void
+hashtable_lf_map_deinit(struct ebpf_map *map)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	struct hash_lf_elem *le, *next;
+
+	/*
+	 * Wait for current readers. Elements which are still linked
+	 * haven't been passed to the reclamation, even if they are
+	 * marked.
+	 */
+	ebpf_epoch_wait();
+	hashtable_reclaim_drain(hash_map);
+
+	for (uint32_t i = 0; i < hash_map->nbuckets; i++) {
+		for (le = hash_map->lf_buckets[i]; le != NULL; le = next) {
+			next = HASH_LF_UNMARK(le->next);
+			ebpf_allocator_free(&hash_map->allocator, le);
+		}
+	}
+
+	ebpf_allocator_deinit(&hash_map->allocator, NULL, NULL);
+	hashtable_reclaim_deinit(hash_map);
+	ebpf_free(hash_map->lf_buckets);
+	ebpf_free(hash_map);
+}
+
+static void *
+hashtable_lf_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	uint32_t hash = hash_map->hash(key, map->key_size);
+	struct hash_lf_elem *le;
+
+	le = hashtable_lf_find(hashtable_lf_get_bucket(hash_map, hash), key,
+			       map->key_size, hash);
+	if (le == NULL)
+		return NULL;
+
+	return HASH_ELEM_VALUE(hash_map, &le->he);
+}
+
+static void
+hashtable_lf_map_prefetch_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	uint32_t hash = hash_map->hash(key, map->key_size);
+	ebpf_prefetch(hashtable_lf_get_bucket(hash_map, hash));
+}
+
+static int
+hashtable_lf_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
+				       void *value)
+{
+	void *v = hashtable_lf_map_lookup_elem(map, key);
+	if (v == NULL)
+		return ENOENT;
+
+	memcpy(value, v, map->value_size);
+
+	return 0;
+}
+
+/*
+ * The new element is always inserted to the head of the bucket and
+ * the elements which have the same key behind it are removed after
+ * that. So the key never disappears during the replacement and the
+ * last inserted element wins when the writers of the same key race.
+ */
+static int
+hashtable_lf_map_update_elem(struct ebpf_map *map, void *key, void *value,
+			     uint64_t flags)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	uint32_t hash = hash_map->hash(key, map->key_size);
+	struct hash_lf_elem **head, *old, *le, *first;
+	uint32_t nmarked;
+	int32_t delta;
+
+	head = hashtable_lf_get_bucket(hash_map, hash);
+
+	old = hashtable_lf_find(head, key, map->key_size, hash);
+	if (old != NULL && flags == EBPF_NOEXIST)
+		return EEXIST;
+	if (old == NULL && flags == EBPF_EXIST)
+		return ENOENT;
+
+	/*
+	 * Reserve the room for the new key. Replacement doesn't
+	 * change the number of the elements, so the counter is not
+	 * touched in the common case.
+	 */
+	if (old == NULL &&
+	    ebpf_atomic_fetch_add32(&hash_map->count, 1) >=
+		map->max_entries) {
+		ebpf_atomic_add32(&hash_map->count, -1);
+		return EBUSY;
+	}
+
+	/* All spare elements may be waiting for the epoch */
+	le = ebpf_allocator_alloc(&hash_map->allocator);
+	if (le == NULL) {
+		if (old == NULL)
+			ebpf_atomic_add32(&hash_map->count, -1);
+		hashtable_reclaim_flush(hash_map);
+		return EAGAIN;
+	}
+
+	le->he.hash = hash;
+	memcpy(le->he.key, key, map->key_size);
+	memcpy(HASH_ELEM_VALUE(hash_map, &le->he), value, map->value_size);
+
+	do {
+		first = ebpf_atomic_load_ptr(head);
+		le->next = first;
+		ebpf_fence_store();
+	} while (!ebpf_atomic_cas_ptr(head, first, le));
+
+	nmarked = hashtable_lf_remove(hash_map, &le->next, key, map->key_size,
+				      hash);
+
+	delta = 1 - (old == NULL) - (int32_t)nmarked;
+	if (delta != 0)
+		ebpf_atomic_add32(&hash_map->count, delta);
+
+	return 0;
+}
+
+static int
+hashtable_lf_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	uint32_t hash = hash_map->hash(key, map->key_size);
+	uint32_t nmarked;
+
+	nmarked = hashtable_lf_remove(hash_map,
+				      hashtable_lf_get_bucket(hash_map, hash),
+				      key, map->key_size, hash);
+	if (nmarked != 0)
+		ebpf_atomic_add32(&hash_map->count, -nmarked);
+
+	return 0;
+}
+
+static int
+hashtable_lf_map_get_next_key(struct ebpf_map *map, void *key,
+			      void *next_key)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	struct hash_lf_elem *le, *next;
+	uint32_t hash, i = 0;
+
+	if (key == NULL)
+		goto get_first_key;
+
+	hash = hash_map->hash(key, map->key_size);
+	le = hashtable_lf_find(hashtable_lf_get_bucket(hash_map, hash), key,
+			       map->key_size, hash);
+	if (le == NULL)
+		goto get_first_key;
+
+	for (le = HASH_LF_UNMARK(ebpf_atomic_load_ptr(&le->next)); le != NULL;
+	     le = HASH_LF_UNMARK(next)) {
+		next = ebpf_atomic_load_ptr(&le->next);
+		if (!HASH_LF_MARKED(next)) {
+			memcpy(next_key, le->he.key, map->key_size);
+			return 0;
+		}
+	}
+
+	i = (hash & (hash_map->nbuckets - 1)) + 1;
+
+get_first_key:
+	for (; i < hash_map->nbuckets; i++) {
+		for (le = ebpf_atomic_load_ptr(&hash_map->lf_buckets[i]);
+		     le != NULL; le = HASH_LF_UNMARK(next)) {
+			next = ebpf_atomic_load_ptr(&le->next);
+			if (!HASH_LF_MARKED(next)) {
+				memcpy(next_key, le->he.key, map->key_size);
+				return 0;
+			}
+		}
+	}
+
+	return ENOENT;
+}
+
+static const struct ebpf_map_ops hashtable_lf_ops = {
+	.init = hashtable_map_init,
+	.update_elem = hashtable_lf_map_update_elem,
+	.lookup_elem = hashtable_lf_map_lookup_elem,
+	.delete_elem = hashtable_lf_map_delete_elem,
+	.update_elem_from_user = hashtable_lf_map_update_elem,
+	.lookup_elem_from_user = hashtable_lf_map_lookup_elem_from_user,
+	.delete_elem_from_user = hashtable_lf_map_delete_elem,
+	.get_next_key_from_user = hashtable_lf_map_get_next_key,
+	.deinit = hashtable_lf_map_deinit,
+	.prefetch_elem = hashtable_lf_map_prefetch_elem
+};
+
+/*
+ * Elements come from the preallocated allocator as in the locked mode.
+ * Its per-CPU magazines keep the writers off the shared lock, and the
+ * unlinked elements return to it after the epoch through the same
+ * reclaim batches.
+ */
+static int
+hashtable_lf_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
+{
+	struct ebpf_map_hashtable *hash_map = map->data;
+	int error;
+
+	hash_map->key_size = ebpf_roundup(attr->key_size, 8);
+	hash_map->value_size = ebpf_roundup(attr->value_size, 8);
+	hash_map->elem_size = hash_map->key_size + hash_map->value_size +
+			      sizeof(struct hash_lf_elem);
+	hash_map->nbuckets = ebpf_roundup_pow_of_two(attr->max_entries);
+
+	if (attr->max_entries >
+	    UINT32_MAX - hashtable_reclaim_reserve(attr->max_entries))
+		return E2BIG;
+
+	hash_map->lf_buckets =
+	    ebpf_calloc(hash_map->nbuckets, sizeof(struct hash_lf_elem *));
+	if (hash_map->lf_buckets == NULL)
+		return ENOMEM;
+
+	error = hashtable_reclaim_init(hash_map);
+	if (error != 0)
+		goto err0;
+
+	error = ebpf_allocator_init(
+	    &hash_map->allocator, hash_map->elem_size,
+	    attr->max_entries + hashtable_reclaim_reserve(attr->max_entries),
+	    NULL, NULL, NULL);
+	if (error != 0)
+		goto err1;
+
+	map->ops = &hashtable_lf_ops;
+
+	return 0;
+
+err1:
+	hashtable_reclaim_deinit(hash_map);
+err0:
+	ebpf_free(hash_map->lf_buckets);
+	hash_map->lf_buckets = NULL;
+	return error;
+}
+
+/*
+ * Operations of the (non-percpu) hashtable specialized for the
+ * common key sizes and each hash function. With the constant key
+ * size, the hash function is inlined and unrolled, and the key is
+ * compared and copied word-wise.
+ */
+#define HASHTABLE_FIXED_KEY_OPS(_name, _hash_type, _hash_fn, _key_size)        \
+	static void *hashtable_map_lookup_elem_##_name(struct ebpf_map *map,   \
+						       void *key)              \
+	{                                                                      \
+		return hashtable_map_lookup_elem_common(map, key, _key_size,   \
+							_hash_fn);             \
+	}                                                                      \
+	static void hashtable_map_prefetch_elem_##_name(struct ebpf_map *map,  \
+							void *key)             \
+	{                                                                      \
+		hashtable_map_prefetch_elem_common(map, key, _key_size,        \
+						   _hash_fn);                  \
+	}                                                                      \
+	static int hashtable_map_lookup_elem_from_user_##_name(                \
+	    struct ebpf_map *map, void *key, void *value)                      \
+	{                                                                      \
+		return hashtable_map_lookup_elem_from_user_common(             \
+		    map, key, value, _key_size, _hash_fn);                     \
+	}                                                                      \
+	static int hashtable_map_update_elem_##_name(                          \
+	    struct ebpf_map *map, void *key, void *value, uint64_t flags)      \
+	{                                                                      \
+		return hashtable_map_update_elem_common(map, key, value,       \
+							flags, _key_size,      \
+							_hash_fn);             \
+	}                                                                      \
+	static int hashtable_map_delete_elem_##_name(struct ebpf_map *map,     \
+						     void *key)                \
+	{                                                                      \
+		return hashtable_map_delete_elem_common(map, key, _key_size,   \
+							_hash_fn);             \
+	}                                                                      \
+	static const struct ebpf_map_ops hashtable_ops_##_name = {             \
+	    .init = hashtable_map_init,                                        \
+	    .update_elem = hashtable_map_update_elem_##_name,                  \
+	    .lookup_elem = hashtable_map_lookup_elem_##_name,                  \
+	    .delete_elem = hashtable_map_delete_elem_##_name,                  \
+	    .update_elem_from_user = hashtable_map_update_elem_##_name,        \
+	    .lookup_elem_from_user =                                           \
+		hashtable_map_lookup_elem_from_user_##_name,                   \
+	    .delete_elem_from_user = hashtable_map_delete_elem_##_name,        \
+	    .get_next_key_from_user = hashtable_map_get_next_key,              \
+	    .deinit = hashtable_map_deinit,                                    \
+	    .prefetch_elem = hashtable_map_prefetch_elem_##_name};
+
+#define HASHTABLE_FIXED_KEY_SIZES(_f, _hname, _hash_type, _hash_fn)            \
+	_f(_hname##_4, _hash_type, _hash_fn, 4)                                \
+	_f(_hname##_8, _hash_type, _hash_fn, 8)                                \
+	_f(_hname##_16, _hash_type, _hash_fn, 16)                              \
+	_f(_hname##_40, _hash_type, _hash_fn, 40)
+
+#ifdef EBPF_HASH_HAVE_CRC32C
+#define HASHTABLE_FIXED_KEYS_CRC32C(_f)                                        \
+	HASHTABLE_FIXED_KEY_SIZES(_f, crc32c, EBPF_MAP_HASH_CRC32C,            \
+				  ebpf_hash_crc32c)
+#else
+#define HASHTABLE_FIXED_KEYS_CRC32C(_f)
+#endif
+
+#define HASHTABLE_FIXED_KEYS(_f)                                               \
+	HASHTABLE_FIXED_KEY_SIZES(_f, jhash, EBPF_MAP_HASH_JHASH,              \
+				  ebpf_hash_jhash)                             \
+	HASHTABLE_FIXED_KEY_SIZES(_f, xxh64, EBPF_MAP_HASH_XXH64,              \
+				  ebpf_hash_xxh64)                             \
+	HASHTABLE_FIXED_KEY_SIZES(_f, wyhash, EBPF_MAP_HASH_WYHASH,            \
+				  ebpf_hash_wyhash)                            \
+	HASHTABLE_FIXED_KEYS_CRC32C(_f)
+
+HASHTABLE_FIXED_KEYS(HASHTABLE_FIXED_KEY_OPS)
+
+static const struct hashtable_fixed_key {
+	uint32_t hash_type;
+	uint32_t key_size;
+	const struct ebpf_map_ops *ops;
+} hashtable_fixed_keys[] = {
+#define HASHTABLE_FIXED_KEY_ENTRY(_name, _hash_type, _hash_fn, _key_size)      \
+	{_hash_type, _key_size, &hashtable_ops_##_name},
+    HASHTABLE_FIXED_KEYS(HASHTABLE_FIXED_KEY_ENTRY)
+#undef HASHTABLE_FIXED_KEY_ENTRY
+};
+
+static const struct ebpf_map_ops *
+hashtable_fixed_key_ops(uint32_t hash_type, uint32_t key_size)
+{
+	for (uint32_t i = 0; i < sizeof(hashtable_fixed_keys) /
+				     sizeof(hashtable_fixed_keys[0]);
+	     i++) {
+		if (hashtable_fixed_keys[i].hash_type == hash_type &&
+		    hashtable_fixed_keys[i].key_size == key_size)
+			return hashtable_fixed_keys[i].ops;
+	}
+
+	return NULL;
+}
+
 const struct ebpf_map_type emt_hashtable = {
 	.name = "hashtable",
 	.ops = {
@@ -551,7 +1897,8 @@ const struct ebpf_map_type emt_hashtable = {
 		.lookup_elem_from_user = hashtable_map_lookup_elem_from_user,
 		.delete_elem_from_user = hashtable_map_delete_elem,
 		.get_next_key_from_user = hashtable_map_get_next_key,
-		.deinit = hashtable_map_deinit
+		.deinit = hashtable_map_deinit,
+		.prefetch_elem = hashtable_map_prefetch_elem
 	}
 };
 
@@ -566,6 +1913,32 @@ const struct ebpf_map_type emt_percpu_hashtable = {
 		.lookup_elem_from_user = hashtable_map_lookup_elem_percpu_from_user,
 		.delete_elem_from_user = hashtable_map_delete_elem,
 		.get_next_key_from_user = hashtable_map_get_next_key,
-		.deinit = hashtable_map_deinit
+		.deinit = hashtable_map_deinit,
+		.prefetch_elem = hashtable_map_prefetch_elem,
+		.percpu_add_elem = hashtable_map_percpu_add_elem
+	}
+};
+
+/*
+ * The LRU hashtable evicts the least recently used keys once it has
+ * max_entries keys. The deleted, replaced and evicted elements are
+ * reused after the epoch like the ones of emt_hashtable, so the value
+ * pointer returned by lookup_elem stays valid for the reader. The map
+ * has spare elements for the ones waiting for the epoch, and the
+ * update returns EAGAIN only when all of them are still waiting.
+ */
+const struct ebpf_map_type emt_lru_hashtable = {
+	.name = "lru_hashtable",
+	.ops = {
+		.init = lru_hashtable_map_init,
+		.update_elem = lru_hashtable_map_update_elem,
+		.lookup_elem = lru_hashtable_map_lookup_elem,
+		.delete_elem = lru_hashtable_map_delete_elem,
+		.update_elem_from_user = lru_hashtable_map_update_elem,
+		.lookup_elem_from_user = hashtable_map_lookup_elem_from_user,
+		.delete_elem_from_user = lru_hashtable_map_delete_elem,
+		.get_next_key_from_user = hashtable_map_get_next_key,
+		.deinit = lru_hashtable_map_deinit,
+		.prefetch_elem = hashtable_map_prefetch_elem
 	}
 };
@@ -0,0 +1,527 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ebpf_map.h"
+#include "ebpf_util.h"
+
+/*
+ * Longest prefix match map. This is a path-compressed binary trie.
+ * Each node holds a prefix of arbitrary length and the children are
+ * selected by the first bit after it, so the number of nodes visited
+ * on lookup is bounded by the number of prefixes on the path instead
+ * of the address width.
+ *
+ * Readers walk the trie without any lock under the epoch. Writers
+ * serialize with the map lock, publish new nodes with
+ * EBPF_EPOCH_ASSIGN and free unlinked nodes after the epoch. Nodes
+ * are never modified after they are published, except for marking
+ * the node intermediate on delete.
+ */
+
+#define LPM_DATA_SIZE_MAX 16 /* IPv6 */
+#define LPM_NODE_F_INTERMEDIATE 0x1
+
+struct lpm_node {
+	struct lpm_node *child[2];
+	ebpf_epoch_context ec;
+	uint32_t prefixlen;
+	uint32_t flags;
+	uint8_t data[0];
+	/* uint8_t value[value_size]; Not for intermediate node */
+};
+
+struct ebpf_map_lpm_trie {
+	struct lpm_node *root;
+	ebpf_spinmtx lock;
+	uint32_t data_size;
+	uint32_t max_prefixlen;
+	uint32_t nentries;
+};
+
+#define LPM_NODE_VALUE(_triep, _nodep)                                         \
+	((_nodep)->data + ebpf_roundup((_triep)->data_size, 8))
+
+static inline uint32_t
+extract_bit(const uint8_t *data, uint32_t index)
+{
+	return !!(data[index / 8] & (1 << (7 - (index % 8))));
+}
+
+/*
+ * Returns the number of leading bits which node and key have in
+ * common, up to the shorter one of their prefixes.
+ */
+static uint32_t
+longest_prefix_match(struct ebpf_map_lpm_trie *trie, struct lpm_node *node,
+		     struct ebpf_lpm_trie_key *key)
+{
+	uint32_t limit = ebpf_min(node->prefixlen, key->prefixlen);
+	uint32_t prefixlen = 0;
+	uint8_t diff;
+
+	for (uint32_t i = 0; i < trie->data_size && prefixlen < limit; i++) {
+		diff = node->data[i] ^ key->data[i];
+		if (diff != 0) {
+			prefixlen += __builtin_clz(diff) - 24;
+			break;
+		}
+		prefixlen += 8;
+	}
+
+	return ebpf_min(prefixlen, limit);
+}
+
+static struct lpm_node *
+lpm_node_alloc(struct ebpf_map *map, const uint8_t *data, uint32_t prefixlen,
+	       void *value)
+{
+	struct ebpf_map_lpm_trie *trie = map->data;
+	struct lpm_node *node;
+	size_t size = sizeof(*node) + ebpf_roundup(trie->data_size, 8);
+
+	if (value != NULL)
+		size += map->value_size;
+
+	node = ebpf_malloc(size);
+	if (node == NULL)
+		return NULL;
+
+	node->child[0] = NULL;
+	node->child[1] = NULL;
+	node->prefixlen = prefixlen;
+	node->flags = value == NULL ? LPM_NODE_F_INTERMEDIATE : 0;
+	memcpy(node->data, data, trie->data_size);
+	if (value != NULL)
+		memcpy(LPM_NODE_VALUE(trie, node), value, map->value_size);
+
+	return node;
+}
+
+static void
+lpm_node_free_cb(ebpf_epoch_context *ec)
+{
+	ebpf_free(ebpf_container_of(ec, struct lpm_node, ec));
+}
+
+static void
+lpm_node_free_deferred(struct lpm_node *node)
+{
+	ebpf_epoch_call(&node->ec, lpm_node_free_cb);
+}
+
+static void
+lpm_node_free_all(struct lpm_node *node)
+{
+	if (node == NULL)
+		return;
+
+	lpm_node_free_all(node->child[0]);
+	lpm_node_free_all(node->child[1]);
+	ebpf_free(node);
+}
+
+static int
+lpm_trie_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
+{
+	struct ebpf_map_lpm_trie *trie;
+
+	if (attr->key_size <= sizeof(struct ebpf_lpm_trie_key) ||
+	    attr->key_size >
+		sizeof(struct ebpf_lpm_trie_key) + LPM_DATA_SIZE_MAX)
+		return EINVAL;
+
+	/* Check overflow */
+	if (sizeof(struct lpm_node) + LPM_DATA_SIZE_MAX +
+		(uint64_t)attr->value_size >
+	    UINT32_MAX)
+		return E2BIG;
+
+	trie = ebpf_calloc(1, sizeof(*trie));
+	if (trie == NULL)
+		return ENOMEM;
+
+	trie->data_size = attr->key_size - sizeof(struct ebpf_lpm_trie_key);
+	trie->max_prefixlen = trie->data_size * 8;
+	ebpf_spinmtx_init(&trie->lock, "ebpf_lpm_trie_map lock");
+
+	map->percpu = false;
+	map->data = trie;
+
+	return 0;
+}
+
+static void
+lpm_trie_map_deinit(struct ebpf_map *map)
+{
+	struct ebpf_map_lpm_trie *trie = map->data;
+
+	/*
+	 * Wait for current readers
+	 */
+	ebpf_epoch_wait();
+
+	lpm_node_free_all(trie->root);
+	ebpf_spinmtx_destroy(&trie->lock);
+	ebpf_free(trie);
+}
+
+static void *
+lpm_trie_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_lpm_trie *trie = map->data;
+	struct ebpf_lpm_trie_key *k = key;
+	struct lpm_node *node, *found = NULL;
+	uint32_t matchlen;
+
+	if (k->prefixlen > trie->max_prefixlen)
+		return NULL;
+
+	node = EBPF_EPOCH_DEREF(trie->root);
+	while (node != NULL) {
+		matchlen = longest_prefix_match(trie, node, k);
+
+		/* Node's prefix doesn't cover the key. Stop here. */
+		if (matchlen < node->prefixlen)
+			break;
+
+		if (!(node->flags & LPM_NODE_F_INTERMEDIATE))
+			found = node;
+
+		if (matchlen == trie->max_prefixlen ||
+		    matchlen == k->prefixlen)
+			break;
+
+		node = EBPF_EPOCH_DEREF(
+		    node->child[extract_bit(k->data, node->prefixlen)]);
+	}
+
+	if (found == NULL)
+		return NULL;
+
+	return LPM_NODE_VALUE(trie, found);
+}
+
+static int
+lpm_trie_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
+				   void *value)
+{
+	void *v;
+
+	v = lpm_trie_map_lookup_elem(map, key);
+	if (v == NULL)
+		return ENOENT;
+
+	memcpy(value, v, map->value_size);
+
+	return 0;
+}
+
+static int
+lpm_trie_map_update_elem(struct ebpf_map *map, void *key, void *value,
+			 uint64_t flags)
+{
+	int error = 0;
+	struct ebpf_map_lpm_trie *trie = map->data;
+	struct ebpf_lpm_trie_key *k = key;
+	struct lpm_node *node, *new_node, *im_node, **slot;
+	uint32_t matchlen = 0;
+
+	if (flags >= __EBPF_MAP_UPDATE_FLAGS_MAX ||
+	    k->prefixlen > trie->max_prefixlen)
+		return EINVAL;
+
+	/*
+	 * Allocate nodes before taking lock. Intermediate node may
+	 * not be used, but at most one extra allocation per update
+	 * is cheaper than allocating under the spin lock.
+	 */
+	new_node = lpm_node_alloc(map, k->data, k->prefixlen, value);
+	if (new_node == NULL)
+		return ENOMEM;
+
+	im_node = ebpf_malloc(sizeof(*im_node) + ebpf_roundup(trie->data_size, 8));
+	if (im_node == NULL) {
+		ebpf_free(new_node);
+		return ENOMEM;
+	}
+
+	ebpf_spinmtx_lock(&trie->lock);
+
+	/*
+	 * Find the slot which the new node should be linked to.
+	 * Stops at the first node which doesn't fully cover the
+	 * key or has exactly the same prefix.
+	 */
+	slot = &trie->root;
+	while ((node = *slot) != NULL) {
+		matchlen = longest_prefix_match(trie, node, k);
+		if (node->prefixlen != matchlen ||
+		    node->prefixlen == k->prefixlen ||
+		    node->prefixlen == trie->max_prefixlen)
+			break;
+
+		slot = &node->child[extract_bit(k->data, node->prefixlen)];
+	}
+
+	if (node != NULL && node->prefixlen == matchlen &&
+	    node->prefixlen == k->prefixlen) {
+		/* Same prefix. Replace the node. */
+		if (node->flags & LPM_NODE_F_INTERMEDIATE) {
+			if (flags == EBPF_EXIST) {
+				error = ENOENT;
+				goto err0;
+			}
+			if (trie->nentries == map->max_entries) {
+				error = EBUSY;
+				goto err0;
+			}
+			trie->nentries++;
+		} else if (flags == EBPF_NOEXIST) {
+			error = EEXIST;
+			goto err0;
+		}
+
+		new_node->child[0] = node->child[0];
+		new_node->child[1] = node->child[1];
+		EBPF_EPOCH_ASSIGN(*slot, new_node);
+		ebpf_spinmtx_unlock(&trie->lock);
+
+		lpm_node_free_deferred(node);
+		ebpf_free(im_node);
+		return 0;
+	}
+
+	if (flags == EBPF_EXIST) {
+		error = ENOENT;
+		goto err0;
+	}
+
+	if (trie->nentries == map->max_entries) {
+		error = EBUSY;
+		goto err0;
+	}
+
+	if (node == NULL) {
+		/* Empty slot */
+		EBPF_EPOCH_ASSIGN(*slot, new_node);
+		ebpf_free(im_node);
+	} else if (matchlen == k->prefixlen) {
+		/* New node covers the existing node */
+		new_node->child[extract_bit(node->data, matchlen)] = node;
+		EBPF_EPOCH_ASSIGN(*slot, new_node);
+		ebpf_free(im_node);
+	} else {
+		/*
+		 * Prefixes diverge in the middle. Put intermediate
+		 * node which holds the common part.
+		 */
+		im_node->prefixlen = matchlen;
+		im_node->flags = LPM_NODE_F_INTERMEDIATE;
+		memcpy(im_node->data, node->data, trie->data_size);
+		if (extract_bit(k->data, matchlen)) {
+			im_node->child[0] = node;
+			im_node->child[1] = new_node;
+		} else {
+			im_node->child[0] = new_node;
+			im_node->child[1] = node;
+		}
+		EBPF_EPOCH_ASSIGN(*slot, im_node);
+	}
+
+	trie->nentries++;
+	ebpf_spinmtx_unlock(&trie->lock);
+
+	return 0;
+
+err0:
+	ebpf_spinmtx_unlock(&trie->lock);
+	ebpf_free(new_node);
+	ebpf_free(im_node);
+	return error;
+}
+
+static int
+lpm_trie_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_lpm_trie *trie = map->data;
+	struct ebpf_lpm_trie_key *k = key;
+	struct lpm_node *node, *parent = NULL;
+	struct lpm_node **slot, **parent_slot;
+	uint32_t matchlen = 0;
+
+	if (k->prefixlen > trie->max_prefixlen)
+		return EINVAL;
+
+	ebpf_spinmtx_lock(&trie->lock);
+
+	slot = parent_slot = &trie->root;
+	while ((node = *slot) != NULL) {
+		matchlen = longest_prefix_match(trie, node, k);
+		if (node->prefixlen != matchlen ||
+		    node->prefixlen == k->prefixlen)
+			break;
+
+		parent = node;
+		parent_slot = slot;
+		slot = &node->child[extract_bit(k->data, node->prefixlen)];
+	}
+
+	if (node == NULL || node->prefixlen != k->prefixlen ||
+	    node->prefixlen != matchlen ||
+	    (node->flags & LPM_NODE_F_INTERMEDIATE)) {
+		ebpf_spinmtx_unlock(&trie->lock);
+		return ENOENT;
+	}
+
+	trie->nentries--;
+
+	if (node->child[0] != NULL && node->child[1] != NULL) {
+		/*
+		 * Node with two children is still needed for the
+		 * structure. Just make it invisible from lookup.
+		 */
+		node->flags |= LPM_NODE_F_INTERMEDIATE;
+		ebpf_spinmtx_unlock(&trie->lock);
+		return 0;
+	}
+
+	if (parent != NULL && (parent->flags & LPM_NODE_F_INTERMEDIATE) &&
+	    node->child[0] == NULL && node->child[1] == NULL) {
+		/*
+		 * Intermediate parent becomes meaningless after
+		 * removing the leaf. Replace it with the sibling.
+		 */
+		EBPF_EPOCH_ASSIGN(*parent_slot,
+				  parent->child[parent->child[0] == node]);
+		ebpf_spinmtx_unlock(&trie->lock);
+
+		lpm_node_free_deferred(parent);
+		lpm_node_free_deferred(node);
+		return 0;
+	}
+
+	EBPF_EPOCH_ASSIGN(*slot, node->child[node->child[0] == NULL]);
+	ebpf_spinmtx_unlock(&trie->lock);
+
+	lpm_node_free_deferred(node);
+
+	return 0;
+}
+
+/*
+ * Iterates over the nodes in post-order, so that more specific
+ * prefixes come first.
+ */
+static int
+lpm_trie_map_get_next_key(struct ebpf_map *map, void *key, void *next_key)
+{
+	struct ebpf_map_lpm_trie *trie = map->data;
+	struct ebpf_lpm_trie_key *k = key, *nk = next_key;
+	struct lpm_node *node, *parent, *next_node = NULL, *search_root;
+	struct lpm_node **stack = NULL;
+	int32_t sp = -1;
+	uint32_t matchlen;
+
+	search_root = EBPF_EPOCH_DEREF(trie->root);
+	if (search_root == NULL)
+		return ENOENT;
+
+	if (k == NULL || k->prefixlen > trie->max_prefixlen)
+		goto find_leftmost;
+
+	stack = ebpf_calloc(trie->max_prefixlen + 1, sizeof(*stack));
+	if (stack == NULL)
+		return ENOMEM;
+
+	/* Record the path to the node which has the key */
+	for (node = search_root; node != NULL;) {
+		stack[++sp] = node;
+		matchlen = longest_prefix_match(trie, node, k);
+		if (node->prefixlen != matchlen ||
+		    node->prefixlen == k->prefixlen)
+			break;
+
+		node = EBPF_EPOCH_DEREF(
+		    node->child[extract_bit(k->data, node->prefixlen)]);
+	}
+
+	node = stack[sp];
+	if (node->prefixlen != k->prefixlen ||
+	    longest_prefix_match(trie, node, k) != k->prefixlen ||
+	    (node->flags & LPM_NODE_F_INTERMEDIATE))
+		goto find_leftmost;
+
+	/*
+	 * Next node in post-order is the leftmost node of the right
+	 * sibling, or the parent itself.
+	 */
+	for (; sp > 0; sp--) {
+		parent = stack[sp - 1];
+		if (EBPF_EPOCH_DEREF(parent->child[0]) == node) {
+			search_root = EBPF_EPOCH_DEREF(parent->child[1]);
+			if (search_root != NULL)
+				goto find_leftmost;
+		}
+
+		if (!(parent->flags & LPM_NODE_F_INTERMEDIATE)) {
+			next_node = parent;
+			goto copy;
+		}
+
+		node = parent;
+	}
+
+	ebpf_free(stack);
+	return ENOENT;
+
+find_leftmost:
+	for (node = search_root; node != NULL;) {
+		if (!(node->flags & LPM_NODE_F_INTERMEDIATE))
+			next_node = node;
+		parent = node;
+		node = EBPF_EPOCH_DEREF(parent->child[0]);
+		if (node == NULL)
+			node = EBPF_EPOCH_DEREF(parent->child[1]);
+	}
+
+copy:
+	ebpf_free(stack);
+
+	if (next_node == NULL)
+		return ENOENT;
+
+	nk->prefixlen = next_node->prefixlen;
+	memcpy(nk->data, next_node->data, trie->data_size);
+
+	return 0;
+}
+
+const struct ebpf_map_type emt_lpm_trie = {
+	.name = "lpm_trie",
+	.ops = {
+		.init = lpm_trie_map_init,
+		.update_elem = lpm_trie_map_update_elem,
+		.lookup_elem = lpm_trie_map_lookup_elem,
+		.delete_elem = lpm_trie_map_delete_elem,
+		.update_elem_from_user = lpm_trie_map_update_elem,
+		.lookup_elem_from_user = lpm_trie_map_lookup_elem_from_user,
+		.delete_elem_from_user = lpm_trie_map_delete_elem,
+		.get_next_key_from_user = lpm_trie_map_get_next_key,
+		.deinit = lpm_trie_map_deinit
+	}
+};
@@ -0,0 +1,561 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ebpf_map.h"
+#include "ebpf_util.h"
+#include "ebpf_hash.h"
+
+/*
+ * Open addressing hashtable with Robin Hood hashing. Keys are stored
+ * inline in the slot array, so lookup of the small key touches only
+ * one or two cachelines (plus the value) instead of chasing the chain
+ * of separately allocated elements.
+ *
+ * Each slot remembers its probe sequence length (distance from the
+ * home slot plus one, zero means empty). Insertion steals the slot
+ * from the entry which is closer to its home, and deletion shifts
+ * the following entries backward. This keeps the probe sequences
+ * short and lets lookup stop at the first slot which is closer to
+ * its home than the key would be.
+ *
+ * Since writers move entries around, readers don't take any lock
+ * but validate what they read with the sequence counter which is
+ * odd while the writer is modifying the table. Writers serialize
+ * with the spin lock.
+ *
+ * Values don't move with the slots. They live in the separate value
+ * array and the slot only holds the index, so the value pointer
+ * returned by lookup_elem stays valid for the reader in the epoch.
+ * The index of the deleted key is not reused until the epoch passes,
+ * in the same way as emt_cuckoo_hashtable does with its entries.
+ */
+
+#define RH_RECLAIM_BATCH 16
+#define RH_RECLAIM_NBATCHES 4
+#define RH_RECLAIM_RESERVE (RH_RECLAIM_BATCH * (RH_RECLAIM_NBATCHES + 1))
+#define RH_IDX_NONE UINT32_MAX
+
+struct rh_slot {
+	uint32_t hash;
+	uint32_t psl;
+	uint32_t idx; /* index of the value */
+	uint8_t key[0];
+};
+
+struct ebpf_map_rh_hashtable;
+
+struct rh_reclaim_batch {
+	ebpf_epoch_context ec;
+	struct ebpf_map_rh_hashtable *rh;
+	uint32_t head; /* first index of the chain */
+	uint32_t busy; /* passed to the epoch */
+};
+
+struct ebpf_map_rh_hashtable {
+	uint32_t seq;
+	uint32_t count;
+	uint32_t mask;
+	uint32_t slot_size;
+	uint32_t value_size; /* round upped value size */
+	uint32_t nfree;
+	uint32_t pending; /* first index of the deleted values */
+	uint32_t npending;
+	ebpf_spinmtx lock;
+	ebpf_hash_fn hash;
+	uint8_t *tmp; /* two slots of scratch space for writer */
+	uint8_t *slots;
+	uint8_t *values;
+	uint32_t *free_idx;
+	uint32_t *reclaim_next;
+	struct rh_reclaim_batch batches[RH_RECLAIM_NBATCHES];
+};
+
+#define RH_SLOT(_rhp, _idx)                                                    \
+	((struct rh_slot *)((_rhp)->slots + (size_t)(_rhp)->slot_size * (_idx)))
+#define RH_VALUE(_rhp, _idx)                                                   \
+	((_rhp)->values + (size_t)(_rhp)->value_size * (_idx))
+
+static inline uint32_t
+rh_hash(struct ebpf_map *map, void *key)
+{
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	return rh->hash(key, map->key_size);
+}
+
+/*
+ * Returns the slot which holds the key or NULL. Readers must
+ * validate the result with the sequence counter.
+ */
+static struct rh_slot *
+rh_find(struct ebpf_map *map, void *key, uint32_t hash)
+{
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_slot *slot;
+	uint32_t idx = hash & rh->mask;
+
+	for (uint32_t psl = 1; psl <= rh->mask + 1; psl++) {
+		slot = RH_SLOT(rh, idx);
+
+		/*
+		 * Empty slot or the entry closer to its home than
+		 * the key. The key would have taken this slot if it
+		 * was in the table.
+		 */
+		if (slot->psl < psl)
+			return NULL;
+
+		if (slot->hash == hash && memcmp(slot->key, key, map->key_size) == 0)
+			return slot;
+
+		idx = (idx + 1) & rh->mask;
+	}
+
+	return NULL;
+}
+
+static void
+rh_reclaim_cb(ebpf_epoch_context *ec)
+{
+	struct rh_reclaim_batch *batch;
+	struct ebpf_map_rh_hashtable *rh;
+
+	batch = ebpf_container_of(ec, struct rh_reclaim_batch, ec);
+	rh = batch->rh;
+
+	ebpf_spinmtx_lock(&rh->lock);
+
+	for (uint32_t idx = batch->head; idx != RH_IDX_NONE;
+	     idx = rh->reclaim_next[idx])
+		rh->free_idx[rh->nfree++] = idx;
+
+	batch->head = RH_IDX_NONE;
+	batch->busy = 0;
+
+	ebpf_spinmtx_unlock(&rh->lock);
+}
+
+/*
+ * Moves the pending list to the free batch when it has at least min
+ * values. Must be called with the lock held, and the returned batch
+ * must be passed to ebpf_epoch_call after unlocking.
+ */
+static struct rh_reclaim_batch *
+rh_reclaim_take(struct ebpf_map_rh_hashtable *rh, uint32_t min)
+{
+	struct rh_reclaim_batch *batch;
+
+	if (rh->npending == 0 || rh->npending < min)
+		return NULL;
+
+	for (uint32_t i = 0; i < RH_RECLAIM_NBATCHES; i++) {
+		batch = rh->batches + i;
+		if (!batch->busy) {
+			batch->head = rh->pending;
+			batch->busy = 1;
+			rh->pending = RH_IDX_NONE;
+			rh->npending = 0;
+			return batch;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+rh_hashtable_map_init(struct ebpf_map *map, struct ebpf_map_attr *attr)
+{
+	int error;
+	struct ebpf_map_rh_hashtable *rh;
+	uint64_t slot_size, value_size;
+	uint32_t nslots, nvalues;
+
+	/* Keep the load factor below 0.8 */
+	if (attr->max_entries > (1U << 30))
+		return E2BIG;
+
+	slot_size = ebpf_roundup(sizeof(struct rh_slot) +
+				 (uint64_t)attr->key_size, sizeof(uint32_t));
+	value_size = ebpf_roundup((uint64_t)attr->value_size, 8);
+	if (slot_size > UINT32_MAX || value_size > UINT32_MAX)
+		return E2BIG;
+
+	rh = ebpf_calloc(1, sizeof(*rh));
+	if (rh == NULL)
+		return ENOMEM;
+
+	error = ebpf_hash_select(EBPF_MAP_F_HASH_TYPE(attr->flags), &rh->hash);
+	if (error != 0)
+		goto err0;
+
+	nslots = ebpf_roundup_pow_of_two(attr->max_entries +
+					 attr->max_entries / 4 + 1);
+
+	rh->mask = nslots - 1;
+	rh->slot_size = slot_size;
+	rh->value_size = value_size;
+
+	error = ENOMEM;
+
+	rh->slots = ebpf_calloc(nslots, rh->slot_size);
+	if (rh->slots == NULL)
+		goto err0;
+
+	rh->tmp = ebpf_calloc(2, rh->slot_size);
+	if (rh->tmp == NULL)
+		goto err1;
+
+	/*
+	 * Spare values for the deleted ones waiting for the epoch, but
+	 * never more than max_entries (or one batch for the tiny maps).
+	 */
+	nvalues = ebpf_min(RH_RECLAIM_RESERVE, attr->max_entries);
+	if (nvalues < RH_RECLAIM_BATCH)
+		nvalues = RH_RECLAIM_BATCH;
+	nvalues += attr->max_entries;
+
+	rh->values = ebpf_calloc(nvalues, rh->value_size);
+	if (rh->values == NULL)
+		goto err2;
+
+	rh->free_idx = ebpf_calloc(nvalues, sizeof(uint32_t));
+	if (rh->free_idx == NULL)
+		goto err3;
+
+	rh->reclaim_next = ebpf_calloc(nvalues, sizeof(uint32_t));
+	if (rh->reclaim_next == NULL)
+		goto err4;
+
+	for (uint32_t i = 0; i < nvalues; i++)
+		rh->free_idx[i] = nvalues - i - 1;
+	rh->nfree = nvalues;
+	rh->pending = RH_IDX_NONE;
+
+	for (uint32_t i = 0; i < RH_RECLAIM_NBATCHES; i++) {
+		rh->batches[i].rh = rh;
+		rh->batches[i].head = RH_IDX_NONE;
+	}
+
+	ebpf_spinmtx_init(&rh->lock, "ebpf_rh_hashtable_map lock");
+
+	map->percpu = false;
+	map->data = rh;
+
+	return 0;
+
+err4:
+	ebpf_free(rh->free_idx);
+err3:
+	ebpf_free(rh->values);
+err2:
+	ebpf_free(rh->tmp);
+err1:
+	ebpf_free(rh->slots);
+err0:
+	ebpf_free(rh);
+	return error;
+}
+
+static void
+rh_hashtable_map_deinit(struct ebpf_map *map)
+{
+	struct ebpf_map_rh_hashtable *rh = map->data;
+
+	/*
+	 * Wait for current readers, then for the batches of the deleted
+	 * values, whose callbacks take the lock of the map.
+	 */
+	ebpf_epoch_wait();
+	ebpf_epoch_barrier();
+
+	for (uint32_t i = 0; i < RH_RECLAIM_NBATCHES; i++)
+		ebpf_assert(!rh->batches[i].busy);
+
+	ebpf_spinmtx_destroy(&rh->lock);
+	ebpf_free(rh->reclaim_next);
+	ebpf_free(rh->free_idx);
+	ebpf_free(rh->values);
+	ebpf_free(rh->tmp);
+	ebpf_free(rh->slots);
+	ebpf_free(rh);
+}
+
+static void *
+rh_hashtable_map_lookup_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = rh_hash(map, key);
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_slot *slot;
+	uint32_t seq, idx = 0;
+
+	/* The slot may move after the read section, but the value doesn't */
+	do {
+		seq = ebpf_seq_read_begin(&rh->seq);
+		slot = rh_find(map, key, hash);
+		if (slot != NULL)
+			idx = slot->idx;
+	} while (ebpf_seq_read_retry(&rh->seq, seq));
+
+	if (slot == NULL)
+		return NULL;
+
+	return RH_VALUE(rh, idx);
+}
+
+static void
+rh_hashtable_map_prefetch_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = rh_hash(map, key);
+	struct ebpf_map_rh_hashtable *rh = map->data;
+
+	ebpf_prefetch(RH_SLOT(rh, hash & rh->mask));
+}
+
+static int
+rh_hashtable_map_lookup_elem_from_user(struct ebpf_map *map, void *key,
+				       void *value)
+{
+	uint32_t hash = rh_hash(map, key);
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_slot *slot;
+	uint32_t seq;
+
+	/* Copy inside the read section to get consistent value */
+	do {
+		seq = ebpf_seq_read_begin(&rh->seq);
+		slot = rh_find(map, key, hash);
+		if (slot != NULL)
+			memcpy(value, RH_VALUE(rh, slot->idx), map->value_size);
+	} while (ebpf_seq_read_retry(&rh->seq, seq));
+
+	if (slot == NULL)
+		return ENOENT;
+
+	return 0;
+}
+
+static void
+rh_swap(struct ebpf_map_rh_hashtable *rh, struct rh_slot *a, struct rh_slot *b)
+{
+	struct rh_slot *t = (struct rh_slot *)(rh->tmp + rh->slot_size);
+
+	memcpy(t, a, rh->slot_size);
+	memcpy(a, b, rh->slot_size);
+	memcpy(b, t, rh->slot_size);
+}
+
+static int
+rh_hashtable_map_update_elem(struct ebpf_map *map, void *key, void *value,
+			     uint64_t flags)
+{
+	int error = 0;
+	uint32_t hash = rh_hash(map, key);
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_reclaim_batch *batch = NULL;
+	struct rh_slot *slot, *entry;
+	uint32_t idx;
+
+	if (flags >= __EBPF_MAP_UPDATE_FLAGS_MAX)
+		return EINVAL;
+
+	ebpf_spinmtx_lock(&rh->lock);
+
+	slot = rh_find(map, key, hash);
+	if (slot != NULL) {
+		if (flags == EBPF_NOEXIST) {
+			error = EEXIST;
+			goto err0;
+		}
+
+		/*
+		 * Datapath readers may see torn value as in array
+		 * map, but lookup_elem_from_user never does.
+		 */
+		ebpf_seq_write_begin(&rh->seq);
+		memcpy(RH_VALUE(rh, slot->idx), value, map->value_size);
+		ebpf_seq_write_end(&rh->seq);
+		goto err0;
+	}
+
+	if (flags == EBPF_EXIST) {
+		error = ENOENT;
+		goto err0;
+	}
+
+	if (rh->count == map->max_entries) {
+		error = EBUSY;
+		goto err0;
+	}
+
+	/*
+	 * All spare values are waiting for the epoch. Pass the short
+	 * pending list as well, so that they come back even if no more
+	 * keys are deleted, and let the caller wait for them.
+	 */
+	if (rh->nfree == 0) {
+		batch = rh_reclaim_take(rh, 1);
+		error = EAGAIN;
+		goto err0;
+	}
+
+	/* Nobody sees the value until the slot is published */
+	entry = (struct rh_slot *)rh->tmp;
+	memset(entry, 0, rh->slot_size);
+	entry->hash = hash;
+	entry->psl = 1;
+	entry->idx = rh->free_idx[--rh->nfree];
+	memcpy(entry->key, key, map->key_size);
+	memcpy(RH_VALUE(rh, entry->idx), value, map->value_size);
+
+	ebpf_seq_write_begin(&rh->seq);
+
+	/*
+	 * Table always has an empty slot since the number of slots
+	 * is larger than max_entries.
+	 */
+	idx = hash & rh->mask;
+	for (;;) {
+		slot = RH_SLOT(rh, idx);
+		if (slot->psl == 0) {
+			memcpy(slot, entry, rh->slot_size);
+			break;
+		}
+
+		/* Take the slot from the richer entry */
+		if (slot->psl < entry->psl)
+			rh_swap(rh, slot, entry);
+
+		entry->psl++;
+		idx = (idx + 1) & rh->mask;
+	}
+
+	rh->count++;
+
+	ebpf_seq_write_end(&rh->seq);
+
+err0:
+	ebpf_spinmtx_unlock(&rh->lock);
+
+	if (batch != NULL)
+		ebpf_epoch_call(&batch->ec, rh_reclaim_cb);
+
+	return error;
+}
+
+static int
+rh_hashtable_map_delete_elem(struct ebpf_map *map, void *key)
+{
+	uint32_t hash = rh_hash(map, key);
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_reclaim_batch *batch;
+	struct rh_slot *slot, *next;
+	uint32_t idx;
+
+	ebpf_spinmtx_lock(&rh->lock);
+
+	slot = rh_find(map, key, hash);
+	if (slot == NULL) {
+		ebpf_spinmtx_unlock(&rh->lock);
+		return ENOENT;
+	}
+
+	/* Readers may still see the value until the epoch passes */
+	idx = slot->idx;
+	rh->reclaim_next[idx] = rh->pending;
+	rh->pending = idx;
+	rh->npending++;
+
+	ebpf_seq_write_begin(&rh->seq);
+
+	/*
+	 * Backward shift the following entries until the empty slot
+	 * or the entry which is already at its home.
+	 */
+	idx = ((uint8_t *)slot - rh->slots) / rh->slot_size;
+	for (;;) {
+		next = RH_SLOT(rh, (idx + 1) & rh->mask);
+		if (next->psl <= 1)
+			break;
+
+		memcpy(slot, next, rh->slot_size);
+		slot->psl--;
+		slot = next;
+		idx = (idx + 1) & rh->mask;
+	}
+
+	slot->psl = 0;
+	rh->count--;
+
+	ebpf_seq_write_end(&rh->seq);
+
+	batch = rh_reclaim_take(rh, RH_RECLAIM_BATCH);
+
+	ebpf_spinmtx_unlock(&rh->lock);
+
+	if (batch != NULL)
+		ebpf_epoch_call(&batch->ec, rh_reclaim_cb);
+
+	return 0;
+}
+
+static int
+rh_hashtable_map_get_next_key(struct ebpf_map *map, void *key, void *next_key)
+{
+	struct ebpf_map_rh_hashtable *rh = map->data;
+	struct rh_slot *slot;
+	uint32_t idx = 0;
+	int error = ENOENT;
+
+	/* Iteration is not the hot path. Just exclude writers. */
+	ebpf_spinmtx_lock(&rh->lock);
+
+	if (key != NULL) {
+		slot = rh_find(map, key,
+			       rh_hash(map, key));
+		if (slot != NULL)
+			idx = ((uint8_t *)slot - rh->slots) / rh->slot_size + 1;
+	}
+
+	for (; idx <= rh->mask; idx++) {
+		slot = RH_SLOT(rh, idx);
+		if (slot->psl != 0) {
+			memcpy(next_key, slot->key, map->key_size);
+			error = 0;
+			break;
+		}
+	}
+
+	ebpf_spinmtx_unlock(&rh->lock);
+
+	return error;
+}
+
+const struct ebpf_map_type emt_rh_hashtable = {
+	.name = "rh_hashtable",
+	.ops = {
+		.init = rh_hashtable_map_init,
+		.update_elem = rh_hashtable_map_update_elem,
+		.lookup_elem = rh_hashtable_map_lookup_elem,
+		.delete_elem = rh_hashtable_map_delete_elem,
+		.update_elem_from_user = rh_hashtable_map_update_elem,
+		.lookup_elem_from_user = rh_hashtable_map_lookup_elem_from_user,
+		.delete_elem_from_user = rh_hashtable_map_delete_elem,
+		.get_next_key_from_user = rh_hashtable_map_get_next_key,
+		.deinit = rh_hashtable_map_deinit,
+		.prefetch_elem = rh_hashtable_map_prefetch_elem
+	}
+};
@@ -44,6 +44,7 @@
  * Prototypes of platform dependent functions
  */
 extern int ebpf_init(void);
+extern int ebpf_init_reclaim(uint32_t reclaim);
 extern int ebpf_deinit(void);
 extern void *ebpf_malloc(size_t size);
 extern void *ebpf_calloc(size_t number, size_t size);
@@ -53,12 +54,15 @@ extern void ebpf_exfree(void *mem, size_t size);
 extern int ebpf_error(const char *fmt, ...);
 extern uint16_t ebpf_ncpus(void);
 extern uint16_t ebpf_curcpu(void);
+extern void ebpf_percpu_add64(void *base, size_t stride, uint64_t delta);
 extern long ebpf_getpagesize(void);
 extern void ebpf_epoch_enter(void);
 extern void ebpf_epoch_exit(void);
 extern void ebpf_epoch_call(ebpf_epoch_context *ctx,
 			    void (*callback)(ebpf_epoch_context *));
 extern void ebpf_epoch_wait(void);
+extern void ebpf_epoch_barrier(void);
+extern void ebpf_quiescent(void);
 extern void ebpf_mtx_init(ebpf_mtx *mutex, const char *name);
 extern void ebpf_mtx_lock(ebpf_mtx *mutex);
 extern void ebpf_mtx_unlock(ebpf_mtx *mutex);
@@ -18,6 +18,7 @@
 
 #include "ebpf_prog.h"
 #include "ebpf_map.h"
+#include <sys/ebpf_vm_isa.h>
 
 static void
 ebpf_prog_dtor(struct ebpf_obj *eo)
@@ -27,13 +28,203 @@ ebpf_prog_dtor(struct ebpf_obj *eo)
 	for (uint32_t i = 0; i < ep->ndep_maps; i++)
 		ebpf_obj_release((struct ebpf_obj *)ep->dep_maps[i]);
 
+	if (ep->jit_code != NULL)
+		ebpf_exfree(ep->jit_code, ep->jit_size);
+
+	ebpf_free(ep->dprog);
 	ebpf_free(ep->prog);
 }
 
+/*
+ * Rewrites the lddw with EBPF_PSEUDO_MAP_DESC into the plain lddw of
+ * the map pointer resolved by the preprocessor and attaches the map.
+ * Both the interpreter and the JIT see the pointer as an ordinary
+ * immediate, so the descriptor is never looked at in run time.
+ */
+static int
+ebpf_prog_resolve_maps(struct ebpf_prog *ep, void *data)
+{
+	int error;
+	struct ebpf_inst *inst;
+	struct ebpf_map *em;
+	const struct ebpf_preprocessor_type *eppt =
+		ep->eo.eo_ee->ec->preprocessor_type;
+
+	for (uint32_t pc = 0; pc < ep->prog_len; pc++) {
+		inst = ep->prog + pc;
+
+		if (inst->opcode != EBPF_OP_LDDW)
+			continue;
+
+		/* Reported by the decoder */
+		if (pc + 1 >= ep->prog_len)
+			break;
+
+		if (inst->src != EBPF_PSEUDO_MAP_DESC) {
+			pc++;
+			continue;
+		}
+
+		if (eppt == NULL || eppt->ops.resolve_map_desc == NULL)
+			return EINVAL;
+
+		em = eppt->ops.resolve_map_desc(inst[1].imm, inst->imm, data);
+		if (em == NULL) {
+			ebpf_error("Failed to resolve map at PC %u\n", pc);
+			return EINVAL;
+		}
+
+		if (ep->ept->ops.is_map_usable != NULL &&
+		    !ep->ept->ops.is_map_usable((struct ebpf_map_type *)em->emt))
+			return EINVAL;
+
+		error = ebpf_prog_attach_map(ep, em);
+		if (error != 0 && error != EEXIST)
+			return error;
+
+		inst->src = 0;
+		inst->imm = (uint32_t)(uintptr_t)em;
+		inst[1].imm = (uint32_t)((uint64_t)(uintptr_t)em >> 32);
+		pc++;
+	}
+
+	return 0;
+}
+
+/* Flags of the instructions used by ebpf_prog_inline_lookups */
+#define INSN_TARGET	0x01 /* reachable by jump or call */
+#define INSN_LDDW_HI	0x02 /* second half of lddw */
+
+static bool
+writes_r1(const struct ebpf_inst *inst)
+{
+	switch (EBPF_CLS(inst->opcode)) {
+	case EBPF_CLS_LD:
+	case EBPF_CLS_LDX:
+	case EBPF_CLS_ALU:
+	case EBPF_CLS_ALU64:
+		return inst->dst == EBPF_R1;
+	case EBPF_CLS_STX:
+		/* Atomic operations with fetch */
+		return EBPF_MODE(inst->opcode) == EBPF_MODE_XADD &&
+			inst->src == EBPF_R1;
+	case EBPF_CLS_JMP:
+		return inst->opcode == EBPF_OP_CALL;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Finds the map R1 points to at the call at pc. Only the lddw of the
+ * attached map in the same basic block is recognized.
+ */
+static int
+find_r1_map(struct ebpf_prog *ep, const uint8_t *flags, uint32_t pc)
+{
+	struct ebpf_inst *inst;
+	uint64_t imm;
+
+	if (flags[pc] & INSN_TARGET)
+		return -1;
+
+	for (uint32_t i = pc; i > 0; i--) {
+		if (flags[i - 1] & INSN_LDDW_HI)
+			i--;
+
+		inst = ep->prog + i - 1;
+		if (writes_r1(inst)) {
+			if (inst->opcode != EBPF_OP_LDDW)
+				return -1;
+
+			imm = (uint32_t)inst->imm | ((uint64_t)inst[1].imm << 32);
+			for (uint32_t j = 0; j < ep->ndep_maps; j++) {
+				if ((uintptr_t)ep->dep_maps[j] == imm)
+					return j;
+			}
+
+			return -1;
+		}
+
+		if (flags[i - 1] & INSN_TARGET)
+			return -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Rewrites the calls of map_lookup_elem on the array maps into
+ * EBPF_PSEUDO_CALL_ARRAY_LOOKUP, so that the interpreter and the JIT
+ * compute the address of the element inline instead of going through
+ * the helper and the map ops.
+ */
+static int
+ebpf_prog_inline_lookups(struct ebpf_prog *ep)
+{
+	int idx;
+	uint8_t *flags;
+	struct ebpf_inst *inst;
+	struct ebpf_map *em;
+	const struct ebpf_helper_type *const *helpers =
+		ep->eo.eo_ee->ec->helper_types;
+
+	flags = ebpf_calloc(ep->prog_len, sizeof(*flags));
+	if (flags == NULL)
+		return ENOMEM;
+
+	/* Out of range targets are reported by the decoder */
+	for (uint32_t pc = 0; pc < ep->prog_len; pc++) {
+		inst = ep->prog + pc;
+		if (inst->opcode == EBPF_OP_LDDW && pc + 1 < ep->prog_len) {
+			flags[++pc] |= INSN_LDDW_HI;
+		} else if (inst->opcode == EBPF_OP_CALL) {
+			if (inst->src == EBPF_PSEUDO_CALL_ARRAY_LOOKUP) {
+				ebpf_free(flags);
+				return EINVAL;
+			}
+			if (inst->src == EBPF_PSEUDO_CALL &&
+			    (int64_t)pc + inst->imm + 1 >= 0 &&
+			    (int64_t)pc + inst->imm + 1 < ep->prog_len)
+				flags[pc + inst->imm + 1] |= INSN_TARGET;
+		} else if (EBPF_CLS(inst->opcode) == EBPF_CLS_JMP &&
+			   inst->opcode != EBPF_OP_EXIT &&
+			   (int64_t)pc + inst->offset + 1 >= 0 &&
+			   (int64_t)pc + inst->offset + 1 < ep->prog_len) {
+			flags[pc + inst->offset + 1] |= INSN_TARGET;
+		}
+	}
+
+	for (uint32_t pc = 0; pc < ep->prog_len; pc++) {
+		inst = ep->prog + pc;
+		if (inst->opcode != EBPF_OP_CALL || inst->src != 0 ||
+				inst->imm < 0 || inst->imm >= EBPF_TYPE_MAX ||
+				helpers[inst->imm] != &eht_map_lookup_elem ||
+				(flags[pc] & INSN_LDDW_HI))
+			continue;
+
+		idx = find_r1_map(ep, flags, pc);
+		if (idx < 0)
+			continue;
+
+		em = ep->dep_maps[idx];
+		if (em->emt != &emt_array && em->emt != &emt_percpu_array)
+			continue;
+
+		inst->src = EBPF_PSEUDO_CALL_ARRAY_LOOKUP;
+		inst->imm = idx;
+	}
+
+	ebpf_free(flags);
+
+	return 0;
+}
+
 int
 ebpf_prog_create(struct ebpf_env *ee, struct ebpf_prog **epp,
 		 struct ebpf_prog_attr *attr)
 {
+	int error;
 	struct ebpf_prog *ep;
 	const struct ebpf_prog_type *ept;
 
@@ -50,7 +241,7 @@ ebpf_prog_create(struct ebpf_env *ee, struct ebpf_prog **epp,
 	if (ep == NULL)
 		return ENOMEM;
 
-	ep->prog = ebpf_malloc(attr->prog_len);
+	ep->prog = ebpf_malloc(sizeof(struct ebpf_inst) * attr->prog_len);
 	if (ep->prog == NULL) {
 		ebpf_free(ep);
 		return ENOMEM;
@@ -62,14 +253,51 @@ ebpf_prog_create(struct ebpf_env *ee, struct ebpf_prog **epp,
 	ep->ept 	= ept;
 	ep->ndep_maps 	= 0;
 	ep->prog_len 	= attr->prog_len;
+	ep->dprog	= NULL;
+	ep->jit_code	= NULL;
+	ep->jit_size	= 0;
+	memset(ep->fusion_count, 0, sizeof(ep->fusion_count));
 
-	memcpy(ep->prog, attr->prog, attr->prog_len);
+	memcpy(ep->prog, attr->prog, sizeof(struct ebpf_inst) * attr->prog_len);
 	memset(ep->dep_maps, 0,
 			sizeof(ep->dep_maps[0]) * EBPF_PROG_MAX_ATTACHED_MAPS);
 
+	error = ebpf_prog_resolve_maps(ep, attr->data);
+	if (error != 0)
+		goto err;
+
+	error = ebpf_prog_inline_lookups(ep);
+	if (error != 0)
+		goto err;
+
+	error = ebpf_interp_decode(ep);
+	if (error != 0)
+		goto err;
+
+#ifdef EBPF_JIT
+	/*
+	 * Failing to JIT compile is not fatal. ebpf_prog_run
+	 * falls back to the interpreter in that case.
+	 */
+	if (!(attr->flags & EBPF_PROG_F_NOJIT))
+		ebpf_jit_compile(ep);
+#endif
+
 	*epp = ep;
 
 	return 0;
+
+err:
+	/*
+	 * Same as ebpf_map_create. The initialization of the program
+	 * is not complete, so release the maps and ee manually.
+	 */
+	for (uint32_t i = 0; i < ep->ndep_maps; i++)
+		ebpf_obj_release((struct ebpf_obj *)ep->dep_maps[i]);
+	ebpf_env_release(ee);
+	ebpf_free(ep->prog);
+	ebpf_free(ep);
+	return error;
 }
 
 void
@@ -81,6 +309,18 @@ ebpf_prog_destroy(struct ebpf_prog *ep)
 	ebpf_obj_release(&ep->eo);
 }
 
+int
+ebpf_prog_get_fusion_count(struct ebpf_prog *ep, uint32_t type,
+			   uint32_t *countp)
+{
+	if (ep == NULL || type >= EBPF_FUSION_MAX || countp == NULL)
+		return EINVAL;
+
+	*countp = ep->fusion_count[type];
+
+	return 0;
+}
+
 int
 ebpf_prog_attach_map(struct ebpf_prog *ep, struct ebpf_map *em)
 {
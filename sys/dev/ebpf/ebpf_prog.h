@@ -20,13 +20,44 @@
 
 #include "ebpf_obj.h"
 
+typedef uint64_t (*ebpf_jit_fn)(void *ctx);
+
+/*
+ * Internal src of call instruction. The loader rewrites the calls of
+ * map_lookup_elem on the array maps known at load time into it, so
+ * that the lookup is inlined. imm is the index of the map in
+ * dep_maps.
+ */
+#define EBPF_PSEUDO_CALL_ARRAY_LOOKUP 0xf
+
+/*
+ * Pre-decoded instruction for the threaded interpreter. One
+ * ebpf_dinst corresponds to one struct ebpf_inst, so the index
+ * of the instruction is kept as is.
+ */
+struct ebpf_dinst {
+	const void *handler;
+	uint8_t dst;
+	uint8_t src;
+	int16_t offset;
+	uint32_t target; /* absolute index of jump target */
+	union {
+		int64_t imm; /* sign extended or full lddw immediate */
+		ebpf_helper_fn fn;
+	};
+};
+
 struct ebpf_prog {
 	struct ebpf_obj eo;
 	const struct ebpf_prog_type *ept;
 	uint32_t ndep_maps;
 	uint32_t prog_len;
 	struct ebpf_inst *prog;
+	struct ebpf_dinst *dprog;
 	struct ebpf_map *dep_maps[EBPF_PROG_MAX_ATTACHED_MAPS];
+	ebpf_jit_fn jit_code; /* NULL if the program is not JIT-ed */
+	uint32_t jit_size;
+	uint32_t fusion_count[EBPF_FUSION_MAX];
 };
 
 #define EO2EP(eo) \
@@ -35,3 +66,5 @@ struct ebpf_prog {
 
 
 int ebpf_prog_attach_map(struct ebpf_prog *ep, struct ebpf_map *em);
+int ebpf_interp_decode(struct ebpf_prog *ep);
+int ebpf_jit_compile(struct ebpf_prog *ep);
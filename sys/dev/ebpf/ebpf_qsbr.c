@@ -0,0 +1,250 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Quiescent-state-based reclamation for the userspace, selected with
+ * EBPF_RECLAIM_QSBR. It suits the workers which run busy-poll loops.
+ *
+ * The worker threads announce the quiescent state with ebpf_quiescent
+ * between the batches and do nothing in ebpf_epoch_enter and
+ * ebpf_epoch_exit, so they are considered to be in the read section
+ * all the time except at the announcement. The other threads, like
+ * the ones for control plane, go online in ebpf_epoch_enter and
+ * offline in ebpf_epoch_exit instead.
+ *
+ * The grace period advances the global counter and waits until each
+ * online thread announced the new value. So, the worker which stops
+ * calling ebpf_quiescent without exiting stalls the reclamation.
+ */
+
+#include "ebpf_epoch.h"
+
+struct ebpf_qsbr_record {
+	uint64_t ctr; /* The grace period announced last, 0 if offline */
+	uint32_t depth; /* Nesting of ebpf_epoch_enter of non-workers */
+	bool worker;
+	CK_LIST_ENTRY(ebpf_qsbr_record) link;
+} CK_CC_CACHELINE;
+
+/* Spin this many times before yielding the CPU in the grace period */
+#define EBPF_QSBR_SPIN 1000
+
+static bool ebpf_qsbr_initialized;
+static pthread_key_t ebpf_qsbr_key;
+static pthread_mutex_t ebpf_qsbr_mtx = PTHREAD_MUTEX_INITIALIZER;
+static CK_LIST_HEAD(, ebpf_qsbr_record) ebpf_qsbr_records =
+    CK_LIST_HEAD_INITIALIZER(ebpf_qsbr_records);
+static uint64_t ebpf_qsbr_gp = 1;
+static __thread struct ebpf_qsbr_record *ebpf_qsbr_record;
+
+static void
+ebpf_qsbr_record_dtor(void *specific)
+{
+	struct ebpf_qsbr_record *record = specific;
+
+	/* Never block the grace period which waits for this thread */
+	ck_pr_fence_memory();
+	ck_pr_store_64(&record->ctr, 0);
+
+	pthread_mutex_lock(&ebpf_qsbr_mtx);
+	CK_LIST_REMOVE(record, link);
+	pthread_mutex_unlock(&ebpf_qsbr_mtx);
+
+	ebpf_free(record);
+}
+
+/*
+ * Like the epoch, the records cached in TLS stay registered even if
+ * the library is initialized again.
+ */
+int
+ebpf_qsbr_init(void)
+{
+	int error;
+
+	if (ebpf_qsbr_initialized)
+		return 0;
+
+	error = pthread_key_create(&ebpf_qsbr_key, ebpf_qsbr_record_dtor);
+	if (error != 0)
+		return error;
+
+	ebpf_qsbr_initialized = true;
+
+	return 0;
+}
+
+/*
+ * Undoes ebpf_qsbr_init on the error path of ebpf_epoch_init. Once
+ * any thread has its record, the key is kept for the same reason as
+ * above.
+ */
+void
+ebpf_qsbr_deinit(void)
+{
+	pthread_mutex_lock(&ebpf_qsbr_mtx);
+
+	if (ebpf_qsbr_initialized && CK_LIST_EMPTY(&ebpf_qsbr_records)) {
+		pthread_key_delete(ebpf_qsbr_key);
+		ebpf_qsbr_initialized = false;
+	}
+
+	pthread_mutex_unlock(&ebpf_qsbr_mtx);
+}
+
+static struct ebpf_qsbr_record *
+ebpf_qsbr_record_alloc(void)
+{
+	struct ebpf_qsbr_record *record;
+	int error;
+
+	record = ebpf_calloc(1, sizeof(*record));
+	if (record == NULL)
+		return NULL;
+
+	error = pthread_setspecific(ebpf_qsbr_key, record);
+	if (error != 0) {
+		ebpf_free(record);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ebpf_qsbr_mtx);
+	CK_LIST_INSERT_HEAD(&ebpf_qsbr_records, record, link);
+	pthread_mutex_unlock(&ebpf_qsbr_mtx);
+
+	ebpf_qsbr_record = record;
+
+	return record;
+}
+
+static inline struct ebpf_qsbr_record *
+ebpf_qsbr_get_record(void)
+{
+	struct ebpf_qsbr_record *record = ebpf_qsbr_record;
+
+	if (__builtin_expect(record == NULL, 0))
+		record = ebpf_qsbr_record_alloc();
+
+	return record;
+}
+
+static inline void
+ebpf_qsbr_announce(struct ebpf_qsbr_record *record)
+{
+	ck_pr_fence_memory();
+	ck_pr_store_64(&record->ctr, ck_pr_load_64(&ebpf_qsbr_gp));
+	ck_pr_fence_memory();
+}
+
+void
+ebpf_qsbr_quiescent(void)
+{
+	struct ebpf_qsbr_record *record;
+
+	record = ebpf_qsbr_get_record();
+	ebpf_assert(record != NULL);
+
+	record->worker = true;
+	ebpf_qsbr_announce(record);
+}
+
+void
+ebpf_qsbr_enter(void)
+{
+	struct ebpf_qsbr_record *record;
+
+	record = ebpf_qsbr_get_record();
+	ebpf_assert(record != NULL);
+
+	if (record->worker || record->depth++ > 0)
+		return;
+
+	ebpf_qsbr_announce(record);
+}
+
+void
+ebpf_qsbr_exit(void)
+{
+	struct ebpf_qsbr_record *record = ebpf_qsbr_record;
+
+	ebpf_assert(record != NULL);
+
+	if (record->worker || --record->depth > 0)
+		return;
+
+	ck_pr_fence_memory();
+	ck_pr_store_64(&record->ctr, 0);
+}
+
+/*
+ * Let the worker wait for the grace period. It holds no reference
+ * while waiting, so it goes offline not to wait for itself.
+ */
+void
+ebpf_qsbr_offline(void)
+{
+	struct ebpf_qsbr_record *record = ebpf_qsbr_record;
+
+	if (record == NULL || !record->worker)
+		return;
+
+	ck_pr_fence_memory();
+	ck_pr_store_64(&record->ctr, 0);
+}
+
+void
+ebpf_qsbr_online(void)
+{
+	struct ebpf_qsbr_record *record = ebpf_qsbr_record;
+
+	if (record == NULL || !record->worker)
+		return;
+
+	ebpf_qsbr_announce(record);
+}
+
+void
+ebpf_qsbr_synchronize(void)
+{
+	struct ebpf_qsbr_record *record;
+	uint64_t gp, ctr;
+
+	ck_pr_fence_memory();
+
+	pthread_mutex_lock(&ebpf_qsbr_mtx);
+
+	gp = ck_pr_faa_64(&ebpf_qsbr_gp, 1) + 1;
+	ck_pr_fence_memory();
+
+	CK_LIST_FOREACH(record, &ebpf_qsbr_records, link) {
+		for (uint32_t i = 0;; i++) {
+			ctr = ck_pr_load_64(&record->ctr);
+			if (ctr == 0 || ctr >= gp)
+				break;
+
+			if (i < EBPF_QSBR_SPIN)
+				ebpf_cpu_relax();
+			else
+				sched_yield();
+		}
+	}
+
+	pthread_mutex_unlock(&ebpf_qsbr_mtx);
+
+	ck_pr_fence_memory();
+}
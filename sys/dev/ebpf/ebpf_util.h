@@ -24,6 +24,7 @@
 	((_type *)((uint8_t *)(_ptr) - __builtin_offsetof(_type, _member)))
 
 #define ebpf_roundup(x, y) ((((x) + ((y)-1)) / (y)) * (y))
+#define ebpf_min(x, y) ((x) < (y) ? (x) : (y))
 
 static inline uint32_t
 ebpf_roundup_pow_of_two(uint32_t n)
@@ -37,3 +38,51 @@ ebpf_roundup_pow_of_two(uint32_t n)
 	n++;
 	return n;
 }
+
+/*
+ * Force inlining of the function which is used as a template, so
+ * that the constant arguments of the callers are propagated.
+ */
+#define ebpf_always_inline inline __attribute__((__always_inline__))
+
+/* Hint the CPU to bring the cacheline of the address for reading */
+#define ebpf_prefetch(_addr) __builtin_prefetch((_addr), 0, 3)
+
+/*
+ * Sequence counter for optimistic readers. Writers, which must be
+ * serialized by the caller, keep it odd while modifying the data.
+ * Readers retry when it was changed during their read section.
+ */
+static inline uint32_t
+ebpf_seq_read_begin(uint32_t *seq)
+{
+	uint32_t start;
+
+	while ((start = ebpf_atomic_load32(seq)) & 1)
+		ebpf_cpu_relax();
+
+	ebpf_fence_load();
+
+	return start;
+}
+
+static inline bool
+ebpf_seq_read_retry(uint32_t *seq, uint32_t start)
+{
+	ebpf_fence_load();
+	return ebpf_atomic_load32(seq) != start;
+}
+
+static inline void
+ebpf_seq_write_begin(uint32_t *seq)
+{
+	ebpf_atomic_store32(seq, *seq + 1);
+	ebpf_fence_store();
+}
+
+static inline void
+ebpf_seq_write_end(uint32_t *seq)
+{
+	ebpf_fence_store();
+	ebpf_atomic_store32(seq, *seq + 1);
+}
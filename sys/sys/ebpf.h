@@ -25,6 +25,8 @@
 #define EBPF_PSEUDO_MAP_DESC 1
 
 #define EBPF_STACK_SIZE 512
+#define EBPF_MAX_TAIL_CALL_CNT 32
+#define EBPF_MAX_CALL_DEPTH 8
 
 struct ebpf_obj;
 struct ebpf_prog;
@@ -36,6 +38,24 @@ struct ebpf_prog_attr {
 	struct ebpf_inst *prog;
 	uint32_t prog_len;
 	void *data; /* private data */
+	uint32_t flags; /* unknown bits are ignored */
+};
+
+enum ebpf_prog_flags {
+	EBPF_PROG_F_NOJIT = 1 << 0, /* always run on the interpreter */
+};
+
+/*
+ * Superinstructions the interpreter fuses at load time. Used for
+ * querying how many times each pattern matched on the program.
+ */
+enum ebpf_fusion_types {
+	EBPF_FUSION_LDX_JCC = 0,	/* ldx + jeq/jne imm on loaded value */
+	EBPF_FUSION_MOV_IMM_ADD,	/* mov64 imm + add64 reg */
+	EBPF_FUSION_STACK_ADDR,		/* mov64 reg + add64 imm */
+	EBPF_FUSION_STACK_ADDR_CALL,	/* mov64 reg + add64 imm + call */
+	EBPF_FUSION_LDDW_CALL,		/* lddw + call */
+	EBPF_FUSION_MAX
 };
 
 struct ebpf_map_attr {
@@ -46,6 +66,46 @@ struct ebpf_map_attr {
 	uint32_t flags;
 };
 
+/*
+ * Hash function of the hash based maps. Selected with the lower
+ * bits of ebpf_map_attr.flags (EBPF_MAP_F_HASH_MASK). The default
+ * is Jenkins hash. CRC32C needs hardware support and the map
+ * creation fails with ENOTSUP without it. EBPF_MAP_HASH_AUTO picks
+ * the fastest one available on the running CPU.
+ */
+enum ebpf_map_hash_types {
+	EBPF_MAP_HASH_JHASH = 0,
+	EBPF_MAP_HASH_CRC32C,
+	EBPF_MAP_HASH_XXH64,
+	EBPF_MAP_HASH_WYHASH,
+	EBPF_MAP_HASH_AUTO,
+	EBPF_MAP_HASH_MAX
+};
+
+#define EBPF_MAP_F_HASH_MASK 0xf
+#define EBPF_MAP_F_HASH_TYPE(_flags) ((_flags) & EBPF_MAP_F_HASH_MASK)
+
+/*
+ * Hashtable only. Writers insert and remove elements with CAS
+ * instead of taking the bucket lock, so that updates of the hot
+ * keys from many CPUs don't spin. Elements are preallocated as in
+ * the locked mode, and the replaced ones return to the map after the
+ * epoch.
+ * EBPF_NOEXIST and EBPF_EXIST are checked before the update and
+ * are not atomic with respect to the concurrent writers of the
+ * same key.
+ */
+#define EBPF_MAP_F_LOCKFREE (1 << 4)
+
+/*
+ * Hashtable only, exclusive with EBPF_MAP_F_LOCKFREE. Update of the
+ * existing key overwrites the value in place instead of replacing
+ * the element. Lookups from userspace retry on concurrent update
+ * with the per-element sequence counter. The pointer returned by
+ * ebpf_map_lookup_elem is not protected from the torn read.
+ */
+#define EBPF_MAP_F_INPLACE (1 << 5)
+
 enum ebpf_map_update_flags {
 	EBPF_ANY = 0,
 	EBPF_NOEXIST,
@@ -53,6 +113,15 @@ enum ebpf_map_update_flags {
 	__EBPF_MAP_UPDATE_FLAGS_MAX
 };
 
+/*
+ * Key of lpm_trie map. key_size of the map is sizeof this struct
+ * plus the length of data. data is in network byte order.
+ */
+struct ebpf_lpm_trie_key {
+	uint32_t prefixlen;
+	uint8_t data[0];
+};
+
 struct ebpf_map_ops {
 	int (*init)(struct ebpf_map *em, struct ebpf_map_attr *attr);
 	void* (*lookup_elem)(struct ebpf_map *em, void *key);
@@ -63,6 +132,8 @@ struct ebpf_map_ops {
 	int (*delete_elem_from_user)(struct ebpf_map *em, void *key);
 	int (*get_next_key_from_user)(struct ebpf_map *em, void *key, void *next_key);
 	void (*deinit)(struct ebpf_map *em);
+	void (*prefetch_elem)(struct ebpf_map *em, void *key); /* optional */
+	int (*percpu_add_elem)(struct ebpf_map *em, void *key, uint32_t offset, uint64_t delta); /* optional */
 };
 
 struct ebpf_map_type {
@@ -104,8 +175,26 @@ struct ebpf_config {
 	const struct ebpf_preprocessor_type *preprocessor_type;
 };
 
+/*
+ * Schemes to reclaim the memory which readers may still see, for
+ * ebpf_init_reclaim. ebpf_init uses EBPF_RECLAIM_EPOCH.
+ *
+ * With EBPF_RECLAIM_QSBR, which is only supported in userspace, the
+ * threads which called ebpf_quiescent once skip ebpf_epoch_enter and
+ * ebpf_epoch_exit, and must call ebpf_quiescent regularly while they
+ * don't hold any pointer obtained from the maps, e.g. once per batch
+ * of packets. ebpf_quiescent does nothing with the other schemes.
+ */
+enum ebpf_reclaim_types {
+	EBPF_RECLAIM_EPOCH = 0,
+	EBPF_RECLAIM_QSBR,
+	__EBPF_RECLAIM_MAX
+};
+
 int ebpf_init(void);
+int ebpf_init_reclaim(uint32_t reclaim);
 int ebpf_deinit(void);
+void ebpf_quiescent(void);
 
 int ebpf_env_create(struct ebpf_env **eep, const struct ebpf_config *ec);
 int ebpf_env_destroy(struct ebpf_env *ee);
@@ -116,21 +205,42 @@ void ebpf_obj_release(struct ebpf_obj *eo);
 int ebpf_prog_create(struct ebpf_env *ee, struct ebpf_prog **epp, struct ebpf_prog_attr *attr);
 void ebpf_prog_destroy(struct ebpf_prog *ep);
 uint64_t ebpf_prog_run(void *ctx, struct ebpf_prog *ep);
+void ebpf_prog_run_batch(struct ebpf_prog *ep, void **ctxs, uint64_t *rets, uint32_t n);
+void ebpf_prog_run_interleaved(struct ebpf_prog *ep, void **ctxs, uint64_t *rets, uint32_t n);
+int ebpf_prog_get_fusion_count(struct ebpf_prog *ep, uint32_t type, uint32_t *countp);
 
 int ebpf_map_create(struct ebpf_env *ee, struct ebpf_map **emp, struct ebpf_map_attr *attr);
 void *ebpf_map_lookup_elem(struct ebpf_map *em, void *key);
 int ebpf_map_update_elem(struct ebpf_map *em, void *key, void *value, uint64_t flags);
 int ebpf_map_delete_elem(struct ebpf_map *em, void *key);
 int ebpf_map_lookup_elem_from_user(struct ebpf_map *em, void *key, void *value);
+/*
+ * May wait for the epoch when the spare elements of the map are used
+ * up, so it must not be called inside ebpf_epoch_enter/exit.
+ */
 int ebpf_map_update_elem_from_user(struct ebpf_map *em, void *key, void *value, uint64_t flags);
 int ebpf_map_delete_elem_from_user(struct ebpf_map *em, void *key);
 int ebpf_map_get_next_key_from_user(struct ebpf_map *em, void *key, void *next_key);
+/*
+ * Per-CPU maps only. Adds delta to the 64-bit counter at offset in
+ * the value of the current CPU. Unlike the update through the pointer
+ * returned by ebpf_map_lookup_elem, this is safe for the threads which
+ * are not pinned to a CPU. offset and value_size must be multiples
+ * of 8.
+ */
+int ebpf_map_percpu_add_elem(struct ebpf_map *em, void *key, uint32_t offset, uint64_t delta);
 void ebpf_map_destroy(struct ebpf_map *em);
 
 extern const struct ebpf_map_type emt_array;
 extern const struct ebpf_map_type emt_percpu_array;
 extern const struct ebpf_map_type emt_hashtable;
 extern const struct ebpf_map_type emt_percpu_hashtable;
+extern const struct ebpf_map_type emt_lru_hashtable;
+extern const struct ebpf_map_type emt_lpm_trie;
+extern const struct ebpf_map_type emt_rh_hashtable;
+extern const struct ebpf_map_type emt_cuckoo_hashtable;
+extern const struct ebpf_map_type emt_prog_array;
 extern const struct ebpf_helper_type eht_map_lookup_elem;
 extern const struct ebpf_helper_type eht_map_update_elem;
 extern const struct ebpf_helper_type eht_map_delete_elem;
+extern const struct ebpf_helper_type eht_tail_call;
@@ -42,6 +42,7 @@ enum ebpf_registers {
 };
 
 #define EBPF_PSEUDO_MAP_DESC 1
+#define EBPF_PSEUDO_CALL 1
 
 #define EBPF_CLS_LD 0x00
 #define EBPF_CLS_LDX 0x01
@@ -68,6 +69,7 @@ enum ebpf_registers {
 /* Other memory modes are not yet supported */
 #define EBPF_MODE_IMM 0x00
 #define EBPF_MODE_MEM 0x60
+#define EBPF_MODE_XADD 0xc0 /* atomic operations, operation is in imm */
 #define EBPF_MODE(op) ((op) & 0xe0)
 
 /* ALU operations */
@@ -87,6 +89,11 @@ enum ebpf_registers {
 #define EBPF_END 0xd0 /* convert endianness */
 #define EBPF_ALU_OP(op) ((op) & 0xf0)
 
+/* atomic operations (imm of EBPF_MODE_XADD instructions) */
+#define EBPF_FETCH 0x01 /* load old value into src */
+#define EBPF_XCHG (0xe0 | EBPF_FETCH) /* exchange */
+#define EBPF_CMPXCHG (0xf0 | EBPF_FETCH) /* compare with r0 and exchange */
+
 /* jump operations */
 #define EBPF_JA 0x00 /* unconditional */
 #define EBPF_JEQ 0x10 /* == */
@@ -125,11 +132,10 @@ enum ebpf_registers {
 #define EBPF_STX(size, dst, src, ofs) \
 	{ (EBPF_CLS_ST | EBPF_SRC_MEM | size), dst, src, ofs, 0 }
 #define EBPF_LDDW(dst, imm) \
-	{ (EBPF_CLS_LD | EBPF_SRC_IMM | EBPF_DW), dst, 0, 0, (uint32_t)imm }, \
+	{ EBPF_OP_LDDW, dst, 0, 0, (uint32_t)imm }, \
 	{ 0, 0, 0, 0, ((uint64_t)imm) >> 32 }
 #define EBPF_PSEUDO_MAP_LD(dst, imm) \
-	{ (EBPF_CLS_LD | EBPF_SRC_IMM | EBPF_DW), dst, \
-		EBPF_PSEUDO_MAP_DESC, 0, (uint32_t)imm } \
+	{ EBPF_OP_LDDW, dst, EBPF_PSEUDO_MAP_DESC, 0, (uint32_t)imm }, \
 	{ 0, 0, 0, 0, 0 }
 #define EBPF_JMP_JA(ofs) \
 	{ (EBPF_CLS_JMP | EBPF_JA ), 0, 0, imm, 0 }
@@ -139,6 +145,8 @@ enum ebpf_registers {
 	{ (EBPF_CLS_JMP | EBPF_SRC_REG | op), dst, src, ofs, 0 }
 #define EBPF_JMP_CALL(id) \
 	{ (EBPF_CLS_JMP | EBPF_CALL), 0, 0, 0, id }
+#define EBPF_JMP_CALL_LOCAL(ofs) \
+	{ (EBPF_CLS_JMP | EBPF_CALL), 0, EBPF_PSEUDO_CALL, 0, ofs }
 #define EBPF_JMP_EXIT \
 	{ (EBPF_CLS_JMP | EBPF_EXIT), 0, 0, 0, 0 }
 
@@ -208,6 +216,8 @@ enum ebpf_registers {
 #define EBPF_OP_STXH (EBPF_CLS_STX | EBPF_MODE_MEM | EBPF_SIZE_H)
 #define EBPF_OP_STXB (EBPF_CLS_STX | EBPF_MODE_MEM | EBPF_SIZE_B)
 #define EBPF_OP_STXDW (EBPF_CLS_STX | EBPF_MODE_MEM | EBPF_SIZE_DW)
+#define EBPF_OP_XADDW (EBPF_CLS_STX | EBPF_MODE_XADD | EBPF_SIZE_W)
+#define EBPF_OP_XADDDW (EBPF_CLS_STX | EBPF_MODE_XADD | EBPF_SIZE_DW)
 #define EBPF_OP_LDDW (EBPF_CLS_LD | EBPF_MODE_IMM | EBPF_SIZE_DW)
 
 #define EBPF_OP_JA (EBPF_CLS_JMP | EBPF_JA)
@@ -0,0 +1,241 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the update throughput of the hashtable with the bucket
+ * locks and with EBPF_MAP_F_LOCKFREE, with increasing number of
+ * threads. Every thread is pinned to its own CPU and keeps replacing
+ * randomly chosen keys of the prepopulated map, which models the
+ * per-flow counters updated from many CPUs.
+ *
+ * usage: hashtable_update_bench [-t max_threads] [-k nkeys] [-d msec]
+ */
+
+#define _GNU_SOURCE
+#include <dev/ebpf/ebpf_platform.h>
+#include <sys/ebpf.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Reclaim the replaced elements once per this many updates */
+#define RECLAIM_INTERVAL 1024
+
+enum bench_emts {
+	BENCH_MAP_TYPE_HASHTABLE,
+	BENCH_MAP_TYPE_MAX
+};
+
+static const struct ebpf_config bench_config = {
+	.map_types = {
+		[BENCH_MAP_TYPE_HASHTABLE] = &emt_hashtable
+	}
+};
+
+struct bench_arg {
+	pthread_t thread;
+	uint32_t cpu;
+	uint64_t ops;
+};
+
+static struct ebpf_map *bench_map;
+static uint32_t bench_nkeys;
+static pthread_barrier_t bench_barrier;
+static int bench_stop;
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_arg *ba = arg;
+	uint64_t x = ba->cpu * 0x9e3779b97f4a7c15ULL + 1, ops = 0;
+	uint32_t key;
+	cpu_set_t cpus;
+	int error;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(ba->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	pthread_barrier_wait(&bench_barrier);
+
+	while (!ck_pr_load_int(&bench_stop)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = x % bench_nkeys;
+
+		error = ebpf_map_update_elem_from_user(bench_map, &key, &x,
+						       EBPF_ANY);
+		if (error != 0) {
+			fprintf(stderr, "update failed: %d\n", error);
+			exit(EXIT_FAILURE);
+		}
+
+		if (++ops % RECLAIM_INTERVAL == 0)
+			ebpf_epoch_wait();
+	}
+
+	ebpf_epoch_wait();
+	ba->ops = ops;
+
+	return NULL;
+}
+
+static double
+run(struct ebpf_env *ee, uint32_t flags, uint32_t nthreads, uint32_t msec)
+{
+	struct ebpf_map_attr attr;
+	struct bench_arg *args;
+	struct timespec ts;
+	uint64_t ops = 0;
+	int error;
+
+	attr.type = BENCH_MAP_TYPE_HASHTABLE;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = bench_nkeys;
+	attr.flags = flags;
+
+	error = ebpf_map_create(ee, &bench_map, &attr);
+	if (error != 0) {
+		fprintf(stderr, "ebpf_map_create failed: %d\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < bench_nkeys; i++) {
+		uint64_t v = 0;
+		ebpf_map_update_elem_from_user(bench_map, &i, &v, EBPF_ANY);
+	}
+
+	args = calloc(nthreads, sizeof(*args));
+	if (args == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	ck_pr_store_int(&bench_stop, 0);
+	pthread_barrier_init(&bench_barrier, NULL, nthreads + 1);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		args[i].cpu = i;
+		pthread_create(&args[i].thread, NULL, bench_thread, args + i);
+	}
+
+	pthread_barrier_wait(&bench_barrier);
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+
+	ck_pr_store_int(&bench_stop, 1);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		pthread_join(args[i].thread, NULL);
+		ops += args[i].ops;
+	}
+
+	pthread_barrier_destroy(&bench_barrier);
+	free(args);
+	ebpf_map_destroy(bench_map);
+
+	return (double)ops / msec / 1000;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t ncpus = ebpf_ncpus(), max_threads = ncpus, msec = 1000;
+	double base[2] = {0, 0}, mops;
+	const uint32_t modes[2] = {0, EBPF_MAP_F_LOCKFREE};
+	struct ebpf_env *ee;
+	int error, ch;
+
+	bench_nkeys = 1024;
+
+	while ((ch = getopt(argc, argv, "t:k:d:")) != -1) {
+		switch (ch) {
+		case 't':
+			max_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			bench_nkeys = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			msec = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+					"[-k nkeys] [-d msec]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (max_threads == 0 || bench_nkeys == 0 || msec == 0) {
+		fprintf(stderr, "invalid argument\n");
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * The map assumes that each CPU runs at most one thread
+	 * which uses it at a time.
+	 */
+	if (max_threads > ncpus) {
+		fprintf(stderr, "max_threads is limited to %u CPUs\n", ncpus);
+		max_threads = ncpus;
+	}
+
+	error = ebpf_init();
+	if (error != 0) {
+		fprintf(stderr, "ebpf_init failed: %d\n", error);
+		return EXIT_FAILURE;
+	}
+
+	error = ebpf_env_create(&ee, &bench_config);
+	if (error != 0) {
+		fprintf(stderr, "ebpf_env_create failed: %d\n", error);
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %8s %12s %8s\n", "mode", "threads", "Mupdates/s",
+	       "scaling");
+
+	for (uint32_t n = 1;; n *= 2) {
+		if (n > max_threads)
+			n = max_threads;
+
+		for (int m = 0; m < 2; m++) {
+			mops = run(ee, modes[m], n, msec);
+			if (n == 1)
+				base[m] = mops;
+			printf("%8s %8u %12.2f %8.2f\n",
+			       modes[m] ? "lockfree" : "locked", n, mops,
+			       mops / base[m]);
+		}
+
+		if (n == max_threads)
+			break;
+	}
+
+	ebpf_env_destroy(ee);
+	ebpf_deinit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*-
+ * SPDX-License-Identifier: Apache License 2.0
+ *
+ * Copyright 2019 Yutaro Hayakawa
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the cost of ebpf_curcpu and of the lookups of the per-CPU
+ * maps which call it. The "affinity" row is the lookup of the CPU
+ * number from the affinity set of the thread, which ebpf_curcpu did
+ * on every call before it cached the CPU identity, so it shows how
+ * much each per-CPU lookup used to pay on top of the "curcpu" row.
+ *
+ * usage: percpu_lookup_bench [-n iterations]
+ */
+
+#define _GNU_SOURCE
+#include <dev/ebpf/ebpf_platform.h>
+#include <sys/ebpf.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum bench_emts {
+	BENCH_MAP_TYPE_PERCPU_ARRAY,
+	BENCH_MAP_TYPE_PERCPU_HASHTABLE,
+	BENCH_MAP_TYPE_MAX
+};
+
+static const struct ebpf_config bench_config = {
+	.map_types = {
+		[BENCH_MAP_TYPE_PERCPU_ARRAY] = &emt_percpu_array,
+		[BENCH_MAP_TYPE_PERCPU_HASHTABLE] = &emt_percpu_hashtable
+	}
+};
+
+#define BENCH_NKEYS 1024
+
+static uint64_t bench_sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t
+affinity_cpu(void)
+{
+	cpu_set_t cpus;
+
+	pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	for (uint16_t i = 0; i < CPU_MAXSIZE; i++) {
+		if (CPU_ISSET(i, &cpus)) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+static double
+bench_affinity(uint64_t n)
+{
+	uint64_t start = now_ns();
+
+	for (uint64_t i = 0; i < n; i++)
+		bench_sink += affinity_cpu();
+
+	return (double)(now_ns() - start) / n;
+}
+
+static double
+bench_curcpu(uint64_t n)
+{
+	uint64_t start = now_ns();
+
+	for (uint64_t i = 0; i < n; i++)
+		bench_sink += ebpf_curcpu();
+
+	return (double)(now_ns() - start) / n;
+}
+
+static double
+bench_lookup(struct ebpf_env *ee, uint16_t type, uint64_t n)
+{
+	struct ebpf_map_attr attr;
+	struct ebpf_map *em;
+	uint64_t start, elapsed, *v;
+	uint32_t key;
+	int error;
+
+	attr.type = type;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = BENCH_NKEYS;
+	attr.flags = 0;
+
+	error = ebpf_map_create(ee, &em, &attr);
+	if (error != 0) {
+		fprintf(stderr, "ebpf_map_create failed: %d\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	for (key = 0; key < BENCH_NKEYS; key++) {
+		uint64_t value = key;
+		ebpf_map_update_elem(em, &key, &value, EBPF_ANY);
+	}
+
+	start = now_ns();
+
+	ebpf_epoch_enter();
+	for (uint64_t i = 0; i < n; i++) {
+		key = i % BENCH_NKEYS;
+		v = ebpf_map_lookup_elem(em, &key);
+		if (v != NULL)
+			bench_sink += *v;
+	}
+	ebpf_epoch_exit();
+
+	elapsed = now_ns() - start;
+	ebpf_map_destroy(em);
+
+	return (double)elapsed / n;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t n = 10000000;
+	struct ebpf_env *ee;
+	cpu_set_t cpus;
+	int error, ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (n == 0) {
+		fprintf(stderr, "invalid argument\n");
+		return EXIT_FAILURE;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	error = ebpf_init();
+	if (error != 0) {
+		fprintf(stderr, "ebpf_init failed: %d\n", error);
+		return EXIT_FAILURE;
+	}
+
+	error = ebpf_env_create(&ee, &bench_config);
+	if (error != 0) {
+		fprintf(stderr, "ebpf_env_create failed: %d\n", error);
+		return EXIT_FAILURE;
+	}
+
+	printf("%18s %10s\n", "operation", "ns/op");
+	printf("%18s %10.2f\n", "affinity", bench_affinity(n));
+	printf("%18s %10.2f\n", "curcpu", bench_curcpu(n));
+	printf("%18s %10.2f\n", "percpu_array",
+	       bench_lookup(ee, BENCH_MAP_TYPE_PERCPU_ARRAY, n));
+	printf("%18s %10.2f\n", "percpu_hashtable",
+	       bench_lookup(ee, BENCH_MAP_TYPE_PERCPU_HASHTABLE, n));
+
+	ebpf_env_destroy(ee);
+	ebpf_deinit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+#include <gtest/gtest.h>
+#include <set>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <dev/ebpf/ebpf_allocator.h>
+}
+
+namespace {
+const uint32_t nblocks = 100;
+
+class AllocatorTest : public ::testing::Test {
+ protected:
+  struct ebpf_allocator alloc;
+
+  virtual void SetUp() {
+    int error;
+
+    error = ebpf_allocator_init(&alloc, 64, nblocks, NULL, NULL, NULL);
+    ASSERT_EQ(0, error);
+  }
+
+  virtual void TearDown() {
+    ebpf_allocator_deinit(&alloc, NULL, NULL);
+  }
+};
+
+TEST_F(AllocatorTest, AllocAllBlocks) {
+  std::set<void *> blocks;
+  void *p;
+
+  for (int round = 0; round < 3; round++) {
+    while ((p = ebpf_allocator_alloc(&alloc)) != NULL)
+      blocks.insert(p);
+
+    EXPECT_EQ(nblocks, blocks.size());
+
+    for (auto b : blocks)
+      ebpf_allocator_free(&alloc, b);
+
+    blocks.clear();
+  }
+}
+
+TEST_F(AllocatorTest, FreeInterleaved) {
+  std::vector<void *> blocks;
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    if (i % 3 != 2 || blocks.empty()) {
+      void *p = ebpf_allocator_alloc(&alloc);
+      if (p != NULL)
+        blocks.push_back(p);
+    } else {
+      ebpf_allocator_free(&alloc, blocks.back());
+      blocks.pop_back();
+    }
+  }
+
+  EXPECT_LE(blocks.size(), nblocks);
+
+  for (auto b : blocks)
+    ebpf_allocator_free(&alloc, b);
+}
+
+TEST_F(AllocatorTest, ConcurrentAllocFree) {
+  const uint32_t nthreads = 4, nheld = 16;
+  std::vector<std::thread> threads;
+
+  for (uint32_t t = 0; t < nthreads; t++) {
+    threads.emplace_back([this, nheld]() {
+      std::vector<void *> held;
+
+      for (uint32_t i = 0; i < 100000; i++) {
+        if (held.size() < nheld) {
+          void *p = ebpf_allocator_alloc(&alloc);
+          if (p != NULL) {
+            memset(p, 0xff, 64);
+            held.push_back(p);
+          }
+        } else {
+          for (auto b : held)
+            ebpf_allocator_free(&alloc, b);
+          held.clear();
+        }
+      }
+
+      for (auto b : held)
+        ebpf_allocator_free(&alloc, b);
+    });
+  }
+
+  for (auto &th : threads)
+    th.join();
+}
+
+uint32_t nconstructed;
+
+int failing_ctor(void *mem, void *arg) {
+  if (nconstructed == *(uint32_t *)arg)
+    return ENOMEM;
+
+  nconstructed++;
+  return 0;
+}
+
+void counting_dtor(void *mem, void *arg) {
+  nconstructed--;
+}
+
+/*
+ * When the constructor fails in the middle, the blocks constructed
+ * so far are destructed and the error is returned.
+ */
+TEST(AllocatorInitTest, CtorFailure) {
+  struct ebpf_allocator alloc;
+  uint32_t limit = nblocks / 2;
+  int error;
+
+  nconstructed = 0;
+  error = ebpf_allocator_init(&alloc, 64, nblocks, failing_ctor,
+                              counting_dtor, &limit);
+  EXPECT_EQ(ENOMEM, error);
+  EXPECT_EQ(0, nconstructed);
+}
+}  // namespace
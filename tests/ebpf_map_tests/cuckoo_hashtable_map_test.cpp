@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class CuckooHashTableMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_CUCKOO_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(CuckooHashTableMapTest, CorrectLookup) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(100, lookup_value);
+
+  uint32_t *v = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  ASSERT_TRUE(v != NULL);
+  EXPECT_EQ(100, *v);
+}
+
+TEST_F(CuckooHashTableMapTest, UpdateFlags) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+
+  value = 200;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(200, lookup_value);
+}
+
+TEST_F(CuckooHashTableMapTest, UpdateMoreThanMaxEntries) {
+  int error;
+  uint32_t i;
+
+  for (i = 0; i < 100; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+    ASSERT_TRUE(!error);
+  }
+
+  error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+}
+
+TEST_F(CuckooHashTableMapTest, CorrectDelete) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(CuckooHashTableMapTest, ChurnKeepsAllEntriesReachable) {
+  int error;
+  bool present[1000] = {};
+  uint32_t seed = 1, key, next_key, value, npresent = 0, nkeys = 0;
+
+  /* Insertions displace entries to their other bucket, check nothing gets lost */
+  for (uint32_t i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    key = (seed >> 8) % 1000;
+
+    if (present[key]) {
+      error = ebpf_map_delete_elem_from_user(em, &key);
+      ASSERT_EQ(0, error);
+      present[key] = false;
+      npresent--;
+    } else if (npresent < 100) {
+      value = key * 2;
+      error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+      ASSERT_EQ(0, error);
+      present[key] = true;
+      npresent++;
+    }
+  }
+
+  for (key = 0; key < 1000; key++) {
+    error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+    if (present[key]) {
+      EXPECT_EQ(0, error);
+      EXPECT_EQ(key * 2, value);
+    } else {
+      EXPECT_EQ(ENOENT, error);
+    }
+  }
+
+  error = ebpf_map_get_next_key_from_user(em, NULL, &next_key);
+  while (error == 0) {
+    EXPECT_TRUE(present[next_key]);
+    nkeys++;
+    key = next_key;
+    error = ebpf_map_get_next_key_from_user(em, &key, &next_key);
+  }
+
+  EXPECT_EQ(npresent, nkeys);
+}
+
+/*
+ * The reader keeps the pointer to the value of the deleted key. The
+ * entry must not be reused by the following updates until the reader
+ * leaves the epoch.
+ */
+TEST_F(CuckooHashTableMapTest, NoReuseInEpoch) {
+  int error;
+  uint32_t key = 1000, value = 0xdeadbeef, seen, *v, failed = 0;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  ebpf_epoch_enter();
+
+  v = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  if (v == NULL) {
+    ebpf_epoch_exit();
+    FAIL();
+  }
+
+  failed += ebpf_map_delete_elem_from_user(em, &key) != 0;
+
+  /* Stay within the spare entries, the update can't wait here */
+  for (uint32_t n = 0; n < 50; n++) {
+    key = n;
+    value = n;
+    failed += ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY) != 0;
+    failed += ebpf_map_delete_elem_from_user(em, &key) != 0;
+  }
+
+  seen = *v;
+
+  ebpf_epoch_exit();
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(0xdeadbeef, seen);
+
+  ebpf_epoch_wait();
+
+  key = 0;
+  value = 1;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(0, error);
+}
+}  // namespace
+
+namespace {
+class CuckooHashTableMapFiveTupleTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  struct five_tuple {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t pad[3];
+  };
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_CUCKOO_HASHTABLE;
+    attr.key_size = sizeof(struct five_tuple);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = 4096;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(CuckooHashTableMapFiveTupleTest, FillToMaxEntries) {
+  int error;
+  uint64_t value;
+
+  /* Every entry must fit, which requires displacement at this load */
+  for (uint32_t i = 0; i < 4096; i++) {
+    struct five_tuple key = {i, ~i, (uint16_t)i, 80, 6, {0, 0, 0}};
+    value = i;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  for (uint32_t i = 0; i < 4096; i++) {
+    struct five_tuple key = {i, ~i, (uint16_t)i, 80, 6, {0, 0, 0}};
+    uint64_t *v = (uint64_t *)ebpf_map_lookup_elem(em, &key);
+    ASSERT_TRUE(v != NULL);
+    EXPECT_EQ(i, *v);
+  }
+
+  struct five_tuple key = {4096, 0, 0, 0, 0, {0, 0, 0}};
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+}
+}  // namespace
@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+#include <dev/ebpf/ebpf_platform.h>
+#include <dev/ebpf/ebpf_epoch.h>
+}
+
+namespace {
+const uint32_t ncallbacks = 1000;
+uint32_t ndispatched;
+
+void count_cb(ebpf_epoch_context *ctx) {
+  ck_pr_inc_32(&ndispatched);
+}
+
+class EpochTest : public ::testing::Test {
+ protected:
+  std::vector<ebpf_epoch_context> ctxs;
+
+  virtual void SetUp() {
+    ebpf_epoch_wait();
+    ndispatched = 0;
+    ctxs.resize(ncallbacks);
+  }
+
+  virtual void TearDown() {
+    ebpf_epoch_wait();
+  }
+
+  void defer_all() {
+    ebpf_epoch_enter();
+    for (auto &ctx : ctxs)
+      ebpf_epoch_call(&ctx, count_cb);
+    ebpf_epoch_exit();
+  }
+};
+
+TEST_F(EpochTest, WaitDispatchesAll) {
+  defer_all();
+  EXPECT_LE(ncallbacks - ck_pr_load_32(&ndispatched), ebpf_epoch_backlog());
+
+  ebpf_epoch_wait();
+  EXPECT_EQ(ncallbacks, ck_pr_load_32(&ndispatched));
+  EXPECT_EQ(0, ebpf_epoch_backlog());
+}
+
+TEST_F(EpochTest, BackgroundReclaim) {
+  defer_all();
+
+  for (int i = 0; i < 1000 && ebpf_epoch_backlog() != 0; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  EXPECT_EQ(0, ebpf_epoch_backlog());
+  EXPECT_EQ(ncallbacks, ck_pr_load_32(&ndispatched));
+}
+
+/*
+ * Callbacks must not be dispatched while the reader which may see
+ * the object is in the section.
+ */
+TEST_F(EpochTest, ReaderDefersReclaim) {
+  std::thread reader;
+  uint32_t entered = 0, leave = 0;
+
+  reader = std::thread([&entered, &leave]() {
+    ebpf_epoch_enter();
+    ck_pr_store_32(&entered, 1);
+    while (ck_pr_load_32(&leave) == 0)
+      std::this_thread::yield();
+    ebpf_epoch_exit();
+  });
+
+  while (ck_pr_load_32(&entered) == 0)
+    std::this_thread::yield();
+
+  defer_all();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(0, ck_pr_load_32(&ndispatched));
+
+  ck_pr_store_32(&leave, 1);
+  reader.join();
+
+  ebpf_epoch_wait();
+  EXPECT_EQ(ncallbacks, ck_pr_load_32(&ndispatched));
+}
+
+TEST_F(EpochTest, ShortLivedThreads) {
+  for (int i = 0; i < 100; i++) {
+    std::thread th([this, i]() {
+      ebpf_epoch_enter();
+      ebpf_epoch_call(&ctxs[i], count_cb);
+      ebpf_epoch_exit();
+    });
+    th.join();
+  }
+
+  ebpf_epoch_wait();
+  EXPECT_EQ(100, ck_pr_load_32(&ndispatched));
+}
+}  // namespace
@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+#include <thread>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+struct large_value {
+  uint64_t w[16];
+};
+
+class HashTableInPlaceMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(struct large_value);
+    attr.max_entries = 100;
+    attr.flags = EBPF_MAP_F_INPLACE;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(HashTableInPlaceMapTest, InvalidFlags) {
+  int error;
+  struct ebpf_map *em2;
+  struct ebpf_map_attr attr;
+
+  attr.type = EBPF_MAP_TYPE_PERCPU_HASHTABLE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 100;
+  attr.flags = EBPF_MAP_F_INPLACE;
+
+  error = ebpf_map_create(ee, &em2, &attr);
+  EXPECT_EQ(EINVAL, error);
+
+  attr.type = EBPF_MAP_TYPE_HASHTABLE;
+  attr.flags = EBPF_MAP_F_INPLACE | EBPF_MAP_F_LOCKFREE;
+
+  error = ebpf_map_create(ee, &em2, &attr);
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(HashTableInPlaceMapTest, UpdateKeepsElement) {
+  int error;
+  uint32_t key = 50;
+  struct large_value value, lookup_value, *v1, *v2;
+
+  for (int i = 0; i < 16; i++)
+    value.w[i] = i;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  v1 = (struct large_value *)ebpf_map_lookup_elem(em, &key);
+  ASSERT_TRUE(v1 != NULL);
+
+  value.w[15] = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  ASSERT_EQ(0, error);
+
+  v2 = (struct large_value *)ebpf_map_lookup_elem(em, &key);
+  EXPECT_EQ(v1, v2);
+  EXPECT_EQ(100, v2->w[15]);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(0, memcmp(&value, &lookup_value, sizeof(value)));
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+}
+
+TEST_F(HashTableInPlaceMapTest, UpdateMoreThanMaxEntries) {
+  int error;
+  struct large_value value = {};
+
+  for (uint32_t i = 0; i < 100; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  for (uint32_t i = 0; i < 100; i++) {
+    value.w[0] = i;
+    error = ebpf_map_update_elem_from_user(em, &i, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  uint32_t key = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+}
+
+/*
+ * All words of the value are the same in every update, so the
+ * reader sees different words only when it got a torn value.
+ */
+TEST_F(HashTableInPlaceMapTest, NoTornRead) {
+  uint32_t key = 1, torn = 0, failed = 0;
+  struct large_value value = {};
+  int error;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  std::thread writer([this, key]() {
+    struct large_value v;
+    for (uint64_t n = 1; n <= 200000; n++) {
+      for (int i = 0; i < 16; i++)
+        v.w[i] = n;
+      ebpf_map_update_elem_from_user(em, (void *)&key, &v, EBPF_EXIST);
+    }
+  });
+
+  for (int n = 0; n < 200000; n++) {
+    if (ebpf_map_lookup_elem_from_user(em, &key, &value) != 0) {
+      failed++;
+      continue;
+    }
+    for (int i = 1; i < 16; i++) {
+      if (value.w[0] != value.w[i]) {
+        torn++;
+        break;
+      }
+    }
+  }
+
+  writer.join();
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(0, torn);
+}
+}  // namespace
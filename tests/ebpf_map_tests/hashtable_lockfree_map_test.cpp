@@ -0,0 +1,250 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class HashTableLockFreeMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = 100;
+    attr.flags = EBPF_MAP_F_LOCKFREE;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(HashTableLockFreeMapTest, PercpuIsNotSupported) {
+  int error;
+  struct ebpf_map *pem;
+  struct ebpf_map_attr attr;
+
+  attr.type = EBPF_MAP_TYPE_PERCPU_HASHTABLE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = 100;
+  attr.flags = EBPF_MAP_F_LOCKFREE;
+
+  error = ebpf_map_create(ee, &pem, &attr);
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(HashTableLockFreeMapTest, CorrectLookup) {
+  int error;
+  uint32_t key = 50;
+  uint64_t value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(100, lookup_value);
+
+  uint64_t *v = (uint64_t *)ebpf_map_lookup_elem(em, &key);
+  ASSERT_TRUE(v != NULL);
+  EXPECT_EQ(100, *v);
+
+  key = 51;
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(HashTableLockFreeMapTest, UpdateFlags) {
+  int error;
+  uint32_t key = 50;
+  uint64_t value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+
+  value = 200;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(200, lookup_value);
+}
+
+TEST_F(HashTableLockFreeMapTest, UpdateMoreThanMaxEntries) {
+  int error;
+  uint64_t value = 1;
+
+  for (uint32_t i = 0; i < 100; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  uint32_t key = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+
+  /* Replacing the existing element is still allowed */
+  key = 10;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(0, error);
+
+  key = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(0, error);
+}
+
+TEST_F(HashTableLockFreeMapTest, DeleteAndGetNextKey) {
+  int error;
+  uint32_t key, next_key, *k = NULL, n = 0;
+  uint64_t value = 1;
+
+  for (uint32_t i = 0; i < 100; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  for (uint32_t i = 0; i < 100; i += 2) {
+    error = ebpf_map_delete_elem_from_user(em, &i);
+    ASSERT_EQ(0, error);
+  }
+
+  while (ebpf_map_get_next_key_from_user(em, k, &next_key) == 0) {
+    EXPECT_EQ(1, next_key % 2);
+    key = next_key;
+    k = &key;
+    n++;
+  }
+
+  EXPECT_EQ(50, n);
+}
+
+/*
+ * Elements are preallocated, and the replaced value stays intact for
+ * the reader until it leaves the epoch. Outside of the epoch, the key
+ * can be replaced any number of times.
+ */
+TEST_F(HashTableLockFreeMapTest, ReplaceKeepsValueForReader) {
+  int error;
+  uint32_t key = 1, n;
+  uint64_t value = 0xdeadbeef, seen, *v;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  ebpf_epoch_enter();
+
+  v = (uint64_t *)ebpf_map_lookup_elem(em, &key);
+  if (v == NULL) {
+    ebpf_epoch_exit();
+    FAIL();
+  }
+
+  /* Stay within the spare elements, the update can't wait here */
+  for (n = 0; n < 10; n++) {
+    value = n;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+    if (error != 0)
+      break;
+  }
+
+  seen = *v;
+
+  ebpf_epoch_exit();
+
+  ASSERT_EQ(0, error);
+  EXPECT_EQ(0xdeadbeef, seen);
+
+  for (n = 0; n < 10000; n++) {
+    value = n;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+    ASSERT_EQ(0, error);
+  }
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+  ASSERT_EQ(0, error);
+  EXPECT_EQ(9999, value);
+}
+
+/*
+ * Writers replace the same keys concurrently. Each key must be
+ * visible exactly once afterwards and have the value written by
+ * one of the writers.
+ */
+TEST_F(HashTableLockFreeMapTest, ConcurrentUpdate) {
+  const uint32_t nthreads = 4, nkeys = 16, niters = 20000;
+  std::vector<std::thread> threads;
+  uint32_t key, next_key, *k = NULL, n = 0;
+  uint64_t value;
+  int error;
+
+  for (uint32_t t = 0; t < nthreads; t++) {
+    threads.emplace_back([this, t, nkeys, niters]() {
+      for (uint32_t i = 0; i < niters; i++) {
+        uint32_t key = i % nkeys;
+        uint64_t value = ((uint64_t)t << 32) | key;
+        int error;
+
+        if (i % 7 == 0)
+          error = ebpf_map_delete_elem_from_user(em, &key);
+        else
+          error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+
+        ASSERT_EQ(0, error);
+      }
+
+      /* Dispatch the deferred frees of this thread */
+      ebpf_epoch_wait();
+    });
+  }
+
+  for (auto &th : threads)
+    th.join();
+
+  for (uint32_t i = 0; i < nkeys; i++) {
+    value = i;
+    error = ebpf_map_update_elem_from_user(em, &i, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  while (ebpf_map_get_next_key_from_user(em, k, &next_key) == 0) {
+    error = ebpf_map_lookup_elem_from_user(em, &next_key, &value);
+    ASSERT_EQ(0, error);
+    EXPECT_EQ(next_key, value);
+    key = next_key;
+    k = &key;
+    n++;
+  }
+
+  EXPECT_EQ(nkeys, n);
+}
+}  // namespace
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ebpf.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class HashTableMapFixedKeyTest : public CommonFixture {
+ protected:
+  /*
+   * Covers the key sizes which have specialized operations and
+   * their neighbours, which take the generic path.
+   */
+  void check_key_size(uint32_t key_size, uint32_t hash_type) {
+    int error;
+    struct ebpf_map *em;
+    struct ebpf_map_attr attr;
+    uint8_t key[48], next_key[48];
+    uint32_t value, *valuep;
+
+    attr.type = EBPF_MAP_TYPE_HASHTABLE;
+    attr.key_size = key_size;
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 64;
+    attr.flags = hash_type;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    if (hash_type == EBPF_MAP_HASH_CRC32C && error == ENOTSUP)
+      return;
+    ASSERT_EQ(0, error);
+
+    /* Keys only differ in the first or the last byte */
+    for (uint32_t i = 0; i < 32; i++) {
+      memset(key, 0, sizeof(key));
+      key[i & 1 ? key_size - 1 : 0] = i + 1;
+      error = ebpf_map_update_elem_from_user(em, key, &i, EBPF_NOEXIST);
+      ASSERT_EQ(0, error) << "key_size " << key_size;
+    }
+
+    for (uint32_t i = 0; i < 32; i++) {
+      memset(key, 0, sizeof(key));
+      key[i & 1 ? key_size - 1 : 0] = i + 1;
+      error = ebpf_map_lookup_elem_from_user(em, key, &value);
+      ASSERT_EQ(0, error) << "key_size " << key_size;
+      EXPECT_EQ(i, value);
+
+      valuep = (uint32_t *)ebpf_map_lookup_elem(em, key);
+      ASSERT_TRUE(valuep != NULL);
+      EXPECT_EQ(i, *valuep);
+    }
+
+    memset(key, 0, sizeof(key));
+    error = ebpf_map_lookup_elem_from_user(em, key, &value);
+    EXPECT_EQ(ENOENT, error);
+
+    value = 100;
+    key[0] = 1;
+    error = ebpf_map_update_elem_from_user(em, key, &value, EBPF_EXIST);
+    EXPECT_EQ(0, error);
+    error = ebpf_map_lookup_elem_from_user(em, key, &value);
+    EXPECT_EQ(0, error);
+    EXPECT_EQ(100, value);
+
+    uint32_t n = 0;
+    uint8_t *k = NULL;
+    while (ebpf_map_get_next_key_from_user(em, k, next_key) == 0) {
+      memcpy(key, next_key, key_size);
+      k = key;
+      n++;
+    }
+    EXPECT_EQ(32, n);
+
+    for (uint32_t i = 0; i < 32; i++) {
+      memset(key, 0, sizeof(key));
+      key[i & 1 ? key_size - 1 : 0] = i + 1;
+      error = ebpf_map_delete_elem_from_user(em, key);
+      EXPECT_EQ(0, error);
+      error = ebpf_map_lookup_elem_from_user(em, key, &value);
+      EXPECT_EQ(ENOENT, error);
+    }
+
+    ebpf_map_destroy(em);
+  }
+};
+
+TEST_F(HashTableMapFixedKeyTest, AllKeySizes) {
+  const uint32_t key_sizes[] = {3, 4, 5, 8, 12, 16, 24, 40, 41};
+
+  for (uint32_t key_size : key_sizes)
+    for (uint32_t ht = 0; ht < EBPF_MAP_HASH_MAX; ht++)
+      check_key_size(key_size, ht);
+}
+}  // namespace
@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class HashTableReclaimTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+/*
+ * The reader keeps the pointer to the value of the deleted key. The
+ * element must not be reused by the following updates until the
+ * reader leaves the epoch.
+ */
+TEST_F(HashTableReclaimTest, NoReuseInEpoch) {
+  int error;
+  uint32_t key = 1, failed = 0;
+  uint64_t value = 0xdeadbeef, seen, *v;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  ebpf_epoch_enter();
+
+  v = (uint64_t *)ebpf_map_lookup_elem(em, &key);
+  if (v == NULL) {
+    ebpf_epoch_exit();
+    FAIL();
+  }
+
+  failed += ebpf_map_delete_elem_from_user(em, &key) != 0;
+
+  /* Insert and then replace other keys with the different values */
+  for (uint32_t n = 0; n < 100; n++) {
+    key = 2 + n % 50;
+    value = n;
+    failed += ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY) != 0;
+  }
+
+  seen = *v;
+
+  ebpf_epoch_exit();
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(0xdeadbeef, seen);
+}
+
+TEST_F(HashTableReclaimTest, MaxEntries) {
+  int error;
+  uint32_t key;
+  uint64_t value = 1;
+
+  for (key = 0; key < 100; key++) {
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  /* Spare elements for the reclamation are not usable for new keys */
+  key = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+
+  key = 0;
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  ASSERT_EQ(0, error);
+
+  key = 100;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  EXPECT_EQ(0, error);
+}
+
+/*
+ * The full map replaces its keys any number of times, even though
+ * every replaced element waits for the epoch before it is reused.
+ */
+TEST_F(HashTableReclaimTest, ReplaceInFullMap) {
+  int error;
+  uint32_t key, n;
+  uint64_t value;
+
+  for (key = 0; key < 100; key++) {
+    value = key;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  for (n = 0; n < 10000; n++) {
+    key = n % 100;
+    value = n;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+    ASSERT_EQ(0, error);
+  }
+
+  key = 42;
+  error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+  ASSERT_EQ(0, error);
+  EXPECT_EQ(9942, value);
+}
+
+/*
+ * The deleted elements are returned to the map after the epoch, so
+ * the map can be refilled any number of times.
+ */
+TEST_F(HashTableReclaimTest, RefillAfterEpoch) {
+  int error;
+  uint32_t key;
+  uint64_t value = 1;
+
+  for (uint32_t round = 0; round < 100; round++) {
+    for (key = 0; key < 100; key++) {
+      error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+      ASSERT_EQ(0, error);
+    }
+
+    for (key = 0; key < 100; key++) {
+      error = ebpf_map_delete_elem_from_user(em, &key);
+      ASSERT_EQ(0, error);
+    }
+
+    ebpf_epoch_wait();
+  }
+}
+}  // namespace
@@ -0,0 +1,213 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+struct lpm_key4 {
+  uint32_t prefixlen;
+  uint8_t data[4];
+};
+
+static struct lpm_key4
+make_key(uint32_t prefixlen, uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  struct lpm_key4 key = {prefixlen, {a, b, c, d}};
+  return key;
+}
+
+class LPMTrieMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_LPM_TRIE;
+    attr.key_size = sizeof(struct lpm_key4);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 1000;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+
+  void Update(struct lpm_key4 key, uint32_t value) {
+    int error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  uint32_t Lookup(struct lpm_key4 key) {
+    uint32_t value;
+    int error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+    return error == 0 ? value : UINT32_MAX;
+  }
+};
+
+TEST_F(LPMTrieMapTest, CreateWithInvalidKeySize) {
+  int error;
+  struct ebpf_map *em2;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_LPM_TRIE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 100;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em2, &attr);
+
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(LPMTrieMapTest, LongestPrefixMatch) {
+  Update(make_key(8, 10, 0, 0, 0), 1);
+  Update(make_key(24, 10, 1, 1, 0), 3);
+  Update(make_key(16, 10, 1, 0, 0), 2);
+
+  EXPECT_EQ(3, Lookup(make_key(32, 10, 1, 1, 5)));
+  EXPECT_EQ(2, Lookup(make_key(32, 10, 1, 2, 5)));
+  EXPECT_EQ(1, Lookup(make_key(32, 10, 2, 0, 1)));
+  EXPECT_EQ(UINT32_MAX, Lookup(make_key(32, 11, 0, 0, 1)));
+
+  /* Datapath lookup returns the same element */
+  struct lpm_key4 key = make_key(32, 10, 1, 1, 5);
+  uint32_t *value = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  ASSERT_TRUE(value != NULL);
+  EXPECT_EQ(3, *value);
+}
+
+TEST_F(LPMTrieMapTest, DefaultRoute) {
+  Update(make_key(0, 0, 0, 0, 0), 100);
+  Update(make_key(32, 192, 168, 0, 1), 1);
+
+  EXPECT_EQ(1, Lookup(make_key(32, 192, 168, 0, 1)));
+  EXPECT_EQ(100, Lookup(make_key(32, 192, 168, 0, 2)));
+}
+
+TEST_F(LPMTrieMapTest, CorrectDelete) {
+  int error;
+  struct lpm_key4 key;
+
+  Update(make_key(8, 10, 0, 0, 0), 1);
+  Update(make_key(16, 10, 1, 0, 0), 2);
+  Update(make_key(24, 10, 1, 1, 0), 3);
+
+  key = make_key(16, 10, 1, 0, 0);
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  ASSERT_EQ(0, error);
+
+  EXPECT_EQ(3, Lookup(make_key(32, 10, 1, 1, 5)));
+  EXPECT_EQ(1, Lookup(make_key(32, 10, 1, 2, 5)));
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(LPMTrieMapTest, UpdateFlags) {
+  int error;
+  uint32_t value = 1;
+  struct lpm_key4 key = make_key(8, 10, 0, 0, 0);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(ENOENT, error);
+
+  Update(key, value);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+
+  value = 2;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(2, Lookup(make_key(32, 10, 0, 0, 1)));
+}
+
+TEST_F(LPMTrieMapTest, GetNextKeyMoreSpecificFirst) {
+  int error;
+  struct lpm_key4 key, next_key;
+  uint32_t prefixlens[3], n = 0;
+
+  Update(make_key(8, 10, 0, 0, 0), 1);
+  Update(make_key(16, 10, 1, 0, 0), 2);
+  Update(make_key(24, 10, 1, 1, 0), 3);
+
+  error = ebpf_map_get_next_key_from_user(em, NULL, &next_key);
+  while (error == 0) {
+    ASSERT_LT(n, 3);
+    prefixlens[n++] = next_key.prefixlen;
+    key = next_key;
+    error = ebpf_map_get_next_key_from_user(em, &key, &next_key);
+  }
+
+  EXPECT_EQ(ENOENT, error);
+  ASSERT_EQ(3, n);
+  EXPECT_EQ(24, prefixlens[0]);
+  EXPECT_EQ(16, prefixlens[1]);
+  EXPECT_EQ(8, prefixlens[2]);
+}
+
+TEST_F(LPMTrieMapTest, MatchesLinearSearch) {
+  struct lpm_key4 prefixes[300];
+  uint32_t seed = 12345, n = 0;
+
+  for (uint32_t i = 0; i < 300; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t addr = seed & 0x0f0f0fff;
+    seed = seed * 1103515245 + 12345;
+    uint32_t plen = (seed >> 16) % 33;
+
+    addr &= plen == 0 ? 0 : ~0u << (32 - plen);
+    prefixes[n] = make_key(plen, addr >> 24, addr >> 16, addr >> 8, addr);
+    Update(prefixes[n], n);
+    n++;
+
+    /* Delete some of them to exercise the trimming */
+    if (i % 5 == 4) {
+      struct lpm_key4 key = prefixes[n - 3];
+      int error = ebpf_map_delete_elem_from_user(em, &key);
+      ASSERT_TRUE(error == 0 || key.prefixlen == UINT32_MAX);
+      for (uint32_t j = 0; j < n; j++)
+        if (memcmp(&prefixes[j], &key, sizeof(key)) == 0)
+          prefixes[j].prefixlen = UINT32_MAX;
+    }
+  }
+
+  for (uint32_t i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t addr = seed & 0x0f0f0fff;
+    uint32_t best = UINT32_MAX, best_len = 0;
+
+    /* Later update of the same prefix wins */
+    for (uint32_t j = 0; j < n; j++) {
+      uint32_t plen = prefixes[j].prefixlen;
+      if (plen == UINT32_MAX)
+        continue;
+      uint32_t p = (uint32_t)prefixes[j].data[0] << 24 |
+                   prefixes[j].data[1] << 16 | prefixes[j].data[2] << 8 |
+                   prefixes[j].data[3];
+      uint32_t mask = plen == 0 ? 0 : ~0u << (32 - plen);
+      if ((addr & mask) == p && (best == UINT32_MAX || plen >= best_len)) {
+        best = j;
+        best_len = plen;
+      }
+    }
+
+    EXPECT_EQ(best,
+              Lookup(make_key(32, addr >> 24, addr >> 16, addr >> 8, addr)));
+  }
+}
+}  // namespace
@@ -0,0 +1,179 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class LRUHashTableMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_LRU_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(LRUHashTableMapTest, CorrectLookup) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(100, lookup_value);
+}
+
+TEST_F(LRUHashTableMapTest, CorrectDelete) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(LRUHashTableMapTest, UpdateExistingElementWithNOEXISTFlag) {
+  int error;
+  uint32_t key = 50, value = 100;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+}
+
+TEST_F(LRUHashTableMapTest, UpdateMoreThanMaxEntries) {
+  int error;
+  uint32_t i, value, nkeys = 0;
+  uint32_t key, next_key;
+
+  for (i = 0; i < 1000; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+    ASSERT_EQ(0, error);
+
+    error = ebpf_map_lookup_elem_from_user(em, &i, &value);
+    ASSERT_EQ(0, error);
+    ASSERT_EQ(i, value);
+  }
+
+  /* Evicted entries must not be visible */
+  error = ebpf_map_get_next_key_from_user(em, NULL, &next_key);
+  while (error == 0) {
+    nkeys++;
+    key = next_key;
+    error = ebpf_map_get_next_key_from_user(em, &key, &next_key);
+  }
+
+  EXPECT_LE(nkeys, 100);
+}
+
+TEST_F(LRUHashTableMapTest, RecentlyUsedElementSurvives) {
+  int error;
+  uint32_t hot = 10000, value = 1, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &hot, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  for (uint32_t i = 0; i < 1000; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+    ASSERT_EQ(0, error);
+
+    /* Datapath lookup marks the element as referenced */
+    ASSERT_TRUE(ebpf_map_lookup_elem(em, &hot) != NULL);
+  }
+
+  error = ebpf_map_lookup_elem_from_user(em, &hot, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(1, lookup_value);
+}
+
+TEST_F(LRUHashTableMapTest, CreateWithUnsupportedFlags) {
+  int error;
+  struct ebpf_map *m;
+  struct ebpf_map_attr attr;
+
+  attr.type = EBPF_MAP_TYPE_LRU_HASHTABLE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 100;
+
+  attr.flags = EBPF_MAP_F_INPLACE;
+  error = ebpf_map_create(ee, &m, &attr);
+  EXPECT_EQ(EINVAL, error);
+
+  attr.flags = EBPF_MAP_F_LOCKFREE;
+  error = ebpf_map_create(ee, &m, &attr);
+  EXPECT_EQ(EINVAL, error);
+}
+
+/*
+ * The reader keeps the pointer to the value of the deleted key. The
+ * element must not be reused by the following updates, which evict
+ * the other keys, until the reader leaves the epoch.
+ */
+TEST_F(LRUHashTableMapTest, NoReuseInEpoch) {
+  int error;
+  uint32_t key, value, seen, *v, failed = 0;
+
+  for (key = 0; key < 100; key++) {
+    value = key + 1000;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  ebpf_epoch_enter();
+
+  key = 0;
+  v = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  if (v == NULL) {
+    ebpf_epoch_exit();
+    FAIL();
+  }
+
+  failed += ebpf_map_delete_elem_from_user(em, &key) != 0;
+
+  /* Stay within the spare elements, the update can't wait here */
+  for (key = 100; key < 150; key++) {
+    value = key + 1000;
+    failed += ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY) != 0;
+  }
+
+  seen = *v;
+
+  ebpf_epoch_exit();
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(1000, seen);
+}
+}  // namespace
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ebpf.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class MapHashTest : public CommonFixture {
+ protected:
+  static const uint32_t max_entries = 256;
+
+  struct key40 {
+    uint32_t w[10];
+  };
+
+  int create(uint32_t map_type, uint32_t hash_type, uint32_t key_size,
+             struct ebpf_map **emp) {
+    struct ebpf_map_attr attr;
+    attr.type = map_type;
+    attr.key_size = key_size;
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = max_entries;
+    attr.flags = hash_type;
+    return ebpf_map_create(ee, emp, &attr);
+  }
+
+  void fill_and_check(struct ebpf_map *em) {
+    int error;
+    struct key40 key;
+    uint32_t value;
+
+    for (uint32_t i = 0; i < max_entries; i++) {
+      memset(&key, 0, sizeof(key));
+      key.w[0] = i;
+      key.w[9] = ~i;
+      error = ebpf_map_update_elem_from_user(em, &key, &i, EBPF_NOEXIST);
+      ASSERT_EQ(0, error);
+    }
+
+    for (uint32_t i = 0; i < max_entries; i++) {
+      memset(&key, 0, sizeof(key));
+      key.w[0] = i;
+      key.w[9] = ~i;
+      error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+      ASSERT_EQ(0, error);
+      EXPECT_EQ(i, value);
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.w[0] = max_entries;
+    error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+    EXPECT_EQ(ENOENT, error);
+  }
+};
+
+const uint32_t map_types[] = {
+    EBPF_MAP_TYPE_HASHTABLE,
+    EBPF_MAP_TYPE_LRU_HASHTABLE,
+    EBPF_MAP_TYPE_RH_HASHTABLE,
+    EBPF_MAP_TYPE_CUCKOO_HASHTABLE,
+};
+
+TEST_F(MapHashTest, AllHashTypes) {
+  int error;
+  struct ebpf_map *em;
+
+  for (uint32_t mt : map_types) {
+    for (uint32_t ht = 0; ht < EBPF_MAP_HASH_MAX; ht++) {
+      error = create(mt, ht, sizeof(struct key40), &em);
+      if (ht == EBPF_MAP_HASH_CRC32C && error == ENOTSUP)
+        continue;
+      ASSERT_EQ(0, error) << "map type " << mt << " hash type " << ht;
+      fill_and_check(em);
+      ebpf_map_destroy(em);
+    }
+  }
+}
+
+TEST_F(MapHashTest, ShortKey) {
+  int error;
+  struct ebpf_map *em;
+  uint32_t value;
+
+  for (uint32_t mt : map_types) {
+    for (uint32_t ht = 0; ht < EBPF_MAP_HASH_MAX; ht++) {
+      error = create(mt, ht, 3, &em);
+      if (ht == EBPF_MAP_HASH_CRC32C && error == ENOTSUP)
+        continue;
+      ASSERT_EQ(0, error);
+
+      for (uint32_t i = 0; i < 100; i++) {
+        error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+        ASSERT_EQ(0, error);
+      }
+
+      for (uint32_t i = 0; i < 100; i++) {
+        error = ebpf_map_lookup_elem_from_user(em, &i, &value);
+        ASSERT_EQ(0, error);
+        EXPECT_EQ(i, value);
+      }
+
+      ebpf_map_destroy(em);
+    }
+  }
+}
+
+TEST_F(MapHashTest, InvalidHashType) {
+  int error;
+  struct ebpf_map *em;
+
+  for (uint32_t mt : map_types) {
+    error = create(mt, EBPF_MAP_HASH_MAX, sizeof(uint32_t), &em);
+    EXPECT_EQ(EINVAL, error);
+  }
+}
+}  // namespace
@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class PercpuAddTest : public CommonFixture {
+ protected:
+  struct ebpf_map *create_map(uint32_t type, uint32_t value_size) {
+    int error;
+    struct ebpf_map *em;
+    struct ebpf_map_attr attr;
+
+    attr.type = type;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = value_size;
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    EXPECT_EQ(0, error);
+
+    return em;
+  }
+
+  /*
+   * Threads are not pinned, so they may share and migrate between
+   * CPUs. No increment may be lost anyway.
+   */
+  void check_concurrent_add(uint32_t type) {
+    const uint32_t nthreads = 4, niters = 100000;
+    std::vector<std::thread> threads;
+    uint64_t values[ebpf_ncpus() * 2], sum = 0;
+    uint32_t key = 10;
+    int error;
+
+    struct ebpf_map *em = create_map(type, sizeof(uint64_t) * 2);
+    ASSERT_TRUE(em != NULL);
+
+    memset(values, 0, sizeof(values));
+    error = ebpf_map_update_elem_from_user(em, &key, values, EBPF_ANY);
+    ASSERT_EQ(0, error);
+
+    for (uint32_t t = 0; t < nthreads; t++) {
+      threads.emplace_back([em, key, niters]() {
+        for (uint32_t i = 0; i < niters; i++)
+          ebpf_map_percpu_add_elem(em, (void *)&key, sizeof(uint64_t), 1);
+      });
+    }
+
+    for (auto &th : threads)
+      th.join();
+
+    error = ebpf_map_lookup_elem_from_user(em, &key, values);
+    ASSERT_EQ(0, error);
+
+    for (uint16_t i = 0; i < ebpf_ncpus(); i++) {
+      EXPECT_EQ(0, values[i * 2]);
+      sum += values[i * 2 + 1];
+    }
+
+    EXPECT_EQ(nthreads * niters, sum);
+
+    ebpf_map_destroy(em);
+  }
+};
+
+TEST_F(PercpuAddTest, InvalidArguments) {
+  int error;
+  uint32_t key = 10;
+  struct ebpf_map *em;
+
+  em = create_map(EBPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint64_t) * 2);
+  ASSERT_TRUE(em != NULL);
+
+  error = ebpf_map_percpu_add_elem(em, NULL, 0, 1);
+  EXPECT_EQ(EINVAL, error);
+
+  error = ebpf_map_percpu_add_elem(em, &key, 4, 1);
+  EXPECT_EQ(EINVAL, error);
+
+  error = ebpf_map_percpu_add_elem(em, &key, sizeof(uint64_t) * 2, 1);
+  EXPECT_EQ(EINVAL, error);
+
+  key = 100;
+  error = ebpf_map_percpu_add_elem(em, &key, 0, 1);
+  EXPECT_EQ(EINVAL, error);
+
+  ebpf_map_destroy(em);
+
+  em = create_map(EBPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t));
+  ASSERT_TRUE(em != NULL);
+
+  key = 10;
+  error = ebpf_map_percpu_add_elem(em, &key, 0, 1);
+  EXPECT_EQ(EINVAL, error);
+
+  ebpf_map_destroy(em);
+
+  em = create_map(EBPF_MAP_TYPE_HASHTABLE, sizeof(uint64_t));
+  ASSERT_TRUE(em != NULL);
+
+  error = ebpf_map_percpu_add_elem(em, &key, 0, 1);
+  EXPECT_EQ(ENOTSUP, error);
+
+  ebpf_map_destroy(em);
+
+  em = create_map(EBPF_MAP_TYPE_PERCPU_HASHTABLE, sizeof(uint64_t));
+  ASSERT_TRUE(em != NULL);
+
+  error = ebpf_map_percpu_add_elem(em, &key, 0, 1);
+  EXPECT_EQ(ENOENT, error);
+
+  ebpf_map_destroy(em);
+}
+
+TEST_F(PercpuAddTest, ArrayConcurrentAdd) {
+  check_concurrent_add(EBPF_MAP_TYPE_PERCPU_ARRAY);
+}
+
+TEST_F(PercpuAddTest, HashTableConcurrentAdd) {
+  check_concurrent_add(EBPF_MAP_TYPE_PERCPU_HASHTABLE);
+}
+}  // namespace
@@ -4,6 +4,7 @@ extern "C" {
 #include <errno.h>
 #include <stdint.h>
 #include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
 
 #include "../test_common.hpp"
 }
@@ -52,7 +53,7 @@ TEST_F(PercpuHashTableMapLookupTest, LookupUnexistingEntry) {
 TEST_F(PercpuHashTableMapLookupTest, CorrectLookup) {
   int error;
   uint32_t key = 50;
-  uint16_t ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint16_t ncpus = ebpf_ncpus();
   uint32_t value[ncpus];
 
   error = ebpf_map_lookup_elem_from_user(em, &key, value);
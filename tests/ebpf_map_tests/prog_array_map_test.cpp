@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <sys/ebpf_vm_isa.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class ProgArrayMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+  struct ebpf_prog *ep;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_PROG_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(struct ebpf_prog *);
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+
+    struct ebpf_inst insts[] = {
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+    struct ebpf_prog_attr pattr = {.type = EBPF_PROG_TYPE_TEST,
+                                   .prog = insts,
+                                   .prog_len = 2};
+
+    error = ebpf_prog_create(ee, &ep, &pattr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    ebpf_prog_destroy(ep);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(ProgArrayMapTest, CreateWithInvalidValueSize) {
+  int error;
+  struct ebpf_map *em2;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_PROG_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 100;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em2, &attr);
+
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(ProgArrayMapTest, UpdateWithMaxPlusOneKey) {
+  int error;
+  uint32_t key = 100;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(ProgArrayMapTest, UpdateWithNullProg) {
+  int error;
+  uint32_t key = 50;
+  struct ebpf_prog *null_prog = NULL;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &null_prog, EBPF_ANY);
+
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(ProgArrayMapTest, CorrectUpdate) {
+  int error;
+  uint32_t key = 50;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+}
+
+TEST_F(ProgArrayMapTest, UpdateEmptyElementWithEXISTFlag) {
+  int error;
+  uint32_t key = 50;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_EXIST);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_EXIST);
+  EXPECT_EQ(0, error);
+}
+
+TEST_F(ProgArrayMapTest, UpdateFromProgram) {
+  int error;
+  uint32_t key = 50;
+
+  error = ebpf_map_update_elem(em, &key, &ep, EBPF_ANY);
+
+  EXPECT_EQ(EINVAL, error);
+}
+
+TEST_F(ProgArrayMapTest, LookupFromUser) {
+  int error;
+  uint32_t key = 50;
+  struct ebpf_prog *value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+
+  EXPECT_EQ(ENOTSUP, error);
+}
+
+TEST_F(ProgArrayMapTest, CorrectDelete) {
+  int error;
+  uint32_t key = 50;
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(ProgArrayMapTest, DestroyWithElements) {
+  int error;
+  uint32_t key = 50;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &ep, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  /* The map keeps the program alive until it is destroyed */
+  ebpf_prog_destroy(ep);
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+  struct ebpf_prog_attr pattr = {.type = EBPF_PROG_TYPE_TEST,
+                                 .prog = insts,
+                                 .prog_len = 2};
+  error = ebpf_prog_create(ee, &ep, &pattr);
+  ASSERT_EQ(0, error);
+}
+}  // namespace
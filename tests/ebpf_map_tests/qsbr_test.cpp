@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+uint32_t ndispatched;
+
+void count_cb(ebpf_epoch_context *ctx) {
+  ck_pr_inc_32(&ndispatched);
+}
+
+class QsbrTest : public CommonFixture {
+ protected:
+  virtual void SetUp() {
+    int error;
+
+    error = ebpf_deinit();
+    ASSERT_EQ(0, error);
+
+    error = ebpf_init_reclaim(__EBPF_RECLAIM_MAX);
+    EXPECT_EQ(EINVAL, error);
+
+    error = ebpf_init_reclaim(EBPF_RECLAIM_QSBR);
+    ASSERT_EQ(0, error);
+
+    ndispatched = 0;
+    CommonFixture::SetUp();
+  }
+
+  virtual void TearDown() {
+    int error;
+
+    CommonFixture::TearDown();
+
+    error = ebpf_deinit();
+    ASSERT_EQ(0, error);
+
+    error = ebpf_init();
+    ASSERT_EQ(0, error);
+  }
+};
+
+/*
+ * The worker is in the read section until it announces the
+ * quiescent state again, even without ebpf_epoch_enter.
+ */
+TEST_F(QsbrTest, WorkerDefersReclaim) {
+  const uint32_t ncallbacks = 100;
+  std::vector<ebpf_epoch_context> ctxs(ncallbacks);
+  uint32_t state = 0;
+
+  std::thread worker([&state]() {
+    ebpf_quiescent();
+    ck_pr_store_32(&state, 1);
+
+    while (ck_pr_load_32(&state) == 1)
+      std::this_thread::yield();
+
+    while (ck_pr_load_32(&state) == 2) {
+      ebpf_quiescent();
+      std::this_thread::yield();
+    }
+  });
+
+  while (ck_pr_load_32(&state) == 0)
+    std::this_thread::yield();
+
+  for (auto &ctx : ctxs)
+    ebpf_epoch_call(&ctx, count_cb);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(0, ck_pr_load_32(&ndispatched));
+
+  ck_pr_store_32(&state, 2);
+  ebpf_epoch_wait();
+  EXPECT_EQ(ncallbacks, ck_pr_load_32(&ndispatched));
+
+  ck_pr_store_32(&state, 3);
+  worker.join();
+}
+
+TEST_F(QsbrTest, LockFreeMapUpdate) {
+  const uint32_t nthreads = 4, nkeys = 16, niters = 20000;
+  std::vector<std::thread> threads;
+  struct ebpf_map_attr attr;
+  struct ebpf_map *em;
+  uint64_t value;
+  int error;
+
+  attr.type = EBPF_MAP_TYPE_HASHTABLE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = nkeys;
+  attr.flags = EBPF_MAP_F_LOCKFREE;
+
+  error = ebpf_map_create(ee, &em, &attr);
+  ASSERT_EQ(0, error);
+
+  for (uint32_t t = 0; t < nthreads; t++) {
+    threads.emplace_back([em, t, nkeys, niters]() {
+      for (uint32_t i = 0; i < niters; i++) {
+        uint32_t key = (i + t) % nkeys;
+        uint64_t value = key;
+
+        if (i % 7 == 0)
+          ebpf_map_delete_elem(em, &key);
+        else
+          ebpf_map_update_elem(em, &key, &value, EBPF_ANY);
+
+        uint64_t *v = (uint64_t *)ebpf_map_lookup_elem(em, &key);
+        if (v != NULL) {
+          EXPECT_EQ(key, *v);
+        }
+
+        if (i % 64 == 0)
+          ebpf_quiescent();
+      }
+    });
+  }
+
+  for (auto &th : threads)
+    th.join();
+
+  ebpf_epoch_wait();
+
+  for (uint32_t i = 0; i < nkeys; i++) {
+    error = ebpf_map_lookup_elem_from_user(em, &i, &value);
+    if (error == 0) {
+      EXPECT_EQ(i, value);
+    } else {
+      EXPECT_EQ(ENOENT, error);
+    }
+  }
+
+  ebpf_map_destroy(em);
+}
+}  // namespace
@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class RHHashTableMapTest : public CommonFixture {
+ protected:
+  struct ebpf_map *em;
+
+  virtual void SetUp() {
+    int error;
+
+    CommonFixture::SetUp();
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_RH_HASHTABLE;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 100;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  virtual void TearDown() {
+    ebpf_map_destroy(em);
+    CommonFixture::TearDown();
+  }
+};
+
+TEST_F(RHHashTableMapTest, CorrectLookup) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(100, lookup_value);
+
+  uint32_t *v = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  ASSERT_TRUE(v != NULL);
+  EXPECT_EQ(100, *v);
+}
+
+TEST_F(RHHashTableMapTest, UpdateFlags) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_NOEXIST);
+  EXPECT_EQ(EEXIST, error);
+
+  value = 200;
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_EXIST);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(0, error);
+  EXPECT_EQ(200, lookup_value);
+}
+
+TEST_F(RHHashTableMapTest, UpdateMoreThanMaxEntries) {
+  int error;
+  uint32_t i;
+
+  for (i = 0; i < 100; i++) {
+    error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+    ASSERT_TRUE(!error);
+  }
+
+  error = ebpf_map_update_elem_from_user(em, &i, &i, EBPF_ANY);
+  EXPECT_EQ(EBUSY, error);
+}
+
+TEST_F(RHHashTableMapTest, CorrectDelete) {
+  int error;
+  uint32_t key = 50, value = 100, lookup_value;
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(0, error);
+
+  error = ebpf_map_lookup_elem_from_user(em, &key, &lookup_value);
+  EXPECT_EQ(ENOENT, error);
+
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  EXPECT_EQ(ENOENT, error);
+}
+
+TEST_F(RHHashTableMapTest, ChurnKeepsAllEntriesReachable) {
+  int error;
+  bool present[1000] = {};
+  uint32_t seed = 1, key, next_key, value, npresent = 0, nkeys = 0;
+
+  /* Deletions shift entries backward, check nothing gets lost */
+  for (uint32_t i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    key = (seed >> 8) % 1000;
+
+    if (present[key]) {
+      error = ebpf_map_delete_elem_from_user(em, &key);
+      ASSERT_EQ(0, error);
+      present[key] = false;
+      npresent--;
+    } else if (npresent < 100) {
+      value = key * 2;
+      error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+      ASSERT_EQ(0, error);
+      present[key] = true;
+      npresent++;
+    }
+  }
+
+  for (key = 0; key < 1000; key++) {
+    error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+    if (present[key]) {
+      EXPECT_EQ(0, error);
+      EXPECT_EQ(key * 2, value);
+    } else {
+      EXPECT_EQ(ENOENT, error);
+    }
+  }
+
+  error = ebpf_map_get_next_key_from_user(em, NULL, &next_key);
+  while (error == 0) {
+    EXPECT_TRUE(present[next_key]);
+    nkeys++;
+    key = next_key;
+    error = ebpf_map_get_next_key_from_user(em, &key, &next_key);
+  }
+
+  EXPECT_EQ(npresent, nkeys);
+}
+
+/*
+ * Deleting and inserting the other keys moves the slots around. The
+ * reader's value pointers must keep pointing to the same values, even
+ * for the deleted key, until it leaves the epoch.
+ */
+TEST_F(RHHashTableMapTest, StableValueInEpoch) {
+  int error;
+  uint32_t key, value, *v0, *v1, seen0, seen1, failed = 0;
+
+  for (key = 0; key < 100; key++) {
+    value = key + 1000;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_EQ(0, error);
+  }
+
+  ebpf_epoch_enter();
+
+  key = 0;
+  v0 = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  key = 1;
+  v1 = (uint32_t *)ebpf_map_lookup_elem(em, &key);
+  if (v0 == NULL || v1 == NULL) {
+    ebpf_epoch_exit();
+    FAIL();
+  }
+
+  for (key = 1; key < 100; key++)
+    failed += ebpf_map_delete_elem_from_user(em, &key) != 0;
+
+  /* Stay within the spare values, the update can't wait here */
+  for (key = 100; key < 150; key++) {
+    value = key + 1000;
+    failed += ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY) != 0;
+  }
+
+  seen0 = *v0;
+  seen1 = *v1;
+
+  ebpf_epoch_exit();
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(1000, seen0);
+  EXPECT_EQ(1001, seen1);
+}
+}  // namespace
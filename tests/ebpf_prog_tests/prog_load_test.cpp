@@ -101,3 +101,19 @@ TEST_F(ProgLoadTest, CorrectLoad) {
 
   EXPECT_EQ(0, error);
 }
+
+TEST_F(ProgLoadTest, LoadWithUnresolvableMap) {
+  int error;
+
+  struct ebpf_inst insts[] = {
+      EBPF_PSEUDO_MAP_LD(1, 0),
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_prog_attr attr = {
+      .type = EBPF_PROG_TYPE_TEST, .prog = insts, .prog_len = 3,
+      .data = NULL};
+
+  error = ebpf_prog_create(ee, &ep, &attr);
+
+  EXPECT_EQ(EINVAL, error);
+}
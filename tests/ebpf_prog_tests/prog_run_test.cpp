@@ -0,0 +1,1103 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ebpf.h>
+#include <sys/ebpf_vm_isa.h>
+#include <dev/ebpf/ebpf_platform.h>
+
+#include "../test_common.hpp"
+}
+
+namespace {
+class ProgRunTest : public CommonFixture {
+ protected:
+  struct ebpf_prog *ep;
+
+  virtual void SetUp() {
+    CommonFixture::SetUp();
+    ep = NULL;
+  }
+
+  virtual void TearDown() {
+    if (ep != NULL) ebpf_prog_destroy(ep);
+    CommonFixture::TearDown();
+  }
+
+  uint32_t FusionCount(uint32_t type) {
+    uint32_t count;
+    EXPECT_EQ(0, ebpf_prog_get_fusion_count(ep, type, &count));
+    return count;
+  }
+
+  struct ebpf_map *CreateProgArray(uint32_t max_entries) {
+    int error;
+    struct ebpf_map *em;
+
+    struct ebpf_map_attr attr;
+    attr.type = EBPF_MAP_TYPE_PROG_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(struct ebpf_prog *);
+    attr.max_entries = max_entries;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, &em, &attr);
+    EXPECT_EQ(0, error);
+
+    return em;
+  }
+
+  struct ebpf_prog *Create(struct ebpf_inst *insts, uint32_t len) {
+    int error;
+    struct ebpf_prog *prog;
+
+    struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST,
+                                  .prog = insts,
+                                  .prog_len = len};
+
+    error = ebpf_prog_create(ee, &prog, &attr);
+    EXPECT_EQ(0, error);
+
+    return prog;
+  }
+
+  void Load(struct ebpf_inst *insts, uint32_t len, uint32_t flags = 0) {
+    int error;
+
+    struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST,
+                                  .prog = insts,
+                                  .prog_len = len,
+                                  .flags = flags};
+
+    error = ebpf_prog_create(ee, &ep, &attr);
+    ASSERT_EQ(0, error);
+  }
+};
+
+#define LEN(_insts) (sizeof(_insts) / sizeof((_insts)[0]))
+
+TEST_F(ProgRunTest, ReturnImmediate) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 42},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(42, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, Alu64) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 10},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 3},
+      {EBPF_OP_MUL64_REG, 0, 1, 0, 0},
+      {EBPF_OP_SUB64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_MOV64_REG, 2, 0, 0, 0},
+      {EBPF_OP_LSH64_IMM, 2, 0, 0, 4},
+      {EBPF_OP_OR64_REG, 0, 2, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(28 | (28 << 4), ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, Alu32ZeroExtends) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+      {EBPF_OP_ADD_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(1, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, SignedShift) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, -16},
+      {EBPF_OP_ARSH64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ((uint64_t)-4, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, DivModByZero) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 7},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 0},
+      {EBPF_OP_MOD64_REG, 0, 1, 0, 0},
+      {EBPF_OP_MOV64_IMM, 2, 0, 0, 100},
+      {EBPF_OP_DIV64_REG, 2, 1, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(7, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, DivMod) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 100},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 7},
+      {EBPF_OP_DIV64_IMM, 0, 0, 0, 3},
+      {EBPF_OP_MOD_REG, 0, 3, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(33 % 7 + 7, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, Loop) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 10},
+      {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+      {EBPF_OP_SUB64_IMM, 1, 0, 0, 1},
+      {EBPF_OP_JNE_IMM, 1, 0, -3, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(55, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, SignedJump) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, -5},
+      {EBPF_OP_JSGT_IMM, 1, 0, 1, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_JGT_IMM, 1, 0, 1, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_ADD64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(3, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, LoadDoubleWord) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDDW, 0, 0, 0, (int32_t)0x89abcdef},
+      {0, 0, 0, 0, 0x01234567},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(0x0123456789abcdefULL, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, ByteSwap) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0x11223344},
+      {EBPF_OP_BE, 0, 0, 0, 16},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 0x11223344},
+      {EBPF_OP_BE, 1, 0, 0, 32},
+      {EBPF_OP_LSH64_IMM, 1, 0, 0, 16},
+      {EBPF_OP_OR64_REG, 0, 1, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(0x443322114433ULL, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, StackAndContext) {
+  uint32_t ctx[2] = {1, 0xdeadbeef};
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDXW, 2, 1, 4, 0},
+      {EBPF_OP_STXW, 10, 2, -4, 0},
+      {EBPF_OP_STB, 10, 0, -8, 0x7f},
+      {EBPF_OP_LDXW, 0, 10, -4, 0},
+      {EBPF_OP_LDXB, 3, 10, -8, 0},
+      {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+      {EBPF_OP_STXW, 1, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(0xdeadbeefULL + 0x7f, ebpf_prog_run(ctx, ep));
+  EXPECT_EQ(0xdeadbeef + 0x7f, ctx[0]);
+}
+
+TEST_F(ProgRunTest, HelperCall) {
+  int error;
+  struct ebpf_map *em;
+  uint32_t key = 1, value = 1234;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 10;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em, &attr);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  uint64_t map = (uint64_t)em;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 1},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 1, 0},
+      {EBPF_OP_LDXW, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(1234, ebpf_prog_run(NULL, ep));
+
+  ebpf_prog_destroy(ep);
+  ep = NULL;
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, PseudoMapLoad) {
+  int error;
+  struct ebpf_map *maps[2];
+  uint32_t key = 1, value = 1234;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 10;
+  attr.flags = 0;
+
+  for (uint32_t i = 0; i < 2; i++) {
+    error = ebpf_map_create(ee, maps + i, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  error = ebpf_map_update_elem_from_user(maps[1], &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 1},
+      EBPF_PSEUDO_MAP_LD(1, 1),
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 1, 0},
+      {EBPF_OP_LDXW, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_prog_attr pattr = {.type = EBPF_PROG_TYPE_TEST,
+                                 .prog = insts,
+                                 .prog_len = LEN(insts),
+                                 .data = maps};
+
+  error = ebpf_prog_create(ee, &ep, &pattr);
+  ASSERT_EQ(0, error);
+
+  /* The program keeps the map alive */
+  ebpf_map_destroy(maps[0]);
+  ebpf_map_destroy(maps[1]);
+
+  EXPECT_EQ(1234, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, InlineArrayLookup) {
+  int error;
+  struct ebpf_map *maps[2];
+  uint32_t key, value;
+  uint32_t types[] = {EBPF_MAP_TYPE_ARRAY, EBPF_MAP_TYPE_PERCPU_ARRAY};
+
+  for (uint32_t i = 0; i < 2; i++) {
+    struct ebpf_map_attr attr;
+    attr.type = types[i];
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = 10;
+    attr.flags = 0;
+
+    error = ebpf_map_create(ee, maps + i, &attr);
+    ASSERT_TRUE(!error);
+  }
+
+  /* Increments the element of ctx in both maps, returns -1 if not found */
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STXW, 10, 1, -4, 0},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      EBPF_PSEUDO_MAP_LD(1, 0),
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 14, 0},
+      {EBPF_OP_LDXDW, 1, 0, 0, 0},
+      {EBPF_OP_ADD64_IMM, 1, 0, 0, 1},
+      {EBPF_OP_STXDW, 0, 1, 0, 0},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      EBPF_PSEUDO_MAP_LD(1, 1),
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 5, 0},
+      {EBPF_OP_LDXDW, 1, 0, 0, 0},
+      {EBPF_OP_ADD64_IMM, 1, 0, 0, 1},
+      {EBPF_OP_STXDW, 0, 1, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t flags : {0u, (uint32_t)EBPF_PROG_F_NOJIT}) {
+    struct ebpf_prog_attr pattr = {.type = EBPF_PROG_TYPE_TEST,
+                                   .prog = insts,
+                                   .prog_len = LEN(insts),
+                                   .data = maps,
+                                   .flags = flags};
+
+    error = ebpf_prog_create(ee, &ep, &pattr);
+    ASSERT_EQ(0, error);
+
+    EXPECT_EQ(0, ebpf_prog_run((void *)3, ep));
+    EXPECT_EQ(0, ebpf_prog_run((void *)9, ep));
+    EXPECT_EQ(-1, ebpf_prog_run((void *)10, ep));
+
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+
+  uint64_t value64, percpu_values[ebpf_ncpus()];
+  for (key = 0; key < 10; key++) {
+    error = ebpf_map_lookup_elem_from_user(maps[0], &key, &value64);
+    ASSERT_EQ(0, error);
+    EXPECT_EQ(key == 3 || key == 9 ? 2 : 0, value64);
+
+    error = ebpf_map_lookup_elem_from_user(maps[1], &key, percpu_values);
+    ASSERT_EQ(0, error);
+    value64 = 0;
+    for (uint16_t i = 0; i < ebpf_ncpus(); i++) value64 += percpu_values[i];
+    EXPECT_EQ(key == 3 || key == 9 ? 2 : 0, value64);
+  }
+
+  ebpf_map_destroy(maps[0]);
+  ebpf_map_destroy(maps[1]);
+}
+
+TEST_F(ProgRunTest, RunBatch) {
+  uint32_t flags[] = {0, EBPF_PROG_F_NOJIT};
+  uint32_t data[37];
+  void *ctxs[37];
+  uint64_t rets[37];
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDXW, 0, 1, 0, 0},
+      {EBPF_OP_JGT_IMM, 0, 0, 2, 20},
+      {EBPF_OP_STW, 10, 0, -4, 1},
+      {EBPF_OP_LDXW, 2, 10, -4, 0},
+      {EBPF_OP_MUL64_IMM, 0, 0, 0, 3},
+      {EBPF_OP_STXW, 1, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t f = 0; f < LEN(flags); f++) {
+    for (uint32_t i = 0; i < LEN(data); i++) {
+      data[i] = i;
+      ctxs[i] = &data[i];
+      rets[i] = 0;
+    }
+
+    Load(insts, LEN(insts), flags[f]);
+
+    ebpf_prog_run_batch(ep, ctxs, rets, 0);
+    EXPECT_EQ(0, rets[0]);
+
+    ebpf_prog_run_batch(ep, ctxs, rets, LEN(ctxs));
+    for (uint32_t i = 0; i < LEN(data); i++) {
+      EXPECT_EQ(i * 3, rets[i]);
+      EXPECT_EQ(i * 3, data[i]);
+    }
+
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+}
+
+TEST_F(ProgRunTest, RunInterleaved) {
+  int error;
+  struct ebpf_map *em;
+  uint32_t keys[37];
+  void *ctxs[37];
+  uint64_t rets[37];
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_HASHTABLE;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 64;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em, &attr);
+  ASSERT_TRUE(!error);
+
+  for (uint32_t k = 0; k < 64; k++) {
+    uint32_t v = k * 10;
+    if (k % 3 == 0) continue;
+    error = ebpf_map_update_elem_from_user(em, &k, &v, EBPF_ANY);
+    ASSERT_TRUE(!error);
+  }
+
+  uint64_t map = (uint64_t)em;
+
+  /*
+   * Looks up the key in the context and the key next to it.
+   * Returns the sum of the values, or 0 if the first key is
+   * missing.
+   */
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDXW, 6, 1, 0, 0},
+      {EBPF_OP_STXW, 10, 6, -4, 0},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 14, 0},
+      {EBPF_OP_LDXW, 7, 0, 0, 0},
+      {EBPF_OP_ADD64_IMM, 6, 0, 0, 1},
+      {EBPF_OP_STXW, 10, 6, -4, 0},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 3, 0},
+      {EBPF_OP_LDXW, 0, 0, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  for (uint32_t i = 0; i < LEN(keys); i++) {
+    keys[i] = i;
+    ctxs[i] = &keys[i];
+  }
+
+  for (uint32_t n = 0; n <= LEN(keys); n += 9) {
+    for (uint32_t i = 0; i < LEN(rets); i++) rets[i] = UINT64_MAX;
+
+    ebpf_prog_run_interleaved(ep, ctxs, rets, n);
+
+    for (uint32_t i = 0; i < n; i++) {
+      uint64_t expected = 0;
+      if (i % 3 != 0) {
+        expected = i * 10;
+        if ((i + 1) % 3 != 0) expected += (i + 1) * 10;
+      }
+      EXPECT_EQ(expected, rets[i]);
+      EXPECT_EQ(expected, ebpf_prog_run(ctxs[i], ep));
+    }
+
+    for (uint32_t i = n; i < LEN(rets); i++) EXPECT_EQ(UINT64_MAX, rets[i]);
+  }
+
+  ebpf_prog_destroy(ep);
+  ep = NULL;
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, Atomic) {
+  uint32_t flags[] = {0, EBPF_PROG_F_NOJIT};
+
+  struct {
+    uint64_t a;
+    uint32_t b;
+    uint32_t c;
+    uint64_t d;
+  } ctx;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 2, 0, 0, 5},
+      {EBPF_OP_XADDDW, 1, 2, 0, EBPF_ADD},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 7},
+      {EBPF_OP_XADDW, 1, 3, 8, EBPF_ADD | EBPF_FETCH},
+      {EBPF_OP_MOV64_IMM, 4, 0, 0, -1},
+      {EBPF_OP_XADDW, 1, 4, 12, EBPF_XCHG},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 42},
+      {EBPF_OP_MOV64_IMM, 5, 0, 0, 99},
+      {EBPF_OP_XADDDW, 1, 5, 16, EBPF_CMPXCHG},
+      {EBPF_OP_MOV64_REG, 6, 0, 0, 0},
+      {EBPF_OP_XADDDW, 1, 5, 16, EBPF_CMPXCHG},
+      {EBPF_OP_MOV64_REG, 7, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+      {EBPF_OP_XADDW, 1, 5, 12, EBPF_CMPXCHG},
+      {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 4, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+      {EBPF_OP_ADD64_REG, 0, 7, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t f = 0; f < LEN(flags); f++) {
+    ctx.a = 10;
+    ctx.b = 100;
+    ctx.c = 3;
+    ctx.d = 42;
+
+    Load(insts, LEN(insts), flags[f]);
+
+    EXPECT_EQ(0xffffffffULL + 100 + 3 + 42 + 99, ebpf_prog_run(&ctx, ep));
+    EXPECT_EQ(15, ctx.a);
+    EXPECT_EQ(107, ctx.b);
+    EXPECT_EQ(99, ctx.c);
+    EXPECT_EQ(99, ctx.d);
+
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+}
+
+TEST_F(ProgRunTest, AtomicInvalidOperation) {
+  struct ebpf_prog *ep2;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_XADDW, 10, 0, -8, EBPF_SUB},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_prog_attr attr = {
+      .type = EBPF_PROG_TYPE_TEST, .prog = insts, .prog_len = LEN(insts)};
+
+  EXPECT_EQ(EINVAL, ebpf_prog_create(ee, &ep2, &attr));
+}
+
+TEST_F(ProgRunTest, AtomicSharedCounter) {
+  int error;
+  struct ebpf_map *em;
+  uint32_t flags[] = {0, EBPF_PROG_F_NOJIT};
+  uint32_t key = 0;
+  uint64_t value;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = 1;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em, &attr);
+  ASSERT_TRUE(!error);
+
+  uint64_t map = (uint64_t)em;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 0},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 2, 0},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+      {EBPF_OP_XADDDW, 0, 1, 0, EBPF_ADD},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t f = 0; f < LEN(flags); f++) {
+    value = 0;
+    error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+    ASSERT_TRUE(!error);
+
+    Load(insts, LEN(insts), flags[f]);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([this] {
+        for (int i = 0; i < 100000; i++) ebpf_prog_run(NULL, ep);
+      });
+    }
+    for (auto &t : threads) t.join();
+
+    error = ebpf_map_lookup_elem_from_user(em, &key, &value);
+    ASSERT_TRUE(!error);
+    EXPECT_EQ(400000, value);
+
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, FuseLoadAndCompare) {
+  uint32_t ctx[2] = {5, 7};
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDXW, 2, 1, 0, 0},
+      {EBPF_OP_JEQ_IMM, 2, 0, 2, 5},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_LDXB, 3, 1, 4, 0},
+      {EBPF_OP_JNE_IMM, 3, 0, 2, 7},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 3},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts), EBPF_PROG_F_NOJIT);
+
+  EXPECT_EQ(2, FusionCount(EBPF_FUSION_LDX_JCC));
+  EXPECT_EQ(2, ebpf_prog_run(ctx, ep));
+
+  ctx[1] = 8;
+  EXPECT_EQ(3, ebpf_prog_run(ctx, ep));
+
+  ctx[0] = 6;
+  EXPECT_EQ(1, ebpf_prog_run(ctx, ep));
+}
+
+TEST_F(ProgRunTest, FuseMovImmAdd) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 10},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 3},
+      {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+      {EBPF_OP_MOV64_REG, 2, 0, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -20},
+      {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts), EBPF_PROG_F_NOJIT);
+
+  EXPECT_EQ(1, FusionCount(EBPF_FUSION_MOV_IMM_ADD));
+  EXPECT_EQ(1, FusionCount(EBPF_FUSION_STACK_ADDR));
+  EXPECT_EQ(6, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, NoFusionOnJumpTarget) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_JA, 0, 0, 1, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_ADD64_REG, 0, 0, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts), EBPF_PROG_F_NOJIT);
+
+  EXPECT_EQ(0, FusionCount(EBPF_FUSION_MOV_IMM_ADD));
+  EXPECT_EQ(2, ebpf_prog_run(NULL, ep));
+}
+
+TEST_F(ProgRunTest, FuseHelperCall) {
+  int error;
+  struct ebpf_map *em;
+  uint32_t key = 1, value = 1234;
+
+  struct ebpf_map_attr attr;
+  attr.type = EBPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = 10;
+  attr.flags = 0;
+
+  error = ebpf_map_create(ee, &em, &attr);
+  ASSERT_TRUE(!error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &value, EBPF_ANY);
+  ASSERT_TRUE(!error);
+
+  uint64_t map = (uint64_t)em;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 1},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_JEQ_IMM, 0, 0, 6, 0},
+      {EBPF_OP_LDXW, 6, 0, 0, 0},
+      {EBPF_OP_LDDW, 1, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_REG, 2, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_map_lookup_elem},
+      {EBPF_OP_MOV64_REG, 0, 6, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts), EBPF_PROG_F_NOJIT);
+
+  EXPECT_EQ(1, FusionCount(EBPF_FUSION_STACK_ADDR));
+  EXPECT_EQ(1, FusionCount(EBPF_FUSION_LDDW_CALL));
+  EXPECT_EQ(1, FusionCount(EBPF_FUSION_STACK_ADDR_CALL));
+  EXPECT_EQ(1234, ebpf_prog_run(NULL, ep));
+
+  ebpf_prog_destroy(ep);
+  ep = NULL;
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, GetFusionCountInvalid) {
+  uint32_t count;
+
+  struct ebpf_inst insts[] = {{EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(EINVAL, ebpf_prog_get_fusion_count(NULL, 0, &count));
+  EXPECT_EQ(EINVAL,
+            ebpf_prog_get_fusion_count(ep, EBPF_FUSION_MAX, &count));
+}
+
+TEST_F(ProgRunTest, TailCall) {
+  int error;
+  uint32_t key = 0;
+  struct ebpf_map *em = CreateProgArray(4);
+  uint64_t map = (uint64_t)em;
+
+  /* The stack and the registers are handed over to the callee */
+  struct ebpf_inst callee_insts[] = {
+      {EBPF_OP_LDXW, 0, 10, -4, 0},
+      {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+  struct ebpf_prog *callee = Create(callee_insts, LEN(callee_insts));
+
+  error = ebpf_map_update_elem_from_user(em, &key, &callee, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 5},
+      {EBPF_OP_MOV64_IMM, 6, 0, 0, 35},
+      {EBPF_OP_LDDW, 2, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_tail_call},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(40, ebpf_prog_run(NULL, ep));
+
+  void *ctxs[8] = {NULL};
+  uint64_t rets[8];
+
+  ebpf_prog_run_batch(ep, ctxs, rets, 8);
+  for (uint32_t i = 0; i < 8; i++) EXPECT_EQ(40, rets[i]);
+
+  ebpf_prog_run_interleaved(ep, ctxs, rets, 8);
+  for (uint32_t i = 0; i < 8; i++) EXPECT_EQ(40, rets[i]);
+
+  /* Replacing the element takes effect on the next run */
+  struct ebpf_inst other_insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+  struct ebpf_prog *other = Create(other_insts, LEN(other_insts));
+
+  error = ebpf_map_update_elem_from_user(em, &key, &other, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  EXPECT_EQ(2, ebpf_prog_run(NULL, ep));
+
+  /* Empty element makes the tail call fall through */
+  error = ebpf_map_delete_elem_from_user(em, &key);
+  ASSERT_EQ(0, error);
+
+  EXPECT_EQ(1, ebpf_prog_run(NULL, ep));
+
+  ebpf_prog_destroy(callee);
+  ebpf_prog_destroy(other);
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, TailCallTypeMismatch) {
+  int error;
+  uint32_t key = 0;
+  struct ebpf_map *em = CreateProgArray(4);
+  uint64_t map = (uint64_t)em;
+  struct ebpf_prog *callee;
+
+  struct ebpf_inst callee_insts[] = {
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+  struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST2,
+                                .prog = callee_insts,
+                                .prog_len = LEN(callee_insts)};
+
+  error = ebpf_prog_create(ee, &callee, &attr);
+  ASSERT_EQ(0, error);
+
+  error = ebpf_map_update_elem_from_user(em, &key, &callee, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDDW, 2, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_tail_call},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  /* The program of the other type is never jumped into */
+  EXPECT_EQ(1, ebpf_prog_run(NULL, ep));
+
+  ebpf_prog_destroy(callee);
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, TailCallOutOfRange) {
+  struct ebpf_map *em = CreateProgArray(4);
+  uint64_t map = (uint64_t)em;
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_LDDW, 2, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 4},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_tail_call},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  EXPECT_EQ(1, ebpf_prog_run(NULL, ep));
+
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, TailCallDepthLimit) {
+  int error;
+  uint32_t key = 0;
+  struct ebpf_map *em = CreateProgArray(1);
+  uint64_t map = (uint64_t)em;
+
+  /* Tail calls itself forever, counting the depth in R6 */
+  struct ebpf_inst loop_insts[] = {
+      {EBPF_OP_ADD64_IMM, 6, 0, 0, 1},
+      {EBPF_OP_LDDW, 2, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_tail_call},
+      {EBPF_OP_MOV64_REG, 0, 6, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+  struct ebpf_prog *loop = Create(loop_insts, LEN(loop_insts));
+
+  error = ebpf_map_update_elem_from_user(em, &key, &loop, EBPF_ANY);
+  ASSERT_EQ(0, error);
+
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 6, 0, 0, 0},
+      {EBPF_OP_LDDW, 2, 0, 0, (int32_t)map},
+      {0, 0, 0, 0, (int32_t)(map >> 32)},
+      {EBPF_OP_MOV64_IMM, 3, 0, 0, 0},
+      {EBPF_OP_CALL, 0, 0, 0, EBPF_HELPER_TYPE_tail_call},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, -1},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  Load(insts, LEN(insts));
+
+  /* R6 is incremented once per successful tail call */
+  EXPECT_EQ(EBPF_MAX_TAIL_CALL_CNT, ebpf_prog_run(NULL, ep));
+
+  ebpf_prog_destroy(loop);
+  ebpf_map_destroy(em);
+}
+
+TEST_F(ProgRunTest, LocalCall) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_IMM, 6, 0, 0, 10},
+      {EBPF_OP_MOV64_IMM, 1, 0, 0, 5},
+      EBPF_JMP_CALL_LOCAL(2),
+      {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      /* R6 is restored on return */
+      {EBPF_OP_MOV64_IMM, 6, 0, 0, 100},
+      {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+      {EBPF_OP_MUL64_IMM, 0, 0, 0, 2},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t flags : {0u, (uint32_t)EBPF_PROG_F_NOJIT}) {
+    Load(insts, LEN(insts), flags);
+    EXPECT_EQ(20, ebpf_prog_run(NULL, ep));
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+}
+
+TEST_F(ProgRunTest, LocalCallStackFrames) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_STW, 10, 0, -4, 7},
+      {EBPF_OP_MOV64_REG, 1, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 1, 0, 0, -4},
+      EBPF_JMP_CALL_LOCAL(3),
+      {EBPF_OP_LDXW, 1, 10, -4, 0},
+      {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      /* Reads the caller's stack via R1 */
+      {EBPF_OP_STW, 10, 0, -8, 9},
+      {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+      EBPF_JMP_CALL_LOCAL(4),
+      {EBPF_OP_LDXW, 0, 6, 0, 0},
+      {EBPF_OP_LDXW, 2, 10, -8, 0},
+      {EBPF_OP_MUL64_REG, 0, 2, 0, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      /* Doesn't overwrite the frames of the callers */
+      {EBPF_OP_STDW, 10, 0, -8, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t flags : {0u, (uint32_t)EBPF_PROG_F_NOJIT}) {
+    Load(insts, LEN(insts), flags);
+    EXPECT_EQ(7 * 9 + 7, ebpf_prog_run(NULL, ep));
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+
+  Load(insts, LEN(insts));
+
+  void *ctxs[8] = {NULL};
+  uint64_t rets[8];
+
+  ebpf_prog_run_interleaved(ep, ctxs, rets, 8);
+  for (uint32_t i = 0; i < 8; i++) EXPECT_EQ(7 * 9 + 7, rets[i]);
+}
+
+TEST_F(ProgRunTest, LocalCallDerivedStackPointer) {
+  struct ebpf_inst insts[] = {
+      /* Accesses R10 - 16 only through R6 */
+      {EBPF_OP_MOV64_REG, 6, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 6, 0, 0, -8},
+      {EBPF_OP_STDW, 6, 0, -8, 42},
+      EBPF_JMP_CALL_LOCAL(2),
+      {EBPF_OP_LDXDW, 0, 6, -8, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      /* Doesn't overwrite the frame of the caller */
+      {EBPF_OP_STDW, 10, 0, -8, 0},
+      {EBPF_OP_STDW, 10, 0, -16, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  for (uint32_t flags : {0u, (uint32_t)EBPF_PROG_F_NOJIT}) {
+    Load(insts, LEN(insts), flags);
+    EXPECT_EQ(42, ebpf_prog_run(NULL, ep));
+    ebpf_prog_destroy(ep);
+    ep = NULL;
+  }
+}
+
+/* Copies of the derived register make the function use the whole stack */
+TEST_F(ProgRunTest, LocalCallCopiedStackPointer) {
+  struct ebpf_inst insts[] = {
+      {EBPF_OP_MOV64_REG, 1, 10, 0, 0},
+      {EBPF_OP_ADD64_IMM, 1, 0, 0, -8},
+      {EBPF_OP_MOV64_REG, 2, 1, 0, 0},
+      {EBPF_OP_ADD64_IMM, 2, 0, 0, -64},
+      {EBPF_OP_STDW, 2, 0, 0, 42},
+      EBPF_JMP_CALL_LOCAL(2),
+      {EBPF_OP_LDXDW, 0, 10, -72, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_STDW, 10, 0, -8, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST,
+                                .prog = insts,
+                                .prog_len = LEN(insts)};
+
+  /* The callee has no room below the whole stack of the caller */
+  EXPECT_EQ(EINVAL, ebpf_prog_create(ee, &ep, &attr));
+  ep = NULL;
+}
+
+TEST_F(ProgRunTest, LocalCallInvalid) {
+  int error;
+
+  struct ebpf_inst recursive[] = {
+      EBPF_JMP_CALL_LOCAL(1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      EBPF_JMP_CALL_LOCAL(-1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_inst out_of_prog[] = {
+      EBPF_JMP_CALL_LOCAL(1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_inst jump_out[] = {
+      EBPF_JMP_CALL_LOCAL(1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_JA, 0, 0, -2, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct ebpf_inst fall_through[] = {
+      EBPF_JMP_CALL_LOCAL(1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_MOV64_IMM, 0, 0, 0, 0}};
+
+  /* Both frames use the whole stack */
+  struct ebpf_inst large_stack[] = {
+      {EBPF_OP_STW, 10, 0, -EBPF_STACK_SIZE, 0},
+      EBPF_JMP_CALL_LOCAL(1),
+      {EBPF_OP_EXIT, 0, 0, 0, 0},
+      {EBPF_OP_STW, 10, 0, -4, 0},
+      {EBPF_OP_EXIT, 0, 0, 0, 0}};
+
+  struct {
+    struct ebpf_inst *insts;
+    uint32_t len;
+  } progs[] = {{recursive, LEN(recursive)},
+               {out_of_prog, LEN(out_of_prog)},
+               {jump_out, LEN(jump_out)},
+               {fall_through, LEN(fall_through)},
+               {large_stack, LEN(large_stack)}};
+
+  for (auto &p : progs) {
+    struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST,
+                                  .prog = p.insts,
+                                  .prog_len = p.len};
+
+    error = ebpf_prog_create(ee, &ep, &attr);
+    EXPECT_EQ(EINVAL, error);
+    ep = NULL;
+  }
+}
+
+TEST_F(ProgRunTest, LocalCallDepth) {
+  int error;
+  struct ebpf_inst insts[EBPF_MAX_CALL_DEPTH * 3 + 3];
+  uint32_t len;
+
+  /* Each function calls the next one and adds 1 to the result */
+  for (uint32_t depth = EBPF_MAX_CALL_DEPTH; depth <= EBPF_MAX_CALL_DEPTH + 1;
+       depth++) {
+    len = 0;
+    for (uint32_t i = 0; i < depth - 1; i++) {
+      insts[len++] = EBPF_JMP_CALL_LOCAL(2);
+      insts[len++] = {EBPF_OP_ADD64_IMM, 0, 0, 0, 1};
+      insts[len++] = {EBPF_OP_EXIT, 0, 0, 0, 0};
+    }
+    insts[len++] = {EBPF_OP_MOV64_IMM, 0, 0, 0, 0};
+    insts[len++] = {EBPF_OP_EXIT, 0, 0, 0, 0};
+
+    struct ebpf_prog_attr attr = {.type = EBPF_PROG_TYPE_TEST,
+                                  .prog = insts,
+                                  .prog_len = len};
+
+    error = ebpf_prog_create(ee, &ep, &attr);
+    if (depth > EBPF_MAX_CALL_DEPTH) {
+      EXPECT_EQ(EINVAL, error);
+      ep = NULL;
+    } else {
+      ASSERT_EQ(0, error);
+      EXPECT_EQ(depth - 1, ebpf_prog_run(NULL, ep));
+      ebpf_prog_destroy(ep);
+      ep = NULL;
+    }
+  }
+}
+}  // namespace
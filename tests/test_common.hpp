@@ -9,11 +9,17 @@ enum test_emts {
 	EBPF_MAP_TYPE_PERCPU_ARRAY,
 	EBPF_MAP_TYPE_HASHTABLE,
 	EBPF_MAP_TYPE_PERCPU_HASHTABLE,
+	EBPF_MAP_TYPE_PROG_ARRAY,
+	EBPF_MAP_TYPE_LRU_HASHTABLE,
+	EBPF_MAP_TYPE_LPM_TRIE,
+	EBPF_MAP_TYPE_RH_HASHTABLE,
+	EBPF_MAP_TYPE_CUCKOO_HASHTABLE,
 	EBPF_MAP_TYPE_MAX
 };
 
 enum test_epts {
 	EBPF_PROG_TYPE_TEST,
+	EBPF_PROG_TYPE_TEST2,
 	EBPF_PROG_TYPE_MAX
 };
 
@@ -21,6 +27,7 @@ enum test_ehts {
 	EBPF_HELPER_TYPE_map_lookup_elem,
 	EBPF_HELPER_TYPE_map_update_elem,
 	EBPF_HELPER_TYPE_map_delete_elem,
+	EBPF_HELPER_TYPE_tail_call,
 	EBPF_HELPER_TYPE_MAX
 };
 
@@ -31,6 +38,11 @@ test_is_map_usable(struct ebpf_map_type *emt)
 	if (emt == &emt_percpu_array) return true;
 	if (emt == &emt_hashtable) return true;
 	if (emt == &emt_percpu_hashtable) return true;
+	if (emt == &emt_prog_array) return true;
+	if (emt == &emt_lru_hashtable) return true;
+	if (emt == &emt_lpm_trie) return true;
+	if (emt == &emt_rh_hashtable) return true;
+	if (emt == &emt_cuckoo_hashtable) return true;
 	return false;
 }
 
@@ -40,6 +52,7 @@ test_is_helper_usable(struct ebpf_helper_type *eht)
 	if (eht == &eht_map_lookup_elem) return true;
 	if (eht == &eht_map_update_elem) return true;
 	if (eht == &eht_map_delete_elem) return true;
+	if (eht == &eht_tail_call) return true;
 	return false;
 }
 
@@ -51,25 +64,53 @@ static const struct ebpf_prog_type ept_test = {
 	}
 };
 
+/* Same as ept_test, but programs of the two types don't mix */
+static const struct ebpf_prog_type ept_test2 = {
+	"test2",
+	{
+		test_is_map_usable,
+		test_is_helper_usable
+	}
+};
+
+/* data is an array of maps indexed by the lower half of the descriptor */
+static struct ebpf_map *
+test_resolve_map_desc(int32_t upper, int32_t lower, void *data)
+{
+	struct ebpf_map **maps = (struct ebpf_map **)data;
+
+	if (maps == NULL || lower < 0)
+		return NULL;
+
+	return maps[lower];
+}
+
 static const struct ebpf_preprocessor_type eppt_test = {
 	"test",
-	{ NULL }
+	{ test_resolve_map_desc }
 };
 
 static const struct ebpf_config ebpf_test_config = {
 	.prog_types = {
-		[EBPF_PROG_TYPE_TEST] = &ept_test
+		[EBPF_PROG_TYPE_TEST] = &ept_test,
+		[EBPF_PROG_TYPE_TEST2] = &ept_test2
 	},
 	.map_types = {
 		[EBPF_MAP_TYPE_ARRAY] = &emt_array,
 		[EBPF_MAP_TYPE_PERCPU_ARRAY] = &emt_percpu_array,
 		[EBPF_MAP_TYPE_HASHTABLE] = &emt_hashtable,
-		[EBPF_MAP_TYPE_PERCPU_HASHTABLE] = &emt_percpu_hashtable
+		[EBPF_MAP_TYPE_PERCPU_HASHTABLE] = &emt_percpu_hashtable,
+		[EBPF_MAP_TYPE_PROG_ARRAY] = &emt_prog_array,
+		[EBPF_MAP_TYPE_LRU_HASHTABLE] = &emt_lru_hashtable,
+		[EBPF_MAP_TYPE_LPM_TRIE] = &emt_lpm_trie,
+		[EBPF_MAP_TYPE_RH_HASHTABLE] = &emt_rh_hashtable,
+		[EBPF_MAP_TYPE_CUCKOO_HASHTABLE] = &emt_cuckoo_hashtable
 	},
 	.helper_types = {
 		[EBPF_HELPER_TYPE_map_lookup_elem] = &eht_map_lookup_elem,
 		[EBPF_HELPER_TYPE_map_update_elem] = &eht_map_update_elem,
-		[EBPF_HELPER_TYPE_map_delete_elem] = &eht_map_delete_elem
+		[EBPF_HELPER_TYPE_map_delete_elem] = &eht_map_delete_elem,
+		[EBPF_HELPER_TYPE_tail_call] = &eht_tail_call
 	},
 	.preprocessor_type = &eppt_test
 };